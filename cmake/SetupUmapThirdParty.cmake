@@ -5,3 +5,27 @@
 # SPDX-License-Identifier: LGPL-2.1-only
 #############################################################################
 
+
+#
+# Compression libraries of the CompressedStore, each of them is optional
+#
+find_package(ZLIB)
+set(UMAP_HAVE_ZLIB ${ZLIB_FOUND})
+
+find_path(LZ4_INCLUDE_DIR lz4.h)
+find_library(LZ4_LIBRARY lz4)
+if (LZ4_INCLUDE_DIR AND LZ4_LIBRARY)
+  set(UMAP_HAVE_LZ4 On)
+endif()
+
+find_path(ZSTD_INCLUDE_DIR zstd.h)
+find_library(ZSTD_LIBRARY zstd)
+if (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+  set(UMAP_HAVE_ZSTD On)
+endif()
+
+#
+# TLS and request signing of the S3Store, optional as well
+#
+find_package(OpenSSL)
+set(UMAP_HAVE_OPENSSL ${OPENSSL_FOUND})
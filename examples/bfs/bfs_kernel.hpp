@@ -23,6 +23,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #endif
 
 #include "utility/bitmap.hpp"
+#include "utility/frontier_prefetch.hpp"
 #include "utility/open_mp.hpp"
 
 namespace bfs {
@@ -63,11 +64,14 @@ void print_omp_configuration() {
 /// \param edges A pointer of an edges array
 /// \param level A pointer of level array
 /// \param visited_filter A pointer of an bitset for visited filter
+/// \param prefetcher If not null, the neighbour lists of the vertices
+/// discovered at a level are prefetched for the next one
 uint16_t run_bfs(const size_t num_vertices,
                  const uint64_t *const index,
                  const uint64_t *const edges,
                  uint16_t *const level,
-                 uint64_t *visited_filter) {
+                 uint64_t *visited_filter,
+                 utility::frontier_prefetcher *const prefetcher = nullptr) {
 
   print_omp_configuration();
 
@@ -76,6 +80,8 @@ uint16_t run_bfs(const size_t num_vertices,
 
   while (true) { /// BFS main loop
 
+    if (prefetcher) prefetcher->start_level();
+
     /// BFS loop for a single level
     /// We assume that the cost of generating threads at every level is negligible
 #ifdef _OPENMP
@@ -89,10 +95,13 @@ uint16_t run_bfs(const size_t num_vertices,
           level[trg] = current_level + 1;
           utility::set_bit(visited_filter, trg);
           visited_new_vertex = true;
+          if (prefetcher) prefetcher->add(trg);
         }
       }
     }
 
+    if (prefetcher) prefetcher->flush_all();
+
     if (!visited_new_vertex) break;
 
     ++current_level;
@@ -18,7 +18,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #include <tuple>
 #include <string>
 #include <fstream>
+#include <memory>
 
+#include "umap/store/SparseStore.h"
 #include "bfs_kernel.hpp"
 #include "utility/map_file.hpp"
 #include "utility/bitmap.hpp"
@@ -30,8 +32,13 @@ struct bfs_options {
   size_t num_vertices{0};
   size_t num_edges{0};
   std::string graph_file_name;
+  std::string sparse_store_path;
   std::string bfs_level_reference_file_name;
   bool use_mmap{false};
+  bool prefetch{false};
+  bool compare{false};
+  size_t prefetch_batch_size{256};
+  uint64_t prefetch_level_bytes{0};
 };
 
 void disp_umap_env_variables() {
@@ -52,7 +59,13 @@ void usage() {
             << "-n\t#vertices\n"
             << "-m\t#edges\n"
             << "-g\tGraph file name\n"
-            << "-s\tUse system mmap" << std::endl;
+            << "-S\tSparseStore directory written by ingest_edge_list -S, instead of -g\n"
+            << "-l\tBFS level reference file name\n"
+            << "-s\tUse system mmap\n"
+            << "-p\tPrefetch the neighbour lists of the next level\n"
+            << "-c\tRun with demand paging, then with prefetching, and report the speedup\n"
+            << "-b\t#vertices a thread collects before it prefetches (default 256)\n"
+            << "-w\tBytes prefetched per level at most (default half the umap buffer)" << std::endl;
 
   disp_umap_env_variables();
 }
@@ -60,7 +73,7 @@ void usage() {
 void parse_options(int argc, char **argv,
                    bfs_options &options) {
   int c;
-  while ((c = getopt(argc, argv, "n:m:g:l:sh")) != -1) {
+  while ((c = getopt(argc, argv, "n:m:g:S:l:spcb:w:h")) != -1) {
     switch (c) {
       case 'n': /// Required
         options.num_vertices = std::stoull(optarg);
@@ -74,6 +87,10 @@ void parse_options(int argc, char **argv,
         options.graph_file_name = optarg;
         break;
 
+      case 'S':
+        options.sparse_store_path = optarg;
+        break;
+
       case 'l':
         options.bfs_level_reference_file_name = optarg;
         break;
@@ -82,6 +99,22 @@ void parse_options(int argc, char **argv,
         options.use_mmap = true;
         break;
 
+      case 'p':
+        options.prefetch = true;
+        break;
+
+      case 'c':
+        options.compare = true;
+        break;
+
+      case 'b':
+        options.prefetch_batch_size = std::stoull(optarg);
+        break;
+
+      case 'w':
+        options.prefetch_level_bytes = std::stoull(optarg);
+        break;
+
       case 'h':
         usage();
         std::exit(0);
@@ -94,7 +127,9 @@ void disp_bfs_options(const bfs_options &options) {
             << "\n#vertices: " << options.num_vertices
             << "\n#edges: " << options.num_edges
             << "\nGraph file: " << options.graph_file_name
-            << "\nUse system mmap: " << options.use_mmap << std::endl;
+            << "\nSparseStore: " << options.sparse_store_path
+            << "\nUse system mmap: " << options.use_mmap
+            << "\nPrefetch: " << (options.compare ? "compare" : options.prefetch ? "yes" : "no") << std::endl;
 }
 
 size_t calculate_umap_pagesize_aligned_graph_file_size(const size_t num_vertices, const size_t num_edges) {
@@ -106,12 +141,27 @@ size_t calculate_umap_pagesize_aligned_graph_file_size(const size_t num_vertices
   return aligned_graph_size;
 }
 
+/// \brief Store of the graph when it is read from a SparseStore
+std::unique_ptr<Umap::SparseStore> sparse_store;
+
 std::pair<uint64_t *, uint64_t *> map_graph(const bfs_options &options) {
 
   void* map_raw_address;
 
-  // Umap requires a pagesize aligned file
-  if (!options.use_mmap) {
+  if (!options.sparse_store_path.empty()) {
+    if (options.use_mmap) {
+      std::cerr << "A SparseStore can not be mapped with system mmap" << std::endl;
+      std::abort();
+    }
+    const size_t size = calculate_umap_pagesize_aligned_graph_file_size(options.num_vertices, options.num_edges);
+    sparse_store.reset(new Umap::SparseStore(options.sparse_store_path, true));
+    map_raw_address = Umap::umap_ex(nullptr, size, PROT_READ, UMAP_PRIVATE, -1, 0, sparse_store.get());
+    if (map_raw_address == UMAP_FAILED) {
+      std::cerr << "Failed to umap the SparseStore " << options.sparse_store_path << std::endl;
+      std::abort();
+    }
+  } else if (!options.use_mmap) {
+    // Umap requires a pagesize aligned file
     const size_t size = calculate_umap_pagesize_aligned_graph_file_size(options.num_vertices, options.num_edges);
     if (!utility::extend_file_size(options.graph_file_name, size)) {
       std::cerr << "Failed to extend the graph file "<< options.graph_file_name <<" to " << size << std::endl;
@@ -201,16 +251,10 @@ void print_num_page_faults() {
   std::cout << "#of major page faults\t" << num_page_faults.second << std::endl;
 }
 
-int main(int argc, char **argv) {
-  bfs_options options;
-
-  parse_options(argc, argv, options);
-  disp_bfs_options(options);
-  if (!options.use_mmap) disp_umap_env_variables();
-
-  std::cout << "Initial #of page faults" << std::endl;
-  print_num_page_faults();
-
+/// \brief Maps the graph, runs BFS on it and unmaps it again,
+/// so that every run starts with an empty buffer
+/// \return The time BFS took in seconds
+double run(const bfs_options &options, const bool prefetch) {
   const uint64_t *index = nullptr;
   const uint64_t *edges = nullptr;
   std::tie(index, edges) = map_graph(options);
@@ -224,15 +268,29 @@ int main(int argc, char **argv) {
   bfs::init_bfs(options.num_vertices, level.data(), visited_filter.data());
   find_bfs_root(options.num_vertices, index, level.data());
 
+  std::unique_ptr<utility::frontier_prefetcher> prefetcher;
+  if (prefetch) {
+    prefetcher.reset(new utility::frontier_prefetcher(options.num_vertices, index, edges, options.use_mmap,
+                                                      options.prefetch_batch_size,
+                                                      options.prefetch_level_bytes));
+  }
+
   std::cout << "Before BFS #of page faults" << std::endl;
   print_num_page_faults();
   const auto bfs_start_time = utility::elapsed_time_sec();
-  const uint16_t max_level = bfs::run_bfs(options.num_vertices, index, edges, level.data(), visited_filter.data());
+  const uint16_t max_level = bfs::run_bfs(options.num_vertices, index, edges, level.data(), visited_filter.data(),
+                                          prefetcher.get());
   const auto bfs_time = utility::elapsed_time_sec(bfs_start_time);
-  std::cout << "BFS took (s)\t" << bfs_time << std::endl;
+  std::cout << "BFS " << (prefetch ? "with prefetching " : "") << "took (s)\t" << bfs_time << std::endl;
   std::cout << "After BFS #of page faults" << std::endl;
   print_num_page_faults();
 
+  if (prefetcher) {
+    std::cout << "Prefetched ranges\t" << prefetcher->total_ranges() << std::endl;
+    std::cout << "Prefetched bytes\t" << prefetcher->total_bytes() << std::endl;
+    std::cout << "Batches cut short by the level limit\t" << prefetcher->truncated_batches() << std::endl;
+  }
+
   count_level(options.num_vertices, max_level, level.data());
 
   if( !options.bfs_level_reference_file_name.empty() ){
@@ -240,9 +298,42 @@ int main(int argc, char **argv) {
       std::cout << "Passed validation" << std::endl;
   }
 
-  utility::unmap_file(options.use_mmap,
-                      utility::get_file_size(options.graph_file_name),
-                      const_cast<uint64_t *>(index));
+  if (sparse_store) {
+    utility::unmap_file(false,
+                        calculate_umap_pagesize_aligned_graph_file_size(options.num_vertices, options.num_edges),
+                        const_cast<uint64_t *>(index));
+    sparse_store->close_files();
+    sparse_store.reset();
+  } else {
+    utility::unmap_file(options.use_mmap,
+                        utility::get_file_size(options.graph_file_name),
+                        const_cast<uint64_t *>(index));
+  }
+
+  return bfs_time;
+}
+
+int main(int argc, char **argv) {
+  bfs_options options;
+
+  parse_options(argc, argv, options);
+  disp_bfs_options(options);
+  if (!options.use_mmap) disp_umap_env_variables();
+
+  std::cout << "Initial #of page faults" << std::endl;
+  print_num_page_faults();
+
+  if (!options.compare) {
+    run(options, options.prefetch);
+    return 0;
+  }
+
+  const double demand_time = run(options, false);
+  const double prefetch_time = run(options, true);
+
+  std::cout << "Demand paging (s)\t" << demand_time << std::endl;
+  std::cout << "Prefetching (s)\t" << prefetch_time << std::endl;
+  std::cout << "Speedup\t" << demand_time / prefetch_time << std::endl;
 
   return 0;
 }
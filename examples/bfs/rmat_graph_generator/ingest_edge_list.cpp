@@ -14,6 +14,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 */
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <sys/mman.h>
 #include <iostream>
 #include <fstream>
@@ -22,10 +23,42 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #include <algorithm>
 #include <tuple>
 #include <cstring>
+#include <memory>
+#include <limits>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "umap/umap.h"
+#include "umap/store/SparseStore.h"
 #include "utility/bitmap.hpp"
 #include "utility/mmap.hpp"
 #include "utility/file.hpp"
+#include "utility/time.hpp"
+#include "rmat_edge_generator.hpp"
+
+/// \brief Where the edges come from: edge list files, or an R-MAT generator
+/// run with the parameters of generate_edge_list
+struct edge_source {
+  std::vector<std::string> file_names;
+  uint64_t vertex_scale{0}; /// 0 reads file_names
+  uint64_t edge_count{0};
+  uint64_t seed{123};
+  double a{0.57};
+  double b{0.19};
+  double c{0.19};
+  bool scramble_id{true};
+  bool generate_both_directions{true};
+  int num_threads{1};
+};
+
+/// \brief Options of the SparseStore ingestion
+struct sparse_store_options {
+  std::string root_path;                 /// Empty writes a graph file instead
+  size_t file_granularity{1ULL << 30};
+  size_t partition_bytes{1ULL << 30};    /// DRAM for the edges of a partition
+};
 
 std::pair<uint64_t, uint64_t>
 check_edge_list(const std::vector<std::string> &edge_list_file_names) {
@@ -135,41 +168,334 @@ void ingest_edges(void *const map_raw_address, const uint64_t max_id, const std:
   delete[] index;
 }
 
+/// \brief Calls f(source, target) for every edge, from several threads.
+/// The generator is deterministic for a seed and a thread count, so every
+/// call sees the same edges.
+template <typename Function>
+void for_each_edge(const edge_source &source, Function f) {
+  if (source.vertex_scale == 0) {
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (size_t i = 0; i < source.file_names.size(); ++i) {
+      std::ifstream edge_stream(source.file_names[i]);
+      if (!edge_stream.is_open()) {
+        std::cerr << "Can not open " << source.file_names[i] << std::endl;
+        std::abort();
+      }
+
+      uint64_t src, trg;
+      while (edge_stream >> src >> trg) f(src, trg);
+    }
+    return;
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static, 1) num_threads(source.num_threads)
+#endif
+  for (int t = 0; t < source.num_threads; ++t) {
+    // Same split as generate_edge_list
+    const uint64_t chunk = source.edge_count / source.num_threads;
+    const uint64_t num_local_edges = chunk + (static_cast<uint64_t>(t) < source.edge_count % source.num_threads ? 1 : 0);
+
+    rmat_edge_generator rmat(source.seed + t, source.vertex_scale, num_local_edges,
+                             source.a, source.b, source.c, 1.0 - (source.a + source.b + source.c),
+                             source.scramble_id, source.generate_both_directions);
+    for (auto edge : rmat) f(edge.first, edge.second);
+  }
+}
+
+/// \brief A umap region backed by a new SparseStore
+struct store_region {
+  std::unique_ptr<Umap::SparseStore> store;
+  void *address{nullptr};
+  size_t size{0};
+};
+
+void map_new_store(const std::string &root_path, const size_t bytes, const size_t file_granularity,
+                   store_region &region) {
+  const size_t page_size = umapcfg_get_umap_page_size();
+  region.size = std::max<size_t>((bytes + page_size - 1) / page_size, 1) * page_size;
+  region.store.reset(new Umap::SparseStore(region.size, page_size, root_path, file_granularity));
+  region.address = Umap::umap_ex(nullptr, region.size, PROT_READ | PROT_WRITE, UMAP_PRIVATE, -1, 0,
+                                 region.store.get());
+  if (region.address == UMAP_FAILED) {
+    std::cerr << "Failed to umap the SparseStore " << root_path << std::endl;
+    std::abort();
+  }
+}
+
+void unmap_store(store_region &region) {
+  if (uunmap(region.address, region.size) < 0) {
+    std::cerr << "Failed to uunmap a SparseStore" << std::endl;
+    std::abort();
+  }
+  region.store->close_files();
+  region.store.reset();
+}
+
+/// \brief Removes the files of a SparseStore and its directory
+void remove_store(const std::string &root_path) {
+  DIR *const directory = ::opendir(root_path.c_str());
+  if (directory == nullptr) return;
+  while (const struct dirent *const entry = ::readdir(directory)) {
+    const std::string name(entry->d_name);
+    if (name != "." && name != "..") ::unlink((root_path + "/" + name).c_str());
+  }
+  ::closedir(directory);
+  ::rmdir(root_path.c_str());
+}
+
+/// \brief Writes the CSR graph into a new SparseStore through a umap region.
+/// The input is read once: the degrees are counted while every thread
+/// appends the edges it reads, as binary pairs, to chunks of a staging
+/// region.  The index is built in DRAM from the degrees.  The vertices are
+/// then cut into partitions whose edges fit in partition_bytes; for each
+/// partition the staging region is scanned sequentially, its edges are
+/// scattered into DRAM, and copied into the graph region in order.  The copy
+/// is advised SEQUENTIAL, the written range NOREUSE, and its write-back is
+/// started right away, so the store is written sequentially and in the
+/// background while the next partition is built.  No random write of
+/// ingest_edges() reaches a region.
+void ingest_edges_to_sparse_store(const sparse_store_options &options, const edge_source &source,
+                                  const uint64_t max_id, const size_t num_edges) {
+  const auto start_time = utility::elapsed_time_sec();
+  const size_t page_size = umapcfg_get_umap_page_size();
+
+  /// ----- read the input into the staging region ----- ///
+  typedef std::pair<uint64_t, uint64_t> edge_type;
+  const uint64_t k_no_edge = std::numeric_limits<uint64_t>::max();
+  const size_t chunk_edges = std::max<size_t>(16 * page_size / sizeof(edge_type), 1);
+  const std::string staging_path = options.root_path + ".staging";
+
+  store_region staging;
+  map_new_store(staging_path, (num_edges + source.num_threads * chunk_edges) * sizeof(edge_type),
+                options.file_granularity, staging);
+  edge_type *const staged = static_cast<edge_type *>(staging.address);
+  umap_advise(staged, 0, UMAP_ADVICE_SEQUENTIAL);
+
+  std::vector<uint64_t> index(max_id + 2, 0);
+  std::vector<std::pair<size_t, size_t>> thread_chunk(source.num_threads, std::make_pair(0, 0));
+  size_t next_chunk = 0;
+
+  std::cout << "---------- Count degree and stage edges ----------" << std::endl;
+  for_each_edge(source, [&](const uint64_t src, const uint64_t trg) {
+#ifdef _OPENMP
+    std::pair<size_t, size_t> &chunk = thread_chunk[omp_get_thread_num()];
+#else
+    std::pair<size_t, size_t> &chunk = thread_chunk[0];
+#endif
+    if (chunk.first == chunk.second) {
+      size_t first;
+#ifdef _OPENMP
+#pragma omp atomic capture
+#endif
+      first = next_chunk++;
+      chunk.first = first * chunk_edges;
+      chunk.second = chunk.first + chunk_edges;
+    }
+    staged[chunk.first++] = edge_type(src, trg);
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+    ++index[src + 1];
+  });
+
+  // The chunks a thread did not fill end with k_no_edge
+  for (const auto &chunk : thread_chunk) {
+    if (chunk.first != chunk.second) staged[chunk.first].first = k_no_edge;
+  }
+
+  for (size_t i = 0; i < max_id + 1; ++i) {
+    index[i + 1] += index[i];
+  }
+  if (index[max_id + 1] != num_edges) {
+    std::cerr << "#of edges read: " << index[max_id + 1] << " != " << num_edges << std::endl;
+    std::abort();
+  }
+
+  /// ----- create and map the graph store ----- ///
+  store_region graph;
+  map_new_store(options.root_path, (max_id + 2 + num_edges) * sizeof(uint64_t), options.file_granularity, graph);
+  uint64_t *const index_map = static_cast<uint64_t *>(graph.address);
+  uint64_t *const edges_map = index_map + max_id + 2;
+
+  // Writes [begin, begin + count) of the graph region, then starts writing
+  // back the pages it completed.  A page that the range ends in is left to
+  // the next range.
+  char *flushed = static_cast<char *>(graph.address);
+  umap_flush_handle pending = nullptr;
+  auto write_range = [&](const uint64_t *const data, uint64_t *const begin, const size_t count) {
+    umap_advise(begin, count * sizeof(uint64_t), UMAP_ADVICE_SEQUENTIAL);
+    const size_t chunk = std::max<size_t>(page_size / sizeof(uint64_t), 1);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (size_t i = 0; i < count; i += chunk) {
+      std::memcpy(begin + i, data + i, std::min(chunk, count - i) * sizeof(uint64_t));
+    }
+    umap_advise(begin, count * sizeof(uint64_t), UMAP_ADVICE_NOREUSE);
+
+    char *const end = static_cast<char *>(graph.address)
+        + (reinterpret_cast<char *>(begin + count) - static_cast<char *>(graph.address)) / page_size * page_size;
+    if (end <= flushed) return;
+
+    // One write-back in flight while the next range is built
+    if (pending != nullptr) umap_flush_wait(pending);
+    pending = umap_flush_async(flushed, end - flushed);
+    flushed = end;
+  };
+
+  std::cout << "---------- Writing index ----------" << std::endl;
+  write_range(index.data(), index_map, max_id + 2);
+
+  std::cout << "---------- Load edges ----------" << std::endl;
+  const size_t partition_edges = std::max<size_t>(options.partition_bytes / sizeof(uint64_t), 1);
+  const size_t num_chunks = next_chunk;
+  std::vector<uint64_t> edges;
+  std::vector<uint64_t> position;
+  size_t num_partitions = 0;
+
+  for (uint64_t first = 0; first <= max_id;) {
+    // A vertex with more edges than fit gets a partition of its own
+    uint64_t last = first + 1;
+    while (last <= max_id && index[last + 1] - index[first] <= partition_edges) ++last;
+
+    const uint64_t edge_base = index[first];
+    edges.resize(index[last] - edge_base);
+    position.assign(index.begin() + first, index.begin() + last);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (size_t c = 0; c < num_chunks; ++c) {
+      for (size_t i = c * chunk_edges; i < (c + 1) * chunk_edges && staged[i].first != k_no_edge; ++i) {
+        const uint64_t src = staged[i].first;
+        if (src < first || src >= last) continue;
+        size_t pos;
+#ifdef _OPENMP
+#pragma omp atomic capture
+#endif
+        pos = position[src - first]++;
+        edges[pos - edge_base] = staged[i].second;
+      }
+    }
+
+    write_range(edges.data(), edges_map + edge_base, edges.size());
+    ++num_partitions;
+    first = last;
+  }
+  std::cout << "#of partitions: " << num_partitions << std::endl;
+
+  /// ----- closing ----- ///
+  if (pending != nullptr) umap_flush_wait(pending);
+  unmap_store(graph);
+  unmap_store(staging);
+  remove_store(staging_path);
+
+  std::cout << "Ingestion took (s)\t" << utility::elapsed_time_sec(start_time) << std::endl;
+}
+
+void usage() {
+  std::cout << "ingest_edge_list [options] [edge list files]\n"
+            << "-g\tGraph file name\n"
+            << "-S\tSparseStore directory to write the graph into instead of a graph file\n"
+            << "-F\tSparseStore file granularity in bytes (default 1 GiB)\n"
+            << "-M\tDRAM for the edges of one partition, in bytes (default 1 GiB); -S only\n"
+            << "-v\tGenerate an R-MAT graph of this SCALE instead of reading edge lists; -S only\n"
+            << "-e\t#of R-MAT edges (default 2^SCALE x 16)\n"
+            << "-s\tR-MAT seed (default 123)\n"
+            << "-u\tIf true, generates R-MAT edges for both directions (default true)" << std::endl;
+}
+
 void parse_options(int argc, char **argv,
                    std::string &graph_file_name,
-                   std::vector<std::string> &edge_list_file_names) {
+                   sparse_store_options &store_options,
+                   edge_source &source) {
   graph_file_name = "";
 
   int c;
-  while ((c = getopt(argc, argv, "g:h")) != -1) {
+  while ((c = getopt(argc, argv, "g:S:F:M:v:e:s:u:h")) != -1) {
     switch (c) {
-      case 'g': /// Required
+      case 'g': /// Required unless -S is given
         graph_file_name = optarg;
         break;
 
-      case 'h':
-        // usage();
+      case 'S':
+        store_options.root_path = optarg;
+        break;
+
+      case 'F':
+        store_options.file_granularity = std::stoull(optarg);
+        break;
+
+      case 'M':
+        store_options.partition_bytes = std::stoull(optarg);
+        break;
+
+      case 'v':
+        source.vertex_scale = std::stoull(optarg);
+        break;
+
+      case 'e':
+        source.edge_count = std::stoull(optarg);
+        break;
+
+      case 's':
+        source.seed = std::stoull(optarg);
         break;
+
+      case 'u':
+        source.generate_both_directions = static_cast<bool>(std::stoi(optarg));
+        break;
+
+      case 'h':
+        usage();
+        std::exit(0);
     }
   }
 
   for (int index = optind; index < argc; index++) {
-    edge_list_file_names.emplace_back(argv[index]);
+    source.file_names.emplace_back(argv[index]);
+  }
+
+  if (source.vertex_scale != 0 && store_options.root_path.empty()) {
+    std::cerr << "R-MAT generation (-v) requires a SparseStore (-S)" << std::endl;
+    std::abort();
   }
+  if (source.vertex_scale != 0 && source.edge_count == 0) {
+    source.edge_count = (1ULL << source.vertex_scale) * 16;
+  }
+#ifdef _OPENMP
+  source.num_threads = omp_get_max_threads();
+#endif
 }
 
 int main(int argc, char **argv) {
   std::string graph_file_name;
-  std::vector<std::string> edge_list_file_names;
+  sparse_store_options store_options;
+  edge_source source;
 
-  parse_options(argc, argv, graph_file_name, edge_list_file_names);
+  parse_options(argc, argv, graph_file_name, store_options, source);
+  const std::vector<std::string> &edge_list_file_names = source.file_names;
 
   uint64_t max_id;
   size_t num_edges;
-  std::tie(max_id, num_edges) = check_edge_list(edge_list_file_names);
+  if (source.vertex_scale != 0) {
+    max_id = (1ULL << source.vertex_scale) - 1;
+    num_edges = source.edge_count * (source.generate_both_directions ? 2 : 1);
+  } else {
+    std::tie(max_id, num_edges) = check_edge_list(edge_list_file_names);
+  }
   std::cout << "num_vertices: " << max_id + 1 << std::endl;
   std::cout << "num_edges: " << num_edges << std::endl;
 
+  if (!store_options.root_path.empty()) {
+    ingest_edges_to_sparse_store(store_options, source, max_id, num_edges);
+    std::cout << "Edge list ingestion is finished" << std::endl;
+    return 0;
+  }
+
   /// ----- create and map output (graph) file ----- ///
   const size_t graph_size = (max_id + 2 + num_edges) * sizeof(uint64_t);
   if (!utility::create_file(graph_file_name)) {
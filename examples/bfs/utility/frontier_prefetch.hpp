@@ -0,0 +1,196 @@
+/*
+This file is part of UMAP.  For copyright information see the COPYRIGHT
+file in the top level directory, or at
+https://github.com/LLNL/umap/blob/master/COPYRIGHT
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU Lesser General Public License (as published by the Free
+Software Foundation) version 2.1 dated February 1999.  This program is
+distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the IMPLIED WARRANTY OF MERCHANTABILITY or FITNESS FOR A PARTICULAR
+PURPOSE. See the terms and conditions of the GNU Lesser General Public License
+for more details.  You should have received a copy of the GNU Lesser General
+Public License along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+#ifndef UMAP_APPS_UTILITY_FRONTIER_PREFETCH_HPP
+#define UMAP_APPS_UTILITY_FRONTIER_PREFETCH_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "umap/umap.h"
+#include "utility/bitmap.hpp"
+
+namespace utility {
+
+/// \brief Prefetches the neighbour lists of the vertices a level of a graph
+/// traversal discovers, while that level is still running.
+/// Each thread adds the vertices it discovers to its own batch.  A full batch
+/// is sorted, the edge ranges of its vertices are extended to whole pages,
+/// pages already prefetched for the level are left out, and every run of
+/// consecutive pages is handed to umap as one asynchronous prefetch.  The
+/// bytes prefetched per level are bounded so that prefetches do not evict the
+/// pages the level is still reading.
+class frontier_prefetcher {
+ public:
+  /// \param num_vertices The number of vertices
+  /// \param index The index array of the CSR graph
+  /// \param edges The edges array of the CSR graph
+  /// \param use_mmap Whether the graph is mapped with mmap, in which case
+  /// madvise(MADV_WILLNEED) is used instead of umap_prefetch_range()
+  /// \param batch_size Number of vertices a thread collects before it prefetches
+  /// \param max_level_bytes Bytes prefetched per level at most,
+  /// 0 for half the umap buffer
+  frontier_prefetcher(const size_t num_vertices,
+                      const uint64_t *const index,
+                      const uint64_t *const edges,
+                      const bool use_mmap,
+                      const size_t batch_size = 256,
+                      const uint64_t max_level_bytes = 0)
+      : m_index(index),
+        m_edges(edges),
+        m_use_mmap(use_mmap),
+        m_batch_size(batch_size),
+        m_page_size(use_mmap ? ::sysconf(_SC_PAGESIZE) : umapcfg_get_umap_page_size()),
+        m_max_level_bytes(max_level_bytes),
+        m_level_bytes(0),
+        m_total_bytes(0),
+        m_total_ranges(0),
+        m_truncated_batches(0) {
+    m_first_page = page_down(reinterpret_cast<uintptr_t>(m_edges));
+    m_requested.resize(utility::bitmap_size(
+        (page_up(reinterpret_cast<uintptr_t>(m_edges + m_index[num_vertices])) - m_first_page) / m_page_size));
+    if (m_max_level_bytes == 0)
+      m_max_level_bytes = umapcfg_get_max_pages_in_buffer() * umapcfg_get_umap_page_size() / 2;
+#ifdef _OPENMP
+    m_batches.resize(::omp_get_max_threads());
+#else
+    m_batches.resize(1);
+#endif
+    for (auto &batch : m_batches)
+      batch.reserve(m_batch_size);
+  }
+
+  /// \brief Called before a level starts, resets the bytes prefetched for it
+  void start_level() {
+    m_level_bytes = 0;
+    std::fill(m_requested.begin(), m_requested.end(), 0);
+  }
+
+  /// \brief Adds a vertex discovered by the calling thread
+  void add(const uint64_t vertex) {
+    std::vector<uint64_t> &batch = m_batches[thread_num()];
+    batch.push_back(vertex);
+    if (batch.size() >= m_batch_size)
+      flush(batch);
+  }
+
+  /// \brief Prefetches what is left in the batches of all threads,
+  /// called after the loop of a level
+  void flush_all() {
+    for (auto &batch : m_batches)
+      flush(batch);
+  }
+
+  uint64_t total_bytes() const { return m_total_bytes; }
+  uint64_t total_ranges() const { return m_total_ranges; }
+  uint64_t truncated_batches() const { return m_truncated_batches; }
+
+ private:
+  static int thread_num() {
+#ifdef _OPENMP
+    return ::omp_get_thread_num();
+#else
+    return 0;
+#endif
+  }
+
+  void flush(std::vector<uint64_t> &batch) {
+    if (batch.empty()) return;
+
+    std::sort(batch.begin(), batch.end());
+
+    uint64_t run_start = 0;
+    uint64_t run_end = 0;
+
+    for (const uint64_t vertex : batch) {
+      if (m_index[vertex] == m_index[vertex + 1]) continue;
+
+      const uint64_t first = page_number(page_down(reinterpret_cast<uintptr_t>(m_edges + m_index[vertex])));
+      const uint64_t last = page_number(page_up(reinterpret_cast<uintptr_t>(m_edges + m_index[vertex + 1])));
+
+      for (uint64_t page = first; page < last; ++page) {
+        if (!request(page)) continue;
+        if (run_end == page) {
+          ++run_end;
+          continue;
+        }
+        if (run_end != 0 && !prefetch(run_start, run_end)) {
+          ++m_truncated_batches;
+          batch.clear();
+          return;
+        }
+        run_start = page;
+        run_end = page + 1;
+      }
+    }
+    if (run_end != 0 && !prefetch(run_start, run_end))
+      ++m_truncated_batches;
+
+    batch.clear();
+  }
+
+  /// \brief Marks a page as prefetched for the level
+  /// \return false if it was already
+  bool request(const uint64_t page) {
+    const uint64_t bit = 0x1ULL << utility::bitmap_local_pos(page);
+    return !(__atomic_fetch_or(&m_requested[utility::bitmap_global_pos(page)], bit, __ATOMIC_RELAXED) & bit);
+  }
+
+  /// \brief Prefetches the pages [first, last)
+  bool prefetch(const uint64_t first, const uint64_t last) {
+    const uint64_t length = (last - first) * m_page_size;
+
+    if (m_level_bytes.fetch_add(length) + length > m_max_level_bytes)
+      return false;
+
+    void *const addr = reinterpret_cast<void *>(m_first_page + first * m_page_size);
+    if (m_use_mmap)
+      ::madvise(addr, length, MADV_WILLNEED);
+    else
+      umap_prefetch_range(addr, length, UMAP_PREFETCH_DETACHED);
+
+    m_total_bytes += length;
+    ++m_total_ranges;
+    return true;
+  }
+
+  uint64_t page_number(const uintptr_t addr) const { return (addr - m_first_page) / m_page_size; }
+  uintptr_t page_down(const uintptr_t addr) const { return addr - addr % m_page_size; }
+  uintptr_t page_up(const uintptr_t addr) const { return page_down(addr + m_page_size - 1); }
+
+  const uint64_t *const m_index;
+  const uint64_t *const m_edges;
+  const bool m_use_mmap;
+  const size_t m_batch_size;
+  const uint64_t m_page_size;
+  uint64_t m_max_level_bytes;
+  std::atomic<uint64_t> m_level_bytes;
+  std::atomic<uint64_t> m_total_bytes;
+  std::atomic<uint64_t> m_total_ranges;
+  std::atomic<uint64_t> m_truncated_batches;
+  uintptr_t m_first_page;
+  std::vector<uint64_t> m_requested;
+  std::vector<std::vector<uint64_t>> m_batches;
+};
+
+} // namespace utility
+#endif //UMAP_APPS_UTILITY_FRONTIER_PREFETCH_HPP
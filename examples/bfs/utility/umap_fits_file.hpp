@@ -31,6 +31,12 @@
 #include <unordered_map>
 #include <algorithm>
 #include <cassert>
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -55,11 +61,10 @@ struct Tile_Dim {
 };
 
 struct Tile_File {
-  int fd;
   std::string fname;
-  std::size_t tile_start;
   std::size_t tile_size;
-  std::size_t pgaligned_tile_start;
+  int datatype;       // CFITSIO type the pixels are read as
+  bool compressed;
 };
 
 class Tile {
@@ -67,14 +72,11 @@ friend std::ostream &operator<<(std::ostream &os, utility::umap_fits_file::Tile
 friend class CfitsStoreFile;
 public:
   Tile(const std::string& _fn);
-  ssize_t buffered_read(void*, std::size_t, off_t);
+  void decode(void*);
   Tile_Dim get_Dim() { return dim; }
 private:
   Tile_File file;
   Tile_Dim  dim;
-  void* map;
-  std::size_t map_start; // start of the file data in the map
-  std::size_t map_size; // size of the map
 };
 std::ostream &operator<<(std::ostream &os, utility::umap_fits_file::Tile const &ft);
 
@@ -87,26 +89,77 @@ struct Cube {
 
 static std::unordered_map<void*, Cube*>  Cubes;
 
+//
+// Serves the pages of a cube from whole decoded tiles.  CFITSIO decodes a
+// (possibly compressed) tile in one go, so a bounded LRU cache of decoded
+// tiles keeps it from being decoded again for every umap page inside it.
+// A batch of pages read ahead by umap has the tiles it needs decoded in
+// parallel, by up to "decoders" threads, before its pages are copied out.
+//
 class CfitsStoreFile : public Umap::Store {
   public:
-    CfitsStoreFile(Cube* _cube_, size_t _rsize_, size_t _aligned_size)
-      : cube{_cube_}, rsize{_rsize_}, aligned_size{_aligned_size}{}
+    CfitsStoreFile(Cube* _cube_, size_t _rsize_, size_t _aligned_size, size_t _cache_tiles = 8, unsigned _decoders = 4)
+      : cube{_cube_}, rsize{_rsize_}, aligned_size{_aligned_size}
+      , cache_tiles{std::max<size_t>(_cache_tiles, 1)}, decoders{std::max(_decoders, 1u)} {}
 
     ssize_t read_from_store(char* buf, size_t nb, off_t off) {
-      ssize_t rval = 0;
-      off_t tileno = off / cube->tile_size;
-      off_t tileoffset = off % cube->tile_size;
+      size_t done = 0;
 
-      if ( ( rval = cube->tiles[tileno].buffered_read(buf, nb, tileoffset) ) == -1) {
-        perror("ERROR: buffered_read failed");
-        exit(1);
+      while ( done < nb ) {
+        size_t tileno = (off + done) / cube->tile_size;
+        size_t tileoffset = (off + done) % cube->tile_size;
+
+        // Fill the padding after the last tile with NaNs
+        if ( tileno >= cube->tiles.size() ) {
+          memset(&buf[done], 0xff, nb - done);
+          break;
+        }
+
+        size_t n = std::min(nb - done, cube->tile_size - tileoffset);
+        std::shared_ptr<DecodedTile> tile = get_tile(tileno);
+
+        memcpy(&buf[done], &tile->data[tileoffset], n);
+        done += n;
+      }
+      return nb;
+    }
+
+    int read_batch(Umap::StoreIo* ios, size_t n) {
+      std::vector<size_t> tilenos;
+
+      for ( size_t i = 0; i < n; i++ ) {
+        size_t first = ios[i].off / cube->tile_size;
+        size_t last = std::min((ios[i].off + ios[i].nb - 1) / cube->tile_size, cube->tiles.size() - 1);
+
+        for ( size_t t = first; t <= last; t++ )
+          tilenos.push_back(t);
       }
 
-      // Fill the rest with NaNs if the read returned less than the requested amount.
-      if (rval < nb) {
-        memset((void*)&buf[rval], 0xff, nb - rval - 1);
+      std::sort(tilenos.begin(), tilenos.end());
+      tilenos.erase(std::unique(tilenos.begin(), tilenos.end()), tilenos.end());
+
+      // More tiles than the cache holds would evict each other
+      if ( tilenos.size() > cache_tiles )
+        tilenos.resize(cache_tiles);
+
+      if ( tilenos.size() > 1 && decoders > 1 ) {
+        std::atomic<size_t> next{0};
+        std::vector<std::thread> threads;
+
+        for ( unsigned d = 0; d < std::min<size_t>(decoders, tilenos.size()); d++ )
+          threads.emplace_back([&]() {
+            for ( size_t i; ( i = next++ ) < tilenos.size(); )
+              get_tile(tilenos[i]);
+          });
+
+        for ( auto& t : threads )
+          t.join();
       }
-      return rval;
+
+      for ( size_t i = 0; i < n; i++ )
+        ios[i].done = read_from_store(ios[i].buf, ios[i].nb, ios[i].off);
+
+      return 0;
     }
 
     ssize_t  write_to_store(char* buf, size_t nb, off_t off) {
@@ -117,11 +170,63 @@ class CfitsStoreFile : public Umap::Store {
     void* region;
 
   private:
+    struct DecodedTile {
+      std::vector<char> data;
+      bool ready;
+    };
+
+    //
+    // Returns the decoded tile, decoding it unless it is in the cache.  A
+    // tile being decoded by another thread is waited for.
+    //
+    std::shared_ptr<DecodedTile> get_tile(size_t tileno) {
+      std::unique_lock<std::mutex> lock(mutex);
+      auto it = cache.find(tileno);
+
+      if ( it != cache.end() ) {
+        lru.splice(lru.begin(), lru, it->second.second);
+        std::shared_ptr<DecodedTile> tile = it->second.first;
+        cond.wait(lock, [&tile]() { return tile->ready; });
+        return tile;
+      }
+
+      std::shared_ptr<DecodedTile> tile = std::make_shared<DecodedTile>();
+      tile->ready = false;
+      lru.push_front(tileno);
+      cache[tileno] = std::make_pair(tile, lru.begin());
+
+      // Tiles still being decoded stay, they are waited for
+      while ( cache.size() > cache_tiles ) {
+        auto victim = std::find_if(lru.rbegin(), lru.rend()
+            , [this](size_t t) { return cache[t].first->ready; });
+
+        if ( victim == lru.rend() )
+          break;
+
+        cache.erase(*victim);
+        lru.erase(std::next(victim).base());
+      }
+      lock.unlock();
+
+      tile->data.resize(cube->tile_size);
+      cube->tiles[tileno].decode(tile->data.data());
+
+      lock.lock();
+      tile->ready = true;
+      cond.notify_all();
+      return tile;
+    }
+
     Cube* cube;
-    char* aligned_buf;
     size_t rsize;
     size_t aligned_size;
-    int fd;
+    size_t cache_tiles;
+    unsigned decoders;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::list<size_t> lru;      // Most recently used first
+    std::unordered_map<size_t, std::pair<std::shared_ptr<DecodedTile>, std::list<size_t>::iterator>> cache;
 };
 
 /* Returns pointer to cube[Z][Y][X] Z=time, X/Y=2D space coordinates */
@@ -130,7 +235,9 @@ void* PerFits_alloc_cube(
     size_t* BytesPerElement,            /* Output: size of each element of cube */
     size_t* xDim,                       /* Output: Dimension of X */
     size_t* yDim,                       /* Output: Dimension of Y */
-    size_t* zDim                        /* Output: Dimension of Z */
+    size_t* zDim,                       /* Output: Dimension of Z */
+    size_t cache_tiles = 8,             /* Decoded tiles kept in memory */
+    unsigned decoders = 4               /* Threads decoding the tiles of a read-ahead */
 )
 {
   void* region = NULL;
@@ -183,7 +290,7 @@ void* PerFits_alloc_cube(
 
 
   CfitsStoreFile* cstore;
-  cstore = new CfitsStoreFile{cube, cube->cube_size, psize};
+  cstore = new CfitsStoreFile{cube, cube->cube_size, psize, cache_tiles, decoders};
 
   const int prot = PROT_READ|PROT_WRITE;
   int flags = UMAP_PRIVATE;
@@ -222,33 +329,18 @@ Tile::Tile(const std::string& _fn)
 {
   fitsfile* fptr = NULL;
   int status = 0;
-  LONGLONG headstart;
-  LONGLONG datastart;
-  LONGLONG dataend;
   int bitpix;
   long naxis[2];
   int naxes;
-  int open_flags = (O_RDONLY | O_LARGEFILE | O_DIRECT);
 
   file.fname = _fn;
-  file.tile_start = (size_t)0;
   file.tile_size = (size_t)0;
   dim.xDim = (size_t)0;
   dim.yDim = (size_t)0;
   dim.elem_size = 0;
-  file.fd = -1;
-
-  if ( fits_open_data(&fptr, file.fname.c_str(), READONLY, &status) ) {
-    fits_report_error(stderr, status);
-    exit(-1);
-  }
-
-  if ( fits_get_hduaddrll(fptr, &headstart, &datastart, &dataend, &status) ) {
-    fits_report_error(stderr, status);
-    exit(-1);
-  }
 
-  if ( fits_get_img_type(fptr, &bitpix, &status) ) {
+  // Compressed images are opened as the image they hold
+  if ( fits_open_image(&fptr, file.fname.c_str(), READONLY, &status) ) {
     fits_report_error(stderr, status);
     exit(-1);
   }
@@ -258,69 +350,55 @@ Tile::Tile(const std::string& _fn)
     exit(-1);
   }
 
+  file.compressed = fits_is_compressed_image(fptr, &status);
+
   if ( fits_close_file(fptr, &status) ) {
     fits_report_error(stderr, status);
     exit(-1);
   }
 
-  if ( ( file.fd = open(file.fname.c_str(), open_flags) ) == -1 ) {
-    perror(file.fname.c_str());
-    exit(-1);
+  switch ( bitpix ) {
+    case BYTE_IMG:     file.datatype = TBYTE;     break;
+    case SHORT_IMG:    file.datatype = TSHORT;    break;
+    case LONG_IMG:     file.datatype = TINT;      break;
+    case LONGLONG_IMG: file.datatype = TLONGLONG; break;
+    case FLOAT_IMG:    file.datatype = TFLOAT;    break;
+    case DOUBLE_IMG:   file.datatype = TDOUBLE;   break;
+    default:
+      cerr << file.fname << ": unsupported BITPIX " << bitpix << endl;
+      exit(-1);
   }
 
   dim.xDim = (size_t)naxis[0];
   dim.yDim = (size_t)naxis[1];
   dim.elem_size = bitpix < 0 ? (size_t)( ( bitpix * -1 ) / 8 ) : (size_t)( bitpix / 8 );
-  file.tile_start = (size_t)datastart;
   file.tile_size = (size_t)(dim.xDim * dim.yDim * dim.elem_size);
-
-  file.pgaligned_tile_start = file.tile_start & ~(4096-1);
-  map_start = file.tile_start - file.pgaligned_tile_start;
-  map_size = file.tile_size + map_start;
-//   if ( ( map = mmap(0, map_size, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, file.fd, file.pgaligned_tile_start) ) == 0 ) {
-//     perror(file.fname.c_str());
-//     exit(-1);
-//   }
-
-  // Set some advice flags to minimize unwanted buffering and read-ahead on
-  // sparse data accesses
-  posix_fadvise(file.fd, file.pgaligned_tile_start, map_size, POSIX_FADV_RANDOM);
-//   madvise(map, map_size, MADV_RANDOM | MADV_DONTDUMP);
-
-  assert( (dataend - datastart) >= (dim.xDim * dim.yDim * dim.elem_size) );
 }
 
-ssize_t Tile::buffered_read(void* request_buf, std::size_t request_size, off_t request_offset)
+//
+// Reads the whole image, in native byte order, with CFITSIO doing any
+// decompression.  Each call opens the file for itself, so that tiles can be
+// decoded by several threads at once.
+//
+void Tile::decode(void* buf)
 {
-  std::size_t ua_request_size = request_size + map_start;
-  off_t eof = 0;
-  off_t req_end = request_offset + ua_request_size;
+  fitsfile* fptr = NULL;
+  int status = 0;
+  int anynul = 0;
 
-  // Make sure that the memcpy doesn't go past EOF
-  if (req_end >= map_size) {
-    eof = req_end - map_size;
+  if ( fits_open_image(&fptr, file.fname.c_str(), READONLY, &status)
+    || fits_read_img(fptr, file.datatype, 1, (LONGLONG)(dim.xDim * dim.yDim), NULL, buf, &anynul, &status)
+    || fits_close_file(fptr, &status) ) {
+    fits_report_error(stderr, status);
+    exit(-1);
   }
-
-//   void* request = &((char*)map)[request_offset];
-//   memcpy(request_buf, request, ua_request_size - eof);
-//   madvise(request, request_size*2, MADV_DONTNEED);
-
-  pread(file.fd, request_buf, ua_request_size - eof, file.pgaligned_tile_start);
-  // Realign the data in the request buffer.
-  // TODO: Find a better way to fix this.
-  // This is a hack that relies on the fact that copy_buf passed in by
-  // the userfault handler from umap is actually allocated to be 2 umap pages
-  // rather than the request_size (1 page) given to this function.
-  memmove(request_buf, &((char*)request_buf)[map_start], request_size);
-
-  return request_size - eof;
 }
 
 std::ostream &operator<<(std::ostream &os, Tile const &ft)
 {
   os << ft.file.fname << " "
-     << "Start=" << ft.file.tile_start << ", "
      << "Size=" << ft.file.tile_size << ", "
+     << "Compressed=" << ft.file.compressed << ", "
      << "XDim=" << ft.dim.xDim << ", "
      << "YDim=" << ft.dim.yDim << ", "
      << "ESize=" << ft.dim.elem_size << " ";
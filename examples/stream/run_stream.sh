@@ -28,5 +28,15 @@ echo $cmd
 date
 eval $cmd
 
+# the same arrays as regions of their own, with fault path bandwidth and overlap
+cmd="env LD_LIBRARY_PATH=${UMAP_INSTALL_PATH}/lib UMAP_PAGESIZE=$umap_psize ./stream-regions -n $array_length -i"
+echo $cmd
+eval $cmd
+
+cmd="env LD_LIBRARY_PATH=${UMAP_INSTALL_PATH}/lib UMAP_PAGESIZE=$umap_psize UMAP_BUFSIZE=$umap_bufsize ./stream-regions -n $array_length -H all:sequential"
+echo $cmd
+date
+eval $cmd
+
 echo "Done"
 exit
@@ -0,0 +1,474 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// A variant of the STREAM benchmark for the sequential path of umap.  The
+// three arrays are mapped as regions of their own, each with its own advice
+// and buffer quota, and every kernel is measured three ways:
+//
+// - the bandwidth STREAM reports, from the bytes the kernel touches;
+// - the fault path bandwidth, from the bytes umap read from and wrote to the
+//   files while the kernel ran, as counted by umap_get_stats();
+// - how well that I/O overlapped with the computation: the kernel is timed
+//   on arrays in DRAM, the I/O is timed with O_DIRECT at the bandwidth of
+//   the device, and the overlap is 1 when the kernel took no longer than
+//   the slower of the two and 0 when it took their sum.
+//
+// Usage: stream-regions -n <elements> [-i] [-k iterations] [-d]
+//                       [-H <array>:<advice>] [-Q <array>:<min>:<max>]
+//
+// -i writes the files of the arrays and stops, as "stream <n> 1" does; the
+// kernels change the arrays, so the files are written again before each run.
+// -d skips the DRAM runs, e.g. when the arrays do not fit in memory.
+// <array> is a, b, c or all; <advice> one of normal, sequential, random,
+// noreuse or hot; a quota is given in umap pages, 0 for no maximum.
+//
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "umap/umap.h"
+
+#define NARRAYS  3
+#define NKERNELS 4
+
+static const char* array_names[NARRAYS] = { "a", "b", "c" };
+static const char* kernel_names[NKERNELS] = { "Copy", "Scale", "Add", "Triad" };
+
+// Arrays each kernel reads and writes, in units of array bytes
+static const int kernel_arrays[NKERNELS] = { 2, 2, 3, 3 };
+
+static const double scalar = 3.0;
+
+struct kernel_result {
+  double best_time;
+  double total_time;
+  double dram_time;
+  double io_time;         // At the calibrated bandwidth of the device
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t faults;
+  uint64_t fills;
+  uint64_t prefetches;
+};
+
+static double mysecond( void )
+{
+  struct timeval tp;
+
+  gettimeofday(&tp, NULL);
+  return (double)tp.tv_sec + (double)tp.tv_usec * 1.e-6;
+}
+
+static void usage( const char* pname )
+{
+  fprintf(stderr,
+      "Usage: %s -n <elements> [-i] [-k iterations] [-d]\n"
+      "          [-H <array>:<advice>] [-Q <array>:<min pages>:<max pages>]\n"
+      " -n  Elements of each array\n"
+      " -i  Write the files of the arrays, then stop\n"
+      " -k  Times each kernel is run, default 10\n"
+      " -d  Do not time the kernels on arrays in DRAM\n"
+      " -H  Advice of an array (a, b, c or all): normal, sequential, random, noreuse or hot\n"
+      " -Q  Buffer quota of an array in umap pages, 0 for no maximum\n"
+      , pname);
+  exit(1);
+}
+
+static int parse_arrays( const char* s, const char** rest, int* which )
+{
+  size_t len = strcspn(s, ":");
+
+  *rest = ( s[len] == ':' ) ? s + len + 1 : NULL;
+
+  if ( len == 3 && strncmp(s, "all", 3) == 0 ) {
+    which[0] = which[1] = which[2] = 1;
+    return 0;
+  }
+  for ( int i = 0; i < NARRAYS; ++i ) {
+    if ( len == 1 && s[0] == array_names[i][0] ) {
+      which[i] = 1;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int parse_advice( const char* s )
+{
+  static const struct { const char* name; int advice; } advice[] = {
+      { "normal", UMAP_ADVICE_NORMAL }
+    , { "sequential", UMAP_ADVICE_SEQUENTIAL }
+    , { "random", UMAP_ADVICE_RANDOM }
+    , { "noreuse", UMAP_ADVICE_NOREUSE }
+    , { "hot", UMAP_ADVICE_HOT }
+  };
+
+  for ( size_t i = 0; i < sizeof(advice) / sizeof(advice[0]); ++i )
+    if ( strcmp(s, advice[i].name) == 0 )
+      return advice[i].advice;
+  return -1;
+}
+
+static int open_array_file( const char* name, size_t length, int init )
+{
+  char fname[64];
+  int fd;
+
+  snprintf(fname, sizeof(fname), "./stream_regions_%s", name);
+
+  if ( init )
+    unlink(fname);
+
+  if ( ( fd = open(fname, O_RDWR | O_CREAT | O_DIRECT, S_IRUSR | S_IWUSR) ) == -1 ) {
+    fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+    exit(1);
+  }
+
+  if ( init && posix_fallocate(fd, 0, length) != 0 ) {
+    fprintf(stderr, "Failed to allocate %s\n", fname);
+    exit(1);
+  }
+  return fd;
+}
+
+//
+// Bandwidth of the device the arrays are on, from writing and reading a
+// scratch file of the size of an array with O_DIRECT
+//
+static void calibrate( size_t length, double* read_bw, double* write_bw )
+{
+  const size_t chunk = 1 << 20;
+  void* buf;
+  int fd = open_array_file("calibrate", length, 1);
+  double t;
+
+  if ( posix_memalign(&buf, 4096, chunk) != 0 ) {
+    fprintf(stderr, "Failed to allocate the calibration buffer\n");
+    exit(1);
+  }
+  memset(buf, 0x5a, chunk);
+
+  t = mysecond();
+  for ( size_t off = 0; off < length; off += chunk )
+    if ( pwrite(fd, buf, ( length - off < chunk ) ? length - off : chunk, off) < 0 )
+      perror("pwrite");
+  fsync(fd);
+  *write_bw = length / ( mysecond() - t );
+
+  t = mysecond();
+  for ( size_t off = 0; off < length; off += chunk )
+    if ( pread(fd, buf, ( length - off < chunk ) ? length - off : chunk, off) < 0 )
+      perror("pread");
+  *read_bw = length / ( mysecond() - t );
+
+  close(fd);
+  unlink("./stream_regions_calibrate");
+  free(buf);
+}
+
+static void run_kernel( int k, double* a, double* b, double* c, size_t n )
+{
+  size_t j;
+
+  switch ( k ) {
+    case 0:
+#pragma omp parallel for
+      for ( j = 0; j < n; j++ )
+        c[j] = a[j];
+      break;
+    case 1:
+#pragma omp parallel for
+      for ( j = 0; j < n; j++ )
+        b[j] = scalar * c[j];
+      break;
+    case 2:
+#pragma omp parallel for
+      for ( j = 0; j < n; j++ )
+        c[j] = a[j] + b[j];
+      break;
+    case 3:
+#pragma omp parallel for
+      for ( j = 0; j < n; j++ )
+        a[j] = b[j] + scalar * c[j];
+      break;
+  }
+}
+
+static void init_arrays( double* a, double* b, double* c, size_t n )
+{
+  size_t j;
+
+#pragma omp parallel for
+  for ( j = 0; j < n; j++ ) {
+    a[j] = 1.0;
+    b[j] = 2.0;
+    c[j] = 0.0;
+  }
+}
+
+//
+// Best time of each kernel with the arrays in DRAM
+//
+static void time_dram( size_t n, int ntimes, struct kernel_result* results )
+{
+  double* a = malloc(n * sizeof(double));
+  double* b = malloc(n * sizeof(double));
+  double* c = malloc(n * sizeof(double));
+
+  if ( a == NULL || b == NULL || c == NULL ) {
+    fprintf(stderr, "The arrays do not fit in memory, use -d\n");
+    exit(1);
+  }
+
+  init_arrays(a, b, c, n);
+
+  for ( int iter = 0; iter < ntimes; iter++ ) {
+    for ( int k = 0; k < NKERNELS; k++ ) {
+      double t = mysecond();
+
+      run_kernel(k, a, b, c, n);
+      t = mysecond() - t;
+
+      if ( iter > 0 && ( results[k].dram_time == 0.0 || t < results[k].dram_time ) )
+        results[k].dram_time = t;
+    }
+  }
+
+  free(a);
+  free(b);
+  free(c);
+}
+
+static int check_results( double* a, double* b, double* c, size_t n, int ntimes )
+{
+  double aj = 1.0, bj = 2.0, cj = 0.0;
+  const double epsilon = 1.e-13;
+  size_t errors = 0;
+  size_t j;
+
+  for ( int k = 0; k < ntimes; k++ ) {
+    cj = aj;
+    bj = scalar * cj;
+    cj = aj + bj;
+    aj = bj + scalar * cj;
+  }
+
+#pragma omp parallel for reduction(+:errors)
+  for ( j = 0; j < n; j++ ) {
+    if ( ( a[j] - aj ) / aj > epsilon || ( aj - a[j] ) / aj > epsilon
+      || ( b[j] - bj ) / bj > epsilon || ( bj - b[j] ) / bj > epsilon
+      || ( c[j] - cj ) / cj > epsilon || ( cj - c[j] ) / cj > epsilon )
+      errors++;
+  }
+
+  if ( errors != 0 ) {
+    printf("Failed validation: %zu elements differ from a=%e b=%e c=%e\n", errors, aj, bj, cj);
+    return 1;
+  }
+  printf("Solution validates\n");
+  return 0;
+}
+
+int main( int argc, char* argv[] )
+{
+  size_t n = 0;
+  int init = 0;
+  int ntimes = 10;
+  int dram = 1;
+  int advice[NARRAYS] = { -1, -1, -1 };
+  uint64_t quota_min[NARRAYS] = { 0, 0, 0 };
+  uint64_t quota_max[NARRAYS] = { 0, 0, 0 };
+  int has_quota[NARRAYS] = { 0, 0, 0 };
+  int opt;
+
+  while ( ( opt = getopt(argc, argv, "n:ik:dH:Q:") ) != -1 ) {
+    int which[NARRAYS] = { 0, 0, 0 };
+    const char* rest;
+
+    switch ( opt ) {
+      case 'n': n = strtoull(optarg, NULL, 0); break;
+      case 'i': init = 1; break;
+      case 'k': ntimes = atoi(optarg); break;
+      case 'd': dram = 0; break;
+      case 'H':
+      {
+        int adv;
+
+        if ( parse_arrays(optarg, &rest, which) != 0 || rest == NULL || ( adv = parse_advice(rest) ) == -1 )
+          usage(argv[0]);
+        for ( int i = 0; i < NARRAYS; ++i )
+          if ( which[i] )
+            advice[i] = adv;
+        break;
+      }
+      case 'Q':
+      {
+        unsigned long long min, max;
+
+        if ( parse_arrays(optarg, &rest, which) != 0 || rest == NULL || sscanf(rest, "%llu:%llu", &min, &max) != 2 )
+          usage(argv[0]);
+        for ( int i = 0; i < NARRAYS; ++i ) {
+          if ( which[i] ) {
+            has_quota[i] = 1;
+            quota_min[i] = min;
+            quota_max[i] = max;
+          }
+        }
+        break;
+      }
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if ( n == 0 || ntimes < 2 )
+    usage(argv[0]);
+
+  const size_t psize = umapcfg_get_umap_page_size();
+  const size_t length = ( n * sizeof(double) + psize - 1 ) / psize * psize;
+  double* arrays[NARRAYS];
+
+  for ( int i = 0; i < NARRAYS; ++i ) {
+    int fd = open_array_file(array_names[i], length, init);
+
+    arrays[i] = (double*)umap(NULL, length, PROT_READ | PROT_WRITE, UMAP_PRIVATE, fd, 0);
+    if ( arrays[i] == UMAP_FAILED ) {
+      fprintf(stderr, "Failed to map %s: %s\n", array_names[i], strerror(errno));
+      return 1;
+    }
+    if ( advice[i] != -1 )
+      umap_advise(arrays[i], 0, advice[i]);
+    if ( has_quota[i] )
+      umap_region_set_quota(arrays[i], quota_min[i], quota_max[i]);
+  }
+
+  double* a = arrays[0];
+  double* b = arrays[1];
+  double* c = arrays[2];
+
+  printf("%zu elements, %zu bytes per array, umap page size %zu, buffer %lu pages\n"
+      , n, length, psize, (unsigned long)umapcfg_get_max_pages_in_buffer());
+
+  if ( init ) {
+    double t = mysecond();
+
+    init_arrays(a, b, c, n);
+    for ( int i = 0; i < NARRAYS; ++i )
+      uunmap(arrays[i], length);
+    printf("Initialization took %.3f seconds\n", mysecond() - t);
+    return 0;
+  }
+
+  struct kernel_result results[NKERNELS];
+  double read_bw, write_bw;
+
+  memset(results, 0, sizeof(results));
+
+  calibrate(length, &read_bw, &write_bw);
+  printf("Device: %.1f MB/s read, %.1f MB/s write with O_DIRECT\n", read_bw / 1e6, write_bw / 1e6);
+
+  if ( dram )
+    time_dram(n, ntimes, results);
+
+  uint64_t region_read[NARRAYS] = { 0, 0, 0 };
+  uint64_t region_written[NARRAYS] = { 0, 0, 0 };
+  struct umap_region_stats rs;
+
+  for ( int i = 0; i < NARRAYS; ++i ) {
+    umap_region_get_stats(arrays[i], &rs);
+    region_read[i] = rs.bytes_read;
+    region_written[i] = rs.bytes_written;
+  }
+
+  for ( int iter = 0; iter < ntimes; iter++ ) {
+    for ( int k = 0; k < NKERNELS; k++ ) {
+      struct umap_stats before, after;
+      double t;
+
+      umap_get_stats(&before);
+      t = mysecond();
+      run_kernel(k, a, b, c, n);
+      t = mysecond() - t;
+      umap_get_stats(&after);
+
+      // The first iteration is left out, as STREAM does
+      if ( iter == 0 )
+        continue;
+
+      uint64_t r = after.bytes_read - before.bytes_read;
+      uint64_t w = after.bytes_written - before.bytes_written;
+
+      if ( results[k].best_time == 0.0 || t < results[k].best_time )
+        results[k].best_time = t;
+      results[k].total_time += t;
+      results[k].io_time += r / read_bw + w / write_bw;
+      results[k].bytes_read += r;
+      results[k].bytes_written += w;
+      results[k].faults += after.faults - before.faults;
+      results[k].fills += after.fills - before.fills;
+      results[k].prefetches += after.prefetches - before.prefetches;
+    }
+  }
+
+  const int runs = ntimes - 1;
+
+  printf("\n%-6s %12s %12s %12s %10s %10s %9s %9s %8s\n"
+      , "Kernel", "Best MB/s", "DRAM MB/s", "Fault MB/s", "Read MB", "Write MB"
+      , "Faults", "Prefetch", "Overlap");
+
+  for ( int k = 0; k < NKERNELS; k++ ) {
+    const struct kernel_result* res = &results[k];
+    const double touched = (double)kernel_arrays[k] * n * sizeof(double);
+    const double avg_time = res->total_time / runs;
+    const double io_time = res->io_time / runs;
+    char overlap[16] = "n/a";
+
+    // 1 when the kernel took no longer than the slower of computing and
+    // I/O, 0 when it took their sum
+    if ( dram && res->dram_time > 0.0 && io_time > 0.0 ) {
+      const double shorter = ( io_time < res->dram_time ) ? io_time : res->dram_time;
+      double eff = ( res->dram_time + io_time - avg_time ) / shorter;
+
+      eff = ( eff < 0.0 ) ? 0.0 : ( eff > 1.0 ) ? 1.0 : eff;
+      snprintf(overlap, sizeof(overlap), "%.2f", eff);
+    }
+
+    printf("%-6s %12.1f %12.1f %12.1f %10.1f %10.1f %9lu %8.1f%% %8s\n"
+        , kernel_names[k]
+        , touched / res->best_time / 1e6
+        , ( dram && res->dram_time > 0.0 ) ? touched / res->dram_time / 1e6 : 0.0
+        , ( res->bytes_read + res->bytes_written ) / res->total_time / 1e6
+        , res->bytes_read / 1e6 / runs
+        , res->bytes_written / 1e6 / runs
+        , (unsigned long)( res->faults / runs )
+        , res->fills ? 100.0 * res->prefetches / res->fills : 0.0
+        , overlap);
+  }
+
+  printf("\n%-6s %10s %10s\n", "Array", "Read MB", "Write MB");
+  for ( int i = 0; i < NARRAYS; ++i ) {
+    umap_region_get_stats(arrays[i], &rs);
+    printf("%-6s %10.1f %10.1f\n", array_names[i]
+        , ( rs.bytes_read - region_read[i] ) / 1e6, ( rs.bytes_written - region_written[i] ) / 1e6);
+  }
+  printf("\n");
+
+  int rval = check_results(a, b, c, n, ntimes);
+
+  for ( int i = 0; i < NARRAYS; ++i )
+    uunmap(arrays[i], length);
+
+  return rval;
+}
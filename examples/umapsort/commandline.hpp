@@ -31,6 +31,7 @@ typedef struct {
   int noinit;         // Init already done, so skip it
   int usemmap;
   int shuffle;
+  int external;       // Sort runs that fit the buffer, then merge them
 
   long pagesize;
   uint64_t bufsize;
@@ -66,6 +67,7 @@ static void usage(char* pname)
   << " --noinit                    - Use previously initialized file\n"
   << " --usemmap                   - Use mmap instead of umap\n"
   << " --shuffle                   - Shuffle memory accesses (instead of sequential access)\n"
+  << " --external                  - Sort runs that fit the buffer, then merge them into a second file\n"
   << " -p # of pages               - default: " << NUMPAGES << std::endl
   << " -t # of app threads         - default: " << NUMTHREADS << std::endl
   << " -a # pages to access        - default: 0 - access all pages\n"
@@ -93,6 +95,7 @@ void umt_getoptions(utility::umt_optstruct_t* testops, int argc, char *argv[])
   testops->noinit = 0;
   testops->usemmap = 0;
   testops->shuffle = 0;
+  testops->external = 0;
   testops->pages_to_access = 0;
   testops->numpages = NUMPAGES;
   testops->numthreads = NUMTHREADS;
@@ -113,6 +116,7 @@ void umt_getoptions(utility::umt_optstruct_t* testops, int argc, char *argv[])
       {"noinit",    no_argument,  &testops->noinit,   1 },
       {"usemmap",   no_argument,  &testops->usemmap,  1 },
       {"shuffle",   no_argument,  &testops->shuffle,  1 },
+      {"external",  no_argument,  &testops->external, 1 },
       {"help",      no_argument,  NULL,  0 },
       {0,           0,            0,     0 }
     };
@@ -0,0 +1,207 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _EXTERNAL_SORT_HPP
+#define _EXTERNAL_SORT_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <parallel/algorithm>
+#include <parallel/multiseq_selection.h>
+#include <parallel/multiway_merge.h>
+
+#include "umap/umap.h"
+#include "time.hpp"
+
+namespace utility {
+
+//
+// Sorts an array much larger than the umap buffer in two passes, each of
+// which reads and writes the data once and sequentially:
+//
+// 1. The array is cut into runs small enough for two of them to stay below
+//    the low water mark of the buffer.  Each run is sorted in place while the
+//    next one is prefetched; a sorted run is advised NOREUSE so that it is
+//    written back and evicted before the pages still to be sorted.
+//
+// 2. The runs are merged into the second region block by block.  The input
+//    each block consumes from every run is found by multi-sequence selection
+//    and prefetched while the previous block is merged, so the merge threads
+//    rarely fault on the input.
+//
+// With usemmap the prefetches and hints are given to madvise() instead.
+//
+class external_sort {
+public:
+  external_sort(bool usemmap)
+    : m_usemmap(usemmap)
+  {
+    // Pages of the buffer that stay resident, leaving room for the pages
+    // being evicted and for the prefetches in flight
+    const uint64_t pages = umapcfg_get_max_pages_in_buffer()
+                         * umapcfg_get_evict_low_water_threshold() / 100;
+
+    m_memory = pages * umapcfg_get_umap_page_size();
+  }
+
+  template <typename Compare>
+  void sort(uint64_t* in, uint64_t* out, uint64_t n, Compare comp)
+  {
+    // Two runs are resident during run formation, the block being merged,
+    // its output and the input of the next block during the merge
+    const uint64_t run_length = std::max<uint64_t>(m_memory / 2 / sizeof(uint64_t), 1);
+    const uint64_t block_length = std::max<uint64_t>(m_memory / 4 / sizeof(uint64_t), 1);
+    const uint64_t bytes = n * sizeof(uint64_t);
+
+    std::vector<std::pair<uint64_t*, uint64_t*>> runs;
+
+    for ( uint64_t i = 0; i < n; i += run_length )
+      runs.push_back(std::make_pair(in + i, in + std::min(n, i + run_length)));
+
+    fprintf(stderr, "External sort: %zu runs of %lu bytes, merge blocks of %lu bytes\n"
+        , runs.size(), run_length * sizeof(uint64_t), block_length * sizeof(uint64_t));
+
+    auto start = elapsed_time_sec();
+    form_runs(runs, comp);
+    double seconds = elapsed_time_sec(start);
+    fprintf(stderr, "Run formation took %f seconds, %f MB/s\n", seconds, 2.0 * bytes / seconds / 1e6);
+
+    start = elapsed_time_sec();
+    merge_runs(runs, out, n, block_length, comp);
+    seconds = elapsed_time_sec(start);
+    fprintf(stderr, "Merge took %f seconds, %f MB/s\n", seconds, 2.0 * bytes / seconds / 1e6);
+  }
+
+private:
+  bool m_usemmap;
+  uint64_t m_memory;
+
+  template <typename Compare>
+  void form_runs(const std::vector<std::pair<uint64_t*, uint64_t*>>& runs, Compare comp)
+  {
+    umap_prefetch_handle next = prefetch(runs[0].first, runs[0].second);
+
+    for ( size_t r = 0; r < runs.size(); ++r ) {
+      wait(next);
+      next = ( r + 1 < runs.size() ) ? prefetch(runs[r + 1].first, runs[r + 1].second) : nullptr;
+
+      __gnu_parallel::sort(runs[r].first, runs[r].second, comp, __gnu_parallel::quicksort_tag());
+      advise(runs[r].first, runs[r].second, UMAP_ADVICE_NOREUSE, MADV_NORMAL);
+    }
+  }
+
+  template <typename Compare>
+  void merge_runs(std::vector<std::pair<uint64_t*, uint64_t*>> runs, uint64_t* out
+      , uint64_t n, uint64_t block_length, Compare comp)
+  {
+    // The input is read once and the output written once
+    advise(out, out + n, UMAP_ADVICE_NOREUSE, MADV_SEQUENTIAL);
+
+    std::vector<umap_prefetch_handle> pending = prefetch_block(runs, block_length, comp);
+
+    for ( uint64_t done = 0; done < n; ) {
+      const uint64_t length = std::min(block_length, n - done);
+
+      drop_empty(runs);
+      for ( auto h : pending )
+        wait(h);
+
+      // Where this block ends in every run, so that the next block can be
+      // prefetched while it is merged
+      pending.clear();
+      if ( n - done > length ) {
+        std::vector<std::pair<uint64_t*, uint64_t*>> next = runs;
+        std::vector<uint64_t*> split(runs.size());
+
+        __gnu_parallel::multiseq_partition(runs.begin(), runs.end(), length, split.begin(), comp);
+        for ( size_t r = 0; r < runs.size(); ++r )
+          next[r].first = split[r];
+        pending = prefetch_block(next, block_length, comp);
+      }
+
+      // Advances the begin of every run past what it merged
+      __gnu_parallel::multiway_merge(runs.begin(), runs.end(), out + done, length, comp);
+      done += length;
+    }
+  }
+
+  //
+  // Prefetches what the next block_length elements of the merge read
+  // from each run
+  //
+  template <typename Compare>
+  std::vector<umap_prefetch_handle> prefetch_block(
+      std::vector<std::pair<uint64_t*, uint64_t*>> runs, uint64_t block_length, Compare comp)
+  {
+    std::vector<umap_prefetch_handle> handles;
+    uint64_t left = 0;
+
+    drop_empty(runs);
+    std::vector<uint64_t*> split(runs.size());
+
+    for ( auto& r : runs )
+      left += r.second - r.first;
+
+    if ( left > block_length )
+      __gnu_parallel::multiseq_partition(runs.begin(), runs.end(), block_length, split.begin(), comp);
+    else
+      for ( size_t r = 0; r < runs.size(); ++r )
+        split[r] = runs[r].second;
+
+    for ( size_t r = 0; r < runs.size(); ++r )
+      if ( split[r] > runs[r].first )
+        handles.push_back(prefetch(runs[r].first, split[r]));
+
+    return handles;
+  }
+
+  //
+  // multiseq_partition() reads the first element of every run, even
+  // of those that are used up
+  //
+  static void drop_empty(std::vector<std::pair<uint64_t*, uint64_t*>>& runs)
+  {
+    runs.erase(std::remove_if(runs.begin(), runs.end()
+          , [](const std::pair<uint64_t*, uint64_t*>& r) { return r.first == r.second; })
+        , runs.end());
+  }
+
+  umap_prefetch_handle prefetch(uint64_t* begin, uint64_t* end)
+  {
+    if ( m_usemmap ) {
+      advise(begin, end, UMAP_ADVICE_WILLNEED, MADV_WILLNEED);
+      return nullptr;
+    }
+    return umap_prefetch_range(begin, (end - begin) * sizeof(uint64_t), 0);
+  }
+
+  void wait(umap_prefetch_handle h)
+  {
+    if ( h != nullptr )
+      umap_prefetch_wait(h);
+  }
+
+  void advise(uint64_t* begin, uint64_t* end, int umap_advice, int madv_advice)
+  {
+    if ( ! m_usemmap ) {
+      umap_advise(begin, (end - begin) * sizeof(uint64_t), umap_advice);
+      return;
+    }
+
+    // madvise() wants a page aligned start
+    const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    const uintptr_t first = (uintptr_t)begin & ~(page_size - 1);
+
+    madvise((void*)first, (uintptr_t)end - first, madv_advice);
+  }
+};
+
+} // namespace utility
+#endif // _EXTERNAL_SORT_HPP
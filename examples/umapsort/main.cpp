@@ -25,6 +25,7 @@
 
 #include "umap/umap.h"
 #include "commandline.hpp"
+#include "external_sort.hpp"
 #include "map_file.hpp"
 #include "time.hpp"
 
@@ -114,7 +115,13 @@ int main(int argc, char **argv)
   omp_set_num_threads(options.numthreads);
 
   totalbytes = options.numpages*pagesize;
-  range = utility::map_file(options.filename, true, true, options.usemmap, totalbytes);
+
+  if (options.external && options.numfiles > 1) {
+    std::cerr << "--external sorts a single file" << std::endl;
+    return -1;
+  }
+
+  range = utility::map_file(options.filename, !options.noinit, true, options.usemmap, totalbytes);
   if (range == nullptr)
     return -1;
 
@@ -169,7 +176,35 @@ int main(int argc, char **argv)
     start = utility::elapsed_time_sec();
     sort_ascending = (arr[0] != 1);
 
-    if (sort_ascending == true) {
+    if (options.external) {
+      // The runs are merged into a second file, which then replaces the first
+      std::string merged = std::string(options.filename) + ".merge";
+      uint64_t* out = (uint64_t*) utility::map_file(merged, true, true, options.usemmap, totalbytes);
+      if (out == nullptr)
+        return -1;
+
+      utility::external_sort sorter(options.usemmap);
+
+      if (sort_ascending == true) {
+        printf("Sorting in Ascending Order\n");
+        sorter.sort(arr, out, arraysize, std::less<uint64_t>());
+      }
+      else {
+        printf("Sorting in Descending Order\n");
+        sorter.sort(arr, out, arraysize, std::greater<uint64_t>());
+      }
+
+      utility::unmap_file(options.usemmap, totalbytes, arr);
+      fprintf(stderr, "Sort took %f seconds\n", utility::elapsed_time_sec(start));
+
+      if (rename(merged.c_str(), options.filename) != 0) {
+        perror(("Failed to rename " + merged).c_str());
+        return -1;
+      }
+      arr = out;
+      mappings[0] = out;
+    }
+    else if (sort_ascending == true) {
       printf("Sorting in Ascending Order\n");
       __gnu_parallel::sort(arr, &arr[arraysize], std::less<uint64_t>(), __gnu_parallel::quicksort_tag());
     }
@@ -178,7 +213,8 @@ int main(int argc, char **argv)
       __gnu_parallel::sort(arr, &arr[arraysize], std::greater<uint64_t>(), __gnu_parallel::quicksort_tag());
     }
 
-    fprintf(stderr, "Sort took %f seconds\n", utility::elapsed_time_sec(start));
+    if (!options.external)
+      fprintf(stderr, "Sort took %f seconds\n", utility::elapsed_time_sec(start));
 
     start = utility::elapsed_time_sec();
     validatedata(arr, arraysize);
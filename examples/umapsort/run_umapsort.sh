@@ -34,6 +34,13 @@ cmd="env UMAP_PAGESIZE=$UMAP_PSIZE UMAP_BUFSIZE=$UMAP_BUFSIZE ./umapsort -f $dat
 echo $cmd
 time sh -c "$cmd"
 echo ""
+
+# External sort of data ten times the buffer: sort buffer sized runs, then merge them
+DATA_SIZE=$(( 10*BUF_SIZE ))
+cmd="env UMAP_PAGESIZE=$UMAP_PSIZE UMAP_BUFSIZE=$UMAP_BUFSIZE ./umapsort -f $data_file -p $((DATA_SIZE/UMAP_PSIZE)) -N 1 -t 24 --external"
+echo $cmd
+time sh -c "$cmd"
+echo ""
 exit
 
 
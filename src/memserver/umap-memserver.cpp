@@ -0,0 +1,204 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// Serves the memory of the node it runs on to RemoteStore clients.  The
+// memory is reserved but not committed, so that only the pages written
+// by clients take space.
+//
+// There is no authentication: any host that can connect may read and write
+// all of the memory.  The server therefore listens on the loopback address
+// unless told, with -a, the address of the (trusted) network to serve.
+//
+// Usage: umap-memserver -c <capacity, e.g. 16G> [-p <port>] [-a <address>]
+//
+#include <errno.h>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "umap/store/RemoteStoreProtocol.hpp"
+
+using namespace Umap::RemoteProtocol;
+
+static char* memory;
+static uint64_t capacity;
+
+// Accepts a K, M or G suffix
+static uint64_t parse_size(const char* str)
+{
+  char* end;
+  uint64_t size = strtoull(str, &end, 0);
+
+  switch (*end) {
+    case 'G': case 'g': size <<= 10;
+      // fall through
+    case 'M': case 'm': size <<= 10;
+      // fall through
+    case 'K': case 'k': size <<= 10;
+  }
+  return size;
+}
+
+static void usage(const char* prog)
+{
+  std::cerr << "Usage: " << prog << " -c <capacity, e.g. 16G> [-p <port>] [-a <address>]\n"
+            << "  -a  Address to listen on, 127.0.0.1 by default.  Requests are not\n"
+            << "      authenticated, so only give the address of a trusted network." << std::endl;
+}
+
+static void* serve(void* arg)
+{
+  int fd = (int)(intptr_t)arg;
+  Request req;
+
+  while (recv_all(fd, &req, sizeof(req))) {
+    Response rsp{MAGIC, 0, 0};
+    bool in_range = req.offset <= capacity && req.length <= capacity - req.offset;
+
+    if (req.magic != MAGIC || (req.op != GET && req.op != PUT)) {
+      std::cerr << "umap-memserver: bad request, closing the connection" << std::endl;
+      break;
+    }
+
+    if (req.op == PUT) {
+      // The data of a request out of range is read and dropped
+      if (in_range) {
+        if (!recv_all(fd, memory + req.offset, req.length))
+          break;
+      }
+      else {
+        char sink[4096];
+
+        for (uint64_t left = req.length; left; ) {
+          size_t n = left < sizeof(sink) ? left : sizeof(sink);
+
+          if (!recv_all(fd, sink, n))
+            goto done;
+          left -= n;
+        }
+        rsp.status = ERANGE;
+      }
+
+      if (!send_all(fd, &rsp, sizeof(rsp)))
+        break;
+    }
+    else {
+      if (in_range)
+        rsp.length = req.length;
+      else
+        rsp.status = ERANGE;
+
+      if (!send_all(fd, &rsp, sizeof(rsp))
+          || (in_range && !send_all(fd, memory + req.offset, req.length)))
+        break;
+    }
+  }
+
+done:
+  close(fd);
+  return nullptr;
+}
+
+int main(int argc, char* argv[])
+{
+  const char* address = "127.0.0.1";
+  const char* port = "7654";
+  int c;
+
+  while ((c = getopt(argc, argv, "a:c:p:")) != -1) {
+    switch (c) {
+      case 'a': address = optarg; break;
+      case 'c': capacity = parse_size(optarg); break;
+      case 'p': port = optarg; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (capacity == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  memory = (char*)mmap(nullptr, capacity, PROT_READ | PROT_WRITE
+                     , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (memory == MAP_FAILED) {
+    std::cerr << "umap-memserver: mmap of " << capacity << " bytes failed - " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  struct addrinfo hints;
+  struct addrinfo* res;
+  int lfd = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  int rval = getaddrinfo(address, port, &hints, &res);
+  if (rval != 0) {
+    std::cerr << "umap-memserver: getaddrinfo failed - " << gai_strerror(rval) << std::endl;
+    return 1;
+  }
+
+  for (struct addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+    int one = 1;
+
+    lfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (lfd == -1)
+      continue;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(lfd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(lfd, 128) == 0)
+      break;
+    close(lfd);
+    lfd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (lfd == -1) {
+    std::cerr << "umap-memserver: cannot listen on port " << port << " - " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  std::cout << "umap-memserver: serving " << capacity << " bytes on " << address << " port " << port << std::endl;
+
+  for (;;) {
+    int fd = accept(lfd, nullptr, nullptr);
+    int one = 1;
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      std::cerr << "umap-memserver: accept failed - " << strerror(errno) << std::endl;
+      return 1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, serve, (void*)(intptr_t)fd) != 0) {
+      std::cerr << "umap-memserver: pthread_create failed" << std::endl;
+      close(fd);
+    }
+    pthread_attr_destroy(&attr);
+  }
+
+  return 0;
+}
@@ -0,0 +1,154 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// Prints the metrics a process using umap publishes with UMAP_METRICS_SHM in
+// the text format of Prometheus, e.g. for the textfile collector of the node
+// exporter.  The segment is only read, the process is not involved.
+//
+// Usage: umap-metrics <segment name>
+//
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "umap/util/MetricsFormat.hpp"
+
+using namespace Umap::MetricsFormat;
+
+//
+// The monitor rewrites the segment every interval, so a copy is retried
+// until the monitor was not writing while it was taken
+//
+static bool read_segment( const Segment* shared, Segment* copy )
+{
+  for ( int tries = 0; tries < 1000; ++tries ) {
+    uint64_t seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+
+    if ( seq & 1 ) {
+      usleep(100);
+      continue;
+    }
+
+    memcpy(copy, (const void*)shared, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if ( __atomic_load_n(&shared->seq, __ATOMIC_RELAXED) == seq )
+      return true;
+  }
+  return false;
+}
+
+static void metric( const char* name, const char* type, const char* help, double value, uint32_t pid )
+{
+  printf("# HELP umap_%s %s\n# TYPE umap_%s %s\numap_%s{pid=\"%u\"} %.17g\n"
+      , name, help, name, type, name, pid, value);
+}
+
+static void region_metric( const char* name, const char* type, const char* help
+                         , const Segment& m, uint64_t Region::* field )
+{
+  printf("# HELP umap_region_%s %s\n# TYPE umap_region_%s %s\n", name, help, name, type);
+
+  for ( uint32_t i = 0; i < m.num_regions; ++i )
+    printf("umap_region_%s{pid=\"%u\",region=\"0x%" PRIx64 "\"} %" PRIu64 "\n"
+        , name, m.pid, m.regions[i].start, m.regions[i].*field);
+}
+
+int main(int argc, char* argv[])
+{
+  if ( argc != 2 ) {
+    std::cerr << "Usage: " << argv[0] << " <segment name>" << std::endl;
+    return 1;
+  }
+
+  int fd = shm_open(argv[1], O_RDONLY, 0);
+
+  if ( fd == -1 ) {
+    std::cerr << argv[1] << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  void* p = mmap(NULL, sizeof(Segment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if ( p == MAP_FAILED ) {
+    std::cerr << argv[1] << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  const Segment* shared = (const Segment*)p;
+  Segment m;
+
+  if ( shared->magic != MAGIC ) {
+    std::cerr << argv[1] << ": not a umap metrics segment" << std::endl;
+    return 1;
+  }
+
+  if ( shared->version != VERSION ) {
+    std::cerr << argv[1] << ": metrics version " << shared->version
+      << " is not supported, expected " << VERSION << std::endl;
+    return 1;
+  }
+
+  if ( ! read_segment(shared, &m) ) {
+    std::cerr << argv[1] << ": the segment is being written too often to be read" << std::endl;
+    return 1;
+  }
+
+  uint32_t pid = m.pid;
+
+  metric("samples_total", "counter", "Samples taken by the monitor", m.samples, pid);
+  metric("sample_interval_seconds", "gauge", "Time between the last two samples", m.interval_ns / 1e9, pid);
+
+  metric("buffer_pages", "gauge", "Pages the buffer may hold", m.buffer_pages, pid);
+  metric("resident_pages", "gauge", "Pages present or in transition", m.resident_pages, pid);
+  metric("dirty_pages", "gauge", "Pages modified since they were filled or written back", m.dirty_pages, pid);
+  metric("pinned_pages", "gauge", "Pages pinned with umap_fetch_and_pin()", m.pinned_pages, pid);
+  metric("high_water_pages", "gauge", "Resident pages eviction starts at", m.high_water_pages, pid);
+  metric("low_water_pages", "gauge", "Resident pages eviction stops at", m.low_water_pages, pid);
+  metric("fill_queue_depth", "gauge", "Fill jobs waiting for a worker", m.fill_queue_depth, pid);
+  metric("evict_queue_depth", "gauge", "Evict jobs waiting for a worker", m.evict_queue_depth, pid);
+
+  metric("faults_total", "counter", "Page faults handled", m.faults, pid);
+  metric("spurious_faults_total", "counter", "Faults on pages that were present already", m.spurious_faults, pid);
+  metric("fills_total", "counter", "Pages filled, prefetches included", m.fills, pid);
+  metric("prefetches_total", "counter", "Pages filled ahead of a fault", m.prefetches, pid);
+  metric("evictions_total", "counter", "Pages evicted", m.evictions, pid);
+  metric("writebacks_total", "counter", "Dirty pages written back", m.writebacks, pid);
+  metric("read_bytes_total", "counter", "Bytes read from the stores", m.bytes_read, pid);
+  metric("written_bytes_total", "counter", "Bytes written to the stores", m.bytes_written, pid);
+  metric("free_page_waits_total", "counter", "Faults that waited for a free page descriptor", m.free_page_waits, pid);
+  metric("high_water_crossings_total", "counter", "Times the resident pages reached high water", m.high_water_crossings, pid);
+  metric("low_water_crossings_total", "counter", "Times eviction got the resident pages down to low water", m.low_water_crossings, pid);
+
+  metric("fault_rate", "gauge", "Faults per second over the last interval", m.fault_rate, pid);
+  metric("fill_rate", "gauge", "Fills per second over the last interval", m.fill_rate, pid);
+  metric("eviction_rate", "gauge", "Evictions per second over the last interval", m.eviction_rate, pid);
+  metric("writeback_rate", "gauge", "Writebacks per second over the last interval", m.writeback_rate, pid);
+  metric("read_bytes_rate", "gauge", "Bytes read per second over the last interval", m.read_bytes_rate, pid);
+  metric("written_bytes_rate", "gauge", "Bytes written per second over the last interval", m.write_bytes_rate, pid);
+  metric("hit_ratio", "gauge", "Faults of the last interval that did not wait for a read", m.hit_ratio, pid);
+  metric("dirty_ratio", "gauge", "Dirty pages over buffer pages", m.dirty_ratio, pid);
+
+  metric("regions", "gauge", "Regions mapped", m.total_regions, pid);
+  region_metric("size_bytes", "gauge", "Size of the region", m, &Region::size);
+  region_metric("page_size_bytes", "gauge", "Page size of the region", m, &Region::page_size);
+  region_metric("resident_pages", "gauge", "Pages of the region in the buffer", m, &Region::resident_pages);
+  region_metric("dirty_pages", "gauge", "Dirty pages of the region", m, &Region::dirty_pages);
+  region_metric("read_bytes_total", "counter", "Bytes read for the region", m, &Region::bytes_read);
+  region_metric("written_bytes_total", "counter", "Bytes written for the region", m, &Region::bytes_written);
+  region_metric("writebacks_total", "counter", "Pages of the region written back", m, &Region::writebacks);
+
+  munmap(p, sizeof(Segment));
+  return 0;
+}
@@ -0,0 +1,355 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// Replays the faults and prefetches of a trace written with UMAP_TRACE
+// against regions backed by a file, under the configuration umap is given
+// through its environment (UMAP_PAGESIZE, UMAP_BUFSIZE, UMAP_EVICT_POLICY,
+// UMAP_PAGE_FILLERS, ...), and reports the throughput and the latency of
+// the accesses.
+//
+// Each region of the trace is mapped in turn from the file, which is
+// created or extended as needed, and each thread that faulted is replayed
+// by a thread of its own, touching the byte that faulted in the order it
+// did: a write for a write fault, a read otherwise.  Prefetches are issued
+// with umap_prefetch_range() by the thread that asked for them.  Accesses
+// are replayed as fast as possible, or at the times they were made with -t,
+// sped up by the factor of -s.
+//
+// Only the accesses that faulted in the recorded run are in the trace, so
+// with a larger buffer the replay measures fewer faults, but with a smaller
+// buffer it misses the faults the hits of the recorded run would take.
+//
+// Usage: umap-replay [-t] [-s speed] [-P page size] [-o text|csv] -f <file> <trace file>
+//
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <iostream>
+#include <map>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "umap/umap.h"
+#include "umap/util/TraceFormat.hpp"
+
+using namespace Umap::TraceFormat;
+
+struct Access {
+  uint64_t start_ns;      // Since the first access of the trace
+  char* addr;
+  uint64_t length;        // Of a prefetch, 0 for an access
+  bool write;
+};
+
+struct Replayer {
+  std::vector<Access> accesses;
+  std::vector<uint64_t> latencies;
+  uint64_t prefetches;
+  pthread_t thread;
+
+  Replayer() : prefetches(0) {}
+};
+
+struct MappedRegion {
+  uint64_t size;          // Recorded extent, then mapped length
+  char* base;
+};
+
+static pthread_barrier_t start_barrier;
+static uint64_t start_time;
+static bool timed = false;
+static double speed = 1.0;
+
+static uint64_t now_ns( void )
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t gcd( uint64_t a, uint64_t b )
+{
+  while ( b != 0 ) {
+    uint64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+static void* replay( void* arg )
+{
+  Replayer* r = (Replayer*)arg;
+
+  r->latencies.reserve(r->accesses.size());
+  pthread_barrier_wait(&start_barrier);
+
+  for ( const Access& a : r->accesses ) {
+    if ( timed ) {
+      uint64_t at = start_time + (uint64_t)(a.start_ns / speed);
+      uint64_t now = now_ns();
+
+      if ( at > now ) {
+        struct timespec ts = { (time_t)((at - now) / 1000000000), (long)((at - now) % 1000000000) };
+        nanosleep(&ts, nullptr);
+      }
+    }
+
+    if ( a.length != 0 ) {
+      umap_prefetch_range(a.addr, a.length, UMAP_PREFETCH_DETACHED);
+      r->prefetches++;
+      continue;
+    }
+
+    uint64_t t0 = now_ns();
+
+    if ( a.write )
+      *(volatile char*)a.addr = *(volatile char*)a.addr + 1;
+    else
+      (void)*(volatile char*)a.addr;
+
+    r->latencies.push_back(now_ns() - t0);
+  }
+  return nullptr;
+}
+
+static void usage( const char* prog )
+{
+  std::cerr << "Usage: " << prog << " [-t] [-s speed] [-P page size] [-o text|csv] -f <file> <trace file>" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  std::string format = "text";
+  std::string backing;
+  uint64_t recorded_psize = 0;
+  int c;
+
+  while ((c = getopt(argc, argv, "ts:P:o:f:")) != -1) {
+    switch (c) {
+      case 't': timed = true; break;
+      case 's': speed = atof(optarg); break;
+      case 'P': recorded_psize = strtoull(optarg, nullptr, 0); break;
+      case 'o': format = optarg; break;
+      case 'f': backing = optarg; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind != argc - 1 || backing.empty() || speed <= 0 || (format != "text" && format != "csv")) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE* f = fopen(argv[optind], "r");
+
+  if (f == nullptr) {
+    std::cerr << argv[optind] << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  Header header;
+
+  if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != MAGIC) {
+    std::cerr << argv[optind] << ": not a umap trace" << std::endl;
+    return 1;
+  }
+
+  if (header.version != VERSION || header.record_size != sizeof(Record)) {
+    std::cerr << argv[optind] << ": trace version " << header.version
+      << " is not supported, expected " << VERSION << std::endl;
+    return 1;
+  }
+
+  std::vector<Record> records;
+  Record rec;
+
+  while (records.size() < header.num_records && fread(&rec, sizeof(rec), 1, f) == 1) {
+    if ((rec.event == FAULT || rec.event == SPURIOUS_FAULT || rec.event == PREFETCH)
+        && rec.region != 0 && rec.addr >= rec.region)
+      records.push_back(rec);
+  }
+  fclose(f);
+
+  if (records.empty()) {
+    std::cerr << argv[optind] << ": no faults or prefetches to replay" << std::endl;
+    return 1;
+  }
+
+  //
+  // Faults are recorded once they have been handled, so they are replayed
+  // in the order they were taken
+  //
+  for (Record& r : records)
+    r.time_ns -= std::min(r.time_ns, r.latency_ns);
+
+  std::stable_sort(records.begin(), records.end()
+      , [](const Record& a, const Record& b) { return a.time_ns < b.time_ns; });
+
+  //
+  // Fault addresses are the starts of pages, so the page size of the
+  // recorded run divides all of their offsets.  A trace too short to tell
+  // is taken to have used the page size of the system.
+  //
+  if (recorded_psize == 0) {
+    for (const Record& r : records)
+      recorded_psize = gcd(recorded_psize, r.addr - r.region);
+
+    if (recorded_psize == 0 || (recorded_psize & (recorded_psize - 1)) != 0 || recorded_psize > (1 << 30))
+      recorded_psize = (uint64_t)sysconf(_SC_PAGESIZE);
+  }
+
+  std::map<uint64_t, MappedRegion> regions;
+
+  for (const Record& r : records) {
+    MappedRegion& m = regions[r.region];
+    uint64_t end = r.addr - r.region + std::max<uint64_t>(r.pages, 1) * recorded_psize;
+
+    m.size = std::max(m.size, end);
+  }
+
+  uint64_t psize = umapcfg_get_umap_page_size();
+  uint64_t file_size = 0;
+
+  for (auto& it : regions) {
+    it.second.size = (it.second.size + psize - 1) / psize * psize;
+    file_size += it.second.size;
+  }
+
+  int fd = open(backing.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  struct stat st;
+
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    std::cerr << backing << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  if ((uint64_t)st.st_size < file_size && ftruncate(fd, file_size) == -1) {
+    std::cerr << backing << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  off_t offset = 0;
+
+  for (auto& it : regions) {
+    void* base = umap(NULL, it.second.size, PROT_READ | PROT_WRITE, UMAP_PRIVATE, fd, offset);
+
+    if (base == UMAP_FAILED) {
+      std::cerr << backing << ": umap of " << it.second.size << " bytes failed" << std::endl;
+      return 1;
+    }
+    it.second.base = (char*)base;
+    offset += it.second.size;
+  }
+
+  std::map<uint32_t, Replayer> replayers;
+  uint64_t first = records.front().time_ns;
+  uint64_t num_accesses = 0;
+
+  for (const Record& r : records) {
+    MappedRegion& m = regions[r.region];
+    Replayer& t = replayers[r.tid];
+    Access a;
+
+    a.start_ns = r.time_ns - first;
+    a.addr = m.base + (r.addr - r.region);
+    a.write = (r.flags & FLAG_WRITE) != 0;
+    a.length = 0;
+
+    if (r.event == PREFETCH) {
+      a.length = std::min<uint64_t>(std::max<uint32_t>(r.pages, 1) * recorded_psize
+                                  , m.size - (r.addr - r.region));
+    }
+    else {
+      num_accesses++;
+    }
+
+    t.accesses.push_back(a);
+  }
+
+  umap_reset_stats();
+  pthread_barrier_init(&start_barrier, NULL, replayers.size() + 1);
+
+  for (auto& it : replayers) {
+    if (pthread_create(&it.second.thread, NULL, replay, &it.second) != 0) {
+      std::cerr << "Failed to start a replay thread" << std::endl;
+      return 1;
+    }
+  }
+
+  start_time = now_ns();
+  pthread_barrier_wait(&start_barrier);
+
+  std::vector<uint64_t> latencies;
+  uint64_t prefetches = 0;
+
+  for (auto& it : replayers) {
+    pthread_join(it.second.thread, NULL);
+    latencies.insert(latencies.end(), it.second.latencies.begin(), it.second.latencies.end());
+    prefetches += it.second.prefetches;
+  }
+
+  double seconds = (now_ns() - start_time) / 1e9;
+  struct umap_stats s;
+
+  umap_get_stats(&s);
+
+  for (auto& it : regions)
+    uunmap(it.second.base, it.second.size);
+  close(fd);
+  pthread_barrier_destroy(&start_barrier);
+
+  std::sort(latencies.begin(), latencies.end());
+
+  auto pct = [&latencies](double p) -> uint64_t {
+    if (latencies.empty())
+      return 0;
+    return latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))];
+  };
+
+  double mean = 0;
+  for (uint64_t l : latencies)
+    mean += l;
+  if (!latencies.empty())
+    mean /= latencies.size();
+
+  if (format == "csv") {
+    printf("accesses,prefetches,threads,regions,seconds,accesses_per_second"
+           ",latency_mean_ns,latency_p50_ns,latency_p99_ns,latency_p999_ns,latency_max_ns"
+           ",faults,fills,evictions,writebacks,bytes_read,bytes_written\n");
+    printf("%" PRIu64 ",%" PRIu64 ",%zu,%zu,%.6f,%.1f,%.1f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+           ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n"
+        , num_accesses, prefetches, replayers.size(), regions.size(), seconds, num_accesses / seconds
+        , mean, pct(0.5), pct(0.99), pct(0.999), pct(1.0)
+        , s.faults, s.fills, s.evictions, s.writebacks, s.bytes_read, s.bytes_written);
+    return 0;
+  }
+
+  printf("Replayed %" PRIu64 " accesses and %" PRIu64 " prefetches of %zu threads on %zu regions in %.3f s%s\n"
+      , num_accesses, prefetches, replayers.size(), regions.size(), seconds, timed ? " (timed)" : "");
+  printf("Page size: %" PRIu64 " (recorded with %" PRIu64 "), buffer: %" PRIu64 " pages\n"
+      , psize, recorded_psize, umapcfg_get_max_pages_in_buffer());
+  printf("Throughput: %.1f accesses/s\n", num_accesses / seconds);
+  printf("Latency (ns): mean %.1f, p50 %" PRIu64 ", p99 %" PRIu64 ", p99.9 %" PRIu64 ", max %" PRIu64 "\n"
+      , mean, pct(0.5), pct(0.99), pct(0.999), pct(1.0));
+  printf("Faults: %" PRIu64 " (%" PRIu64 " spurious), fills: %" PRIu64 " (%" PRIu64 " prefetched)"
+         ", evictions: %" PRIu64 ", writebacks: %" PRIu64 "\n"
+      , s.faults, s.spurious_faults, s.fills, s.prefetches, s.evictions, s.writebacks);
+  printf("Bytes read: %" PRIu64 ", written: %" PRIu64 "\n", s.bytes_read, s.bytes_written);
+  return 0;
+}
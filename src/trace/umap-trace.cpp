@@ -0,0 +1,118 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// Decodes a trace written by umap with UMAP_TRACE or umap_trace_dump(), as
+// CSV or as the JSON of the Chrome trace viewer (chrome://tracing or
+// Perfetto), in microseconds of CLOCK_MONOTONIC.  Events that last are
+// complete events there, ending at their time, the others are instant
+// events.
+//
+// Usage: umap-trace [-f csv|chrome] <trace file>
+//
+#include <errno.h>
+#include <inttypes.h>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+
+#include "umap/util/TraceFormat.hpp"
+
+using namespace Umap::TraceFormat;
+
+static void csv(const Record& r)
+{
+  printf("%" PRIu64 ",%u,%s,0x%" PRIx64 ",0x%" PRIx64 ",%u,%" PRIu64 ",%u\n"
+      , r.time_ns, r.tid, event_name(r.event), r.addr, r.region, r.pages, r.latency_ns, r.flags);
+}
+
+static void chrome(const Record& r, bool first)
+{
+  double end_us = r.time_ns / 1000.0;
+
+  printf("%s\n{\"name\":\"%s\",\"cat\":\"umap\",\"pid\":0,\"tid\":%u,", first ? "" : ",", event_name(r.event), r.tid);
+
+  if (r.latency_ns != 0)
+    printf("\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,", end_us - r.latency_ns / 1000.0, r.latency_ns / 1000.0);
+  else
+    printf("\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,", end_us);
+
+  printf("\"args\":{\"addr\":\"0x%" PRIx64 "\",\"region\":\"0x%" PRIx64 "\",\"pages\":%u%s}}"
+      , r.addr, r.region, r.pages, (r.flags & FLAG_WRITE) ? ",\"write\":true" : "");
+}
+
+int main(int argc, char* argv[])
+{
+  std::string format = "csv";
+  int c;
+
+  while ((c = getopt(argc, argv, "f:")) != -1) {
+    if (c == 'f') {
+      format = optarg;
+    }
+    else {
+      std::cerr << "Usage: " << argv[0] << " [-f csv|chrome] <trace file>" << std::endl;
+      return 1;
+    }
+  }
+
+  if (optind != argc - 1 || (format != "csv" && format != "chrome")) {
+    std::cerr << "Usage: " << argv[0] << " [-f csv|chrome] <trace file>" << std::endl;
+    return 1;
+  }
+
+  FILE* f = fopen(argv[optind], "r");
+
+  if (f == nullptr) {
+    std::cerr << argv[optind] << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  Header header;
+
+  if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != MAGIC) {
+    std::cerr << argv[optind] << ": not a umap trace" << std::endl;
+    return 1;
+  }
+
+  if (header.version != VERSION || header.record_size != sizeof(Record)) {
+    std::cerr << argv[optind] << ": trace version " << header.version
+      << " is not supported, expected " << VERSION << std::endl;
+    return 1;
+  }
+
+  Record r;
+  uint64_t n;
+
+  if (format == "csv")
+    printf("time_ns,tid,event,addr,region,pages,latency_ns,flags\n");
+  else
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+  for (n = 0; n < header.num_records && fread(&r, sizeof(r), 1, f) == 1; n++) {
+    if (format == "csv") {
+      csv(r);
+    }
+    else {
+      chrome(r, n == 0);
+    }
+  }
+
+  if (format == "chrome")
+    printf("\n]}\n");
+
+  fclose(f);
+
+  if (n != header.num_records) {
+    std::cerr << argv[optind] << ": truncated after " << n << " of "
+      << header.num_records << " records" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,506 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// Searches the settings of umap for those a workload runs fastest with,
+// and prints them as environment variables or as calls to
+// umap_context_set_config().
+//
+// The workload is either a trace recorded with UMAP_TRACE, replayed with
+// umap-replay against a file, or any command using umap, e.g. a run of
+// pfbenchmark.  Each configuration is run -n times, in a process of its own
+// with the settings in its environment, and scored by the median of the
+// time umap-replay reports, or of the time the command took.
+//
+// The search goes over one setting at a time, keeping the others at the
+// best values found so far, until a pass over all of them changes nothing.
+// --grid runs every combination instead.  Page sizes are tried for a given
+// amount of memory, in bytes, the buffer is then given as many pages of
+// that size as fit.
+//
+// Usage: umap-tune [options] -t <trace file> -f <file>
+//        umap-tune [options] -- <command> [arguments]
+//
+#include <algorithm>
+#include <errno.h>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+//
+// A setting has the values it is tried with, 0 leaving it unset, i.e. to
+// the default of umap or to what the environment of umap-tune has
+//
+struct Setting {
+  const char* name;
+  std::vector<uint64_t> values;
+};
+
+enum { PAGESIZE, MEMORY, FILLERS, EVICTORS, WATERMARKS, NUM_SETTINGS };
+
+typedef std::vector<uint64_t> Config;   // Index of the value of each setting
+
+static Setting settings[NUM_SETTINGS] = {
+    { "page size", {} }
+  , { "memory", {} }
+  , { "fillers", {} }
+  , { "evictors", {} }
+  , { "watermarks", {} }      // high * 100 + low
+};
+
+static std::string replay_path = "umap-replay";
+static std::string trace;
+static std::string replay_file;
+static std::vector<std::string> command;
+static int repetitions = 3;
+static double min_gain = 0.02;
+
+static uint64_t now_ns( void )
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t parse_size( const std::string& s )
+{
+  char* end;
+  uint64_t v = strtoull(s.c_str(), &end, 0);
+
+  switch (*end) {
+    case 'k': case 'K': v <<= 10; break;
+    case 'm': case 'M': v <<= 20; break;
+    case 'g': case 'G': v <<= 30; break;
+    default: break;
+  }
+  return v;
+}
+
+//
+// A comma separated list, with high:low pairs for the watermarks
+//
+static std::vector<uint64_t> parse_list( const char* arg, bool watermarks )
+{
+  std::vector<uint64_t> values;
+  std::stringstream ss(arg);
+  std::string item;
+
+  while (std::getline(ss, item, ',')) {
+    if (item.empty())
+      continue;
+
+    if (watermarks) {
+      std::string::size_type colon = item.find(':');
+
+      if (colon == std::string::npos)
+        return {};
+
+      values.push_back(parse_size(item.substr(0, colon)) * 100 + parse_size(item.substr(colon + 1)));
+    }
+    else {
+      values.push_back(parse_size(item));
+    }
+  }
+  return values;
+}
+
+static std::map<std::string, std::string> environment( const Config& c )
+{
+  std::map<std::string, std::string> env;
+  uint64_t psize = settings[PAGESIZE].values[c[PAGESIZE]];
+  uint64_t memory = settings[MEMORY].values[c[MEMORY]];
+  uint64_t fillers = settings[FILLERS].values[c[FILLERS]];
+  uint64_t evictors = settings[EVICTORS].values[c[EVICTORS]];
+  uint64_t watermarks = settings[WATERMARKS].values[c[WATERMARKS]];
+
+  if (psize != 0)
+    env["UMAP_PAGESIZE"] = std::to_string(psize);
+
+  if (memory != 0) {
+    uint64_t page = ( psize != 0 ) ? psize : (uint64_t)sysconf(_SC_PAGESIZE);
+    env["UMAP_BUFSIZE"] = std::to_string(std::max<uint64_t>(1, memory / page));
+  }
+
+  if (fillers != 0) {
+    env["UMAP_PAGE_FILLERS"] = std::to_string(fillers);
+    env["UMAP_PAGE_FILLERS_MIN"] = std::to_string(fillers);
+  }
+
+  if (evictors != 0) {
+    env["UMAP_PAGE_EVICTORS"] = std::to_string(evictors);
+    env["UMAP_PAGE_EVICTORS_MIN"] = std::to_string(evictors);
+  }
+
+  if (watermarks != 0) {
+    env["UMAP_EVICT_HIGH_WATER_THRESHOLD"] = std::to_string(watermarks / 100);
+    env["UMAP_EVICT_LOW_WATER_THRESHOLD"] = std::to_string(watermarks % 100);
+  }
+  return env;
+}
+
+static std::string describe( const Config& c )
+{
+  std::string s;
+
+  for (auto& e : environment(c))
+    s += ( s.empty() ? "" : " " ) + e.first + "=" + e.second;
+
+  return s.empty() ? "defaults" : s;
+}
+
+//
+// Returns the seconds the workload took, or a negative number if it failed
+//
+static double run_once( const Config& c )
+{
+  std::vector<std::string> args;
+
+  if (!trace.empty())
+    args = { replay_path, "-o", "csv", "-f", replay_file, trace };
+  else
+    args = command;
+
+  int out[2];
+
+  if (pipe(out) == -1) {
+    std::cerr << "pipe: " << strerror(errno) << std::endl;
+    return -1;
+  }
+
+  uint64_t start = now_ns();
+  pid_t pid = fork();
+
+  if (pid == -1) {
+    std::cerr << "fork: " << strerror(errno) << std::endl;
+    return -1;
+  }
+
+  if (pid == 0) {
+    std::vector<char*> argv;
+
+    for (auto& e : environment(c))
+      setenv(e.first.c_str(), e.second.c_str(), 1);
+
+    for (auto& a : args)
+      argv.push_back(const_cast<char*>(a.c_str()));
+    argv.push_back(nullptr);
+
+    dup2(out[1], STDOUT_FILENO);
+    close(out[0]);
+    close(out[1]);
+    execvp(argv[0], argv.data());
+    std::cerr << argv[0] << ": " << strerror(errno) << std::endl;
+    _exit(127);
+  }
+
+  close(out[1]);
+
+  std::string output;
+  char buf[4096];
+  ssize_t n;
+
+  while ((n = read(out[0], buf, sizeof(buf))) > 0 || (n == -1 && errno == EINTR))
+    if (n > 0)
+      output.append(buf, n);
+  close(out[0]);
+
+  int status;
+
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    ;
+
+  double seconds = (now_ns() - start) / 1e9;
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    std::cerr << args[0] << " failed with " << describe(c) << std::endl;
+    return -1;
+  }
+
+  if (trace.empty())
+    return seconds;
+
+  //
+  // The replay reports the time of the accesses only, without that of
+  // starting umap and mapping the regions
+  //
+  std::stringstream lines(output);
+  std::string header, values, name, value;
+
+  while (std::getline(lines, header) && header.compare(0, 9, "accesses,") != 0)
+    ;
+  std::getline(lines, values);
+
+  std::stringstream h(header), v(values);
+
+  while (std::getline(h, name, ',') && std::getline(v, value, ','))
+    if (name == "seconds")
+      return atof(value.c_str());
+
+  std::cerr << args[0] << " did not report its time with " << describe(c) << std::endl;
+  return -1;
+}
+
+static double run( const Config& c )
+{
+  static std::map<Config, double> results;
+  auto it = results.find(c);
+
+  if (it != results.end())
+    return it->second;
+
+  std::vector<double> times;
+
+  for (int i = 0; i < repetitions; ++i) {
+    double t = run_once(c);
+
+    if (t < 0) {
+      times.clear();
+      break;
+    }
+    times.push_back(t);
+  }
+
+  double median = -1;
+
+  if (!times.empty()) {
+    std::sort(times.begin(), times.end());
+    median = times[times.size() / 2];
+    printf("%10.6f s  %s\n", median, describe(c).c_str());
+  }
+  else {
+    printf("    failed    %s\n", describe(c).c_str());
+  }
+  fflush(stdout);
+
+  results[c] = median;
+  return median;
+}
+
+//
+// A setting is only changed for a gain larger than the noise of the runs
+//
+static bool better( double t, double best )
+{
+  return t >= 0 && (best < 0 || t < best * (1 - min_gain));
+}
+
+static Config search( void )
+{
+  Config best(NUM_SETTINGS, 0);
+  double best_time = run(best);
+
+  for (int pass = 0; pass < 10; ++pass) {
+    bool changed = false;
+
+    for (int s = 0; s < NUM_SETTINGS; ++s) {
+      for (uint64_t i = 0; i < settings[s].values.size(); ++i) {
+        Config c = best;
+        c[s] = i;
+
+        double t = run(c);
+
+        if (better(t, best_time)) {
+          best = c;
+          best_time = t;
+          changed = true;
+        }
+      }
+    }
+
+    if (!changed)
+      break;
+  }
+  return best;
+}
+
+static Config grid( void )
+{
+  Config c(NUM_SETTINGS, 0), best = c;
+  double best_time = -1;
+
+  for (;;) {
+    double t = run(c);
+
+    if (better(t, best_time)) {
+      best = c;
+      best_time = t;
+    }
+
+    int s = 0;
+    for (; s < NUM_SETTINGS; ++s) {
+      if (++c[s] < settings[s].values.size())
+        break;
+      c[s] = 0;
+    }
+
+    if (s == NUM_SETTINGS)
+      return best;
+  }
+}
+
+static void recommend( const Config& c, const std::string& format )
+{
+  auto env = environment(c);
+
+  if (format == "env") {
+    printf("\n# Recommended settings\n");
+    for (auto& e : env)
+      printf("export %s=%s\n", e.first.c_str(), e.second.c_str());
+    return;
+  }
+
+  //
+  // The page size and the buffer size are those of the context as it is
+  // created, the others may be set at any time
+  //
+  static const std::map<std::string, const char*> configs = {
+      { "UMAP_PAGESIZE", "UMAP_CONFIG_UMAP_PAGE_SIZE" }
+    , { "UMAP_BUFSIZE", "UMAP_CONFIG_MAX_PAGES_IN_BUFFER" }
+    , { "UMAP_PAGE_FILLERS", "UMAP_CONFIG_NUM_FILLERS" }
+    , { "UMAP_PAGE_EVICTORS", "UMAP_CONFIG_NUM_EVICTORS" }
+    , { "UMAP_EVICT_HIGH_WATER_THRESHOLD", "UMAP_CONFIG_EVICT_HIGH_WATER_THRESHOLD" }
+    , { "UMAP_EVICT_LOW_WATER_THRESHOLD", "UMAP_CONFIG_EVICT_LOW_WATER_THRESHOLD" }
+  };
+
+  printf("\n/* Recommended settings, before the first region is mapped */\n");
+  for (auto& e : env) {
+    auto it = configs.find(e.first);
+
+    if (it != configs.end())
+      printf("umap_context_set_config(NULL, %s, %s);\n", it->second, e.second.c_str());
+  }
+}
+
+static void usage( const char* prog )
+{
+  std::cerr
+    << "Usage: " << prog << " [options] -t <trace file> -f <file>\n"
+    << "       " << prog << " [options] -- <command> [arguments]\n"
+    << "\n"
+    << " -t, --trace file       - Trace of UMAP_TRACE to replay\n"
+    << " -f, --file name        - Backing file of the replay\n"
+    << " -R, --replay path      - default: umap-replay\n"
+    << " -n, --repetitions #    - Runs of each configuration, default: 3\n"
+    << " --pagesizes list       - default: 4096,16384,65536,262144\n"
+    << " --memory list          - Buffer sizes in bytes (k, m, g), default: unset\n"
+    << " --fillers list         - default: 1,2,4,8,16\n"
+    << " --evictors list        - default: 1,2,4,8,16\n"
+    << " --watermarks list      - high:low percentages, default: 90:70,95:85,80:60\n"
+    << " --grid                 - Run all combinations instead of searching\n"
+    << " --min-gain #           - Percentage a setting has to gain to be changed, default: 2\n"
+    << " -o, --output env|c     - Recommended settings as environment variables,\n"
+    << "                          or as calls to umap_context_set_config(), default: env\n"
+    << "\n"
+    << " The other settings of umap are taken from the environment.\n";
+}
+
+int main(int argc, char* argv[])
+{
+  std::string format = "env";
+  const char* lists[NUM_SETTINGS] = {
+      "4096,16384,65536,262144", "", "1,2,4,8,16", "1,2,4,8,16", "90:70,95:85,80:60" };
+  int use_grid = 0;
+  int c;
+
+  static struct option long_options[] = {
+      {"trace",       required_argument,  0, 't' },
+      {"file",        required_argument,  0, 'f' },
+      {"replay",      required_argument,  0, 'R' },
+      {"repetitions", required_argument,  0, 'n' },
+      {"output",      required_argument,  0, 'o' },
+      {"pagesizes",   required_argument,  0, 'P' },
+      {"memory",      required_argument,  0, 'M' },
+      {"fillers",     required_argument,  0, 'F' },
+      {"evictors",    required_argument,  0, 'E' },
+      {"watermarks",  required_argument,  0, 'W' },
+      {"grid",        no_argument,        &use_grid, 1 },
+      {"min-gain",    required_argument,  0, 'G' },
+      {"help",        no_argument,        0, 'h' },
+      {0,             0,                  0,  0 }
+  };
+
+  while ((c = getopt_long(argc, argv, "+t:f:R:n:o:h", long_options, nullptr)) != -1) {
+    switch (c) {
+      case 0: break;
+      case 't': trace = optarg; break;
+      case 'f': replay_file = optarg; break;
+      case 'R': replay_path = optarg; break;
+      case 'n': repetitions = atoi(optarg); break;
+      case 'o': format = optarg; break;
+      case 'P': lists[PAGESIZE] = optarg; break;
+      case 'M': lists[MEMORY] = optarg; break;
+      case 'F': lists[FILLERS] = optarg; break;
+      case 'E': lists[EVICTORS] = optarg; break;
+      case 'W': lists[WATERMARKS] = optarg; break;
+      case 'G': min_gain = atof(optarg) / 100; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  for (int i = optind; i < argc; ++i)
+    command.push_back(argv[i]);
+
+  if (trace.empty() == command.empty() || (!trace.empty() && replay_file.empty())
+      || repetitions < 1 || min_gain < 0 || min_gain >= 1 || (format != "env" && format != "c")) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  //
+  // The settings are tried from where they are left to umap, which is where
+  // the search starts
+  //
+  uint64_t sys_psize = (uint64_t)sysconf(_SC_PAGESIZE);
+
+  for (int s = 0; s < NUM_SETTINGS; ++s) {
+    std::vector<uint64_t> values = parse_list(lists[s], s == WATERMARKS);
+
+    settings[s].values.push_back(0);
+
+    for (uint64_t v : values) {
+      bool valid = v != 0;
+
+      if (s == PAGESIZE)
+        valid = valid && v % sys_psize == 0;
+      else if (s == WATERMARKS)
+        valid = valid && v / 100 <= 100 && v % 100 < v / 100;
+
+      if (!valid) {
+        std::cerr << "Invalid " << settings[s].name << ": " << lists[s] << std::endl;
+        return 1;
+      }
+
+      if (std::find(settings[s].values.begin(), settings[s].values.end(), v) == settings[s].values.end())
+        settings[s].values.push_back(v);
+    }
+  }
+
+  printf("# %s of %s, median of %d runs\n", use_grid ? "Grid" : "Search"
+      , trace.empty() ? command[0].c_str() : trace.c_str(), repetitions);
+
+  Config best = use_grid ? grid() : search();
+
+  if (run(best) < 0) {
+    std::cerr << "No configuration ran" << std::endl;
+    return 1;
+  }
+
+  printf("\n# Best: %.6f s with %s\n", run(best), describe(best).c_str());
+  recommend(best, format);
+  return 0;
+}
@@ -5,16 +5,25 @@
 // SPDX-License-Identifier: LGPL-2.1-only
 //////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>
+#include <mutex>
+#include <errno.h>
 #include <pthread.h>
-#include <fstream>        // for reading meminfo
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "umap/Buffer.hpp"
 #include "umap/config.h"
 #include "umap/FillWorkers.hpp"
+#include "umap/Flusher.hpp"
+#include "umap/Numa.hpp"
 #include "umap/PageDescriptor.hpp"
 #include "umap/RegionManager.hpp"
+#include "umap/Uffd.hpp"
 #include "umap/WorkerPool.hpp"
 #include "umap/util/Macros.hpp"
+#include "umap/util/Trace.hpp"
 
 namespace Umap {
 //
@@ -22,14 +31,21 @@ namespace Umap {
 //
 void Buffer::mark_page_as_present(PageDescriptor* pd)
 {
-  lock();
+  BufferShard* s = shard_of(pd->page);
+  FlushFence* fence = pd->fill_fence;
 
+  s->lock();
+
+  pd->fill_fence = nullptr;
   pd->set_state_present();
 
-  if ( m_waits_for_state_change )
-    pthread_cond_broadcast( &m_state_change_cond );
+  if ( s->m_waits_for_state_change )
+    pthread_cond_broadcast( &s->m_state_change_cond );
+
+  s->unlock();
 
-  unlock();
+  if ( fence != nullptr )
+    fence->page_done();
 }
 
 //
@@ -37,439 +53,1435 @@ void Buffer::mark_page_as_present(PageDescriptor* pd)
 //
 void Buffer::mark_page_as_free( PageDescriptor* pd )
 {
-  lock();
+  BufferShard* s = shard_of(pd->page);
+
+  s->lock();
 
   UMAP_LOG(Debug, "Removing page: " << pd);
   pd->region->erase_page_descriptor(pd);
 
-  m_present_pages.erase(pd->page);
-
   pd->set_state_free();
   pd->spurious_count = 0;
 
   //
   // We only put the page descriptor back onto the free list if it isn't
   // deferred.  Note: It will be marked as deferred when the page is part of a
-  // Region that has been unmapped.  It will become undeferred later when the
-  // eviction manager takes it off the end of the end of the buffer.
+  // Region that is being unmapped, in which case evict_region() releases it.
   //
   if ( ! pd->deferred )
-    release_page_descriptor(pd);
+    release_page_descriptor(s, pd);
+
+  if ( s->m_waits_for_state_change )
+    pthread_cond_broadcast( &s->m_state_change_cond );
+
+  pd->page = nullptr;
+
+  s->unlock();
+}
+
+void Buffer::release_page_descriptor( BufferShard* s, PageDescriptor* pd )
+{
+    //
+    // The shard has been shrunk below the number of descriptors it holds
+    //
+    if ( s->m_num_owned > s->m_size ) {
+      --s->m_num_owned;
+      s->m_spare_pages.push_back(pd);
+      return;
+    }
+
+    s->m_free_pages.push_back(pd);
+
+    if ( s->m_waits_for_avail_pd )
+      pthread_cond_broadcast(&s->m_avail_pd_cond);
+}
+
+//
+// Called from Evict Manager to begin eviction process on oldest present
+// page.  Shards are drained in order; nullptr is returned once every shard
+// is empty.
+//
+PageDescriptor* Buffer::evict_oldest_page()
+{
+  PageDescriptor* pd = nullptr;
+
+  for ( auto s : m_shards ) {
+    s->lock();
+
+    while ( (pd = s->m_policy->oldest()) != nullptr ) {
+      // Deferred means that this page was previously evicted as part of an
+      // uunmap of a Region.  This means that this page descriptor points to a
+      // page that has already been given back to the system so all we need to
+      // do is take it off of the busy list and release the descriptor.
+      //
+      if ( pd->deferred ) {
+        UMAP_LOG(Debug, "Deferred Page: " << pd);
+
+        //
+        // Make sure that the page has truly been flushed.
+        //
+        s->wait_for_page_state(pd, PageDescriptor::State::FREE);
+
+        s->m_policy->remove(pd);
+        m_num_busy_pages--;
+        s->m_stats.pages_deleted++;
+
+        //
+        // Jump to the next page descriptor
+        //
+        release_page_descriptor(s, pd);
+        pd = nullptr;
+      }
+      else {
+        UMAP_LOG(Debug, "Normal Page: " << pd);
+        s->wait_for_page_state(pd, PageDescriptor::State::PRESENT);
+
+        //
+        // The eviction manager may have taken this page while we waited
+        //
+        if ( ! s->m_policy->contains(pd) ) {
+          pd = nullptr;
+          continue;
+        }
+
+        s->m_policy->remove(pd);
+        account_eviction(s, pd);
+        break;
+      }
+    }
+
+    s->unlock();
+
+    if ( pd != nullptr )
+      break;
+  }
+
+  return pd;
+}
+
+//
+// Shards whose callers are waiting for a free descriptor are served first.
+// Otherwise the shard holding the most busy pages is chosen.
+//
+BufferShard* Buffer::select_eviction_shard( void )
+{
+  BufferShard* rval = nullptr;
+  uint64_t most_busy = 0;
+
+  for ( auto s : m_shards ) {
+    uint64_t busy = s->m_policy->size();
+
+    if ( s->m_waits_for_avail_pd && busy > s->m_evict_low_water )
+      return s;
+
+    if ( busy > most_busy ) {
+      most_busy = busy;
+      rval = s;
+    }
+  }
+  return rval;
+}
+
+//
+// Chooses victims according to the region quotas and the advice given for
+// the pages.  Pages advised NOREUSE go first, then pages of regions that
+// are over their maximum, then pages of regions that are above their
+// guaranteed minimum and, as a last resort, any page.  Pages advised HOT
+// are only chosen by the last resort once nothing else could be.
+//
+class QuotaFilter : public VictimFilter {
+  public:
+    enum Level { NOREUSE, OVER_MAX, ABOVE_MIN, ANY, ANY_HOT };
+
+    QuotaFilter( Level level ) : m_level(level) {}
+
+    void set_level( Level level ) { m_level = level; }
+
+    bool accept( PageDescriptor* pd ) {
+      RegionDescriptor* rd = pd->region;
+
+      if ( m_level == ANY_HOT )
+        return true;
+
+      int advice = rd->has_advice() ? rd->advice(rd->page_index(pd->page)) : UMAP_ADVICE_NORMAL;
+
+      if ( m_level == NOREUSE )
+        return advice == UMAP_ADVICE_NOREUSE;
+
+      if ( advice == UMAP_ADVICE_HOT )
+        return false;
+
+      if ( m_level == ANY )
+        return true;
+
+      uint64_t& taken = taken_from(rd);
+      uint64_t count = rd->count();
+
+      count = (count > taken) ? (count - taken) : 0;
+
+      bool ok = ( m_level == OVER_MAX )
+                  ? ( rd->max_pages() != 0 && count > rd->max_pages() )
+                  : ( count > rd->min_pages() );
+      if ( ok )
+        ++taken;
+
+      return ok;
+    }
+
+  private:
+    Level m_level;
+
+    //
+    // Pages chosen so far are still counted by their region until they have
+    // been freed, so we keep track of them here.
+    //
+    std::vector< std::pair<RegionDescriptor*, uint64_t> > m_taken;
+
+    uint64_t& taken_from( RegionDescriptor* rd ) {
+      for ( auto& t : m_taken )
+        if ( t.first == rd )
+          return t.second;
+
+      m_taken.push_back(std::make_pair(rd, (uint64_t)0));
+      return m_taken.back().second;
+    }
+};
+
+//
+// Called from Evict Manager to begin eviction process on at most N (=32)
+// present (non-deferred) pages of a single shard, as chosen by the shard's
+// replacement policy and the region quotas, without waiting for status
+// change
+//
+std::vector<PageDescriptor*> Buffer::evict_oldest_pages()
+{
+  std::vector<PageDescriptor*> evicted_pages;
+  const int max_num_evicted_pages = 32;
+
+  if ( low_threshold_reached() ) {
+    //
+    // The Buffer as a whole has room, we only need to bring the regions
+    // that are over their maximum back within their quota.
+    //
+    for ( auto s : m_shards ) {
+      QuotaFilter filter(QuotaFilter::OVER_MAX);
+
+      s->lock();
+      s->m_policy->select_victims(evicted_pages, max_num_evicted_pages, &filter);
+      account_evictions(s, evicted_pages);
+      s->unlock();
+
+      if ( evicted_pages.size() != 0 )
+        break;
+    }
+    return evicted_pages;
+  }
+
+  BufferShard* s = select_eviction_shard();
+
+  if ( s == nullptr )
+    return evicted_pages;
+
+  QuotaFilter filter(QuotaFilter::NOREUSE);
+
+  s->lock();
+
+  if ( m_rm.get_num_regions_noreuse() != 0 )
+    s->m_policy->select_victims(evicted_pages, max_num_evicted_pages, &filter);
+
+  if ( evicted_pages.size() < max_num_evicted_pages ) {
+    filter.set_level(QuotaFilter::OVER_MAX);
+    s->m_policy->select_victims(evicted_pages, max_num_evicted_pages - evicted_pages.size(), &filter);
+  }
+
+  if ( evicted_pages.size() < max_num_evicted_pages ) {
+    filter.set_level(QuotaFilter::ABOVE_MIN);
+    s->m_policy->select_victims(evicted_pages, max_num_evicted_pages - evicted_pages.size(), &filter);
+  }
+
+  if ( evicted_pages.size() == 0 ) {
+    filter.set_level(QuotaFilter::ANY);
+    s->m_policy->select_victims(evicted_pages, max_num_evicted_pages, &filter);
+  }
+
+  if ( evicted_pages.size() == 0 ) {
+    filter.set_level(QuotaFilter::ANY_HOT);
+    s->m_policy->select_victims(evicted_pages, max_num_evicted_pages, &filter);
+  }
+
+  account_evictions(s, evicted_pages);
+
+  s->unlock();
+
+  return evicted_pages;
+}
+
+void Buffer::account_evictions( BufferShard* s, std::vector<PageDescriptor*>& pages )
+{
+  for ( auto pd : pages )
+    account_eviction(s, pd);
+}
+
+void Buffer::account_eviction( BufferShard* s, PageDescriptor* pd )
+{
+  s->m_stats.pages_deleted++;
+  m_num_busy_pages--;
+  pd->set_state_leaving();
+
+  if ( pd->prefetched ) {
+    pd->prefetched = false;
+
+    //
+    // Pages read ahead of a SEQUENTIAL range may belong to a region that
+    // does not read ahead otherwise
+    //
+    if ( pd->region->read_ahead() != nullptr )
+      pd->region->read_ahead()->on_evict(pd->region->page_index(pd->page));
+  }
+}
+
+bool Buffer::regions_over_quota( void )
+{
+  return m_rm.get_num_regions_over_quota() != 0;
+}
+
+//
+// Called from the Flusher thread.  Only the pages set in the dirty bitmaps
+// of the regions are visited, one page at a time, so that the fault
+// handlers, fillers and evictors are never blocked behind us.  While its
+// flush is pending, a page is kept in the UPDATING state so that it can
+// neither be evicted nor modified.  The evict worker marks it present again
+// once it has been written back and then tells the fence.
+//
+void Buffer::flush_dirty_pages( FlushFence* fence )
+{
+  std::vector<PageDescriptor*> dirty_pages;
+
+  if ( fence->region() == nullptr ) {
+    for ( auto rd : fence->regions() ) {
+      collect_written_pages(rd, rd->start(), rd->end());
+      flush_dirty_range(rd, rd->start(), rd->end(), fence, dirty_pages);
+    }
+  }
+  else {
+    collect_written_pages(fence->region(), fence->start(), fence->end());
+    flush_dirty_range(fence->region(), fence->start(), fence->end(), fence, dirty_pages);
+  }
+
+  schedule_flushes(dirty_pages, fence);
+}
+
+void Buffer::flush_dirty_range(   RegionDescriptor* rd, char* start, char* end
+                                , FlushFence* fence
+                                , std::vector<PageDescriptor*>& dirty_pages )
+{
+  const uint64_t max_batch = 32;
+  uint64_t end_idx = rd->page_index(end - 1) + 1;
+
+  for ( uint64_t i = rd->next_dirty(rd->page_index(start), end_idx);
+        i < end_idx; i = rd->next_dirty(i + 1, end_idx) ) {
+    char* paddr = rd->start() + i * rd->page_size();
+    BufferShard* s = shard_of(paddr);
+
+    s->lock();
+
+    //
+    // The descriptor can only be trusted while the shard is locked, and must
+    // be looked up again after waiting for it to change state.
+    //
+    PageDescriptor* pd;
+    while ( (pd = rd->get_page_descriptor_at(i)) != nullptr && pd->dirty ) {
+      if ( pd->state != PageDescriptor::State::FILLING
+          && pd->state != PageDescriptor::State::UPDATING ) {
+        if ( take_dirty_page(s, pd, fence) )
+          dirty_pages.push_back(pd);
+        break;
+      }
+
+      ++s->m_stats.waits;
+      ++s->m_waits_for_state_change;
+      pthread_cond_wait(&s->m_state_change_cond, &s->m_mutex);
+      --s->m_waits_for_state_change;
+    }
+
+    s->unlock();
+
+    if ( dirty_pages.size() >= max_batch )
+      schedule_flushes(dirty_pages, fence);
+  }
+}
+
+//
+// Called from the Flusher thread to bring the number of dirty pages down
+// to its target.  Only pages that can be taken right away are considered,
+// oldest first (as far as the replacement policy tells), one batch per
+// shard in turn.
+//
+void Buffer::flush_oldest_dirty_pages( uint64_t max_pages )
+{
+  const uint64_t max_batch = 32;
+  std::vector<PageDescriptor*> dirty_pages;
+
+  for ( uint64_t n = 0; n < m_shards.size() && max_pages != 0; ++n ) {
+    BufferShard* s = m_shards[m_next_flush_shard];
+    std::vector<PageDescriptor*> busy_pages;
+
+    m_next_flush_shard = (m_next_flush_shard + 1) % m_shards.size();
+
+    s->lock();
+
+    s->m_policy->get_pages(busy_pages);
+
+    for ( auto it = busy_pages.rbegin(); it != busy_pages.rend()
+          && dirty_pages.size() < max_batch && dirty_pages.size() < max_pages; ++it ) {
+      PageDescriptor* pd = *it;
+
+      if ( pd->dirty && ! pd->deferred && pd->state == PageDescriptor::State::PRESENT ) {
+        pd->set_state_updating();
+        dirty_pages.push_back(pd);
+      }
+    }
+
+    s->unlock();
+
+    max_pages -= dirty_pages.size();
+    schedule_flushes(dirty_pages, nullptr);
+  }
+}
+
+//
+// Called with the lock of shard s held.  Waits for pd to settle and takes
+// it for flushing if it is still present and dirty.
+//
+bool Buffer::take_dirty_page( BufferShard* s, PageDescriptor* pd, FlushFence* fence )
+{
+  while ( pd->state == PageDescriptor::State::FILLING
+      ||  pd->state == PageDescriptor::State::UPDATING ) {
+    ++s->m_stats.waits;
+    ++s->m_waits_for_state_change;
+    pthread_cond_wait(&s->m_state_change_cond, &s->m_mutex);
+    --s->m_waits_for_state_change;
+  }
+
+  if ( pd->state != PageDescriptor::State::PRESENT || ! pd->dirty )
+    return false;
+
+  UMAP_LOG(Debug, "schedule Dirty Page: " << pd);
+  pd->set_state_updating();
+  pd->flush_fence = fence;
+  return true;
+}
+
+void Buffer::schedule_flushes( std::vector<PageDescriptor*>& pages, FlushFence* fence )
+{
+  if ( pages.size() == 0 )
+    return;
+
+  if ( fence != nullptr )
+    fence->add_pages(pages.size());
+
+  m_rm.get_evict_manager()->schedule_runs(pages, Umap::WorkItem::WorkType::FLUSH);
+  pages.clear();
+}
+
+//
+// With UMAP_WP_ASYNC the kernel lets the application write to the clean
+// pages it write protected without telling us, and only the page tables
+// know which pages have been written since.  This asks them about
+// [start, end) of the region and marks the present pages found written as
+// dirty, write protecting them again.
+//
+// Pages on their way out belong to an evict worker, which looks for the
+// pages of its run that have been written before it drops them.  The
+// written bit this took from such a page is handed back to it by lifting
+// the write protection again, under the scan mutex of the region so that
+// the worker cannot look in between.
+//
+void Buffer::collect_written_pages( RegionDescriptor* rd, char* start, char* end )
+{
+  Uffd* uffd = m_rm.get_uffd_h();
+
+  if ( ! uffd->wp_async() || rd->read_only() )
+    return;
+
+  std::vector<std::pair<char*, char*>> ranges;
+  std::vector<char*> leaving;
+  std::lock_guard<std::mutex> lock(rd->scan_mutex());
+
+  uffd->collect_written(start, end, ranges);
+
+  for ( auto& r : ranges ) {
+    char* paddr = rd->start() + rd->page_index(r.first) * rd->page_size();
+
+    for ( ; paddr < r.second; paddr += rd->page_size() ) {
+      BufferShard* s = shard_of(paddr);
+
+      s->lock();
+
+      PageDescriptor* pd = rd->get_page_descriptor_at(rd->page_index(paddr));
+
+      if ( pd != nullptr && pd->page == paddr ) {
+        if ( pd->state == PageDescriptor::State::PRESENT
+            || pd->state == PageDescriptor::State::FILLING )
+          page_written(pd);
+        else if ( pd->state != PageDescriptor::State::FREE )
+          leaving.push_back(paddr);
+      }
+
+      s->unlock();
+    }
+  }
+
+  for ( auto paddr : leaving )
+    uffd->disable_write_protect(paddr, rd->page_size());
+}
+
+//
+// Called with the shard of the page locked, or by the evict worker that
+// owns it, for a page found written by collect_written_pages()
+//
+void Buffer::page_written( PageDescriptor* pd )
+{
+  if ( pd->dirty )
+    return;
+
+  pd->dirty = true;
+  pd->region->set_dirty(pd->page);
+  page_dirtied();
+}
+
+//
+// With UMAP_WP_ASYNC, gives a page on its way out that its evict worker
+// could not move out of the region back to the replacement policy, as if it
+// had just been brought in
+//
+void Buffer::keep_page( PageDescriptor* pd )
+{
+  BufferShard* s = shard_of(pd->page);
+  bool kick;
+
+  s->lock();
+
+  pd->set_state_present();
+  s->m_policy->insert(pd);
+  s->m_stats.pages_inserted++;
+  kick = page_became_busy();
+
+  if ( s->m_waits_for_state_change )
+    pthread_cond_broadcast( &s->m_state_change_cond );
+
+  s->unlock();
+
+  if ( kick )
+    kick_evict_manager();
+}
+
+void Buffer::page_dirtied( void )
+{
+  if ( ++m_num_dirty_pages == m_dirty_target + 1 && m_dirty_target != 0 )
+    m_rm.get_flusher_h()->kick();
+}
+
+//
+// Called from uunmap by the unmapping thread of the application, once the
+// flusher and the prefetcher are done with the region and its pages have
+// been unpinned.
+//
+// Every page of the region is taken off the replacement policy in one pass
+// over its page table, with the lock of a shard held for as long as the
+// pages walked belong to it.  Dirty pages are written back by the evict
+// workers as runs of adjacent pages, and the other pages are dropped all at
+// once when the writes are done.  The descriptors are then given back to
+// their shards with one lock per shard.
+//
+void Buffer::evict_region(RegionDescriptor* rd)
+{
+  std::vector<std::pair<BufferShard*, PageDescriptor*>> taken;
+  std::vector<PageDescriptor*> dirty_pages;
+  std::vector<PageDescriptor*> clean_pages;
+  std::vector<std::pair<BufferShard*, PageDescriptor*>> waits;
+  BufferShard* s = nullptr;
+  uint64_t remaining = rd->count();
+
+  collect_written_pages(rd, rd->start(), rd->end());
+
+  for ( uint64_t i = 0; i < rd->num_pages() && remaining != 0; ++i ) {
+    if ( ! rd->chunk_allocated(i) ) {
+      i |= (RegionDescriptor::CHUNK_PAGES - 1);
+      continue;
+    }
+
+    char* paddr = rd->start() + i * rd->page_size();
+    BufferShard* ps = shard_of(paddr);
+
+    if ( ps != s ) {
+      if ( s != nullptr )
+        s->unlock();
+      s = ps;
+      s->lock();
+    }
+
+    PageDescriptor* pd = rd->get_page_descriptor_at(i);
+
+    if ( pd == nullptr || pd->page != paddr )
+      continue;
+
+    --remaining;
+
+    while ( pd->state == PageDescriptor::State::FILLING
+        ||  pd->state == PageDescriptor::State::UPDATING ) {
+      ++s->m_stats.waits;
+      ++s->m_waits_for_state_change;
+      pthread_cond_wait(&s->m_state_change_cond, &s->m_mutex);
+      --s->m_waits_for_state_change;
+    }
+
+    //
+    // The page may have left while we waited
+    //
+    if ( rd->get_page_descriptor_at(i) != pd || pd->page != paddr )
+      continue;
+
+    taken.push_back(std::make_pair(s, pd));
+
+    //
+    // Pages being evicted already are waited for.  They are deferred so that
+    // their descriptors are not reused before we release them.
+    //
+    if ( pd->state == PageDescriptor::State::LEAVING ) {
+      pd->deferred = true;
+      waits.push_back(std::make_pair(s, pd));
+      continue;
+    }
+
+    if ( s->m_policy->contains(pd) )
+      s->m_policy->remove(pd);
+    account_eviction(s, pd);
+
+    if ( pd->dirty ) {
+      pd->deferred = true;
+      dirty_pages.push_back(pd);
+      waits.push_back(std::make_pair(s, pd));
+    }
+    else {
+      clean_pages.push_back(pd);
+    }
+  }
+
+  if ( s != nullptr )
+    s->unlock();
+
+  UMAP_LOG(Debug, "region: " << (void*)rd->start() << " dirty: " << dirty_pages.size()
+      << " clean: " << clean_pages.size() << " in flight: " << waits.size() - dirty_pages.size());
+
+  m_rm.get_evict_manager()->schedule_runs(dirty_pages, Umap::WorkItem::WorkType::EVICT);
+  drop_clean_pages(rd, clean_pages);
+
+  for ( auto w : waits ) {
+    w.first->lock();
+    w.first->wait_for_page_state(w.second, PageDescriptor::State::FREE);
+    w.first->unlock();
+  }
+
+  //
+  // The clean pages of a private region are dropped with the dirty ones
+  // that were written back, those of a shared region one run at a time
+  //
+  if ( ! rd->shared() && madvise(rd->start(), rd->size(), MADV_DONTNEED) == -1 )
+    UMAP_ERROR("madvise failed: " << errno << " (" << strerror(errno) << ")");
+
+  release_region_pages(taken);
+}
+
+//
+// Tells the store about the runs of adjacent clean pages taken by
+// evict_region(), and removes those of a shared region from its shared
+// memory, as the evict workers would have.
+//
+void Buffer::drop_clean_pages( RegionDescriptor* rd, const std::vector<PageDescriptor*>& pages )
+{
+  for ( uint64_t first = 0; first < pages.size(); ) {
+    uint64_t end = first + 1;
+
+    while ( end < pages.size()
+        && pages[end]->page == pages[end - 1]->page + rd->page_size() )
+      ++end;
+
+    char* start = pages[first]->page;
+    uint64_t nb = (end - first) * rd->page_size();
+
+    rd->store()->page_evicted(start, nb, rd->store_offset(start));
+
+    if ( rd->shared() && madvise(start, nb, MADV_REMOVE) == -1 )
+      UMAP_ERROR("madvise failed: " << errno << " (" << strerror(errno) << ")");
+
+    first = end;
+  }
+}
+
+//
+// Gives the descriptors taken by evict_region() back to their shards.  The
+// written back and in flight pages have been removed from the region by
+// mark_page_as_free() already, which left their deferred descriptors to us.
+//
+void Buffer::release_region_pages( std::vector<std::pair<BufferShard*, PageDescriptor*>>& taken )
+{
+  std::sort(taken.begin(), taken.end(),
+      [](const std::pair<BufferShard*, PageDescriptor*>& a, const std::pair<BufferShard*, PageDescriptor*>& b) {
+        return a.first < b.first;
+      });
+
+  for ( uint64_t i = 0; i < taken.size(); ) {
+    BufferShard* s = taken[i].first;
+
+    s->lock();
+
+    for ( ; i < taken.size() && taken[i].first == s; ++i ) {
+      PageDescriptor* pd = taken[i].second;
+
+      if ( pd->state != PageDescriptor::State::FREE ) {
+        pd->region->erase_page_descriptor(pd);
+        pd->set_state_free();
+        pd->spurious_count = 0;
+        pd->page = nullptr;
+      }
+
+      pd->deferred = false;
+      release_page_descriptor(s, pd);
+    }
+
+    if ( s->m_waits_for_state_change )
+      pthread_cond_broadcast( &s->m_state_change_cond );
+
+    s->unlock();
+  }
+}
+
+//
+// Called for UMAP_ADVICE_DONTNEED.  The present pages of [first, end) leave
+// the Buffer right away, as if they had been chosen by the replacement
+// policy: clean pages are simply dropped and dirty pages are written back
+// first.  Pages on their way in or out are left alone.
+//
+void Buffer::evict_range( RegionDescriptor* rd, uint64_t first, uint64_t end )
+{
+  std::vector<PageDescriptor*> leaving;
+
+  for ( uint64_t i = first; i < end && rd->count() != 0; ++i ) {
+    if ( ! rd->chunk_allocated(i) ) {
+      i |= (RegionDescriptor::CHUNK_PAGES - 1);
+      continue;
+    }
+
+    PageDescriptor* pd = rd->get_page_descriptor_at(i);
+
+    if ( pd == nullptr )
+      continue;
+
+    char* paddr = rd->start() + i * rd->page_size();
+    BufferShard* s = shard_of(paddr);
+
+    s->lock();
+
+    if ( rd->get_page_descriptor_at(i) == pd && pd->page == paddr
+        && pd->state == PageDescriptor::State::PRESENT && ! pd->deferred
+        && s->m_policy->contains(pd) ) {
+      s->m_policy->remove(pd);
+      account_eviction(s, pd);
+      leaving.push_back(pd);
+    }
+
+    s->unlock();
+  }
+
+  m_rm.get_evict_manager()->schedule_runs(leaving, Umap::WorkItem::WorkType::EVICT);
+}
+
+//
+// Called by umap_snapshot() once the region has been flushed.  Every page
+// written since the last snapshot is copied to the target, at its offset in
+// the store of the region, as runs of adjacent pages.  A page in the Buffer
+// is copied from memory with the lock of its shard held, so that it cannot
+// leave meanwhile, and any other page is read from the store, which holds
+// it since it was written back.  Pages on their way in or out are waited
+// for, one at a time, and faults on other pages are not held up.
+//
+// A page is taken off the changed pages unless it is dirty: writes to a
+// dirty page do not fault, and it has to be copied again by the next
+// snapshot.  The other pages fault, or are found written, when they are
+// written again.  Returns the number of pages copied.
+//
+uint64_t Buffer::snapshot_range( RegionDescriptor* rd, Store* target )
+{
+  const uint64_t max_run = std::max<uint64_t>(rd->max_run_pages(), 1);
+  const uint64_t psize = rd->page_size();
+  char* run = nullptr;
+  std::vector<bool> from_store(max_run);
+  uint64_t run_first = 0;
+  uint64_t run_pages = 0;
+  uint64_t copied = 0;
+
+  if ( posix_memalign((void**)&run, 4096, max_run * psize) != 0 )
+    UMAP_ERROR("Failed to allocate the snapshot buffer");
+
+  auto write_run = [&]() {
+    off_t offset = rd->store_offset(rd->start() + run_first * psize);
+
+    for ( uint64_t p = 0; p < run_pages; ++p ) {
+      if ( from_store[p]
+          && rd->store()->read_from_store(run + p * psize, psize, offset + p * psize) == -1 )
+        UMAP_ERROR("read_from_store failed: " << errno << " (" << strerror(errno) << ")");
+    }
+
+    for ( uint64_t done = 0; done < run_pages * psize; ) {
+      ssize_t written = target->write_to_store(run + done, run_pages * psize - done, offset + done);
+
+      if ( written <= 0 )
+        UMAP_ERROR("Snapshot write to store failed at offset " << offset + done
+            << ": " << strerror(errno));
+      done += written;
+    }
+
+    copied += run_pages;
+    run_pages = 0;
+  };
+
+  for ( uint64_t i = rd->next_changed(0, rd->num_pages()); i < rd->num_pages();
+        i = rd->next_changed(i + 1, rd->num_pages()) ) {
+    char* paddr = rd->start() + i * psize;
+    BufferShard* s = shard_of(paddr);
+
+    if ( run_pages != 0 && ( run_first + run_pages != i || run_pages == max_run ) )
+      write_run();
+    if ( run_pages == 0 )
+      run_first = i;
+
+    s->lock();
+
+    PageDescriptor* pd;
+    while ( (pd = rd->get_page_descriptor_at(i)) != nullptr && pd->page == paddr
+        && pd->state != PageDescriptor::State::PRESENT ) {
+      ++s->m_stats.waits;
+      ++s->m_waits_for_state_change;
+      pthread_cond_wait(&s->m_state_change_cond, &s->m_mutex);
+      --s->m_waits_for_state_change;
+    }
+
+    if ( pd != nullptr && pd->page == paddr ) {
+      memcpy(run + run_pages * psize, paddr, psize);
+      from_store[run_pages] = false;
+      if ( ! pd->dirty )
+        rd->clear_changed(paddr);
+    }
+    else {
+      from_store[run_pages] = true;
+      rd->clear_changed(paddr);
+    }
+
+    s->unlock();
+    ++run_pages;
+  }
+
+  if ( run_pages != 0 )
+    write_run();
+
+  free(run);
+  return copied;
+}
+
+//
+// Lists the pages of the region in the Buffer as runs [first, end) of page
+// indices, hottest first as far as the replacement policies tell.  The
+// pages of each shard are ranked in quarters by their place in its policy,
+// and the pages of a quarter are sorted, so that they may be read back in
+// runs.
+//
+void Buffer::hot_pages( RegionDescriptor* rd, std::vector<std::pair<uint64_t, uint64_t>>& extents )
+{
+  const uint64_t tiers = 4;
+  std::vector<std::pair<uint64_t, uint64_t>> ranked;    // (tier, page index)
+  std::vector<PageDescriptor*> pages;
+
+  for ( auto s : m_shards ) {
+    pages.clear();
+
+    s->lock();
+    s->m_policy->get_pages(pages);
+
+    for ( uint64_t k = 0; k < pages.size(); ++k ) {
+      PageDescriptor* pd = pages[k];
+
+      if ( pd->region == rd && ! pd->deferred && pd->state != PageDescriptor::State::LEAVING )
+        ranked.push_back(std::make_pair(k * tiers / pages.size(), rd->page_index(pd->page)));
+    }
+
+    s->unlock();
+  }
+
+  std::sort(ranked.begin(), ranked.end());
+
+  for ( uint64_t i = 0; i < ranked.size(); ++i ) {
+    if ( i != 0 && ranked[i].first == ranked[i - 1].first && extents.back().second == ranked[i].second )
+      ++extents.back().second;
+    else
+      extents.push_back(std::make_pair(ranked[i].second, ranked[i].second + 1));
+  }
+}
+
+bool Buffer::low_threshold_reached( void )
+{
+  if ( m_num_busy_pages > m_evict_low_water )
+    return false;
+
+  //
+  // A shard can run out of descriptors before the buffer as a whole reaches
+  // its high water mark.  Keep evicting until such a shard has been served.
+  //
+  for ( auto s : m_shards ) {
+    if ( s->m_waits_for_avail_pd && s->m_policy->size() > s->m_evict_low_water )
+      return false;
+  }
+
+  return true;
+}
+
+//
+// Called by umap_pin() with the pin mutex of the RegionManager held.
+// Pinned pages are taken off the replacement policy, so that eviction never
+// sees them, until they have been unpinned as many times as they were
+// pinned.  Pages that are not present are brought in as runs through the
+// fill workers, as for a prefetch, and waited for.
+//
+void Buffer::pin_range( RegionDescriptor* rd, uint64_t first, uint64_t end )
+{
+  FlushFence fence(rd, rd->start() + first * rd->page_size(), rd->start() + end * rd->page_size());
+  FillBatch batch(m_rm);
+
+  for ( uint64_t i = first; i < end; ++i ) {
+    char* paddr = rd->start() + i * rd->page_size();
+    BufferShard* s = shard_of(paddr);
+
+    s->lock();
+
+    auto pd = page_already_present(s, paddr, rd, &batch);
+
+    while ( pd == nullptr && s->num_free() == 0 ) {
+      wait_for_free_page_descriptor(s, &batch);
+      pd = page_already_present(s, paddr, rd, &batch);
+    }
+
+    if ( pd == nullptr ) {
+      pd = get_page_descriptor(s, paddr, rd, &batch);
+      pd->data_present = false;
+      pd->fill_fence = &fence;
+      fence.add_pages(1);
+
+      bool over_quota = rd->insert_page_descriptor(pd);
+
+      if ( page_became_busy() || over_quota )
+        kick_evict_manager();
+
+      UMAP_LOG(Debug, "PIN: " << pd << " From: " << this);
+
+      send_fill(pd, &batch);
+    }
+
+    if ( pd->pin_count++ == 0 ) {
+      if ( s->m_policy->contains(pd) )
+        s->m_policy->remove(pd);
+      ++m_num_pinned_pages;
+    }
+
+    s->unlock();
+  }
+
+  batch.flush();
+  fence.walk_done();
+  fence.wait();
+}
+
+//
+// Pages whose last pin goes are given back to the replacement policy as if
+// they had just been brought in
+//
+void Buffer::unpin_range( RegionDescriptor* rd, uint64_t first, uint64_t end )
+{
+  for ( uint64_t i = first; i < end && m_num_pinned_pages != 0; ++i ) {
+    if ( ! rd->chunk_allocated(i) ) {
+      i |= (RegionDescriptor::CHUNK_PAGES - 1);
+      continue;
+    }
+
+    char* paddr = rd->start() + i * rd->page_size();
+    BufferShard* s = shard_of(paddr);
+
+    s->lock();
+
+    PageDescriptor* pd = rd->get_page_descriptor(paddr);
+
+    if ( pd != nullptr && pd->pin_count != 0 && --pd->pin_count == 0 ) {
+      s->m_policy->insert(pd);
+      --m_num_pinned_pages;
+    }
+
+    s->unlock();
+  }
+}
+
+//
+// Number of pages of the range that pin_range() would have to pin
+//
+uint64_t Buffer::num_unpinned_pages( RegionDescriptor* rd, uint64_t first, uint64_t end )
+{
+  uint64_t rval = 0;
+
+  for ( uint64_t i = first; i < end; ++i ) {
+    char* paddr = rd->start() + i * rd->page_size();
+    BufferShard* s = shard_of(paddr);
+
+    s->lock();
+
+    PageDescriptor* pd = rd->get_page_descriptor(paddr);
 
-  if ( m_waits_for_state_change )
-    pthread_cond_broadcast( &m_state_change_cond );
+    if ( pd == nullptr || pd->pin_count == 0 )
+      ++rval;
 
-  pd->page = nullptr;
+    s->unlock();
+  }
 
-  unlock();
+  return rval;
 }
 
-void Buffer::release_page_descriptor( PageDescriptor* pd )
+void Buffer::process_page_event(char* paddr, bool iswrite, RegionDescriptor* rd, FillBatch* batch)
 {
-    m_free_pages.push_back(pd);
+  BufferShard* s = shard_of(paddr);
 
-    if ( m_waits_for_avail_pd )
-      pthread_cond_broadcast(&m_avail_pd_cond);
+  s->lock();
+  page_event(s, paddr, iswrite, rd, batch);
+  s->unlock();
 }
 
 //
-// Called from Evict Manager to begin eviction process on oldest present
-// page
+// Processes the page events a fault handler has read at once, sorted by
+// address and without duplicates.  Since they are sorted, the region of the
+// previous event is tried before the regions are searched, and consecutive
+// events of a shard, such as the pages of a fill run, are processed under
+// one acquisition of its lock.  The lock is let go before reading ahead,
+// which locks the shards of the pages it prefetches.
 //
-PageDescriptor* Buffer::evict_oldest_page()
+void Buffer::process_fault_events(const FaultEvent* events, uint64_t num_events, uint64_t read_time, FillBatch* batch)
 {
-  PageDescriptor* pd = nullptr;
+  RegionIndex::Reader reader(m_rm.get_region_index());
+  RegionDescriptor* rd = nullptr;
+  BufferShard* s = nullptr;
 
-  lock();
+  batch->set_fault_time(read_time);
 
-  while ( m_busy_pages.size() != 0 ) {
-    pd = m_busy_pages.back();
-
-    // Deferred means that this page was previously evicted as part of an
-    // uunmap of a Region.  This means that this page descriptor points to a
-    // page that has already been given back to the system so all we need to
-    // do is take it off of the busy list and release the descriptor.
-    //
-    if ( pd->deferred ) {
-      UMAP_LOG(Debug, "Deferred Page: " << pd);
+  for ( uint64_t i = 0; i < num_events; ++i ) {
+    char* paddr = events[i].paddr;
 
-      //
-      // Make sure that the page has truly been flushed.
-      //
-      wait_for_page_state(pd, PageDescriptor::State::FREE);
+    if ( rd == nullptr || paddr < rd->start() || paddr >= rd->end() ) {
+      if ( s != nullptr ) {
+        s->unlock();
+        s = nullptr;
+      }
 
-      m_busy_pages.pop_back();
-      m_stats.pages_deleted++;
+      batch->flush();
+      if ( (rd = m_rm.containing_region(paddr)) == nullptr )
+        continue;
+    }
 
-      //
-      // Jump to the next page descriptor
-      //
-      release_page_descriptor(pd);
-      pd = nullptr;
+    if ( shard_of(paddr) != s ) {
+      if ( s != nullptr )
+        s->unlock();
+      s = shard_of(paddr);
+      s->lock();
     }
-    else {
-      UMAP_LOG(Debug, "Normal Page: " << pd);
-      wait_for_page_state(pd, PageDescriptor::State::PRESENT);
-      m_busy_pages.pop_back();
-      m_stats.pages_deleted++;
-      pd->set_state_leaving();
-      break;
+
+    batch->set_fault_thread(events[i].thread);
+    page_event(s, paddr, events[i].iswrite, rd, batch);
+
+    if ( rd->read_ahead() != nullptr || rd->has_advice() ) {
+      s->unlock();
+      s = nullptr;
+      read_ahead(paddr, rd, batch);
     }
+
+    if ( read_time != 0 )
+      m_rm.record_latency(UMAP_LATENCY_HANDLER, read_time);
   }
 
-  unlock();
-  return pd;
+  if ( s != nullptr )
+    s->unlock();
 }
 
 //
-// Called from Evict Manager to begin eviction process on at most N (=32)
-// oldest present (non-deferred) pages without waiting for status change
+// Called with the lock of the shard of paddr held, which it still is on
+// return, though it may have been let go while waiting
 //
-std::vector<PageDescriptor*> Buffer::evict_oldest_pages()
+void Buffer::page_event(BufferShard* s, char* paddr, bool iswrite, RegionDescriptor* rd, FillBatch* batch)
 {
-  std::vector<PageDescriptor*> evicted_pages;
-  std::vector<PageDescriptor*> pending_pages;
-  const int max_num_evicted_pages = 32;
-  int num_evicted_pages = 0;
-
-  lock();
-  size_t num_busy_pages = m_busy_pages.size();
-  if( num_busy_pages>0 ){
-    size_t i = num_busy_pages - 1;
-    for(; (i>=0 && num_evicted_pages<max_num_evicted_pages); i--){
-        PageDescriptor* pd = m_busy_pages[i];
-        if( !pd->deferred && pd->state == PageDescriptor::State::PRESENT ){
-          m_stats.pages_deleted++;
-          num_evicted_pages ++;
-
-          pd->state = PageDescriptor::State::LEAVING;
-          evicted_pages.push_back(pd);
-        }else{
-          pending_pages.push_back(pd);
-        }
-        m_busy_pages.pop_back();
+  if ( rd->unmapping() )
+    return;
+
+  auto pd = page_already_present(s, paddr, rd, batch);
+
+  //
+  // Read-ahead may bring the page in while we wait for a free descriptor
+  //
+  while ( pd == nullptr && s->num_free() == 0 ) {
+    wait_for_free_page_descriptor(s, batch);
+    pd = page_already_present(s, paddr, rd, batch);
+  }
+
+  bool new_page = ( pd == nullptr );
+
+  if ( pd != nullptr ) {  // Page is already present
+    if ( pd->pin_count == 0 )
+      s->m_policy->touch(pd);
+    pd->prefetched = false;
+
+    if (iswrite && pd->dirty == false) {
+      pd->dirty = true;
+      rd->set_dirty(paddr);
+      page_dirtied();
+      pd->set_state_updating();
+      UMAP_LOG(Debug, "PRE: " << pd << " From: " << this);
+    }
+    else if ( rd->shared() && ! rd->shared_resident(pd->page, rd->page_size()) ) {
+      //
+      // Another process sharing the region has evicted the page
+      //
+      pd->set_state_updating();
+      pd->data_present = false;
+      UMAP_LOG(Debug, "REF: " << pd << " From: " << this);
     }
+    else {
+      if ( pd->spurious_count != UINT8_MAX )
+        pd->spurious_count++;
+      s->m_stats.spurious_faults++;
+
+      //
+      // The page of a shared region may have been filled again, by another
+      // process, after the fault
+      //
+      if ( rd->shared() )
+        m_rm.get_uffd_h()->wake_pages(pd->page, rd->page_size());
 
-    size_t num_pending_pages = pending_pages.size();
-    for(size_t k=0; k<num_pending_pages; k++){
-      m_busy_pages.push_back(pending_pages[k]);
+      if ( batch != nullptr )
+        Trace::record(TraceFormat::SPURIOUS_FAULT, paddr, rd->start(), batch->fault_time(), 1
+            , iswrite ? TraceFormat::FLAG_WRITE : 0, (uint32_t)batch->fault_thread());
+
+      UMAP_LOG(Debug, "SPU: " << pd << " From: " << this);
+      return;
     }
   }
-  unlock();
-
-  return evicted_pages;
-}
+  else {                  // This page has not been brought in yet
+    pd = get_page_descriptor(s, paddr, rd, batch);
+    pd->data_present = false;
 
-  void Buffer::flush_dirty_pages()
-  {
-    lock();
+    bool over_quota = rd->insert_page_descriptor(pd);
 
-    for (auto it = m_busy_pages.begin(); it != m_busy_pages.end(); it++) {
-      
-      if ( (*it)->dirty ) {
-        PageDescriptor* pd = *it;
-        UMAP_LOG(Debug, "schedule Dirty Page: " << pd);
-        wait_for_page_state(pd, PageDescriptor::State::PRESENT);
-        m_rm.get_evict_manager()->schedule_flush(pd);
-      }
+    if (iswrite) {
+      pd->dirty = true;
+      rd->set_dirty(paddr);
+      page_dirtied();
     }
 
-    m_rm.get_evict_manager()->WaitAll();
-    
-    unlock();
+    UMAP_LOG(Debug, "NEW: " << pd << " From: " << this);
+
+    //
+    // Kick the eviction daemon if the high water mark has been reached or
+    // if this region has just gone over its maximum
+    //
+    if ( page_became_busy() || over_quota )
+      kick_evict_manager();
   }
-  
-//
-// Called from uunmap by the unmapping thread of the application
+
+  send_fill(pd, batch, new_page);
+
+  //
+  // Without a batch this is a page of umap_prefetch(), which has been
+  // traced as a prefetch already
+  //
+  if ( batch != nullptr )
+    Trace::record(TraceFormat::FAULT, paddr, rd->start(), batch->fault_time(), 1
+        , iswrite ? TraceFormat::FLAG_WRITE : 0, (uint32_t)batch->fault_thread());
+
+  s->m_stats.events_processed ++;
+}
+
 //
-// The idea is to go through the entire buffer and remove (evict) all pages
-// of the given region descriptor.
+// Called by the fault handler after a fault on a region that does
+// read-ahead, or has been advised, has been processed.  Faults in RANDOM
+// ranges are not read ahead of, and those in SEQUENTIAL ranges always are
+// by as much as read-ahead ever would, without waiting for the stream
+// detector to notice them.
 //
-void Buffer::evict_region(RegionDescriptor* rd)
+void Buffer::read_ahead(char* paddr, RegionDescriptor* rd, FillBatch* batch)
 {
-  if (m_rm.get_num_active_regions() > 1) {
-    lock();
-    while ( rd->count() ) {
-      auto pd = rd->get_next_page_descriptor();
-      if(pd->state != PageDescriptor::State::LEAVING ){
-        pd->deferred = true;
-        wait_for_page_state(pd, PageDescriptor::State::PRESENT);
-        pd->set_state_leaving();
-        m_rm.get_evict_manager()->schedule_eviction(pd);
-      }
-      wait_for_page_state(pd, PageDescriptor::State::FREE);
-    }
-    unlock();
+  ReadAhead::Window w;
+  uint64_t page = rd->page_index(paddr);
+  int advice = rd->advice(page);
+
+  if ( advice == UMAP_ADVICE_RANDOM )
+    return;
+
+  if ( advice == UMAP_ADVICE_SEQUENTIAL ) {
+    uint64_t window = rd->max_run_pages();
+
+    if ( rd->read_ahead() != nullptr )
+      window = std::max(window, rd->read_ahead()->max_window());
+
+    w.first = page + 1;
+    w.count = std::min(window, rd->num_pages() - w.first);
+    w.stride = 1;
   }
-  else {
-    m_rm.get_evict_manager()->EvictAll();
+  else if ( rd->read_ahead() == nullptr || ! rd->read_ahead()->on_fault(page, &w) ) {
+    return;
+  }
+
+  for ( uint64_t i = 0; i < w.count; ++i ) {
+    uint64_t idx = ( w.stride != 0 ) ? w.first + i * w.stride : w.pages[i];
+    char* page = rd->start() + idx * rd->page_size();
+
+    if ( ! prefetch_page(page, rd, batch) )
+      break;
   }
 }
 
-bool Buffer::low_threshold_reached( void )
+//
+// Starts filling a page that has not been faulted on yet.  Read-ahead never
+// waits for a descriptor nor causes evictions, so false is returned once
+// the shard has run out of free descriptors or the Buffer has reached its
+// high water mark.
+//
+bool Buffer::prefetch_page( char* paddr, RegionDescriptor* rd, FillBatch* batch )
 {
-  return m_busy_pages.size() <= m_evict_low_water;
-}
-
-typedef struct FetchFuncParams {
-  uint64_t psize;
-  RegionDescriptor* rd;
-  Uffd* m_uffd;
-  uint64_t offset_st;
-  uint64_t offset_end;
-} FetchFuncParams;
-
-void *FetchFunc(void *arg) 
-{ 
-  FetchFuncParams* params = (FetchFuncParams*) arg;
-  uint64_t psize = params->psize;
-  RegionDescriptor* rd = params->rd;
-  Uffd* m_uffd = params->m_uffd;
-  char* region_st = rd->start();
-  uint64_t offset_st = params->offset_st;
-  uint64_t offset_end= params->offset_end;
-
-  char* copyin_buf = (char*) malloc(psize);
-  if ( !copyin_buf )
-    UMAP_ERROR("Failed to allocate copyin_buf");
-  
-  for(uint64_t offset = offset_st; offset < offset_end; offset+=psize){
-    
-    if( rd->store()->read_from_store(copyin_buf, psize, offset) == -1)
-      UMAP_ERROR("failed to read_from_store at offset="<<offset);
-  
-    m_uffd->copy_in_page(copyin_buf, region_st + offset );
-  }
-
-  free(copyin_buf);
-  return NULL;
-} 
-
-void Buffer::fetch_and_pin(char* paddr, uint64_t size)
-{
-  lock();
-  auto rd = m_rm.containing_region(paddr);
-  
-  if ( rd == nullptr )
-    UMAP_ERROR("the prefetched region is not found");
-
-  /* cap the prefetched region */
-  char* pend = paddr + size;  
-  if( pend > rd->end() ){
-    pend = (char*) rd->end();
-    UMAP_LOG(Info, "the prefetched rergion is larger than the region (end at "<<pend<<")");
-  }
-
-  /* get aligned fetch size */
-  uint64_t offset_st = rd->store_offset( paddr );
-  uint64_t offset_end = rd->store_offset( pend );
-  size = pend - paddr;
-  
-  /* Check free memory */
-  uint64_t mem_avail_kb = 0;
-  unsigned long mem;
-  std::string token;
-  std::ifstream file("/proc/meminfo");
-  while (file >> token) {
-    if (token == "MemAvailable:") {
-      if (file >> mem) {
-	mem_avail_kb = mem;
-      } else {
-        UMAP_ERROR("UMAP unable to determine system memory size\n");
-      }
-    }
-    // ignore rest of the line
-    file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-  }
+  BufferShard* s = shard_of(paddr);
+  bool rval = true;
 
-  const uint64_t mem_margin_kb = 16777216;
-  mem_avail_kb = (mem_avail_kb > mem_margin_kb) ?(mem_avail_kb-mem_margin_kb) : 0;
-  
+  s->lock();
 
-  uint64_t psize = m_rm.get_umap_page_size();
-  size_t num_free_pages = m_free_pages.size();
-  uint64_t free_page_mem = psize * num_free_pages;
-  uint64_t mem_avail = (mem_avail_kb*1024/psize) * psize;
+  if ( rd->unmapping() ) {
+    rval = false;
+  }
+  else if ( rd->get_page_descriptor(paddr) == nullptr ) {
+    if ( s->num_free() == 0 || m_num_busy_pages + 1 >= m_evict_high_water ) {
+      rval = false;
+    }
+    else {
+      PageDescriptor* pd = get_page_descriptor(s, paddr, rd, batch);
 
-  UMAP_LOG(Info, " MemAvailable = " << mem
-	   << " Mem Usable = " << mem_avail
-	   << " fetch_and_pin = " << size
-	   << " free_page_mem = " << free_page_mem << " (" << num_free_pages <<" x " << psize <<" )");
+      pd->data_present = false;
+      pd->prefetched = true;
+      ++m_num_busy_pages;
 
-  /* Reduce the number of free pages if avail mem is insufficient */
-  if( ( free_page_mem + size) >= mem_avail ){
+      if ( rd->insert_page_descriptor(pd) )
+        kick_evict_manager();
 
-    uint64_t reduced_mem = ( free_page_mem + size) - mem_avail;
-    if( reduced_mem < free_page_mem){
-      size_t new_num_free_pages = (free_page_mem - reduced_mem)/psize;
-      m_free_pages.resize(new_num_free_pages);
-      
-      m_size = m_busy_pages.size() + m_free_pages.size();
-      m_evict_low_water = apply_int_percentage(m_rm.get_evict_low_water_threshold(), m_size);
-      m_evict_high_water = apply_int_percentage(m_rm.get_evict_high_water_threshold(), m_size);
-          
-      UMAP_LOG(Info, "Reduced Buffer Size to " << m_size );
+      UMAP_LOG(Debug, "PRF: " << pd << " From: " << this);
 
-    }else{
-      /* TODO: evict current pages? */
-      UMAP_ERROR("Currently, no support for pinning a region larger than free pages\n");
+      send_fill(pd, batch);
+      s->m_stats.pages_prefetched++;
     }
   }
 
+  s->unlock();
+  return rval;
+}
 
-  /* get page alighed offset*/
-  Uffd* m_uffd = m_rm.get_uffd_h();
-  size_t num_pages = (offset_end - offset_st)/psize;
-  size_t num_fetch_threads = (num_pages>1024) ?8 : 1;
-  size_t stride = num_pages/num_fetch_threads*psize;
+//
+// Called from the Prefetcher thread.  Pages that are not in the Buffer are
+// brought in as runs, waiting for free descriptors if need be, and those
+// that are present are left alone.  Pages on their way in or out are waited
+// for, so that each page of the range has been present once the fence is
+// complete.
+//
+void Buffer::prefetch_range( FlushFence* fence )
+{
+  RegionDescriptor* rd = fence->region();
+  FillBatch batch(m_rm);
 
-  time_t start = time(NULL);
-  pthread_t fetchThreads[num_fetch_threads];
-  FetchFuncParams params[num_fetch_threads];
-  for(int i=0; i<num_fetch_threads; i++){
-    params[i].psize = psize;
-    params[i].rd = rd;
-    params[i].m_uffd = m_uffd;
-    params[i].offset_st = offset_st + stride*i;
-    params[i].offset_end = params[i].offset_st + stride;
-    if(i==(num_fetch_threads-1))
-      params[i].offset_end = offset_end;
-    UMAP_LOG(Info, "FetchThread "<<i<<" ["<<params[i].offset_st<<" , "<<params[i].offset_end<<"]");
-      
-    int ret = pthread_create(&fetchThreads[i], NULL, FetchFunc, &params[i]);
-    if (ret) {
-      UMAP_ERROR("Failed to launch fetchthread "<<i );
-    }
-  }
+  for ( char* paddr = fence->start(); paddr < fence->end(); paddr += rd->page_size() ) {
+    BufferShard* s = shard_of(paddr);
 
-  for(int i=0; i<num_fetch_threads; i++)
-    pthread_join(fetchThreads[i], NULL);
+    s->lock();
 
-  time_t end = time(NULL);
-  UMAP_LOG(Info,"Fetch_and_pin: "<< (end-start) << " seconds");
+    if ( rd->unmapping() ) {
+      s->unlock();
+      break;
+    }
 
-  unlock();
-}
+    auto pd = page_already_present(s, paddr, rd, &batch);
 
-  
-void Buffer::process_page_event(char* paddr, bool iswrite, RegionDescriptor* rd)
-{
-  WorkItem work;
-  work.type = Umap::WorkItem::WorkType::NONE;
+    while ( pd == nullptr && s->num_free() == 0 ) {
+      wait_for_free_page_descriptor(s, &batch);
+      pd = page_already_present(s, paddr, rd, &batch);
+    }
 
-  lock();
-  auto pd = page_already_present(paddr);
+    if ( pd == nullptr ) {
+      pd = get_page_descriptor(s, paddr, rd, &batch);
+      pd->data_present = false;
+      pd->fill_fence = fence;
+      fence->add_pages(1);
 
-  if ( pd != nullptr ) {  // Page is already present
-    if (iswrite && pd->dirty == false) {
-      work.page_desc = pd;
-      pd->dirty = true;
-      pd->set_state_updating();
-      UMAP_LOG(Debug, "PRE: " << pd << " From: " << this);
-    }
-    else {
-      static int hiwat = 0;
+      bool over_quota = rd->insert_page_descriptor(pd);
 
-      pd->spurious_count++;
-      if (pd->spurious_count > hiwat) {
-        hiwat = pd->spurious_count;
-        UMAP_LOG(Debug, "New Spurious cound high water mark: " << hiwat);
-      }
+      if ( page_became_busy() || over_quota )
+        kick_evict_manager();
 
-      UMAP_LOG(Debug, "SPU: " << pd << " From: " << this);
-      unlock();
-      return;
+      UMAP_LOG(Debug, "PRR: " << pd << " From: " << this);
+
+      send_fill(pd, &batch);
+      s->m_stats.pages_prefetched++;
     }
+
+    s->unlock();
   }
-  else {                  // This page has not been brought in yet
-    pd = get_page_descriptor(paddr, rd);
-    pd->data_present = false;
-    work.page_desc = pd;
 
-    rd->insert_page_descriptor(pd);
-    m_present_pages[pd->page] = pd;
+  batch.flush();
+}
 
-    if (iswrite)
-      pd->dirty = true;
+//
+// The descriptors are zeroed by calloc(), which for large arrays leaves the
+// pages to be zeroed by the kernel as they are first touched.  One more is
+// allocated for the array to start on a cache line.
+//
+PageDescriptor* Buffer::alloc_descriptors( uint64_t count )
+{
+  void* raw = calloc(count + 1, sizeof(PageDescriptor));
 
-    UMAP_LOG(Debug, "NEW: " << pd << " From: " << this);
-  }
+  if ( raw == nullptr )
+    UMAP_ERROR("Failed to allocate " << (count + 1) * sizeof(PageDescriptor)
+        << " bytes for buffer page descriptors");
 
-  m_rm.get_fill_workers_h()->send_work(work);
+  m_arrays.push_back(raw);
 
-  //
-  // Kick the eviction daemon if the high water mark has been reached
-  //
-  if ( m_busy_pages.size() == m_evict_high_water ) {
-    WorkItem w;
+  uintptr_t align = alignof(PageDescriptor);
+  return (PageDescriptor*)(((uintptr_t)raw + align - 1) & ~(align - 1));
+}
+
+//
+// Pages are left to the batch of the fault handler (if any) so that they may
+// be filled, or write unprotected, together with their neighbors.  fault
+// tells that pd is filled for the fault being handled, rather than ahead of
+// one, for its latency to be recorded.
+//
+void Buffer::send_fill( PageDescriptor* pd, FillBatch* batch, bool fault )
+{
+  if ( batch != nullptr ) {
+    batch->add(pd, fault);
+  }
+  else {
+    WorkItem work;
 
-    w.type = Umap::WorkItem::WorkType::THRESHOLD;
-    w.page_desc = nullptr;
-    m_rm.get_evict_manager()->send_work(w);
+    work.type = Umap::WorkItem::WorkType::NONE;
+    work.page_desc = pd;
+    work.time = m_rm.latency_clock();
+    work.faults = 0;
+    work.fault_time = 0;
+    pd->fill_next = nullptr;
+    m_rm.get_fill_workers_h()->send_work(work, pd->fill_node);
   }
+}
+
+void Buffer::kick_evict_manager( void )
+{
+  WorkItem w;
 
-  m_stats.events_processed ++;
-  unlock();
+  w.type = Umap::WorkItem::WorkType::THRESHOLD;
+  w.page_desc = nullptr;
+  m_rm.get_evict_manager()->send_work(w);
 }
 
 // Return nullptr if page not present, PageDescriptor * otherwise
-PageDescriptor* Buffer::page_already_present( char* page_addr )
+PageDescriptor* Buffer::page_already_present( BufferShard* s, char* page_addr, RegionDescriptor* rd, FillBatch* batch )
 {
   while (1) {
-    auto pp = m_present_pages.find(page_addr);
-  
+    auto pd = rd->get_page_descriptor(page_addr);
+
     //
     // Most likely case
     //
-    if ( pp == m_present_pages.end() )
+    if ( pd == nullptr )
       return nullptr;
 
     //
     // Next most likely is that it is just present in the buffer
     //
-    if ( pp->second->state == PageDescriptor::State::PRESENT )
-      return pp->second;
+    if ( pd->state == PageDescriptor::State::PRESENT )
+      return pd;
 
     // There is a chance that the state of this page is not/no-longer
     // PRESENT.  If this is the case, we need to wait for it to finish
     // with whatever is happening to it and then check again
     //
-    UMAP_LOG(Debug, "Waiting for state: (ANY)" << ", " << pp->second);
+    UMAP_LOG(Debug, "Waiting for state: (ANY)" << ", " << pd);
 
-    ++m_stats.waits;
-    ++m_waits_for_state_change;
-    pthread_cond_wait(&m_state_change_cond, &m_mutex);
-    --m_waits_for_state_change;
+    if ( batch != nullptr )
+      batch->flush();
+
+    ++s->m_stats.waits;
+    ++s->m_waits_for_state_change;
+    pthread_cond_wait(&s->m_state_change_cond, &s->m_mutex);
+    --s->m_waits_for_state_change;
   }
 }
 
-PageDescriptor* Buffer::get_page_descriptor(char* vaddr, RegionDescriptor* rd)
+void Buffer::wait_for_free_page_descriptor( BufferShard* s, FillBatch* batch )
 {
-  while ( m_free_pages.size() == 0 )  {
-    ++m_waits_for_avail_pd;
-    m_stats.not_avail++;
+  if ( batch != nullptr )
+    batch->flush();
 
-    ++m_stats.waits;
-    ++m_waits_for_state_change;
-    pthread_cond_wait(&m_avail_pd_cond, &m_mutex);
+  ++s->m_waits_for_avail_pd;
+  s->m_stats.not_avail++;
+  ++s->m_stats.waits;
+
+  //
+  // This shard may run dry before the buffer as a whole crosses its high
+  // water mark, so make sure the eviction manager knows about us.
+  //
+  kick_evict_manager();
 
-    --m_waits_for_avail_pd;
+  uint64_t wait_time = m_rm.latency_clock();
+
+  pthread_cond_wait(&s->m_avail_pd_cond, &s->m_mutex);
+
+  if ( wait_time != 0 ) {
+    m_rm.record_latency(UMAP_LATENCY_DESCRIPTOR_WAIT, wait_time);
+    Trace::record(TraceFormat::DESCRIPTOR_WAIT, nullptr, nullptr, wait_time, 0);
   }
 
-  PageDescriptor* rval;
+  --s->m_waits_for_avail_pd;
+}
+
+//
+// The caller must make sure that the shard has a free descriptor
+//
+PageDescriptor* Buffer::get_page_descriptor(BufferShard* s, char* vaddr, RegionDescriptor* rd, FillBatch* batch)
+{
+  assert("No free page descriptor" && s->num_free() != 0);
 
-  rval = m_free_pages.back();
-  m_free_pages.pop_back();
+  PageDescriptor* rval = s->take_free_page();
 
   rval->page = vaddr;
   rval->region = rd;
   rval->dirty = false;
   rval->deferred = false;
+  rval->prefetched = false;
+  rval->flush_fence = nullptr;
+  rval->fill_fence = nullptr;
+  rval->pin_count = 0;
   rval->set_state_filling();
   rval->spurious_count = 0;
 
-  m_stats.pages_inserted++;
-  m_busy_pages.push_front(rval);
+  Numa* numa = m_rm.get_numa_h();
+  rval->fill_node = ( numa != nullptr )
+      ? numa->fill_node(rd, vaddr, ( batch != nullptr ) ? batch->fault_thread() : 0) : 0;
+
+  s->m_stats.pages_inserted++;
+  s->m_policy->insert(rval);
 
   return rval;
 }
@@ -491,7 +1503,136 @@ uint64_t Buffer::apply_int_percentage( int percentage, uint64_t item )
   return rval;
 }
 
-void Buffer::lock()
+void Buffer::lock_all_shards( void )
+{
+  for ( auto s : m_shards )
+    s->lock();
+}
+
+void Buffer::unlock_all_shards( void )
+{
+  for ( auto it = m_shards.rbegin(); it != m_shards.rend(); ++it )
+    (*it)->unlock();
+}
+
+void Buffer::resize( uint64_t num_pages )
+{
+  lock_all_shards();
+  resize_locked(num_pages);
+  unlock_all_shards();
+
+  UMAP_LOG(Debug, "Buffer resized to " << m_size << " pages, "
+      << m_num_busy_pages << " busy");
+
+  if ( m_num_busy_pages >= m_evict_high_water )
+    kick_evict_manager();
+}
+
+//
+// The caller holds the locks of all shards.  The new size is split over the
+// shards as it is when the Buffer is created.
+//
+void Buffer::resize_locked( uint64_t num_pages )
+{
+  uint64_t num_shards = m_shards.size();
+
+  if ( num_pages < num_shards )
+    num_pages = num_shards;
+
+  std::vector<PageDescriptor*> spare;
+  uint64_t needed = 0;
+
+  for ( uint64_t i = 0; i < num_shards; ++i ) {
+    BufferShard* s = m_shards[i];
+    uint64_t target = ((i + 1) * num_pages) / num_shards - (i * num_pages) / num_shards;
+
+    spare.insert(spare.end(), s->m_spare_pages.begin(), s->m_spare_pages.end());
+    s->m_spare_pages.clear();
+
+    if ( target > s->m_num_owned )
+      needed += target - s->m_num_owned;
+  }
+
+  if ( needed > spare.size() ) {
+    uint64_t count = needed - spare.size();
+    PageDescriptor* array = alloc_descriptors(count);
+
+    for ( uint64_t j = 0; j < count; ++j )
+      spare.push_back(&array[j]);
+  }
+
+  for ( uint64_t i = 0; i < num_shards; ++i ) {
+    BufferShard* s = m_shards[i];
+    uint64_t target = ((i + 1) * num_pages) / num_shards - (i * num_pages) / num_shards;
+
+    while ( s->m_num_owned < target ) {
+      s->m_free_pages.push_back(spare.back());
+      spare.pop_back();
+      ++s->m_num_owned;
+    }
+
+    //
+    // Busy descriptors above the target are given up as their pages are
+    // evicted, see release_page_descriptor()
+    //
+    while ( s->m_num_owned > target && s->num_free() != 0 ) {
+      spare.push_back(s->take_free_page());
+      --s->m_num_owned;
+    }
+
+    s->m_size = target;
+    s->m_policy->set_capacity(s->m_size);
+    s->m_evict_low_water = apply_int_percentage(m_rm.get_evict_low_water_threshold(), s->m_size);
+
+    if ( s->m_waits_for_avail_pd && s->num_free() != 0 )
+      pthread_cond_broadcast(&s->m_avail_pd_cond);
+  }
+
+  m_shards[0]->m_spare_pages.swap(spare);
+
+  m_size = num_pages;
+  set_watermarks();
+}
+
+//
+// Applies the eviction thresholds and dirty ratio of the RegionManager to a
+// running Buffer
+//
+void Buffer::watermarks_changed( void )
+{
+  lock_all_shards();
+
+  for ( auto s : m_shards )
+    s->m_evict_low_water = apply_int_percentage(m_rm.get_evict_low_water_threshold(), s->m_size);
+  set_watermarks();
+
+  unlock_all_shards();
+
+  UMAP_LOG(Debug, "low water: " << m_evict_low_water << " high water: " << m_evict_high_water
+      << " dirty target: " << m_dirty_target << " pages");
+
+  if ( m_num_busy_pages >= m_evict_high_water )
+    kick_evict_manager();
+}
+
+void Buffer::set_watermarks( void )
+{
+  m_evict_low_water = apply_int_percentage(m_rm.get_evict_low_water_threshold(), m_size);
+  m_evict_high_water = apply_int_percentage(m_rm.get_evict_high_water_threshold(), m_size);
+  m_dirty_target = m_rm.get_dirty_ratio() ? apply_int_percentage(m_rm.get_dirty_ratio(), m_size) : 0;
+}
+
+BufferStats Buffer::get_stats( void ) const
+{
+  BufferStats stats;
+
+  for ( auto s : m_shards )
+    stats += s->m_stats.load();
+
+  return stats;
+}
+
+void BufferShard::lock()
 {
   int err;
   if ( (err = pthread_mutex_trylock(&m_mutex)) != 0 ) {
@@ -505,12 +1646,12 @@ void Buffer::lock()
   m_stats.lock++;
 }
 
-void Buffer::unlock()
+void BufferShard::unlock()
 {
   pthread_mutex_unlock(&m_mutex);
 }
 
-void Buffer::wait_for_page_state( PageDescriptor* pd, PageDescriptor::State st)
+void BufferShard::wait_for_page_state( PageDescriptor* pd, PageDescriptor::State st)
 {
   UMAP_LOG(Debug, "Waiting for state: " << st << ", " << pd);
 
@@ -524,84 +1665,137 @@ void Buffer::wait_for_page_state( PageDescriptor* pd, PageDescriptor::State st)
   }
 }
 
-void Buffer::monitor(void)
-{
-  const int monitor_interval = m_rm.get_monitor_freq();
-  UMAP_LOG(Info, "every " << monitor_interval << " seconds");
-
-  /* start the monitoring loop */
-  while( is_monitor_on ){
-
-    UMAP_LOG(Info, "m_size = " << m_size
-	     << ", num_busy_pages = " << m_busy_pages.size()
-	     << ", num_free_pages = " << m_free_pages.size()
-	     << ", events_processed = " << m_stats.events_processed );
-
-    sleep(monitor_interval);
-
-  }//End of loop
-
-}
-
-Buffer::Buffer( void )
-  :     m_rm(RegionManager::getInstance())
-      , m_size(m_rm.get_max_pages_in_buffer())
+BufferShard::BufferShard( ReplacementPolicy* policy )
+  :     m_size(0)
+      , m_num_owned(0)
+      , m_evict_low_water(0)
+      , m_fresh_pages(nullptr)
+      , m_num_fresh(0)
+      , m_policy(policy)
       , m_waits_for_avail_pd(0)
       , m_waits_for_state_change(0)
 {
-  m_array = (PageDescriptor *)calloc(m_size, sizeof(PageDescriptor));
-  if ( m_array == nullptr )
-    UMAP_ERROR("Failed to allocate " << m_size*sizeof(PageDescriptor)
-        << " bytes for buffer page descriptors");
-
-  for ( int i = 0; i < m_size; ++i )
-    m_free_pages.push_back(&m_array[i]);
-
   pthread_mutex_init(&m_mutex, NULL);
   pthread_cond_init(&m_avail_pd_cond, NULL);
   pthread_cond_init(&m_state_change_cond, NULL);
+}
 
-  m_evict_low_water = apply_int_percentage(m_rm.get_evict_low_water_threshold(), m_size);
-  m_evict_high_water = apply_int_percentage(m_rm.get_evict_high_water_threshold(), m_size);
+BufferShard::~BufferShard( void )
+{
+  assert("Pages are still present" && m_policy->size() == 0);
+  delete m_policy;
+  pthread_cond_destroy(&m_avail_pd_cond);
+  pthread_cond_destroy(&m_state_change_cond);
+  pthread_mutex_destroy(&m_mutex);
+}
 
-  /* monitor page stats periodically */
-  if( m_rm.get_monitor_freq()>0 ){
-    is_monitor_on = true;
-    int ret = pthread_create( &monitorThread, NULL, MonitorThreadEntryFunc, this);
-    if (ret) {
-      UMAP_ERROR("Failed to launch the monitor thread");
-    }
-  }else{
-    is_monitor_on = false;
+Buffer::Buffer( RegionManager& rm )
+  :     m_rm(rm)
+      , m_size(m_rm.get_max_pages_in_buffer())
+      , m_num_busy_pages(0)
+      , m_num_pinned_pages(0)
+      , m_num_dirty_pages(0)
+      , m_next_flush_shard(0)
+      , m_high_water_crossings(0)
+      , m_low_water_crossings(0)
+{
+  PageDescriptor* array = alloc_descriptors(m_size);
+
+  //
+  // Never create more shards than there are pages to put in them
+  //
+  uint64_t num_shards = m_rm.get_num_buffer_shards();
+  if ( num_shards > m_size )
+    num_shards = m_size;
+  if ( num_shards == 0 )
+    num_shards = 1;
+
+  //
+  // Pages are hashed to shards in extents as large as the largest fill and
+  // eviction jobs, so that runs of adjacent pages are mostly found in (and
+  // evicted from) a single shard.
+  //
+  m_hash_unit = m_rm.get_umap_page_size() * m_rm.get_max_fill_pages();
+
+  for ( uint64_t i = 0; i < num_shards; ++i ) {
+    uint64_t first = (i * m_size) / num_shards;
+    uint64_t last = ((i + 1) * m_size) / num_shards;
+    BufferShard* s = new BufferShard(
+        ReplacementPolicy::make_policy(m_rm.get_evict_policy(), last - first));
+
+    s->m_fresh_pages = &array[first];
+    s->m_num_fresh = last - first;
+    s->m_size = last - first;
+    s->m_num_owned = s->m_size;
+    s->m_evict_low_water = apply_int_percentage(m_rm.get_evict_low_water_threshold(), s->m_size);
+    m_shards.push_back(s);
   }
 
+  set_watermarks();
+
+  UMAP_LOG(Debug, "Buffer of " << m_size << " pages in " << m_shards.size() << " shards");
 }
 
 Buffer::~Buffer( void ) {
 #ifdef UMAP_DISPLAY_STATS
-  std::cout << m_stats << std::endl;
+  std::cout << get_stats() << std::endl;
 #endif
 
-  if( is_monitor_on ){
-    is_monitor_on = false;
-    pthread_join( monitorThread , NULL );
-  }
-  
-  assert("Pages are still present" && m_present_pages.size() == 0);
-  pthread_cond_destroy(&m_avail_pd_cond);
-  pthread_cond_destroy(&m_state_change_cond);
-  pthread_mutex_destroy(&m_mutex);
-  free(m_array);
+  for ( auto s : m_shards )
+    delete s;
+  m_shards.clear();
+
+  for ( auto array : m_arrays )
+    free(array);
+}
+
+BufferStats& BufferStats::operator+=(const BufferStats& rhs)
+{
+  lock_collision += rhs.lock_collision;
+  lock += rhs.lock;
+  pages_inserted += rhs.pages_inserted;
+  pages_deleted += rhs.pages_deleted;
+  not_avail += rhs.not_avail;
+  waits += rhs.waits;
+  events_processed += rhs.events_processed;
+  pages_prefetched += rhs.pages_prefetched;
+  spurious_faults += rhs.spurious_faults;
+  return *this;
+}
+
+BufferStats ShardStats::load( void ) const
+{
+  BufferStats stats;
+
+  stats.lock_collision = lock_collision.load();
+  stats.lock = lock.load();
+  stats.pages_inserted = pages_inserted.load();
+  stats.pages_deleted = pages_deleted.load();
+  stats.not_avail = not_avail.load();
+  stats.waits = waits.load();
+  stats.events_processed = events_processed.load();
+  stats.pages_prefetched = pages_prefetched.load();
+  stats.spurious_faults = spurious_faults.load();
+  return stats;
 }
 
 std::ostream& operator<<(std::ostream& os, const Umap::Buffer* b)
 {
   if ( b != nullptr ) {
+    uint64_t free = 0, busy = 0;
+    int waits_for_avail_pd = 0;
+
+    for ( auto s : b->m_shards ) {
+      free += s->num_free();
+      busy += s->m_policy->size();
+      waits_for_avail_pd += s->m_waits_for_avail_pd;
+    }
+
     os << "{ m_size: " << b->m_size
-      << ", m_waits_for_avail_pd: " << b->m_waits_for_avail_pd
-      << ", m_present_pages.size(): " << std::setw(2) << b->m_present_pages.size()
-      << ", m_free_pages.size(): " << std::setw(2) << b->m_free_pages.size()
-      << ", m_busy_pages.size(): " << std::setw(2) << b->m_busy_pages.size()
+      << ", shards: " << b->m_shards.size()
+      << ", m_waits_for_avail_pd: " << waits_for_avail_pd
+      << ", m_free_pages.size(): " << std::setw(2) << free
+      << ", busy pages: " << std::setw(2) << busy
       << " }"
       ;
   }
@@ -616,6 +1810,8 @@ std::ostream& operator<<(std::ostream& os, const Umap::BufferStats& stats)
   os << "Buffer Statisics:\n"
     << "   Pages Inserted: " << std::setw(12) << stats.pages_inserted<< "\n"
     << "    Pages Deleted: " << std::setw(12) << stats.pages_deleted<< "\n"
+    << " Pages Prefetched: " << std::setw(12) << stats.pages_prefetched<< "\n"
+    << "  Spurious faults: " << std::setw(12) << stats.spurious_faults<< "\n"
     << " Unavailable wait: " << std::setw(12) << stats.not_avail<< "\n"
     << "            Locks: " << std::setw(12) << stats.lock << "\n"
     << "  Lock collisions: " << std::setw(12) << stats.lock_collision << "\n"
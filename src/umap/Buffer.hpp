@@ -7,23 +7,31 @@
 #ifndef _UMAP_Buffer_HPP
 #define _UMAP_Buffer_HPP
 
+#include <atomic>
 #include <pthread.h>
-#include <unordered_map>
+#include <sys/types.h>            // pid_t
+#include <utility>
 #include <vector>
-#include <deque>
 
 #include "umap/RegionDescriptor.hpp"
 #include "umap/PageDescriptor.hpp"
+#include "umap/ReplacementPolicy.hpp"
 
 namespace Umap {
+  class Buffer;
+  class FillBatch;
+  class FlushFence;
   class RegionManager;
 
   struct BufferStats {
     BufferStats() :   lock_collision(0), lock(0), pages_inserted(0)
                     , pages_deleted(0), not_avail(0), waits(0)
-                    , events_processed(0)
+                    , events_processed(0), pages_prefetched(0)
+                    , spurious_faults(0)
     {};
 
+    BufferStats& operator+=(const BufferStats& rhs);
+
     uint64_t lock_collision;
     uint64_t lock;
     uint64_t pages_inserted;
@@ -31,6 +39,102 @@ namespace Umap {
     uint64_t not_avail;
     uint64_t waits;
     uint64_t events_processed;
+    uint64_t pages_prefetched;
+    uint64_t spurious_faults;   // Faults on pages already present
+  };
+
+  //
+  // A counter of a shard.  It is only bumped with the lock of the shard
+  // held, but is read without it by Buffer::get_stats() while the engine
+  // runs, so it is a relaxed atomic that is loaded and stored rather than
+  // incremented atomically.
+  //
+  class ShardCounter {
+    public:
+      ShardCounter() : m_value(0) {}
+
+      void operator++( void )  { m_value.store(load() + 1, std::memory_order_relaxed); }
+      void operator++( int )   { ++*this; }
+      uint64_t load( void ) const { return m_value.load(std::memory_order_relaxed); }
+
+    private:
+      std::atomic<uint64_t> m_value;
+  };
+
+  struct ShardStats {
+    ShardCounter lock_collision;
+    ShardCounter lock;
+    ShardCounter pages_inserted;
+    ShardCounter pages_deleted;
+    ShardCounter not_avail;
+    ShardCounter waits;
+    ShardCounter events_processed;
+    ShardCounter pages_prefetched;
+    ShardCounter spurious_faults;
+
+    BufferStats load( void ) const;
+  };
+
+  //
+  // A shard is an independent slice of the Buffer.  Pages are assigned to a
+  // shard by a hash of their address and each shard owns a fixed subset of
+  // the page descriptors.  The free and busy lists of a shard, as well as
+  // the region page table slots of its pages, are protected by the shard
+  // mutex so that faults, fills and evictions only contend with other
+  // operations on the same shard.
+  //
+  class BufferShard {
+    friend class Buffer;
+    friend std::ostream& operator<<(std::ostream& os, const Umap::Buffer* b);
+    public:
+      BufferShard( ReplacementPolicy* policy );
+      ~BufferShard( void );
+
+    private:
+      uint64_t m_size;          // Page descriptors this shard may hold
+      uint64_t m_num_owned;     // Page descriptors held by this shard
+      uint64_t m_evict_low_water;
+
+      //
+      // Descriptors that were never used are handed out from a contiguous
+      // range of the Buffer array, so that creating a Buffer does not touch
+      // each of them.  They are only on m_free_pages once released.
+      //
+      std::vector<PageDescriptor*> m_free_pages;
+      PageDescriptor* m_fresh_pages;
+      uint64_t m_num_fresh;
+      std::vector<PageDescriptor*> m_spare_pages;   // Given up by a shrink
+      ReplacementPolicy* m_policy;  // Pages that are present or in transition
+
+      pthread_mutex_t m_mutex;
+
+      int m_waits_for_avail_pd;
+      pthread_cond_t m_avail_pd_cond;
+
+      int m_waits_for_state_change;
+      pthread_cond_t m_state_change_cond;
+
+      ShardStats m_stats;
+
+      inline uint64_t num_free( void ) { return m_free_pages.size() + m_num_fresh; }
+
+      inline PageDescriptor* take_free_page( void ) {
+        PageDescriptor* pd;
+
+        if ( ! m_free_pages.empty() ) {
+          pd = m_free_pages.back();
+          m_free_pages.pop_back();
+        }
+        else {
+          pd = m_fresh_pages++;
+          --m_num_fresh;
+        }
+        return pd;
+      }
+
+      void lock();
+      void unlock();
+      void wait_for_page_state( PageDescriptor* pd, PageDescriptor::State st);
   };
 
   class Buffer {
@@ -41,57 +145,131 @@ namespace Umap {
       void mark_page_as_free( PageDescriptor* pd );
 
       bool low_threshold_reached( void );
+      bool regions_over_quota( void );
+      void kick_evict_manager( void );
 
-      void fetch_and_pin(char* paddr, uint64_t size);
+      //
+      // Changes the number of pages the Buffer may hold.  Growing adds free
+      // page descriptors to the shards.  Shrinking drops free descriptors
+      // and lets the eviction manager bring the busy pages down to the new
+      // size, the descriptors of evicted pages being kept aside until the
+      // Buffer grows again.
+      //
+      void resize( uint64_t num_pages );
+      void watermarks_changed( void );
+      uint64_t size( void ) { return m_size; }
+      uint64_t num_busy_pages( void ) { return m_num_busy_pages; }
 
       PageDescriptor* evict_oldest_page( void );
       std::vector<PageDescriptor*> evict_oldest_pages( void );
-      void process_page_event(char* paddr, bool iswrite, RegionDescriptor* rd);
+      //
+      // A page fault read by a fault handler, at the start of its umap page
+      //
+      struct FaultEvent {
+        char* paddr;
+        bool  iswrite;
+        pid_t thread;               // 0 if not known
+      };
+
+      void process_page_event(char* paddr, bool iswrite, RegionDescriptor* rd, FillBatch* batch = nullptr);
+      void process_fault_events(const FaultEvent* events, uint64_t num_events, uint64_t read_time, FillBatch* batch);
+      void read_ahead(char* paddr, RegionDescriptor* rd, FillBatch* batch);
       void evict_region(RegionDescriptor* rd);
-      void flush_dirty_pages();
-    
-      explicit Buffer( void );
+      void evict_range( RegionDescriptor* rd, uint64_t first, uint64_t end );
+      void flush_dirty_pages( FlushFence* fence );
+      void collect_written_pages( RegionDescriptor* rd, char* start, char* end );
+      void page_written( PageDescriptor* pd );
+      void keep_page( PageDescriptor* pd );
+      void prefetch_range( FlushFence* fence );
+      uint64_t snapshot_range( RegionDescriptor* rd, Store* target );
+      void hot_pages( RegionDescriptor* rd, std::vector<std::pair<uint64_t, uint64_t>>& extents );
+      void pin_range( RegionDescriptor* rd, uint64_t first, uint64_t end );
+      void unpin_range( RegionDescriptor* rd, uint64_t first, uint64_t end );
+      uint64_t num_unpinned_pages( RegionDescriptor* rd, uint64_t first, uint64_t end );
+      uint64_t num_pinned_pages( void ) { return m_num_pinned_pages; }
+      void flush_oldest_dirty_pages( uint64_t max_pages );
+
+      uint64_t num_dirty_pages( void ) { return m_num_dirty_pages; }
+      uint64_t dirty_target( void ) { return m_dirty_target; }
+      uint64_t high_water( void ) { return m_evict_high_water; }
+      uint64_t low_water( void ) { return m_evict_low_water; }
+
+      //
+      // Times the busy pages reached the high water mark, starting the evict
+      // manager, and times the evict manager got them back to low water
+      //
+      uint64_t high_water_crossings( void ) { return m_high_water_crossings; }
+      uint64_t low_water_crossings( void ) { return m_low_water_crossings; }
+      void low_water_reached( void ) { ++m_low_water_crossings; }
+      void pages_cleaned( uint64_t num_pages ) { m_num_dirty_pages -= num_pages; }
+
+      BufferStats get_stats( void ) const;
+
+      explicit Buffer( RegionManager& rm );
       ~Buffer( void );
 
     private:
       RegionManager& m_rm;
       uint64_t m_size;          // Maximum pages this buffer may have
-      PageDescriptor* m_array;
+      std::vector<void*> m_arrays;  // Page descriptors, one block per growth
 
-      std::unordered_map<char*, PageDescriptor*> m_present_pages;
-
-      std::vector<PageDescriptor*> m_free_pages;
-      std::deque<PageDescriptor*> m_busy_pages;
+      std::vector<BufferShard*> m_shards;
+      uint64_t m_hash_unit;     // Granularity used to hash pages to shards
 
+      //
+      // Global accounting of the pages that are currently busy (present or
+      // in transition) across all shards.  The watermarks apply to this sum.
+      //
+      std::atomic<uint64_t> m_num_busy_pages;
       uint64_t m_evict_low_water;   // % to evict too
       uint64_t m_evict_high_water;  // % to start evicting
 
-      pthread_mutex_t m_mutex;
+      std::atomic<uint64_t> m_num_pinned_pages;
+      std::atomic<uint64_t> m_num_dirty_pages;
+      uint64_t m_dirty_target;      // Kick the flusher above this, 0 if none
+      uint64_t m_next_flush_shard;
 
-      int m_waits_for_avail_pd;
-      pthread_cond_t m_avail_pd_cond;
+      std::atomic<uint64_t> m_high_water_crossings;
+      std::atomic<uint64_t> m_low_water_crossings;
 
-      int m_waits_for_state_change;
-      pthread_cond_t m_state_change_cond;
+      inline bool page_became_busy( void ) {
+        if ( ++m_num_busy_pages != m_evict_high_water )
+          return false;
+        ++m_high_water_crossings;
+        return true;
+      }
 
-      BufferStats m_stats;
-      bool is_monitor_on;
-      pthread_t monitorThread;
-      void monitor(void);
-      static void* MonitorThreadEntryFunc(void * obj){
-	      ((Buffer *) obj)->monitor();
-        return NULL;
+      inline BufferShard* shard_of( char* page_addr ) {
+        uint64_t h = ((uint64_t)page_addr / m_hash_unit) * 0x9E3779B97F4A7C15ULL;
+        return m_shards[ (h >> 32) % m_shards.size() ];
       }
 
-      void release_page_descriptor( PageDescriptor* pd );
+      BufferShard* select_eviction_shard( void );
+      void lock_all_shards( void );
+      void unlock_all_shards( void );
+      void resize_locked( uint64_t num_pages );
+      void set_watermarks( void );
+      void account_evictions( BufferShard* s, std::vector<PageDescriptor*>& pages );
+      void account_eviction( BufferShard* s, PageDescriptor* pd );
+      void page_dirtied( void );
+      void page_event( BufferShard* s, char* paddr, bool iswrite, RegionDescriptor* rd, FillBatch* batch );
+      void flush_dirty_range(   RegionDescriptor* rd, char* start, char* end
+                              , FlushFence* fence
+                              , std::vector<PageDescriptor*>& dirty_pages );
+      void drop_clean_pages( RegionDescriptor* rd, const std::vector<PageDescriptor*>& pages );
+      void release_region_pages( std::vector<std::pair<BufferShard*, PageDescriptor*>>& taken );
+      bool take_dirty_page( BufferShard* s, PageDescriptor* pd, FlushFence* fence );
+      void schedule_flushes( std::vector<PageDescriptor*>& pages, FlushFence* fence );
+      bool prefetch_page( char* paddr, RegionDescriptor* rd, FillBatch* batch );
+      PageDescriptor* alloc_descriptors( uint64_t count );
+      void send_fill( PageDescriptor* pd, FillBatch* batch, bool fault = false );
 
-      PageDescriptor* page_already_present( char* page_addr );
-      PageDescriptor* get_page_descriptor( char* page_addr, RegionDescriptor* rd );
-      uint64_t apply_int_percentage( int percentage, uint64_t item );
+      void release_page_descriptor( BufferShard* s, PageDescriptor* pd );
 
-      void lock();
-      void unlock();
-      void wait_for_page_state( PageDescriptor* pd, PageDescriptor::State st);
+      PageDescriptor* page_already_present( BufferShard* s, char* page_addr, RegionDescriptor* rd, FillBatch* batch );
+      PageDescriptor* get_page_descriptor( BufferShard* s, char* page_addr, RegionDescriptor* rd, FillBatch* batch );
+      void wait_for_free_page_descriptor( BufferShard* s, FillBatch* batch );
+      uint64_t apply_int_percentage( int percentage, uint64_t item );
   };
 
   std::ostream& operator<<(std::ostream& os, const Umap::BufferStats& stats);
@@ -0,0 +1,255 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include <algorithm>      // min(), max()
+#include <errno.h>
+#include <fstream>
+#include <limits>
+#include <time.h>
+
+#include "umap/Buffer.hpp"
+#include "umap/BufferController.hpp"
+#include "umap/RegionManager.hpp"
+#include "umap/util/Macros.hpp"
+
+namespace Umap {
+
+BufferController::BufferController( RegionManager& rm, Buffer* buffer, uint64_t interval_ms, uint64_t psi_threshold )
+  :   m_rm(rm), m_buffer(buffer)
+    , m_interval_ms(interval_ms), m_psi_threshold(psi_threshold)
+    , m_cgroup_dir(find_cgroup_dir(false)), m_memcg_v1_dir(find_cgroup_dir(true))
+    , m_running(true)
+{
+  pthread_mutex_init(&m_mutex, NULL);
+  pthread_cond_init(&m_cond, NULL);
+
+  UMAP_LOG(Info, "every " << m_interval_ms << " ms, cgroup: "
+      << (m_cgroup_dir.empty() ? "none" : m_cgroup_dir) << ", v1 memory cgroup: "
+      << (m_memcg_v1_dir.empty() ? "none" : m_memcg_v1_dir));
+
+  if ( pthread_create(&m_thread, NULL, ThreadEntryFunc, this) != 0 )
+    UMAP_ERROR("Failed to launch the buffer controller thread");
+
+  if ( pthread_setname_np(m_thread, "BufController") != 0 )
+    UMAP_ERROR("Failed to set thread name");
+}
+
+BufferController::~BufferController( void )
+{
+  pthread_mutex_lock(&m_mutex);
+  m_running = false;
+  pthread_cond_signal(&m_cond);
+  pthread_mutex_unlock(&m_mutex);
+
+  (void) pthread_join(m_thread, NULL);
+
+  pthread_mutex_destroy(&m_mutex);
+  pthread_cond_destroy(&m_cond);
+}
+
+void BufferController::run( void )
+{
+  m_rm.get_umap_placement().apply();
+
+  pthread_mutex_lock(&m_mutex);
+
+  while ( m_running ) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += m_interval_ms / 1000;
+    ts.tv_nsec += (m_interval_ms % 1000) * 1000000L;
+    if ( ts.tv_nsec >= 1000000000L ) {
+      ts.tv_sec += 1;
+      ts.tv_nsec -= 1000000000L;
+    }
+
+    if ( pthread_cond_timedwait(&m_cond, &m_mutex, &ts) != ETIMEDOUT )
+      continue;
+
+    pthread_mutex_unlock(&m_mutex);
+    adjust();
+    pthread_mutex_lock(&m_mutex);
+  }
+
+  pthread_mutex_unlock(&m_mutex);
+}
+
+void BufferController::adjust( void )
+{
+  //
+  // Never go below this fraction of the configured size, and grow back by
+  // this fraction of it at a time
+  //
+  const uint64_t MIN_FRACTION = 16;
+  const uint64_t GROW_FRACTION = 16;
+  const uint64_t SHRINK_FRACTION = 8;
+  const uint64_t MIN_CHANGE_FRACTION = 64;
+  const uint64_t LIMIT_PERCENT = 90;   // Of memory.max we may fill
+
+  uint64_t ceiling = m_rm.get_max_pages_in_buffer();
+  uint64_t floor = std::max(ceiling / MIN_FRACTION, (uint64_t)1);
+  uint64_t psize = m_rm.get_umap_page_size();
+  uint64_t current = m_buffer->size();
+  uint64_t target = ceiling;
+  uint64_t max_bytes, used_bytes;
+  double avg10;
+
+  if ( read_memory_limit(&max_bytes, &used_bytes) ) {
+    //
+    // The busy pages of the Buffer are part of what the cgroup uses
+    //
+    uint64_t ours = m_buffer->num_busy_pages() * psize;
+    uint64_t others = (used_bytes > ours) ? used_bytes - ours : 0;
+    uint64_t allowed = (max_bytes / 100) * LIMIT_PERCENT;
+
+    target = std::min(target, (allowed > others) ? (allowed - others) / psize : 0);
+  }
+
+  if ( read_pressure(&avg10) && avg10 >= (double)m_psi_threshold )
+    target = std::min(target, current - current / SHRINK_FRACTION);
+  else if ( target > current )
+    target = std::min(target, current + std::max(ceiling / GROW_FRACTION, (uint64_t)1));
+
+  target = std::max(target, floor);
+
+  //
+  // Leave the Buffer alone while the usage of the cgroup only wobbles
+  //
+  uint64_t change = (target > current) ? target - current : current - target;
+
+  if ( change != 0 && ( change >= ceiling / MIN_CHANGE_FRACTION || target == ceiling ) ) {
+    UMAP_LOG(Info, "resizing Buffer from " << current << " to " << target << " pages");
+    m_buffer->resize(target);
+  }
+}
+
+//
+// Returns false when the cgroup has no memory limit
+//
+bool BufferController::read_memory_limit( uint64_t* max_bytes, uint64_t* used_bytes )
+{
+  if ( ! m_cgroup_dir.empty() ) {
+    std::ifstream max_file(m_cgroup_dir + "/memory.max");
+    std::ifstream current_file(m_cgroup_dir + "/memory.current");
+
+    if ( (max_file >> *max_bytes) && (current_file >> *used_bytes) ) {
+      *used_bytes -= std::min(*used_bytes, read_stat(m_cgroup_dir, "inactive_file"));
+      return true;
+    }
+    // Otherwise "max" or no memory controller
+  }
+
+  //
+  // cgroup v1 reports no limit as a value close to the largest page
+  // aligned 64 bit integer
+  //
+  const uint64_t V1_UNLIMITED = 1ULL << 62;
+
+  if ( ! m_memcg_v1_dir.empty() ) {
+    std::ifstream max_file(m_memcg_v1_dir + "/memory.limit_in_bytes");
+    std::ifstream current_file(m_memcg_v1_dir + "/memory.usage_in_bytes");
+
+    if ( (max_file >> *max_bytes) && (current_file >> *used_bytes) ) {
+      *used_bytes -= std::min(*used_bytes, read_stat(m_memcg_v1_dir, "total_inactive_file"));
+      return *max_bytes < V1_UNLIMITED;
+    }
+  }
+
+  return false;
+}
+
+//
+// Page cache that has not been used lately is charged to the cgroup as well,
+// but the kernel reclaims it before it gets near the limit
+//
+uint64_t BufferController::read_stat( const std::string& dir, const char* key )
+{
+  std::ifstream file(dir + "/memory.stat");
+  std::string name;
+  uint64_t value;
+
+  while ( file >> name >> value ) {
+    if ( name == key )
+      return value;
+  }
+  return 0;
+}
+
+//
+// Stall information has lines like "some avg10=0.00 avg60=0.00 ..."; the
+// system wide figures are used when the cgroup has none
+//
+bool BufferController::read_pressure( double* avg10 )
+{
+  std::ifstream file;
+
+  if ( ! m_cgroup_dir.empty() )
+    file.open(m_cgroup_dir + "/memory.pressure");
+
+  if ( ! file.is_open() )
+    file.open("/proc/pressure/memory");
+
+  std::string kind, field;
+  while ( file >> kind >> field ) {
+    if ( kind == "some" && field.compare(0, 6, "avg10=") == 0 ) {
+      *avg10 = std::stod(field.substr(6));
+      return true;
+    }
+    file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+  }
+  return false;
+}
+
+//
+// The directory of our cgroup is the path of its /proc/self/cgroup entry,
+// "0::<path>" for cgroup v2 or "<id>:<controllers>:<path>" for cgroup v1,
+// below the mount point of its hierarchy.  An empty string is returned if
+// there is no such hierarchy.
+//
+std::string BufferController::find_cgroup_dir( bool v1_memory )
+{
+  std::ifstream mounts("/proc/self/mounts");
+  std::string device, mount_point, fs_type, options, mount_dir;
+
+  while ( mounts >> device >> mount_point >> fs_type >> options ) {
+    mounts.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+
+    if ( ! v1_memory && fs_type == "cgroup2" ) {
+      mount_dir = mount_point;
+      break;
+    }
+
+    if ( v1_memory && fs_type == "cgroup"
+        && ("," + options + ",").find(",memory,") != std::string::npos ) {
+      mount_dir = mount_point;
+      break;
+    }
+  }
+
+  if ( mount_dir.empty() )
+    return "";
+
+  std::ifstream file("/proc/self/cgroup");
+  std::string line;
+
+  while ( std::getline(file, line) ) {
+    std::string::size_type first = line.find(':');
+    std::string::size_type second = line.find(':', first + 1);
+
+    if ( first == std::string::npos || second == std::string::npos )
+      continue;
+
+    std::string controllers = line.substr(first + 1, second - first - 1);
+    bool match = v1_memory
+        ? ("," + controllers + ",").find(",memory,") != std::string::npos
+        : ( line.compare(0, first, "0") == 0 && controllers.empty() );
+
+    if ( match )
+      return mount_dir + line.substr(second + 1);
+  }
+  return "";
+}
+} // end of namespace Umap
@@ -0,0 +1,59 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_BufferController_HPP
+#define _UMAP_BufferController_HPP
+
+#include <cstdint>
+#include <pthread.h>
+#include <string>
+
+namespace Umap {
+  class Buffer;
+  class RegionManager;
+
+  //
+  // Background thread that resizes the Buffer to what the memory cgroup of
+  // the process can hold.  Every UMAP_BUFFER_CONTROLLER milliseconds the
+  // Buffer is shrunk to fit below memory.max (memory.limit_in_bytes with
+  // cgroup v1), and by a further eighth when
+  // the memory pressure stall information is over UMAP_BUFFER_PSI_THRESHOLD.
+  // Otherwise it grows back gradually, never above the size that was
+  // configured with UMAP_BUFSIZE or umap_set_buffer_pages().
+  //
+  class BufferController {
+    public:
+      BufferController( RegionManager& rm, Buffer* buffer, uint64_t interval_ms, uint64_t psi_threshold );
+      ~BufferController( void );
+
+    private:
+      RegionManager& m_rm;
+      Buffer* m_buffer;
+      uint64_t m_interval_ms;
+      uint64_t m_psi_threshold;   // % of time stalled (some avg10)
+      std::string m_cgroup_dir;   // Empty when not in a cgroup v2 hierarchy
+      std::string m_memcg_v1_dir; // Empty without a cgroup v1 memory controller
+
+      pthread_t m_thread;
+      pthread_mutex_t m_mutex;
+      pthread_cond_t m_cond;
+      bool m_running;
+
+      void run( void );
+      void adjust( void );
+      bool read_memory_limit( uint64_t* max_bytes, uint64_t* used_bytes );
+      bool read_pressure( double* avg10 );
+      static uint64_t read_stat( const std::string& dir, const char* key );
+      static std::string find_cgroup_dir( bool v1_memory );
+
+      static void* ThreadEntryFunc( void* This ) {
+        ((BufferController*)This)->run();
+        return NULL;
+      }
+  };
+} // end of namespace Umap
+
+#endif // _UMAP_BufferController_HPP
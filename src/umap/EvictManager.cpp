@@ -5,12 +5,15 @@
 // SPDX-License-Identifier: LGPL-2.1-only
 //////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>
+
 #include "umap/Buffer.hpp"
 #include "umap/EvictManager.hpp"
 #include "umap/EvictWorkers.hpp"
 #include "umap/RegionManager.hpp"
 #include "umap/Uffd.hpp"
 #include "umap/WorkerPool.hpp"
+#include "umap/util/Annotation.hpp"
 #include "umap/util/Macros.hpp"
 #include "umap/store/Store.hpp"
 
@@ -23,7 +26,9 @@ void EvictManager::EvictMgr( void ) {
     if ( w.type == Umap::WorkItem::WorkType::EXIT )
       break;    // Time to leave
 
-    while ( ! m_buffer->low_threshold_reached() ) {
+    bool over_low_water = ! m_buffer->low_threshold_reached();
+
+    while ( ! m_buffer->low_threshold_reached() || m_buffer->regions_over_quota() ) {
 #if 0
       WorkItem work;
       work.type = Umap::WorkItem::WorkType::EVICT;
@@ -36,18 +41,73 @@ void EvictManager::EvictMgr( void ) {
 
       m_evict_workers->send_work(work);
 #else
-      std::vector<PageDescriptor*> evicted_pages = m_buffer->evict_oldest_pages();
-      for(auto pd : evicted_pages){
-        WorkItem work;
-        work.type = Umap::WorkItem::WorkType::EVICT;
-        work.page_desc = pd;
-        assert( work.page_desc != nullptr );
-        m_evict_workers->send_work(work);
+      {
+        UMAP_ANNOTATE_SCOPE("umap.evict_manager.pass");
+        std::lock_guard<std::mutex> lock(m_pass_mutex);
+        std::vector<PageDescriptor*> evicted_pages = m_buffer->evict_oldest_pages();
+        schedule_runs(evicted_pages, Umap::WorkItem::WorkType::EVICT);
       }
+
+      //
+      // Regions only leave their quota once the evicted pages are freed, so
+      // wait for that when we are only here to enforce a quota.
+      //
+      if ( m_buffer->low_threshold_reached() )
+        m_evict_workers->wait_for_idle();
 #endif
     }
+
+    if ( over_low_water && m_buffer->low_threshold_reached() )
+      m_buffer->low_water_reached();
+  }
+}
+//
+// Sorts the pages by address, which orders them by region and by offset
+// within the region, and sends each run of adjacent pages that are all
+// dirty (or all clean) to the evict workers as one job of the given type.
+// The pages of a job are linked through their evict_next field so that the
+// job can be written back with one store write and one write protect ioctl.
+// The jobs are spread over the queues of the evict workers.
+//
+void EvictManager::schedule_runs( std::vector<PageDescriptor*>& pages, WorkItem::WorkType type )
+{
+  std::sort(pages.begin(), pages.end(),
+      [](const PageDescriptor* a, const PageDescriptor* b) { return a->page < b->page; });
+
+  PageDescriptor* head = nullptr;
+  PageDescriptor* tail = nullptr;
+  uint64_t count = 0;
+
+  for ( auto pd : pages ) {
+    assert( pd != nullptr );
+    pd->evict_next = nullptr;
+
+    if ( head != nullptr && count < m_max_evict_pages
+        && pd->region == tail->region
+        && count < pd->region->max_run_pages()
+        && pd->page == tail->page + pd->region->page_size()
+        && pd->dirty == head->dirty ) {
+      tail->evict_next = pd;
+      tail = pd;
+      ++count;
+      continue;
+    }
+
+    if ( head != nullptr ) {
+      WorkItem work = { .page_desc = head, .type = type };
+      m_evict_workers->send_work(work, 0, m_evict_workers->next_queue());
+    }
+
+    head = tail = pd;
+    count = 1;
+  }
+
+  if ( head != nullptr ) {
+    WorkItem work = { .page_desc = head, .type = type };
+    m_evict_workers->send_work(work, 0, m_evict_workers->next_queue());
   }
 }
+
 void EvictManager::WaitAll( void )
 {
   UMAP_LOG(Debug, "Entered");
@@ -55,47 +115,62 @@ void EvictManager::WaitAll( void )
   UMAP_LOG(Debug, "Done");
 }
   
+//
+// Dirty pages are gathered in batches so that adjacent ones are written
+// back and write protected as runs
+//
 void EvictManager::EvictAll( void )
 {
+  const std::size_t max_batch = 1024;
+  std::vector<PageDescriptor*> dirty_pages;
+  UMAP_ANNOTATE_SCOPE("umap.evict_manager.evict_all");
+  std::lock_guard<std::mutex> lock(m_pass_mutex);
+
   UMAP_LOG(Debug, "Entered");
 
   for (auto pd = m_buffer->evict_oldest_page(); pd != nullptr; pd = m_buffer->evict_oldest_page()) {
     UMAP_LOG(Debug, "evicting: " << pd);
     if (pd->dirty) {
-      WorkItem work = { .page_desc = pd, .type = Umap::WorkItem::WorkType::FAST_EVICT };
-      m_evict_workers->send_work(work);
+      dirty_pages.push_back(pd);
+
+      if ( dirty_pages.size() == max_batch ) {
+        schedule_runs(dirty_pages, Umap::WorkItem::WorkType::FAST_EVICT);
+        dirty_pages.clear();
+      }
     }
     else {
       m_buffer->mark_page_as_free(pd);
     }
   }
 
+  schedule_runs(dirty_pages, Umap::WorkItem::WorkType::FAST_EVICT);
+
   m_evict_workers->wait_for_idle();
 
   UMAP_LOG(Debug, "Done");
 }
 
-void EvictManager::schedule_eviction(PageDescriptor* pd)
+EvictManager::EvictManager( RegionManager& rm ) :
+        WorkerPool("Evict Manager", 1)
+      , m_rm(rm)
+      , m_buffer(rm.get_buffer_h())
+      , m_max_evict_pages(rm.get_max_fill_pages())
 {
-  WorkItem work = { .page_desc = pd, .type = Umap::WorkItem::WorkType::EVICT };
-
-  m_evict_workers->send_work(work);
+  m_evict_workers = new EvictWorkers(m_rm, m_rm.get_num_evictors(), m_buffer, m_rm.get_uffd_h());
+  set_placement(m_rm.get_evictor_placement());
+  start_thread_pool();
 }
 
-void EvictManager::schedule_flush(PageDescriptor* pd)
-{
-  WorkItem work = { .page_desc = pd, .type = Umap::WorkItem::WorkType::FLUSH };
+uint64_t EvictManager::num_evict_workers( void ) {
+  return m_evict_workers->num_threads();
+}
 
-  m_evict_workers->send_work(work);
+uint64_t EvictManager::num_queued_runs( void ) {
+  return m_evict_workers->wq_size();
 }
 
-EvictManager::EvictManager( void ) :
-        WorkerPool("Evict Manager", 1)
-      , m_buffer(RegionManager::getInstance().get_buffer_h())
-{
-  m_evict_workers = new EvictWorkers(  RegionManager::getInstance().get_num_evictors()
-                                     , m_buffer, RegionManager::getInstance().get_uffd_h());
-  start_thread_pool();
+void EvictManager::set_max_evict_workers( uint64_t num_workers ) {
+  m_evict_workers->set_max_threads(num_workers, m_rm.get_worker_idle_timeout());
 }
 
 EvictManager::~EvictManager( void ) {
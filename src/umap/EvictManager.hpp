@@ -7,6 +7,9 @@
 #ifndef _UMAP_EvictManager_HPP
 #define _UMAP_EvictManager_HPP
 
+#include <mutex>
+#include <vector>
+
 #include "umap/EvictWorkers.hpp"
 
 #include "umap/Buffer.hpp"
@@ -16,19 +19,31 @@
 
 namespace Umap {
   class EvictWorkers;
+  class RegionManager;
 
   class EvictManager : public WorkerPool {
     public:
-      EvictManager( void );
+      EvictManager( RegionManager& rm );
       ~EvictManager( void );
-      void schedule_eviction(PageDescriptor* pd);
-      void schedule_flush(PageDescriptor* pd);
+      void schedule_runs(std::vector<PageDescriptor*>& pages, WorkItem::WorkType type);
       void EvictAll( void );
       void WaitAll( void );
+      uint64_t num_evict_workers( void );
+      uint64_t num_queued_runs( void );
+      void set_max_evict_workers( uint64_t num_workers );
 
     private:
+      RegionManager& m_rm;
       Buffer* m_buffer;
       EvictWorkers* m_evict_workers;
+      uint64_t m_max_evict_pages;
+
+      //
+      // Held by the manager from taking its victims until they have been
+      // sent to the workers, so that EvictAll() does not miss pages that
+      // are no longer in the Buffer but not yet queued for eviction
+      //
+      std::mutex m_pass_mutex;
 
       void EvictMgr(void);
       void ThreadEntry( void );
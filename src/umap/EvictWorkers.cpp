@@ -4,62 +4,452 @@
 //
 // SPDX-License-Identifier: LGPL-2.1-only
 //////////////////////////////////////////////////////////////////////////////
+#include <algorithm>
+#include <mutex>
 #include <errno.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <utility>
+#include <vector>
 
 #include "umap/Buffer.hpp"
 #include "umap/EvictWorkers.hpp"
+#include "umap/Flusher.hpp"
+#include "umap/IoUring.hpp"
 #include "umap/RegionManager.hpp"
 #include "umap/Uffd.hpp"
 #include "umap/WorkerPool.hpp"
+#include "umap/util/Annotation.hpp"
 #include "umap/util/Macros.hpp"
+#include "umap/util/Trace.hpp"
 
 namespace Umap {
 void EvictWorkers::EvictWorker( void )
 {
-  uint64_t page_size = RegionManager::getInstance().get_umap_page_size();
+  IoUring* ring = nullptr;
 
-  while ( 1 ) {
-    auto w = get_work();
+  if ( m_rm.get_io_engine() == "io_uring" )
+    ring = IoUring::create(m_io_depth);
 
-    UMAP_LOG(Debug, " " << w << " " << m_buffer);
+  std::vector<EvictJob> jobs(m_io_depth);
+  StoreCompletionQueue completions;
+  Staging staging = { nullptr, std::vector<char>(), 0 };
 
-    if ( w.type == Umap::WorkItem::WorkType::EXIT )
-      break;    // Time to leave
+  for ( uint64_t i = 0; i < jobs.size(); ++i ) {
+    jobs[i].pages.resize(m_max_evict_pages);
+    jobs[i].staging = &staging;
+    completions.init(jobs[i].request, i);
+  }
+
+  EvictLoop(ring, completions, jobs);
+  delete ring;
+
+  if ( staging.pages != nullptr )
+    munmap(staging.pages, staging.size);
+}
+
+//
+// Like the fill workers, keeps up to m_io_depth writes of dirty pages in
+// flight, with io_uring (when ring is not nullptr) on the files of the
+// stores that expose them, or with the stores that take asynchronous
+// requests, and only blocks for more work when none are.  The other runs
+// of dirty pages already queued are written back together with a batch
+// request to their store.  Clean pages are evicted right away.
+//
+void EvictWorkers::EvictLoop( IoUring* ring, StoreCompletionQueue& completions, std::vector<EvictJob>& jobs )
+{
+  std::vector<uint64_t> free_jobs;
+  std::vector<uint64_t> batch;
+  uint64_t ring_in_flight = 0;
+  uint64_t store_in_flight = 0;
+  bool exiting = false;
+
+  for ( uint64_t i = jobs.size(); i > 0; --i )
+    free_jobs.push_back(i - 1);
+
+  while ( ! exiting || ring_in_flight + store_in_flight != 0 ) {
+    batch.clear();
+
+    while ( ! exiting && ! free_jobs.empty() ) {
+      WorkItem w;
+
+      if ( ring_in_flight + store_in_flight == 0 && batch.empty() )
+        w = get_work();
+      else if ( ! try_get_work(w) )
+        break;
+
+      UMAP_LOG(Debug, " " << w << " " << m_buffer);
+
+      if ( w.type == Umap::WorkItem::WorkType::EXIT ) {
+        exiting = true;   // Leave once the writes in flight are done
+        break;
+      }
+
+      uint64_t j = free_jobs.back();
+      EvictJob& job = jobs[j];
+
+      start_job(w, job);
+
+      if ( ! job.pages[0]->dirty ) {
+        finish_job(job);
+        continue;
+      }
+
+      PageDescriptor* pd = job.pages[0];
+      Store* store = pd->region->store();
+      off_t offset = pd->region->store_offset(pd->page);
+      int fd;
+      off_t file_offset;
+
+      free_jobs.pop_back();
+      m_uffd->enable_write_protect(pd->page, job.nb);
+
+      if ( store->write_async(pd->page, job.nb, offset, &job.request) )
+        ++store_in_flight;
+      else if ( ring != nullptr
+          && store->get_file_range(offset, job.nb, &fd, &file_offset)
+          && ring->prep_write(fd, pd->page, job.nb, file_offset, j) )
+        ++ring_in_flight;
+      else
+        batch.push_back(j);
+    }
+
+    write_jobs(jobs, batch);
+
+    for ( auto j : batch ) {
+      finish_job(jobs[j]);
+      free_jobs.push_back(j);
+    }
+
+    if ( ring_in_flight + store_in_flight == 0 )
+      continue;
+
+    bool reaped = false;
+    uint64_t j;
+
+    if ( ring_in_flight != 0 ) {
+      int res;
+
+      ring->submit(store_in_flight == 0 ? 1 : 0);
+
+      while ( ring->next_completion(&j, &res) ) {
+        EvictJob& job = jobs[j];
+
+        if ( res < 0 ) {
+          UMAP_LOG(Warning, "asynchronous write of " << job.pages[0] << " failed: "
+              << strerror(-res) << ", retrying synchronously");
+          res = 0;
+        }
+
+        write_pages(job, res);
+        finish_job(job);
+        free_jobs.push_back(j);
+        --ring_in_flight;
+        reaped = true;
+      }
+    }
+
+    //
+    // With writes in flight on both, the completions of the stores are
+    // polled every millisecond
+    //
+    long wait_ms = (reaped || store_in_flight == 0) ? 0 : (ring_in_flight == 0 ? -1 : 1);
+    ssize_t done;
+
+    while ( store_in_flight != 0 && completions.next_completion(&j, &done, wait_ms) ) {
+      EvictJob& job = jobs[j];
+
+      if ( done < 0 ) {
+        UMAP_LOG(Warning, "asynchronous store write of " << job.pages[0]
+            << " failed, retrying synchronously");
+        done = 0;
+      }
+
+      write_pages(job, done);
+      finish_job(job);
+      free_jobs.push_back(j);
+      --store_in_flight;
+      wait_ms = 0;
+    }
+  }
+}
+
+//
+// Writes back the jobs of a batch, which are write protected already, with
+// one write_batch() per store.  What a store did not write in full is
+// finished by write_pages().
+//
+static inline uint64_t batch_bytes( const std::vector<StoreIo>& ios )
+{
+  uint64_t nb = 0;
+
+  for ( auto& io : ios )
+    nb += io.nb;
+  return nb;
+}
+
+void EvictWorkers::write_jobs( std::vector<EvictJob>& jobs, const std::vector<uint64_t>& batch )
+{
+  std::vector<StoreIo> ios;
+  std::vector<uint64_t> same_store;
+
+  for ( auto j : batch )
+    jobs[j].done = false;
+
+  for ( auto i : batch ) {
+    if ( jobs[i].done )
+      continue;
+
+    Store* store = jobs[i].pages[0]->region->store();
+
+    ios.clear();
+    same_store.clear();
+    for ( auto k : batch ) {
+      PageDescriptor* pd = jobs[k].pages[0];
+
+      if ( jobs[k].done || pd->region->store() != store )
+        continue;
+
+      ios.push_back({pd->page, jobs[k].nb, (off_t)pd->region->store_offset(pd->page), 0});
+      same_store.push_back(k);
+      jobs[k].done = true;
+    }
+
+    {
+      UMAP_ANNOTATE_IO_SCOPE("umap.evict.write", batch_bytes(ios), store);
+
+      if ( store->write_batch(ios.data(), ios.size()) == -1 )
+        UMAP_ERROR("write_batch failed: " << errno << " (" << strerror(errno) << ")");
+    }
+
+    for ( uint64_t b = 0; b < same_store.size(); ++b ) {
+      if ( ios[b].done <= 0 )
+        UMAP_ERROR("write_to_store wrote nothing at offset " << ios[b].off);
+
+      write_pages(jobs[same_store[b]], ios[b].done);
+    }
+  }
+}
+
+//
+// The run must be collected before any of its pages is marked free, after
+// which its descriptor may be reused.
+//
+void EvictWorkers::start_job( const WorkItem& w, EvictJob& job )
+{
+  job.work = w;
+  job.num_pages = 0;
 
-    auto pd = w.page_desc;
+  for ( auto pd = w.page_desc; pd != nullptr; pd = pd->evict_next )
+    job.pages[job.num_pages++] = pd;
 
-    if ( pd->dirty ) {
-      auto store = pd->region->store();
-      auto offset = pd->region->store_offset(pd->page);
+  job.nb = job.num_pages * w.page_desc->region->page_size();
+  job.start_time = m_rm.latency_clock();
+}
 
-      m_uffd->enable_write_protect(pd->page);
+//
+// Write what remains after the first done bytes of a run of dirty pages,
+// which are to be write protected unless they already are, to the store.
+// The whole run is written with one request unless the store writes less
+// than was asked for, e.g. at the end of a file of a SparseStore.
+//
+void EvictWorkers::write_pages( EvictJob& job, std::size_t done )
+{
+  PageDescriptor* pd = job.pages[0];
 
-      if (store->write_to_store(pd->page, page_size, offset) == -1)
+  if ( done == 0 )
+    m_uffd->enable_write_protect(pd->page, job.nb);
+
+  store_pages(job, pd->page, done);
+}
+
+//
+// Writes what remains after the first done bytes of the run, whose
+// contents are at data, to the store, and marks its pages clean
+//
+void EvictWorkers::store_pages( EvictJob& job, char* data, std::size_t done )
+{
+  PageDescriptor* pd = job.pages[0];
+  auto store = pd->region->store();
+  auto offset = pd->region->store_offset(pd->page);
+
+  if ( done < job.nb ) {
+    UMAP_ANNOTATE_IO_SCOPE("umap.evict.write", job.nb - done, store);
+
+    while ( done < job.nb ) {
+      ssize_t written = store->write_to_store(data + done, job.nb - done, offset + done);
+
+      if (written == -1)
         UMAP_ERROR("write_to_store failed: "
             << errno << " (" << strerror(errno) << ")");
 
-      pd->dirty = false;
+      if (written == 0)
+        UMAP_ERROR("write_to_store wrote nothing at offset " << offset + done);
+
+      done += written;
     }
+  }
 
-    if (w.type == Umap::WorkItem::WorkType::FLUSH)
-      continue;
-    
-    if (w.type != Umap::WorkItem::WorkType::FAST_EVICT) {
-      if (madvise(pd->page, page_size, MADV_DONTNEED) == -1)
-        UMAP_ERROR("madvise failed: " << errno << " (" << strerror(errno) << ")");
+  pd->region->count_written(job.nb, job.num_pages);
+  Trace::record(TraceFormat::WRITEBACK, pd->page, pd->region->start(), job.start_time, job.num_pages);
+
+  for ( uint64_t i = 0; i < job.num_pages; ++i ) {
+    job.pages[i]->dirty = false;
+    job.pages[i]->region->clear_dirty(job.pages[i]->page);
+  }
+
+  m_buffer->pages_cleaned(job.num_pages);
+}
+
+void EvictWorkers::finish_job( EvictJob& job )
+{
+  auto& w = job.work;
+
+  if (w.type == Umap::WorkItem::WorkType::FLUSH) {
+    for ( uint64_t i = 0; i < job.num_pages; ++i ) {
+      FlushFence* fence = job.pages[i]->flush_fence;
+
+      job.pages[i]->flush_fence = nullptr;
+      m_buffer->mark_page_as_present(job.pages[i]);
+
+      if ( fence != nullptr )
+        fence->page_done();
     }
+    return;
+  }
+
+  if (w.type != Umap::WorkItem::WorkType::FAST_EVICT) {
+    PageDescriptor* pd = job.pages[0];
+    char* data = pd->page;
+
+    if ( m_uffd->wp_async() && ! pd->region->read_only() )
+      data = move_out_pages(job);
+
+    if ( job.num_pages == 0 )
+      return;
 
-    UMAP_LOG(Debug, "Removing page: " << w.page_desc);
-    m_buffer->mark_page_as_free(w.page_desc);
+    pd->region->store()->page_evicted(data, job.nb, pd->region->store_offset(pd->page));
+
+    //
+    // The pages of a shared region are removed from its shared memory, and
+    // so from the other processes as well, which fill them again if need be
+    //
+    int advice = pd->region->shared() ? MADV_REMOVE : MADV_DONTNEED;
+    UMAP_ANNOTATE_SCOPE("umap.evict.drop");
+
+    if (madvise(data, job.nb, advice) == -1)
+      UMAP_ERROR("madvise failed: " << errno << " (" << strerror(errno) << ")");
   }
+
+  Trace::record(TraceFormat::EVICT, job.pages[0]->page, job.pages[0]->region->start(), 0, job.num_pages);
+
+  for ( uint64_t i = 0; i < job.num_pages; ++i ) {
+    UMAP_LOG(Debug, "Removing page: " << job.pages[i]);
+    m_buffer->mark_page_as_free(job.pages[i]);
+  }
+}
+
+//
+// With UMAP_WP_ASYNC, the pages of a run may have been written without a
+// fault since they were write protected, by the application or while the
+// run was written back, and may be written until they leave the region.
+// The run is therefore moved out of the region, to the staging pages of
+// the worker, after which a write to it faults and waits for it to be
+// gone.  The page tables tell about the writes until they are scanned, and
+// a write between the scan and the move shows as a difference from the
+// copy of the run taken before the scan.  A run found written either way
+// is written back from the staging pages, which are returned.
+//
+// The pages the kernel would not move, e.g. those shared with a forked
+// child, are given back to the buffer, dirty if they were found written,
+// and the run is cut short before them.
+//
+char* EvictWorkers::move_out_pages( EvictJob& job )
+{
+  RegionDescriptor* rd = job.pages[0]->region;
+  char* page = job.pages[0]->page;
+  char* data = staging_pages(*job.staging, job.nb);
+  char* copy = job.staging->copy.data();
+  std::vector<std::pair<char*, char*>> ranges;
+  uint64_t moved;
+
+  memcpy(copy, page, job.nb);
+
+  {
+    std::lock_guard<std::mutex> lock(rd->scan_mutex());
+
+    m_uffd->collect_written(page, page + job.nb, ranges);
+    moved = m_uffd->move_out_pages(page, data, job.nb);
+  }
+
+  bool written = false;
+
+  for ( auto& r : ranges ) {
+    for ( char* p = r.first; p < r.second; p += rd->page_size() )
+      m_buffer->page_written(job.pages[(p - page) / rd->page_size()]);
+    written = written || r.first < page + moved;
+  }
+
+  uint64_t num_moved = moved / rd->page_size();
+
+  if ( num_moved < job.num_pages ) {
+    UMAP_LOG(Debug, "keeping " << job.num_pages - num_moved << " pages of "
+        << job.pages[0] << " that could not be moved out");
+
+    for ( uint64_t i = num_moved; i < job.num_pages; ++i )
+      m_buffer->keep_page(job.pages[i]);
+
+    job.num_pages = num_moved;
+    job.nb = moved;
+  }
+
+  if ( job.num_pages != 0 && (written || memcmp(data, copy, job.nb) != 0) ) {
+    for ( uint64_t i = 0; i < job.num_pages; ++i )
+      m_buffer->page_written(job.pages[i]);
+
+    store_pages(job, data, 0);
+  }
+
+  return data;
+}
+
+//
+// The staging pages of a worker hold the largest run it may drop, of pages
+// of the default size or of the largest run it has dropped so far
+//
+char* EvictWorkers::staging_pages( Staging& staging, std::size_t nb )
+{
+  if ( staging.size >= nb )
+    return staging.pages;
+
+  if ( staging.pages != nullptr )
+    munmap(staging.pages, staging.size);
+
+  nb = std::max(nb, m_max_evict_pages * m_rm.get_umap_page_size());
+
+  staging.pages = (char*)mmap(nullptr, nb, PROT_READ | PROT_WRITE
+                            , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if ( staging.pages == MAP_FAILED )
+    UMAP_ERROR("mmap of " << nb << " staging bytes failed: " << strerror(errno));
+
+  staging.size = nb;
+  staging.copy.resize(nb);
+  madvise(staging.pages, nb, MADV_NOHUGEPAGE);
+  m_uffd->register_staging(staging.pages, nb);
+
+  return staging.pages;
 }
 
-EvictWorkers::EvictWorkers(uint64_t num_evictors, Buffer* buffer, Uffd* uffd)
-  :   WorkerPool("Evict Workers", num_evictors), m_buffer(buffer)
+EvictWorkers::EvictWorkers(RegionManager& rm, uint64_t num_evictors, Buffer* buffer, Uffd* uffd)
+  :   WorkerPool("Evict Workers", std::max(num_evictors, rm.get_num_work_queues())
+                , rm.get_ring_work_queue_size(), 1, rm.get_num_work_queues())
+    , m_rm(rm), m_buffer(buffer)
     , m_uffd(uffd)
+    , m_max_evict_pages(rm.get_max_fill_pages())
+    , m_io_depth(rm.get_io_depth())
 {
+  set_elastic(m_rm.get_min_evictors(), m_rm.get_worker_idle_timeout());
+  set_placement(m_rm.get_evictor_placement());
   start_thread_pool();
 }
 
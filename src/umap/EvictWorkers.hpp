@@ -9,23 +9,64 @@
 
 #include "umap/config.h"
 
+#include <vector>
+
 #include "umap/Buffer.hpp"
 #include "umap/PageDescriptor.hpp"
+#include "umap/StoreCompletionQueue.hpp"
 #include "umap/Uffd.hpp"
 #include "umap/WorkerPool.hpp"
+#include "umap/store/Store.hpp"
 
 namespace Umap {
+  class IoUring;
+  class RegionManager;
   class Uffd;
   class EvictWorkers : public WorkerPool {
     public:
-      EvictWorkers(uint64_t num_evictors, Buffer* buffer, Uffd* uffd);
+      EvictWorkers(RegionManager& rm, uint64_t num_evictors, Buffer* buffer, Uffd* uffd);
       ~EvictWorkers( void );
 
     private:
+      //
+      // With UMAP_WP_ASYNC, where a worker moves the runs it drops out of
+      // their region to, and the copy of a run taken before its last scan
+      //
+      struct Staging {
+        char* pages;
+        std::vector<char> copy;
+        std::size_t size;
+      };
+
+      //
+      // A run of pages being evicted (or flushed) together
+      //
+      struct EvictJob {
+        WorkItem work;
+        std::vector<PageDescriptor*> pages;
+        uint64_t num_pages;
+        std::size_t nb;
+        bool done;                // Handed to the store by write_jobs()
+        uint64_t start_time;      // Taken by a worker, when tracing
+        StoreCompletionQueue::Request request;
+        Staging* staging;         // Of the worker
+      };
+
+      RegionManager& m_rm;
       Buffer* m_buffer;
       Uffd* m_uffd;
+      uint64_t m_max_evict_pages;
+      uint64_t m_io_depth;
 
       void EvictWorker( void );
+      void EvictLoop( IoUring* ring, StoreCompletionQueue& completions, std::vector<EvictJob>& jobs );
+      void start_job( const WorkItem& w, EvictJob& job );
+      void write_jobs( std::vector<EvictJob>& jobs, const std::vector<uint64_t>& batch );
+      void write_pages( EvictJob& job, std::size_t done );
+      void store_pages( EvictJob& job, char* data, std::size_t done );
+      void finish_job( EvictJob& job );
+      char* move_out_pages( EvictJob& job );
+      char* staging_pages( Staging& staging, std::size_t nb );
       void ThreadEntry( void );
   };
 } // end of namespace Umap
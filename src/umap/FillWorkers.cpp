@@ -6,80 +6,609 @@
 //////////////////////////////////////////////////////////////////////////////
 #include "umap/config.h"
 
+#include <algorithm>            // min(), max()
 #include <cstdint>              // calloc
+#include <climits>              // INT_MAX
 #include <errno.h>
+#include <linux/futex.h>        // FUTEX_WAIT
+#include <signal.h>             // kill()
 #include <string.h>             // strerror()
+#include <sys/mman.h>           // mmap(), madvise()
+#include <sys/syscall.h>        // SYS_futex
+#include <time.h>
 #include <unistd.h>
+#include <vector>
 
 #include "umap/Buffer.hpp"
 #include "umap/FillWorkers.hpp"
+#include "umap/IoUring.hpp"
+#include "umap/Numa.hpp"
 #include "umap/RegionManager.hpp"
 #include "umap/Uffd.hpp"
 #include "umap/WorkerPool.hpp"
 #include "umap/store/Store.hpp"
+#include "umap/util/Annotation.hpp"
 #include "umap/util/Macros.hpp"
+#include "umap/util/Trace.hpp"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
 
 namespace Umap {
   void FillWorkers::FillWorker( void ) {
-    char* copyin_buf;
-    uint64_t page_size = RegionManager::getInstance().get_umap_page_size();
-    std::size_t sz = page_size;
+    IoUring* ring = nullptr;
+    Numa* numa = m_rm.get_numa_h();
 
-    if (posix_memalign((void**)&copyin_buf, page_size, sz)) {
-      UMAP_ERROR("posix_memalign failed to allocated "
-          << sz << " bytes of memory");
-    }
+    //
+    // Each group of workers fills the pages of one node
+    //
+    if ( numa != nullptr )
+      numa->bind_thread(thread_domain());
 
-    if (copyin_buf == nullptr) {
-      UMAP_ERROR("posix_memalign failed to allocated "
-          << sz << " bytes of memory");
+    if ( m_rm.get_io_engine() == "io_uring" )
+      ring = IoUring::create(m_io_depth);
+
+    //
+    // Only the first job is used unless requests are in flight, so the
+    // buffers of the others are allocated when first needed
+    //
+    std::vector<FillJob> jobs(m_io_depth);
+    StoreCompletionQueue completions;
+
+    for ( uint64_t i = 0; i < jobs.size(); ++i ) {
+      jobs[i].buf = nullptr;
+      jobs[i].buf_size = 0;
+      jobs[i].pages.resize(m_max_fill_pages);
+      completions.init(jobs[i].request, i);
     }
+    alloc_buffer(jobs[0], m_page_size * m_max_fill_pages);
+
+    FillLoop(ring, completions, jobs);
+    delete ring;
+
+    for ( auto& job : jobs )
+      free_buffer(job);
+  }
+
+  //
+  // Keeps up to m_io_depth reads in flight, either with io_uring (when ring
+  // is not nullptr) on the files of the stores that expose them, or with the
+  // stores that take asynchronous requests.  Other reads are made right
+  // away.  The worker only blocks for more work when it has nothing in
+  // flight; otherwise it takes whatever work is queued, submits it together
+  // with the reads already prepared, and waits for a completion.
+  //
+  void FillWorkers::FillLoop( IoUring* ring, StoreCompletionQueue& completions, std::vector<FillJob>& jobs ) {
+    std::vector<uint64_t> free_jobs;
+    uint64_t ring_in_flight = 0;
+    uint64_t store_in_flight = 0;
+    bool exiting = false;
 
-    while ( 1 ) {
-      auto w = get_work();
+    for ( uint64_t i = jobs.size(); i > 0; --i )
+      free_jobs.push_back(i - 1);
+
+    while ( ! exiting || ring_in_flight + store_in_flight != 0 ) {
+      while ( ! exiting && ! free_jobs.empty() ) {
+        WorkItem w;
+
+        if ( ring_in_flight + store_in_flight == 0 )
+          w = get_work();
+        else if ( ! try_get_work(w) )
+          break;
+
+        UMAP_LOG(Debug, ": " << w << " " << m_buffer);
+
+        if (w.type == Umap::WorkItem::WorkType::EXIT) {
+          exiting = true;   // Leave once the reads in flight are done
+          break;
+        }
+
+        uint64_t j = free_jobs.back();
+        FillJob& job = jobs[j];
+
+        if ( ! start_job(w, job) )
+          continue;
+
+        if ( fill_zero_pages(job) || ! claim_shared_pages(job) ) {
+          finish_job(job);
+          continue;
+        }
 
-      UMAP_LOG(Debug, ": " << w << " " << m_buffer);
+        RegionDescriptor* rd = job.pages[0]->region;
+        off_t offset = rd->store_offset(job.pages[0]->page);
+        int fd;
+        off_t file_offset;
 
-      if (w.type == Umap::WorkItem::WorkType::EXIT)
-        break;    // Time to leave
+        job.read_time = m_rm.latency_clock();
 
-      if ( w.page_desc->dirty && w.page_desc->data_present ) {
-        m_uffd->disable_write_protect(w.page_desc->page);
+        if ( rd->store()->read_async(job.buf, job.nb, offset, &job.request) ) {
+          free_jobs.pop_back();
+          ++store_in_flight;
+        }
+        else if ( ring != nullptr
+            && rd->store()->get_file_range(offset, job.nb, &fd, &file_offset)
+            && ring->prep_read(fd, job.buf, job.nb, file_offset, j) ) {
+          free_jobs.pop_back();
+          ++ring_in_flight;
+        }
+        else {
+          fill_pages(job);
+          finish_job(job);
+        }
+      }
+
+      if ( ring_in_flight + store_in_flight == 0 )
+        continue;
+
+      bool reaped = false;
+      uint64_t j;
+
+      if ( ring_in_flight != 0 ) {
+        int res;
+
+        ring->submit(store_in_flight == 0 ? 1 : 0);
+
+        while ( ring->next_completion(&j, &res) ) {
+          FillJob& job = jobs[j];
+
+          if ( res < 0 ) {
+            UMAP_LOG(Warning, "asynchronous read failed: " << strerror(-res)
+                << ", retrying synchronously");
+            fill_pages(job);
+          }
+          else {
+            copy_in_pages(job, res);
+          }
+
+          finish_job(job);
+          free_jobs.push_back(j);
+          --ring_in_flight;
+          reaped = true;
+        }
       }
-      else {
-        uint64_t offset = w.page_desc->region->store_offset(w.page_desc->page);
 
-        if (w.page_desc->region->store()->read_from_store(copyin_buf, page_size, offset) == -1)
-          UMAP_ERROR("read_from_store failed");
+      //
+      // With reads in flight on both, the completions of the stores are
+      // polled every millisecond
+      //
+      long wait_ms = (reaped || store_in_flight == 0) ? 0 : (ring_in_flight == 0 ? -1 : 1);
+      ssize_t done;
+
+      while ( store_in_flight != 0 && completions.next_completion(&j, &done, wait_ms) ) {
+        FillJob& job = jobs[j];
 
-        if ( ! w.page_desc->dirty ) {
-          m_uffd->copy_in_page_and_write_protect(copyin_buf, w.page_desc->page);
+        if ( done < 0 ) {
+          UMAP_LOG(Warning, "asynchronous store read failed, retrying synchronously");
+          fill_pages(job);
         }
         else {
-          m_uffd->copy_in_page(copyin_buf, w.page_desc->page);
+          copy_in_pages(job, done);
         }
-        w.page_desc->data_present = true;
+
+        finish_job(job);
+        free_jobs.push_back(j);
+        --store_in_flight;
+        wait_ms = 0;
+      }
+    }
+  }
+
+  //
+  // Returns false if the work item has already been taken care of
+  //
+  bool FillWorkers::start_job( const WorkItem& w, FillJob& job ) {
+    if ( w.time != 0 )
+      m_rm.record_latency(UMAP_LATENCY_FILL_QUEUE, w.time);
+
+    job.start_time = m_rm.latency_clock();
+    job.faults = w.faults;
+    job.fault_time = w.fault_time;
+
+    //
+    // The run must be collected before any of its pages is marked
+    // present, after which it may be evicted and its descriptor reused.
+    //
+    job.num_pages = 0;
+    for ( auto pd = w.page_desc; pd != nullptr; pd = pd->fill_next )
+      job.pages[job.num_pages++] = pd;
+
+    job.nb = job.num_pages * w.page_desc->region->page_size();
+    job.claimed = false;
+
+    //
+    // A run of present pages that have just been written to only needs to
+    // become writable
+    //
+    if ( w.page_desc->dirty && w.page_desc->data_present ) {
+      m_uffd->disable_write_protect(w.page_desc->page, job.nb);
+      finish_job(job);
+      return false;
+    }
+
+    if ( job.nb > job.buf_size )
+      alloc_buffer(job, job.nb);
+
+    return true;
+  }
+
+  void FillWorkers::alloc_buffer( FillJob& job, std::size_t nb ) {
+    free_buffer(job);
+
+    //
+    // Pages moved out of the buffer are populated again at once, instead
+    // of by a fault of every page during the next read, and huge pages
+    // would be split by the moves
+    //
+    if ( m_move ) {
+      void* buf = mmap(nullptr, nb, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+      if (buf == MAP_FAILED) {
+        UMAP_ERROR("mmap failed to allocate "
+            << nb << " bytes of memory: " << strerror(errno));
+      }
+
+      madvise(buf, nb, MADV_NOHUGEPAGE);
+      madvise(buf, nb, MADV_POPULATE_WRITE);
+      job.buf = (char*)buf;
+      job.buf_size = nb;
+      return;
+    }
+
+    if (posix_memalign((void**)&job.buf, m_page_size, nb)) {
+      UMAP_ERROR("posix_memalign failed to allocated "
+          << nb << " bytes of memory");
+    }
+
+    if (job.buf == nullptr) {
+      UMAP_ERROR("posix_memalign failed to allocated "
+          << nb << " bytes of memory");
+    }
+
+    job.buf_size = nb;
+  }
+
+  void FillWorkers::free_buffer( FillJob& job ) {
+    if ( job.buf == nullptr )
+      return;
+
+    if ( m_move )
+      munmap(job.buf, job.buf_size);
+    else
+      free(job.buf);
+
+    job.buf = nullptr;
+    job.buf_size = 0;
+  }
+
+  //
+  // Fills the run without reading it if the store knows it to be zeros.
+  // Pages that are to be writable, and those of private read-only regions,
+  // get the zero page.  The others must be write protected, which
+  // UFFDIO_ZEROPAGE cannot do, or are shared memory, so they are copied
+  // from a buffer of zeros instead.
+  //
+  bool FillWorkers::fill_zero_pages( FillJob& job ) {
+    RegionDescriptor* rd = job.pages[0]->region;
+
+    if ( ! rd->store()->is_zero_range(rd->store_offset(job.pages[0]->page), job.nb) )
+      return false;
+
+    //
+    // hugetlb pages must be copied in whole, from a buffer large enough
+    //
+    if ( rd->huge_pages() ) {
+      memset(job.buf, 0, job.nb);
+      m_uffd->copy_in_pages(job.buf, job.pages[0]->page, job.nb, write_protect(job));
+    }
+    else
+#ifndef UMAP_RO_MODE
+    if ( ( ! job.pages[0]->dirty && ! rd->read_only() ) || rd->shared() ) {
+      for ( std::size_t done = 0; done < job.nb; done += m_zero_buf_size ) {
+        std::size_t nb = std::min(job.nb - done, m_zero_buf_size);
+        m_uffd->copy_in_pages(m_zero_buf, job.pages[0]->page + done, nb, write_protect(job));
+      }
+    }
+    else
+#endif
+      m_uffd->zero_pages(job.pages[0]->page, job.nb);
+
+    for ( uint64_t i = 0; i < job.num_pages; ++i )
+      job.pages[i]->data_present = true;
+
+    return true;
+  }
+
+  void FillWorkers::finish_job( FillJob& job ) {
+    Trace::record(TraceFormat::FILL, job.pages[0]->page, job.pages[0]->region->start()
+        , job.start_time, job.num_pages);
+
+    if ( job.fault_time != 0 ) {
+      for ( uint32_t i = 0; i < job.faults; ++i )
+        m_rm.record_latency(UMAP_LATENCY_FAULT, job.fault_time);
+    }
+
+    for ( uint64_t i = 0; i < job.num_pages; ++i )
+      m_buffer->mark_page_as_present(job.pages[i]);
+  }
+
+  //
+  // Reads the pages of a run with one store request and copies them in with
+  // one UFFDIO_COPY.
+  //
+  void FillWorkers::fill_pages( FillJob& job ) {
+    RegionDescriptor* rd = job.pages[0]->region;
+    uint64_t offset = rd->store_offset(job.pages[0]->page);
+    ssize_t nread;
+
+    {
+      UMAP_ANNOTATE_IO_SCOPE("umap.fill.read", job.nb, rd->store());
+      nread = rd->store()->read_from_store(job.buf, job.nb, offset);
+    }
+
+    if (nread == -1)
+      UMAP_ERROR("read_from_store failed");
+
+    copy_in_pages(job, nread);
+  }
+
+  //
+  // A store may return less than was asked for, e.g. when the run spans two
+  // files of a SparseStore, in which case the pages of the run that were
+  // not read in full are read as one batch of page sized requests.
+  //
+  void FillWorkers::copy_in_pages( FillJob& job, ssize_t nread ) {
+    RegionDescriptor* rd = job.pages[0]->region;
+    uint64_t psize = rd->page_size();
+    uint64_t offset = rd->store_offset(job.pages[0]->page);
+
+    if ( job.num_pages > 1 && (uint64_t)nread < job.nb ) {
+      UMAP_ANNOTATE_IO_SCOPE("umap.fill.read", job.nb - nread, rd->store());
+
+      job.ios.clear();
+      for ( uint64_t i = nread / psize; i < job.num_pages; ++i )
+        job.ios.push_back({job.buf + i * psize, psize, (off_t)(offset + i * psize), 0});
+
+      if (rd->store()->read_batch(job.ios.data(), job.ios.size()) == -1)
+        UMAP_ERROR("read_batch failed");
+    }
+
+    if ( job.read_time != 0 )
+      m_rm.record_latency(UMAP_LATENCY_STORE_READ, job.read_time);
+
+    uint64_t copy_time = m_rm.latency_clock();
+
+    {
+      UMAP_ANNOTATE_SCOPE("umap.fill.copy");
+      uint64_t moved = move_in_pages(job);
+
+      if ( moved < job.nb )
+        m_uffd->copy_in_pages(job.buf + moved, job.pages[0]->page + moved
+            , job.nb - moved, write_protect(job));
+    }
+    rd->count_read(job.nb);
+
+    if ( copy_time != 0 )
+      m_rm.record_latency(UMAP_LATENCY_COPY, copy_time);
+
+    for ( uint64_t i = 0; i < job.num_pages; ++i )
+      job.pages[i]->data_present = true;
+
+    if ( job.claimed )
+      release_shared_pages(job, job.num_pages);
+  }
+
+  //
+  // With UMAP_FILL_MOVE, the pages read for a private read-write region are
+  // moved into it rather than copied.  A moved page is writable at once and
+  // UFFDIO_MOVE cannot write protect it, so clean pages that are to be write
+  // protected are still copied in, with the write protection.  Pages the
+  // kernel would not move are copied in by the caller.
+  //
+  uint64_t FillWorkers::move_in_pages( FillJob& job ) {
+    RegionDescriptor* rd = job.pages[0]->region;
+    uint64_t moved;
+
+    if ( ! m_move || rd->read_only() || rd->shared() || rd->huge_pages() )
+      return 0;
+
+#ifndef UMAP_RO_MODE
+    if ( write_protect(job) )
+      return 0;
+#endif
+
+    moved = m_uffd->move_in_pages(job.buf, job.pages[0]->page, job.nb);
+
+    if ( moved != 0 )
+      madvise(job.buf, moved, MADV_POPULATE_WRITE);
+
+    return moved;
+  }
+
+  //
+  // The processes sharing a region claim the pages they are about to fill
+  // by setting the word of each page in the shared memory of the region to
+  // their pid, so that a page faulted on by several of them at once is only
+  // read once.  The others wait for the claims to go, and for the pages to
+  // be resident.  A claim outlives a process that dies with it, and is then
+  // taken over.
+  //
+  // Returns false if the pages were filled by another process, in which
+  // case the threads waiting for them here have been woken.
+  //
+  bool FillWorkers::claim_shared_pages( FillJob& job ) {
+    RegionDescriptor* rd = job.pages[0]->region;
+    const uint32_t me = getpid();
+
+    job.claimed = false;
+    if ( ! rd->shared() )
+      return true;
+
+    for ( int attempt = 0; ; ++attempt ) {
+      uint64_t i;
+      uint32_t owner = 0;
+
+      for ( i = 0; i < job.num_pages; ++i ) {
+        owner = 0;
+        if ( ! rd->shared_claim(job.pages[i]->page)->compare_exchange_strong(owner, me) )
+          break;
+      }
+
+      if ( i == job.num_pages )
+        break;
+
+      release_shared_pages(job, i);
+
+      std::atomic<uint32_t>* claim = rd->shared_claim(job.pages[i]->page);
+      struct timespec timeout = { 0, 10 * 1000 * 1000 };
+
+      syscall(SYS_futex, (uint32_t*)claim, FUTEX_WAIT, owner, &timeout, nullptr, 0);
+
+      if ( ! rd->shared_resident(job.pages[0]->page, job.nb) ) {
+        if ( claim->load() == owner && kill(owner, 0) == -1 && errno == ESRCH )
+          claim->compare_exchange_strong(owner, 0);
+        continue;
       }
 
-      m_buffer->mark_page_as_present(w.page_desc);
+      m_uffd->wake_pages(job.pages[0]->page, job.nb);
+      for ( i = 0; i < job.num_pages; ++i )
+        job.pages[i]->data_present = true;
+      return false;
     }
 
-    free(copyin_buf);
+    job.claimed = true;
+
+    //
+    // The pages may have been filled between the fault and the claim
+    //
+    if ( rd->shared_resident(job.pages[0]->page, job.nb) ) {
+      release_shared_pages(job, job.num_pages);
+      job.claimed = false;
+      m_uffd->wake_pages(job.pages[0]->page, job.nb);
+      for ( uint64_t i = 0; i < job.num_pages; ++i )
+        job.pages[i]->data_present = true;
+      return false;
+    }
+    return true;
+  }
+
+  void FillWorkers::release_shared_pages( FillJob& job, uint64_t num_pages ) {
+    RegionDescriptor* rd = job.pages[0]->region;
+
+    for ( uint64_t i = 0; i < num_pages; ++i ) {
+      std::atomic<uint32_t>* claim = rd->shared_claim(job.pages[i]->page);
+
+      claim->store(0);
+      syscall(SYS_futex, (uint32_t*)claim, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+  }
+
+  FillBatch::FillBatch( RegionManager& rm )
+    :   m_rm(rm), m_head(nullptr), m_tail(nullptr), m_count(0)
+      , m_max_pages(rm.get_max_fill_pages()), m_fault_thread(0)
+      , m_fault_time(0), m_run_faults(0), m_run_fault_time(0)
+  {
+  }
+
+  void FillBatch::add( PageDescriptor* pd, bool fault ) {
+    pd->fill_next = nullptr;
+
+    if ( m_head != nullptr && extends(pd) ) {
+      m_tail->fill_next = pd;
+      m_tail = pd;
+    }
+    else {
+      flush();
+      m_head = m_tail = pd;
+    }
+
+    //
+    // The faults of a run are those of one read of fault events, so they
+    // are timed together
+    //
+    if ( fault && m_fault_time != 0 ) {
+      if ( m_run_faults++ == 0 )
+        m_run_fault_time = m_fault_time;
+    }
+
+    //
+    // Neighbors of a fault in a RANDOM range are not expected to follow, so
+    // its fill is not held back for them
+    //
+    if ( ++m_count == m_max_pages || m_count == pd->region->max_run_pages()
+        || pd->region->advice(pd->region->page_index(pd->page)) == UMAP_ADVICE_RANDOM )
+      flush();
+  }
+
+  bool FillBatch::extends( PageDescriptor* pd ) {
+    return pd->region == m_tail->region
+        && pd->page == m_tail->page + pd->region->page_size()
+        && pd->dirty == m_head->dirty
+        && pd->data_present == m_head->data_present
+        && pd->fill_node == m_head->fill_node;
+  }
+
+  void FillBatch::flush( void ) {
+    if ( m_head == nullptr )
+      return;
+
+    WorkItem work;
+
+    work.type = Umap::WorkItem::WorkType::NONE;
+    work.page_desc = m_head;
+    work.time = m_rm.latency_clock();
+    work.faults = m_run_faults;
+    work.fault_time = m_run_fault_time;
+    m_rm.get_fill_workers_h()->send_work(work, m_head->fill_node);
+
+    m_head = m_tail = nullptr;
+    m_count = 0;
+    m_run_faults = 0;
+    m_run_fault_time = 0;
   }
 
   void FillWorkers::ThreadEntry( void ) {
     FillWorker();
   }
 
-  FillWorkers::FillWorkers( void )
-    :   WorkerPool("Fill Workers", RegionManager::getInstance().get_num_fillers())
-      , m_uffd(RegionManager::getInstance().get_uffd_h())
-      , m_buffer(RegionManager::getInstance().get_buffer_h())
+  //
+  // With UMAP_NUMA there is a group of at least one worker per node
+  //
+  uint64_t FillWorkers::num_worker_groups( RegionManager& rm ) {
+    Numa* numa = rm.get_numa_h();
+    return ( numa != nullptr ) ? numa->num_nodes() : 1;
+  }
+
+  uint64_t FillWorkers::num_workers( RegionManager& rm ) {
+    return std::max(rm.get_num_fillers(), num_worker_groups(rm) * rm.get_num_work_queues());
+  }
+
+  FillWorkers::FillWorkers( RegionManager& rm )
+    :   WorkerPool("Fill Workers", num_workers(rm), rm.get_ring_work_queue_size()
+                , num_worker_groups(rm), rm.get_num_work_queues())
+      , m_rm(rm)
+      , m_uffd(rm.get_uffd_h())
+      , m_buffer(rm.get_buffer_h())
+      , m_page_size(rm.get_umap_page_size())
+      , m_max_fill_pages(rm.get_max_fill_pages())
+      , m_io_depth(rm.get_io_depth())
+      , m_move(m_uffd->move())
   {
+    m_zero_buf_size = m_page_size * m_max_fill_pages;
+
+    if (posix_memalign((void**)&m_zero_buf, m_page_size, m_zero_buf_size)) {
+      UMAP_ERROR("posix_memalign failed to allocated "
+          << m_zero_buf_size << " bytes of memory");
+    }
+    memset(m_zero_buf, 0, m_zero_buf_size);
+
+    set_elastic(m_rm.get_min_fillers(), m_rm.get_worker_idle_timeout());
+    set_placement(m_rm.get_filler_placement());
     start_thread_pool();
   }
 
   FillWorkers::~FillWorkers( void ) {
     stop_thread_pool();
+    free(m_zero_buf);
   }
 } // end of namespace Umap
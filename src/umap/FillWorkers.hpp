@@ -7,25 +7,142 @@
 #ifndef _UMAP_FillWorkers_HPP
 #define _UMAP_FillWorkers_HPP
 
+#include <sys/types.h>
+#include <vector>
+
 #include "umap/Buffer.hpp"
 #include "umap/Uffd.hpp"
+#include "umap/StoreCompletionQueue.hpp"
 #include "umap/WorkerPool.hpp"
+#include "umap/store/Store.hpp"
 
 namespace Umap {
   class Buffer;
+  class IoUring;
+  class RegionManager;
   class Uffd;
 
+  //
+  // Collects pages of a region that are adjacent and are to be filled the
+  // same way (with or without write protection) so that they are sent to
+  // the fill workers as one job: a single store read and a single
+  // UFFDIO_COPY for the whole run.  Runs of present pages that have just
+  // been written to are collected the same way, so that they are write
+  // unprotected with a single UFFDIO_WRITEPROTECT.  The pages of a job are
+  // linked through their fill_next field.
+  //
+  // A batch belongs to one fault handler thread.  Pages in a batch are in
+  // the FILLING (or UPDATING) state until flush() has been called, so the handler must
+  // flush before waiting for anything: the Buffer, or the RegionManager
+  // whose lock is held while uunmap() waits for pages to become present.
+  //
+  class FillBatch {
+    public:
+      FillBatch( RegionManager& rm );
+
+      void add( PageDescriptor* pd, bool fault = false );
+      void flush( void );
+
+      //
+      // Thread that caused the fault being processed, 0 if not known.  With
+      // UMAP_NUMA, pages are filled on its node by default.
+      //
+      void set_fault_thread( pid_t tid ) { m_fault_thread = tid; }
+      pid_t fault_thread( void ) { return m_fault_thread; }
+
+      //
+      // When the fault being processed was read, with latency histograms
+      //
+      void set_fault_time( uint64_t time ) { m_fault_time = time; }
+      uint64_t fault_time( void ) { return m_fault_time; }
+
+      //
+      // The region of the pending run if it contains addr, nullptr
+      // otherwise.  The region cannot go away while its pages are pending.
+      //
+      RegionDescriptor* region_of( char* addr ) {
+        if ( m_head == nullptr )
+          return nullptr;
+
+        RegionDescriptor* rd = m_head->region;
+        return ( addr >= rd->start() && addr < rd->end() ) ? rd : nullptr;
+      }
+
+    private:
+      RegionManager& m_rm;
+      PageDescriptor* m_head;
+      PageDescriptor* m_tail;
+      uint64_t m_count;
+      uint64_t m_max_pages;
+      pid_t m_fault_thread;
+      uint64_t m_fault_time;
+      uint32_t m_run_faults;        // Pages of the pending run faulted on
+      uint64_t m_run_fault_time;    // When the first of them was read
+
+      bool extends( PageDescriptor* pd );
+  };
+
   class FillWorkers : public WorkerPool {
     public:
-      FillWorkers( void );
+      FillWorkers( RegionManager& rm );
       ~FillWorkers( void );
 
     private:
+      //
+      // A run being filled and the buffer it is read into.  The buffer
+      // grows for regions whose pages are larger than a whole run of
+      // UMAP_PAGESIZE pages.  With UMAP_FILL_MOVE it is a mapping of its
+      // own, whose pages may be moved into the region.
+      //
+      struct FillJob {
+        std::vector<PageDescriptor*> pages;
+        uint64_t num_pages;
+        std::size_t nb;
+        char* buf;
+        std::size_t buf_size;
+        std::vector<StoreIo> ios;   // Pages read again after a short read
+        StoreCompletionQueue::Request request;
+        bool claimed;               // Holds the claims of a shared region
+        uint64_t start_time;        // Taken by a worker, with latency_clock()
+        uint32_t faults;            // Of the work item
+        uint64_t fault_time;
+        uint64_t read_time;         // Store request sent
+      };
+
+      RegionManager& m_rm;
       Uffd*    m_uffd;
       Buffer*  m_buffer;
+      uint64_t m_page_size;
+      uint64_t m_max_fill_pages;
+      uint64_t m_io_depth;
+      char*    m_zero_buf;
+      std::size_t m_zero_buf_size;
+      bool     m_move;
 
       void FillWorker( void );
+      void FillLoop( IoUring* ring, StoreCompletionQueue& completions, std::vector<FillJob>& jobs );
+      bool start_job( const WorkItem& w, FillJob& job );
+      bool fill_zero_pages( FillJob& job );
+      bool claim_shared_pages( FillJob& job );
+      void release_shared_pages( FillJob& job, uint64_t num_pages );
+      void finish_job( FillJob& job );
+      void fill_pages( FillJob& job );
+      void copy_in_pages( FillJob& job, ssize_t nread );
+      uint64_t move_in_pages( FillJob& job );
+      void alloc_buffer( FillJob& job, std::size_t nb );
+      void free_buffer( FillJob& job );
       void ThreadEntry( void );
+
+      //
+      // Clean pages are copied in write protected, so that the first write
+      // to them is seen, except in read-only regions
+      //
+      static bool write_protect( FillJob& job ) {
+        return ! job.pages[0]->dirty && ! job.pages[0]->region->read_only();
+      }
+
+      static uint64_t num_worker_groups( RegionManager& rm );
+      static uint64_t num_workers( RegionManager& rm );
   };
 } // end of namespace Umap
 #endif // _UMAP_FillWorker_HPP
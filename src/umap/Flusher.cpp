@@ -0,0 +1,244 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include <errno.h>
+#include <time.h>
+
+#include "umap/Buffer.hpp"
+#include "umap/Flusher.hpp"
+#include "umap/RegionManager.hpp"
+#include "umap/util/Annotation.hpp"
+#include "umap/util/Macros.hpp"
+
+namespace Umap {
+//
+// FlushFence
+//
+FlushFence::FlushFence( RegionDescriptor* rd, char* start, char* end )
+  :   m_region(rd), m_start(start), m_end(end), m_pending(0), m_walking(true), m_detached(false)
+{
+  pthread_mutex_init(&m_mutex, NULL);
+  pthread_cond_init(&m_cond, NULL);
+}
+
+FlushFence::FlushFence( const std::vector<RegionDescriptor*>& regions )
+  :   m_region(nullptr), m_start(nullptr), m_end(nullptr), m_regions(regions)
+    , m_pending(0), m_walking(true), m_detached(false)
+{
+  pthread_mutex_init(&m_mutex, NULL);
+  pthread_cond_init(&m_cond, NULL);
+}
+
+FlushFence::~FlushFence( void )
+{
+  pthread_mutex_destroy(&m_mutex);
+  pthread_cond_destroy(&m_cond);
+}
+
+void FlushFence::add_pages( uint64_t num_pages )
+{
+  pthread_mutex_lock(&m_mutex);
+  m_pending += num_pages;
+  pthread_mutex_unlock(&m_mutex);
+}
+
+void FlushFence::page_done( void )
+{
+  pthread_mutex_lock(&m_mutex);
+  bool done = ( --m_pending == 0 && ! m_walking );
+  bool gone = done && m_detached;
+  if ( done )
+    pthread_cond_broadcast(&m_cond);
+  pthread_mutex_unlock(&m_mutex);
+
+  if ( gone )
+    delete this;
+}
+
+void FlushFence::walk_done( void )
+{
+  pthread_mutex_lock(&m_mutex);
+  m_walking = false;
+  bool done = ( m_pending == 0 );
+  bool gone = done && m_detached;
+  if ( done )
+    pthread_cond_broadcast(&m_cond);
+  pthread_mutex_unlock(&m_mutex);
+
+  if ( gone )
+    delete this;
+}
+
+void FlushFence::detach( void )
+{
+  pthread_mutex_lock(&m_mutex);
+  bool done = ( m_pending == 0 && ! m_walking );
+  m_detached = true;
+  pthread_mutex_unlock(&m_mutex);
+
+  if ( done )
+    delete this;
+}
+
+bool FlushFence::test( void )
+{
+  pthread_mutex_lock(&m_mutex);
+  bool done = ( m_pending == 0 && ! m_walking );
+  pthread_mutex_unlock(&m_mutex);
+  return done;
+}
+
+void FlushFence::wait( void )
+{
+  pthread_mutex_lock(&m_mutex);
+  while ( m_pending != 0 || m_walking )
+    pthread_cond_wait(&m_cond, &m_mutex);
+  pthread_mutex_unlock(&m_mutex);
+}
+
+//
+// Flusher
+//
+Flusher::Flusher( RegionManager& rm, Buffer* buffer )
+  :   m_rm(rm), m_buffer(buffer)
+    , m_current(nullptr), m_kicked(false), m_running(true)
+{
+  pthread_mutex_init(&m_mutex, NULL);
+  pthread_cond_init(&m_cond, NULL);
+  pthread_cond_init(&m_done_cond, NULL);
+
+  if ( pthread_create(&m_thread, NULL, ThreadEntryFunc, this) != 0 )
+    UMAP_ERROR("Failed to launch the flusher thread");
+
+  if ( pthread_setname_np(m_thread, "Flusher") != 0 )
+    UMAP_ERROR("Failed to set thread name");
+}
+
+//
+// Requests that are still queued are processed before the thread leaves
+//
+Flusher::~Flusher( void )
+{
+  pthread_mutex_lock(&m_mutex);
+  m_running = false;
+  pthread_cond_signal(&m_cond);
+  pthread_mutex_unlock(&m_mutex);
+
+  (void) pthread_join(m_thread, NULL);
+
+  pthread_mutex_destroy(&m_mutex);
+  pthread_cond_destroy(&m_cond);
+  pthread_cond_destroy(&m_done_cond);
+}
+
+FlushFence* Flusher::flush_async( FlushFence* f )
+{
+  pthread_mutex_lock(&m_mutex);
+  m_requests.push_back(f);
+  pthread_cond_signal(&m_cond);
+  pthread_mutex_unlock(&m_mutex);
+
+  return f;
+}
+
+void Flusher::kick( void )
+{
+  pthread_mutex_lock(&m_mutex);
+  m_kicked = true;
+  pthread_cond_signal(&m_cond);
+  pthread_mutex_unlock(&m_mutex);
+}
+
+bool Flusher::refers_to( FlushFence* f, RegionDescriptor* rd )
+{
+  return f != nullptr && ( f->region() == nullptr || f->region() == rd );
+}
+
+void Flusher::wait_for_region( RegionDescriptor* rd )
+{
+  pthread_mutex_lock(&m_mutex);
+
+  while ( 1 ) {
+    bool busy = refers_to(m_current, rd);
+
+    for ( auto f : m_requests )
+      busy = busy || refers_to(f, rd);
+
+    if ( ! busy )
+      break;
+
+    pthread_cond_wait(&m_done_cond, &m_mutex);
+  }
+
+  pthread_mutex_unlock(&m_mutex);
+}
+
+void Flusher::run( void )
+{
+  //
+  // While over the dirty target, check again this often for the pages
+  // written back in the mean time
+  //
+  const long BACKGROUND_INTERVAL_NS = 10 * 1000 * 1000;
+
+  m_rm.get_umap_placement().apply();
+
+  pthread_mutex_lock(&m_mutex);
+
+  while ( 1 ) {
+    if ( ! m_requests.empty() ) {
+      m_current = m_requests.front();
+      m_requests.pop_front();
+      pthread_mutex_unlock(&m_mutex);
+
+      {
+        UMAP_ANNOTATE_SCOPE("umap.flush");
+        m_buffer->flush_dirty_pages(m_current);
+      }
+      m_current->walk_done();
+
+      pthread_mutex_lock(&m_mutex);
+      m_current = nullptr;
+      pthread_cond_broadcast(&m_done_cond);
+      continue;
+    }
+
+    if ( ! m_running )
+      break;
+
+    uint64_t target = m_buffer->dirty_target();
+    uint64_t dirty = m_buffer->num_dirty_pages();
+
+    if ( target != 0 && dirty > target ) {
+      pthread_mutex_unlock(&m_mutex);
+      {
+        UMAP_ANNOTATE_SCOPE("umap.flush.background");
+        m_buffer->flush_oldest_dirty_pages(dirty - target);
+      }
+      pthread_mutex_lock(&m_mutex);
+
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += BACKGROUND_INTERVAL_NS;
+      if ( ts.tv_nsec >= 1000000000L ) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000L;
+      }
+
+      if ( m_requests.empty() && m_running )
+        pthread_cond_timedwait(&m_cond, &m_mutex, &ts);
+      continue;
+    }
+
+    if ( ! m_kicked )
+      pthread_cond_wait(&m_cond, &m_mutex);
+
+    m_kicked = false;
+  }
+
+  pthread_mutex_unlock(&m_mutex);
+}
+} // end of namespace Umap
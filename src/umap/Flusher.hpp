@@ -0,0 +1,117 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_Flusher_HPP
+#define _UMAP_Flusher_HPP
+
+#include <cstdint>
+#include <deque>
+#include <pthread.h>
+#include <vector>
+
+#include "umap/RegionDescriptor.hpp"
+
+namespace Umap {
+  class Buffer;
+  class RegionManager;
+
+  //
+  // Completion of a flush request.  A fence is complete once the pages that
+  // were dirty in its range when the request was processed have all been
+  // written back.  Its region is nullptr for a flush of the whole Buffer,
+  // which covers the regions that were mapped when the request was made.
+  //
+  class FlushFence {
+    public:
+      FlushFence( RegionDescriptor* rd, char* start, char* end );
+      FlushFence( const std::vector<RegionDescriptor*>& regions );
+      ~FlushFence( void );
+
+      RegionDescriptor* region( void ) { return m_region; }
+      const std::vector<RegionDescriptor*>& regions( void ) { return m_regions; }
+      char* start( void ) { return m_start; }
+      char* end( void ) { return m_end; }
+
+      void add_pages( uint64_t num_pages );
+      void page_done( void );
+      void walk_done( void );
+
+      bool test( void );
+      void wait( void );
+
+      //
+      // Nobody is to test or wait for the fence, which deletes itself once
+      // complete
+      //
+      void detach( void );
+
+    private:
+      RegionDescriptor* m_region;
+      char* m_start;
+      char* m_end;
+      std::vector<RegionDescriptor*> m_regions;
+
+      pthread_mutex_t m_mutex;
+      pthread_cond_t m_cond;
+      uint64_t m_pending;     // Pages scheduled and not yet written back
+      bool m_walking;         // More pages may still be scheduled
+      bool m_detached;
+  };
+
+  //
+  // Background thread that processes flush requests, so that neither the
+  // application nor the fault handlers wait while the Buffer is searched
+  // for dirty pages.
+  //
+  // It also keeps the number of dirty pages close to UMAP_DIRTY_RATIO
+  // percent of the Buffer by writing back the oldest dirty pages whenever
+  // there are more than that.
+  //
+  class Flusher {
+    public:
+      Flusher( RegionManager& rm, Buffer* buffer );
+      ~Flusher( void );
+
+      //
+      // Queues the flush request of the fence and returns it
+      //
+      FlushFence* flush_async( FlushFence* fence );
+
+      //
+      // Called when the number of dirty pages goes over the target
+      //
+      void kick( void );
+
+      //
+      // Waits until no flush request for rd (or for the whole Buffer) is
+      // queued or being processed, before rd goes away
+      //
+      void wait_for_region( RegionDescriptor* rd );
+
+    private:
+      RegionManager& m_rm;
+      Buffer* m_buffer;
+
+      pthread_t m_thread;
+      pthread_mutex_t m_mutex;
+      pthread_cond_t m_cond;
+      pthread_cond_t m_done_cond;
+      std::deque<FlushFence*> m_requests;
+      FlushFence* m_current;
+      bool m_kicked;
+      bool m_running;
+
+      void run( void );
+      bool refers_to( FlushFence* f, RegionDescriptor* rd );
+
+      static void* ThreadEntryFunc( void* This ) {
+        ((Flusher*)This)->run();
+        return NULL;
+      }
+  };
+} // end of namespace Umap
+
+#endif // _UMAP_Flusher_HPP
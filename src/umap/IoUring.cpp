@@ -0,0 +1,215 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include "umap/config.h"
+
+#include <errno.h>
+#include <string.h>             // strerror(), memset()
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef UMAP_HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#include "umap/IoUring.hpp"
+#include "umap/util/Macros.hpp"
+
+namespace Umap {
+
+IoUring::IoUring( void )
+  :   m_fd(-1), m_entries(0), m_to_submit(0)
+    , m_sq_ptr(MAP_FAILED), m_sq_size(0)
+    , m_cq_ptr(MAP_FAILED), m_cq_size(0)
+    , m_sqes(MAP_FAILED), m_sqes_size(0)
+{
+}
+
+IoUring* IoUring::create( unsigned entries )
+{
+  IoUring* ring = new IoUring();
+
+  if ( ! ring->setup(entries) ) {
+    delete ring;
+    return nullptr;
+  }
+  return ring;
+}
+
+IoUring::~IoUring( void )
+{
+  if ( m_sqes != MAP_FAILED )
+    munmap(m_sqes, m_sqes_size);
+
+  if ( m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr )
+    munmap(m_cq_ptr, m_cq_size);
+
+  if ( m_sq_ptr != MAP_FAILED )
+    munmap(m_sq_ptr, m_sq_size);
+
+  if ( m_fd != -1 )
+    close(m_fd);
+}
+
+#ifdef UMAP_HAVE_IO_URING
+bool IoUring::setup( unsigned entries )
+{
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+
+  m_fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if ( m_fd < 0 ) {
+    int eno = errno;
+    m_fd = -1;
+    UMAP_LOG(Warning, "io_uring_setup(" << entries << ") failed: " << strerror(eno));
+    return false;
+  }
+
+  m_entries = p.sq_entries;
+  m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  //
+  // Newer kernels map both rings with a single mmap
+  //
+  if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+    if ( m_cq_size > m_sq_size )
+      m_sq_size = m_cq_size;
+    m_cq_size = m_sq_size;
+  }
+
+  m_sq_ptr = mmap(0, m_sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+  if ( m_sq_ptr == MAP_FAILED ) {
+    UMAP_LOG(Warning, "mmap of io_uring submission ring failed: " << strerror(errno));
+    return false;
+  }
+
+  if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+    m_cq_ptr = m_sq_ptr;
+  }
+  else {
+    m_cq_ptr = mmap(0, m_cq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+    if ( m_cq_ptr == MAP_FAILED ) {
+      UMAP_LOG(Warning, "mmap of io_uring completion ring failed: " << strerror(errno));
+      return false;
+    }
+  }
+
+  m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  m_sqes = mmap(0, m_sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+  if ( m_sqes == MAP_FAILED ) {
+    UMAP_LOG(Warning, "mmap of io_uring submission entries failed: " << strerror(errno));
+    return false;
+  }
+
+  char* sq = (char*)m_sq_ptr;
+  m_sq_head  = (unsigned*)(sq + p.sq_off.head);
+  m_sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+  m_sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+  m_sq_array = (unsigned*)(sq + p.sq_off.array);
+
+  char* cq = (char*)m_cq_ptr;
+  m_cq_head  = (unsigned*)(cq + p.cq_off.head);
+  m_cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+  m_cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+  m_cqes     = cq + p.cq_off.cqes;
+
+  UMAP_LOG(Debug, "io_uring " << m_fd << ": " << p.sq_entries
+      << " submission and " << p.cq_entries << " completion entries");
+  return true;
+}
+
+bool IoUring::prep( int op, int fd, void* buf, std::size_t nb, off_t off, uint64_t user_data )
+{
+  //
+  // Only this thread moves the tail, the kernel moves the head
+  //
+  unsigned tail = *m_sq_tail;
+  unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+
+  if ( tail - head >= m_entries )
+    return false;
+
+  unsigned idx = tail & *m_sq_mask;
+  struct io_uring_sqe* sqe = &((struct io_uring_sqe*)m_sqes)[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = (uint8_t)op;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = (uint32_t)nb;
+  sqe->off = (uint64_t)off;
+  sqe->user_data = user_data;
+
+  m_sq_array[idx] = idx;
+  __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++m_to_submit;
+  return true;
+}
+
+bool IoUring::prep_read( int fd, void* buf, std::size_t nb, off_t off, uint64_t user_data )
+{
+  return prep(IORING_OP_READ, fd, buf, nb, off, user_data);
+}
+
+bool IoUring::prep_write( int fd, void* buf, std::size_t nb, off_t off, uint64_t user_data )
+{
+  return prep(IORING_OP_WRITE, fd, buf, nb, off, user_data);
+}
+
+void IoUring::submit( unsigned wait_for )
+{
+  while ( 1 ) {
+    int rval = (int)syscall(__NR_io_uring_enter, m_fd, m_to_submit, wait_for,
+                            wait_for ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    if ( rval >= 0 ) {
+      m_to_submit -= rval;
+      if ( m_to_submit == 0 )
+        return;
+      continue;
+    }
+
+    if ( errno != EINTR && errno != EAGAIN && errno != EBUSY )
+      UMAP_ERROR("io_uring_enter failed: " << errno << " (" << strerror(errno) << ")");
+  }
+}
+
+bool IoUring::next_completion( uint64_t* user_data, int* res )
+{
+  unsigned head = *m_cq_head;
+  unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+  if ( head == tail )
+    return false;
+
+  struct io_uring_cqe* cqe = &((struct io_uring_cqe*)m_cqes)[head & *m_cq_mask];
+
+  *user_data = cqe->user_data;
+  *res = cqe->res;
+
+  __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+#else
+bool IoUring::setup( unsigned )
+{
+  UMAP_LOG(Warning, "umap was built without io_uring support");
+  return false;
+}
+
+bool IoUring::prep( int, int, void*, std::size_t, off_t, uint64_t ) { return false; }
+bool IoUring::prep_read( int, void*, std::size_t, off_t, uint64_t ) { return false; }
+bool IoUring::prep_write( int, void*, std::size_t, off_t, uint64_t ) { return false; }
+void IoUring::submit( unsigned ) {}
+bool IoUring::next_completion( uint64_t*, int* ) { return false; }
+#endif
+} // end of namespace Umap
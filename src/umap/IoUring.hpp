@@ -0,0 +1,77 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_IoUring_HPP
+#define _UMAP_IoUring_HPP
+
+#include <cstdint>
+#include <sys/types.h>
+
+namespace Umap {
+  //
+  // Minimal io_uring submission/completion ring, used by the fill and evict
+  // workers to keep several store requests in flight at once.  It talks to
+  // the kernel through the raw system calls so that no library is needed.
+  //
+  // A ring belongs to the one thread that created it.  The caller must not
+  // have more requests in flight than the ring has entries.
+  //
+  class IoUring {
+    public:
+      //
+      // Returns nullptr if io_uring is not supported by this build or by
+      // the running kernel
+      //
+      static IoUring* create( unsigned entries );
+      ~IoUring( void );
+
+      //
+      // Queue a request, tagged with user_data, for the next submit().
+      // Returns false if the submission queue is full.
+      //
+      bool prep_read( int fd, void* buf, std::size_t nb, off_t off, uint64_t user_data );
+      bool prep_write( int fd, void* buf, std::size_t nb, off_t off, uint64_t user_data );
+
+      //
+      // Hand the queued requests to the kernel and wait until at least
+      // wait_for completions are available
+      //
+      void submit( unsigned wait_for );
+
+      //
+      // Reap one completion.  res is what pread/pwrite would have returned,
+      // or -errno.  Returns false if no completion is available.
+      //
+      bool next_completion( uint64_t* user_data, int* res );
+
+    private:
+      int m_fd;
+      unsigned m_entries;
+      unsigned m_to_submit;
+
+      void* m_sq_ptr;
+      std::size_t m_sq_size;
+      void* m_cq_ptr;
+      std::size_t m_cq_size;
+      void* m_sqes;
+      std::size_t m_sqes_size;
+
+      unsigned* m_sq_head;
+      unsigned* m_sq_tail;
+      unsigned* m_sq_mask;
+      unsigned* m_sq_array;
+      unsigned* m_cq_head;
+      unsigned* m_cq_tail;
+      unsigned* m_cq_mask;
+      void* m_cqes;
+
+      IoUring( void );
+      bool setup( unsigned entries );
+      bool prep( int op, int fd, void* buf, std::size_t nb, off_t off, uint64_t user_data );
+  };
+} // end of namespace Umap
+
+#endif // _UMAP_IoUring_HPP
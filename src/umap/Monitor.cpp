@@ -0,0 +1,233 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include <algorithm>      // min()
+#include <cstddef>        // offsetof()
+#include <errno.h>
+#include <fcntl.h>        // O_CREAT
+#include <string.h>       // memset(), strerror()
+#include <sys/mman.h>     // shm_open(), mmap()
+#include <time.h>
+#include <unistd.h>       // ftruncate(), getpid()
+
+#include "umap/Buffer.hpp"
+#include "umap/Monitor.hpp"
+#include "umap/RegionManager.hpp"
+#include "umap/util/Clock.hpp"
+#include "umap/util/Macros.hpp"
+
+namespace Umap {
+
+Monitor::Monitor( RegionManager& rm, Buffer* buffer, uint64_t interval_ms
+                , uint64_t log_interval_ms, const std::string& shm_name )
+  :   m_rm(rm), m_buffer(buffer)
+    , m_interval_ms(interval_ms), m_log_interval_ms(log_interval_ms)
+    , m_shm_name(shm_name), m_segment(nullptr)
+    , m_last_time(0), m_last_log_time(0), m_samples(0)
+    , m_running(true)
+{
+  memset(&m_last, 0, sizeof(m_last));
+
+  if ( ! m_shm_name.empty() )
+    open_segment();
+
+  pthread_mutex_init(&m_mutex, NULL);
+  pthread_cond_init(&m_cond, NULL);
+
+  UMAP_LOG(Info, "every " << m_interval_ms << " ms, segment: "
+      << (m_shm_name.empty() ? "none" : m_shm_name));
+
+  if ( pthread_create(&m_thread, NULL, ThreadEntryFunc, this) != 0 )
+    UMAP_ERROR("Failed to launch the monitor thread");
+
+  if ( pthread_setname_np(m_thread, "UmapMonitor") != 0 )
+    UMAP_ERROR("Failed to set thread name");
+}
+
+Monitor::~Monitor( void )
+{
+  pthread_mutex_lock(&m_mutex);
+  m_running = false;
+  pthread_cond_signal(&m_cond);
+  pthread_mutex_unlock(&m_mutex);
+
+  (void) pthread_join(m_thread, NULL);
+
+  pthread_mutex_destroy(&m_mutex);
+  pthread_cond_destroy(&m_cond);
+
+  if ( m_segment != nullptr ) {
+    munmap(m_segment, sizeof(*m_segment));
+    shm_unlink(m_shm_name.c_str());
+  }
+}
+
+//
+// A %p in the name is replaced by the pid, and the segments of the contexts
+// other than the default one have the number of their context appended.
+//
+void Monitor::open_segment( void )
+{
+  std::string::size_type pos = m_shm_name.find("%p");
+  if ( pos != std::string::npos )
+    m_shm_name.replace(pos, 2, std::to_string(getpid()));
+
+  if ( m_rm.get_context_id() != 0 )
+    m_shm_name += "." + std::to_string(m_rm.get_context_id());
+
+  int fd = shm_open(m_shm_name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+  if ( fd == -1 )
+    UMAP_ERROR("shm_open(" << m_shm_name << ") failed: " << strerror(errno));
+
+  if ( ftruncate(fd, sizeof(MetricsFormat::Segment)) == -1 ) {
+    int err = errno;
+    close(fd);
+    shm_unlink(m_shm_name.c_str());
+    UMAP_ERROR("ftruncate(" << m_shm_name << ") failed: " << strerror(err));
+  }
+
+  void* p = mmap(NULL, sizeof(MetricsFormat::Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  int err = errno;
+
+  close(fd);
+
+  if ( p == MAP_FAILED ) {
+    shm_unlink(m_shm_name.c_str());
+    UMAP_ERROR("mmap(" << m_shm_name << ") failed: " << strerror(err));
+  }
+
+  m_segment = (MetricsFormat::Segment*)p;
+  m_segment->version = MetricsFormat::VERSION;
+  m_segment->pid = (uint32_t)getpid();
+  m_segment->seq = 0;
+  __atomic_store_n(&m_segment->magic, MetricsFormat::MAGIC, __ATOMIC_RELEASE);
+}
+
+void Monitor::run( void )
+{
+  m_rm.get_monitor_placement().apply();
+
+  pthread_mutex_lock(&m_mutex);
+
+  while ( m_running ) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += m_interval_ms / 1000;
+    ts.tv_nsec += (m_interval_ms % 1000) * 1000000L;
+    if ( ts.tv_nsec >= 1000000000L ) {
+      ts.tv_sec += 1;
+      ts.tv_nsec -= 1000000000L;
+    }
+
+    if ( pthread_cond_timedwait(&m_cond, &m_mutex, &ts) != ETIMEDOUT )
+      continue;
+
+    pthread_mutex_unlock(&m_mutex);
+    sample();
+    pthread_mutex_lock(&m_mutex);
+  }
+
+  pthread_mutex_unlock(&m_mutex);
+}
+
+//
+// The first sample has no rates, it only sets the counters the next one
+// starts from.
+//
+void Monitor::sample( void )
+{
+  MetricsFormat::Segment m;
+  struct umap_stats s;
+
+  memset(&m, 0, sizeof(m));
+
+  if ( ! m_rm.sample_metrics(&s, &m) )
+    return;
+
+  uint64_t now = now_ns();
+
+  m.time_ns = now;
+  m.interval_ns = ( m_samples != 0 ) ? now - m_last_time : 0;
+  m.samples = ++m_samples;
+
+  m.buffer_pages = m_buffer->size();
+  m.resident_pages = s.resident_pages;
+  m.dirty_pages = s.dirty_pages;
+  m.pinned_pages = s.pinned_pages;
+  m.high_water_pages = m_buffer->high_water();
+  m.low_water_pages = m_buffer->low_water();
+  m.fill_queue_depth = s.fill_queue_depth;
+  m.evict_queue_depth = s.evict_queue_depth;
+
+  m.faults = s.faults;
+  m.spurious_faults = s.spurious_faults;
+  m.fills = s.fills;
+  m.prefetches = s.prefetches;
+  m.evictions = s.evictions;
+  m.writebacks = s.writebacks;
+  m.bytes_read = s.bytes_read;
+  m.bytes_written = s.bytes_written;
+  m.free_page_waits = s.free_page_waits;
+  m.high_water_crossings = m_buffer->high_water_crossings();
+  m.low_water_crossings = m_buffer->low_water_crossings();
+
+  if ( m.interval_ns != 0 ) {
+    double seconds = m.interval_ns / 1e9;
+
+    m.fault_rate = (s.faults - m_last.faults) / seconds;
+    m.fill_rate = (s.fills - m_last.fills) / seconds;
+    m.eviction_rate = (s.evictions - m_last.evictions) / seconds;
+    m.writeback_rate = (s.writebacks - m_last.writebacks) / seconds;
+    m.read_bytes_rate = (s.bytes_read - m_last.bytes_read) / seconds;
+    m.write_bytes_rate = (s.bytes_written - m_last.bytes_written) / seconds;
+
+    //
+    // A fault is a hit when it did not have to wait for its page to be
+    // read, i.e. the page was filled by another fault or by a prefetch
+    //
+    uint64_t faults = s.faults - m_last.faults;
+    uint64_t demand_fills = (s.fills - m_last.fills) - (s.prefetches - m_last.prefetches);
+
+    if ( faults != 0 )
+      m.hit_ratio = (double)(faults - std::min(faults, demand_fills)) / faults;
+  }
+
+  if ( m.buffer_pages != 0 )
+    m.dirty_ratio = (double)m.dirty_pages / m.buffer_pages;
+
+  if ( m_segment != nullptr ) {
+    const size_t first = offsetof(MetricsFormat::Segment, time_ns);
+    uint64_t seq = m_segment->seq;
+
+    __atomic_store_n(&m_segment->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char*)m_segment + first, (char*)&m + first, sizeof(m) - first);
+    __atomic_store_n(&m_segment->seq, seq + 2, __ATOMIC_RELEASE);
+  }
+
+  m_last = s;
+  m_last_time = now;
+
+  if ( m_log_interval_ms != 0 && now - m_last_log_time >= m_log_interval_ms * 1000000 ) {
+    log(m);
+    m_last_log_time = now;
+  }
+}
+
+void Monitor::log( const MetricsFormat::Segment& m )
+{
+  UMAP_LOG(Info, "resident pages: " << m.resident_pages << " of " << m.buffer_pages
+      << ", dirty pages: " << m.dirty_pages
+      << ", faults/s: " << (uint64_t)m.fault_rate
+      << ", fills/s: " << (uint64_t)m.fill_rate
+      << ", evictions/s: " << (uint64_t)m.eviction_rate
+      << ", writebacks/s: " << (uint64_t)m.writeback_rate
+      << ", hit ratio: " << m.hit_ratio
+      << ", faults: " << m.faults);
+}
+
+} // end of namespace Umap
@@ -0,0 +1,68 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_Monitor_HPP
+#define _UMAP_Monitor_HPP
+
+#include <cstdint>
+#include <pthread.h>
+#include <string>
+
+#include "umap/umap.h"
+#include "umap/util/MetricsFormat.hpp"
+
+namespace Umap {
+  class Buffer;
+  class RegionManager;
+
+  //
+  // Background thread that samples the statistics of a context every
+  // UMAP_MONITOR_INTERVAL_MS milliseconds.  Each sample is published to the
+  // shared memory segment named by UMAP_METRICS_SHM, if any, for an agent to
+  // read without involving the process, and every UMAP_MONITOR_FREQ seconds
+  // a summary is logged.
+  //
+  // Samples are taken without blocking on the mutex of the RegionManager,
+  // which is held while the engine stops, so a sample is skipped while
+  // regions are being mapped or unmapped.
+  //
+  class Monitor {
+    public:
+      Monitor( RegionManager& rm, Buffer* buffer, uint64_t interval_ms
+             , uint64_t log_interval_ms, const std::string& shm_name );
+      ~Monitor( void );
+
+    private:
+      RegionManager& m_rm;
+      Buffer* m_buffer;
+      uint64_t m_interval_ms;
+      uint64_t m_log_interval_ms;     // 0 to never log
+      std::string m_shm_name;         // Empty without a segment
+      MetricsFormat::Segment* m_segment;
+
+      struct umap_stats m_last;       // Of the sample before
+      uint64_t m_last_time;
+      uint64_t m_last_log_time;
+      uint64_t m_samples;
+
+      pthread_t m_thread;
+      pthread_mutex_t m_mutex;
+      pthread_cond_t m_cond;
+      bool m_running;
+
+      void run( void );
+      void sample( void );
+      void log( const MetricsFormat::Segment& m );
+      void open_segment( void );
+
+      static void* ThreadEntryFunc( void* This ) {
+        ((Monitor*)This)->run();
+        return NULL;
+      }
+  };
+} // end of namespace Umap
+
+#endif // _UMAP_Monitor_HPP
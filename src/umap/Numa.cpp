@@ -0,0 +1,205 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include <algorithm>              // sort()
+#include <dirent.h>
+#include <errno.h>
+#include <fstream>
+#include <linux/mempolicy.h>    // MPOL_PREFERRED
+#include <sstream>
+#include <stdlib.h>             // strtol()
+#include <string.h>             // strerror()
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "umap/Numa.hpp"
+#include "umap/RegionDescriptor.hpp"
+#include "umap/umap.h"
+#include "umap/util/Macros.hpp"
+#include "umap/util/ThreadPlacement.hpp"
+
+namespace Umap {
+
+Numa::Numa( void )
+{
+  DIR* dir = opendir("/sys/devices/system/node");
+
+  if ( dir != nullptr ) {
+    struct dirent* ent;
+
+    while ( (ent = readdir(dir)) != nullptr ) {
+      char* end;
+
+      if ( strncmp(ent->d_name, "node", 4) != 0 )
+        continue;
+
+      long id = strtol(ent->d_name + 4, &end, 10);
+      if ( end != ent->d_name + 4 && *end == '\0' )
+        m_node_ids.push_back((int)id);
+    }
+    closedir(dir);
+  }
+
+  std::sort(m_node_ids.begin(), m_node_ids.end());
+
+  //
+  // Without NUMA support in the kernel, everything is on a single node
+  //
+  if ( m_node_ids.empty() )
+    m_node_ids.push_back(0);
+
+  for ( uint64_t n = 0; n < m_node_ids.size(); ++n ) {
+    cpu_set_t cpus;
+    std::stringstream path;
+    std::string list;
+
+    path << "/sys/devices/system/node/node" << m_node_ids[n] << "/cpulist";
+    std::ifstream file(path.str());
+
+    if ( ! std::getline(file, list) || ! parse_cpu_list(list, &cpus) )
+      CPU_ZERO(&cpus);    // A node with memory only
+
+    for ( int cpu = 0; cpu < CPU_SETSIZE; ++cpu ) {
+      if ( CPU_ISSET(cpu, &cpus) ) {
+        if ( (int)m_cpu_node.size() <= cpu )
+          m_cpu_node.resize(cpu + 1, 0);
+        m_cpu_node[cpu] = (int)n;
+      }
+    }
+
+    m_node_cpus.push_back(cpus);
+  }
+
+  UMAP_LOG(Debug, m_node_ids.size() << " NUMA nodes");
+}
+
+int Numa::node_of_id( int node_id )
+{
+  for ( uint64_t n = 0; n < m_node_ids.size(); ++n )
+    if ( m_node_ids[n] == node_id )
+      return (int)n;
+  return -1;
+}
+
+uint16_t Numa::fill_node( RegionDescriptor* rd, char* paddr, pid_t tid )
+{
+  switch ( rd->numa_policy() ) {
+    default:
+    case UMAP_NUMA_LOCAL:
+      return node_of_thread(tid);
+
+    case UMAP_NUMA_INTERLEAVE:
+      //
+      // Pages are interleaved in runs, so that they may still be filled
+      // together
+      //
+      return (uint16_t)((rd->page_index(paddr) / rd->max_run_pages()) % m_node_ids.size());
+
+    case UMAP_NUMA_BIND:
+      return (uint16_t)rd->numa_node();
+  }
+}
+
+uint16_t Numa::node_of_cpu( int cpu )
+{
+  return ( cpu >= 0 && cpu < (int)m_cpu_node.size() ) ? (uint16_t)m_cpu_node[cpu] : 0;
+}
+
+//
+// The CPU a thread last ran on is field 39 of its stat file.  Threads that
+// fault are blocked until their page is filled, so this is where they are
+// about to touch it.  Since reading the file costs a system call or two,
+// what we found is remembered for a little while.
+//
+uint16_t Numa::node_of_thread( pid_t tid )
+{
+  const long CACHE_NS = 100 * 1000 * 1000;
+
+  struct Entry {
+    uint16_t node;
+    struct timespec when;
+  };
+  static thread_local std::unordered_map<pid_t, Entry> cache;
+
+  if ( m_node_ids.size() == 1 )
+    return 0;
+
+  if ( tid == 0 || tid == (pid_t)syscall(SYS_gettid) )
+    return node_of_cpu(sched_getcpu());
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+  auto it = cache.find(tid);
+  if ( it != cache.end() ) {
+    long age = (now.tv_sec - it->second.when.tv_sec) * 1000000000L
+                + (now.tv_nsec - it->second.when.tv_nsec);
+    if ( age < CACHE_NS )
+      return it->second.node;
+  }
+
+  //
+  // Keep the cache from growing without bound as threads come and go
+  //
+  const std::size_t MAX_CACHED_THREADS = 4096;
+  if ( cache.size() >= MAX_CACHED_THREADS )
+    cache.clear();
+
+  std::stringstream path;
+  std::string stat;
+  path << "/proc/self/task/" << tid << "/stat";
+  std::ifstream file(path.str());
+  std::getline(file, stat);
+
+  //
+  // The command name, in parentheses, may contain spaces
+  //
+  int cpu = -1;
+  std::string::size_type paren = stat.rfind(')');
+  if ( paren != std::string::npos ) {
+    std::stringstream fields(stat.substr(paren + 1));
+    std::string field;
+
+    for ( int i = 3; i <= 39 && (fields >> field); ++i )
+      if ( i == 39 )
+        cpu = atoi(field.c_str());
+  }
+
+  uint16_t node = node_of_cpu(cpu);
+  cache[tid] = Entry{ node, now };
+  return node;
+}
+
+//
+// The thread stays within the CPUs it was given (UMAP_FILLER_CPUS) when some
+// of them are on the node
+//
+void Numa::bind_thread( uint64_t node )
+{
+  cpu_set_t cpus;
+
+  if ( sched_getaffinity(0, sizeof(cpus), &cpus) == 0 )
+    CPU_AND(&cpus, &cpus, &m_node_cpus[node]);
+
+  if ( CPU_COUNT(&cpus) == 0 )
+    cpus = m_node_cpus[node];
+
+  if ( CPU_COUNT(&cpus) != 0 && sched_setaffinity(0, sizeof(cpus), &cpus) != 0 )
+    UMAP_LOG(Warning, "sched_setaffinity to node " << m_node_ids[node]
+        << " failed: " << strerror(errno));
+
+  const unsigned long BITS = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask(m_node_ids.back() / BITS + 1, 0);
+
+  mask[m_node_ids[node] / BITS] |= 1UL << (m_node_ids[node] % BITS);
+
+  if ( syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.data(), mask.size() * BITS + 1) != 0 )
+    UMAP_LOG(Warning, "set_mempolicy to node " << m_node_ids[node]
+        << " failed: " << strerror(errno));
+}
+} // end of namespace Umap
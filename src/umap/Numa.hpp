@@ -0,0 +1,64 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_Numa_HPP
+#define _UMAP_Numa_HPP
+
+#include <cstdint>
+#include <sched.h>
+#include <sys/types.h>
+#include <vector>
+
+namespace Umap {
+  class RegionDescriptor;
+
+  //
+  // NUMA topology of the system, as found in /sys/devices/system/node.
+  //
+  // UMAP_NUMA splits the fill workers into one group per node.  The kernel
+  // places a page filled with UFFDIO_COPY according to the memory policy of
+  // the thread doing the copy, so each group runs on the CPUs of its node and
+  // prefers its memory, and every fill is sent to the group of the node that
+  // the policy of its region picks for the page.
+  //
+  // Nodes are numbered densely from 0 here; node_id() gives the number the
+  // kernel knows a node by.
+  //
+  class Numa {
+    public:
+      Numa( void );
+
+      uint64_t num_nodes( void ) { return m_node_ids.size(); }
+      int node_id( uint64_t node ) { return m_node_ids[node]; }
+
+      //
+      // Node in [0, num_nodes()) that the page at paddr is to be filled on.
+      // tid is the thread that faulted on the page, 0 if not known.
+      //
+      uint16_t fill_node( RegionDescriptor* rd, char* paddr, pid_t tid );
+
+      //
+      // Runs the calling thread on the CPUs of node and has it allocate
+      // memory from that node while there is some
+      //
+      void bind_thread( uint64_t node );
+
+      //
+      // Dense node number of a node as known to the kernel, -1 if unknown
+      //
+      int node_of_id( int node_id );
+
+    private:
+      std::vector<int> m_node_ids;
+      std::vector<cpu_set_t> m_node_cpus;
+      std::vector<int> m_cpu_node;      // Dense node of each CPU
+
+      uint16_t node_of_cpu( int cpu );
+      uint16_t node_of_thread( pid_t tid );
+  };
+} // end of namespace Umap
+
+#endif // _UMAP_Numa_HPP
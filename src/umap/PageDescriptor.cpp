@@ -34,8 +34,11 @@ namespace Umap {
     state = FILLING;
   }
 
+  //
+  // A page LEAVING is PRESENT again when Buffer::keep_page() gives it back
+  //
   void PageDescriptor::set_state_present( void ) {
-    if ( state != FILLING && state != UPDATING )
+    if ( state != FILLING && state != UPDATING && state != LEAVING )
       UMAP_ERROR("Invalid state transition from: " << print_state());
     state = PRESENT;
   }
@@ -64,7 +67,7 @@ namespace Umap {
       if ( pd->deferred )
          os << ", DEFERRED";
       if ( pd->spurious_count )
-         os << ", spurious: " << pd->spurious_count;
+         os << ", spurious: " << (unsigned)pd->spurious_count;
 
       os << " }";
     }
@@ -7,21 +7,54 @@
 #ifndef _UMAP_PageDescriptor_HPP
 #define _UMAP_PageDescriptor_HPP
 
+#include <cstdint>
 #include <iostream>
 #include <string>
 
 namespace Umap {
+  class FlushFence;
   class RegionDescriptor;
 
-  struct PageDescriptor {
-    enum State { FREE = 0, FILLING, PRESENT, UPDATING, LEAVING };
+  //
+  // A descriptor fills one cache line.  The fields that are only used at
+  // different stages of the life of a page share their storage: a page is
+  // on a fill job, or has a prefetch waiting for it, while it is FILLING
+  // only, and is on an evict job, or has a flush waiting for it, once it
+  // has been filled.  The flags are bytes of their own, rather than bits,
+  // because the workers owning a page in transition change them without the
+  // lock of its shard.
+  //
+  struct alignas(64) PageDescriptor {
+    enum State : uint8_t { FREE = 0, FILLING, PRESENT, UPDATING, LEAVING };
     char*             page;
     RegionDescriptor* region;
+
+    //
+    // Bookkeeping of the Buffer replacement policy
+    //
+    PageDescriptor*   policy_prev;
+    PageDescriptor*   policy_next;
+
+    union {
+      PageDescriptor* fill_next;    // Next page of the same fill job
+      PageDescriptor* evict_next;   // Next page of the same eviction job
+    };
+    union {
+      FlushFence*     fill_fence;   // Prefetch request waiting for this page
+      FlushFence*     flush_fence;  // Flush request waiting for this page
+    };
+
+    uint32_t          frequency;
+    uint16_t          pin_count;    // Off the replacement policy while not 0
+    uint16_t          fill_node;    // Fill worker group, with UMAP_NUMA
     State             state;
     bool              dirty;
     bool              deferred;
     bool              data_present;
-    int               spurious_count;
+    bool              prefetched;   // Filled by read-ahead, not yet faulted on
+    bool              referenced;
+    uint8_t           policy_list;  // 0 when not on any list
+    uint8_t           spurious_count; // Saturates, for debugging
 
     std::string print_state( void ) const;
     void set_state_free( void );
@@ -31,6 +64,8 @@ namespace Umap {
     void set_state_leaving( void );
   };
 
+  static_assert(sizeof(PageDescriptor) == 64, "A PageDescriptor should fill one cache line");
+
   std::ostream& operator<<(std::ostream& os, const Umap::PageDescriptor::State st);
   std::ostream& operator<<(std::ostream& os, const Umap::PageDescriptor* pd);
 } // end of namespace Umap
@@ -0,0 +1,206 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include <algorithm>
+
+#include "umap/Buffer.hpp"
+#include "umap/Prefetcher.hpp"
+#include "umap/RegionManager.hpp"
+#include "umap/util/Macros.hpp"
+#include "umap/util/Trace.hpp"
+
+namespace Umap {
+Prefetcher::Prefetcher( RegionManager& rm, Buffer* buffer )
+  :   m_rm(rm), m_buffer(buffer), m_current(nullptr), m_running(true)
+{
+  pthread_mutex_init(&m_mutex, NULL);
+  pthread_cond_init(&m_cond, NULL);
+  pthread_cond_init(&m_done_cond, NULL);
+
+  if ( pthread_create(&m_thread, NULL, ThreadEntryFunc, this) != 0 )
+    UMAP_ERROR("Failed to launch the prefetcher thread");
+
+  if ( pthread_setname_np(m_thread, "Prefetcher") != 0 )
+    UMAP_ERROR("Failed to set thread name");
+}
+
+//
+// Requests that are still queued are processed before the thread leaves
+//
+Prefetcher::~Prefetcher( void )
+{
+  pthread_mutex_lock(&m_mutex);
+  m_running = false;
+  pthread_cond_signal(&m_cond);
+  pthread_mutex_unlock(&m_mutex);
+
+  (void) pthread_join(m_thread, NULL);
+
+  for ( auto w : m_warm_ups )
+    delete w;
+
+  pthread_mutex_destroy(&m_mutex);
+  pthread_cond_destroy(&m_cond);
+  pthread_cond_destroy(&m_done_cond);
+}
+
+FlushFence* Prefetcher::prefetch_async( FlushFence* f )
+{
+  Trace::record(TraceFormat::PREFETCH, f->start(), f->region()->start(), 0
+      , (f->end() - f->start() + f->region()->page_size() - 1) / f->region()->page_size());
+
+  pthread_mutex_lock(&m_mutex);
+  m_requests.push_back(f);
+  pthread_cond_signal(&m_cond);
+  pthread_mutex_unlock(&m_mutex);
+
+  return f;
+}
+
+void Prefetcher::warm_up( RegionDescriptor* rd, const std::vector<std::pair<uint64_t, uint64_t>>& extents
+                        , uint64_t batch_pages )
+{
+  if ( extents.empty() )
+    return;
+
+  WarmUp* w = new WarmUp{rd, extents, 0, extents[0].first, std::max<uint64_t>(batch_pages, 1)};
+
+  pthread_mutex_lock(&m_mutex);
+  m_warm_ups.push_back(w);
+  pthread_cond_signal(&m_cond);
+  pthread_mutex_unlock(&m_mutex);
+}
+
+//
+// Prefetches the next batch of a warm up and waits for it, so that it does
+// not swamp the fill workers.  Returns false once the warm up is done.
+//
+bool Prefetcher::warm_up_batch( WarmUp* w )
+{
+  RegionDescriptor* rd = w->region;
+  std::vector<FlushFence*> fences;
+  uint64_t pages = 0;
+
+  while ( w->next < w->extents.size() && pages < w->batch_pages ) {
+    uint64_t end = std::min(w->extents[w->next].second, w->next_page + w->batch_pages - pages);
+    FlushFence* f = new FlushFence(rd, rd->start() + w->next_page * rd->page_size()
+                                     , rd->start() + end * rd->page_size());
+
+    m_buffer->prefetch_range(f);
+    f->walk_done();
+    fences.push_back(f);
+
+    pages += end - w->next_page;
+    w->next_page = end;
+
+    if ( end == w->extents[w->next].second && ++w->next < w->extents.size() )
+      w->next_page = w->extents[w->next].first;
+  }
+
+  for ( auto f : fences ) {
+    f->wait();
+    delete f;
+  }
+
+  return w->next < w->extents.size() && ! rd->unmapping();
+}
+
+//
+// The region is being unmapped, so the request being processed stops at
+// its next page and those still queued are completed without prefetching
+//
+void Prefetcher::wait_for_region( RegionDescriptor* rd )
+{
+  std::deque<FlushFence*> dropped;
+
+  pthread_mutex_lock(&m_mutex);
+
+  for ( auto it = m_requests.begin(); it != m_requests.end(); ) {
+    if ( (*it)->region() == rd ) {
+      dropped.push_back(*it);
+      it = m_requests.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+
+  while ( m_current == rd )
+    pthread_cond_wait(&m_done_cond, &m_mutex);
+
+  //
+  // Warm ups are dropped once their batch in flight, if any, is done
+  //
+  for ( auto it = m_warm_ups.begin(); it != m_warm_ups.end(); ) {
+    if ( (*it)->region == rd ) {
+      delete *it;
+      it = m_warm_ups.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+
+  pthread_mutex_unlock(&m_mutex);
+
+  for ( auto f : dropped )
+    f->walk_done();
+}
+
+void Prefetcher::run( void )
+{
+  m_rm.get_umap_placement().apply();
+
+  pthread_mutex_lock(&m_mutex);
+
+  while ( 1 ) {
+    if ( ! m_requests.empty() ) {
+      FlushFence* f = m_requests.front();
+
+      m_requests.pop_front();
+      m_current = f->region();
+      pthread_mutex_unlock(&m_mutex);
+
+      //
+      // A detached fence may be gone once walk_done() returns
+      //
+      m_buffer->prefetch_range(f);
+      f->walk_done();
+
+      pthread_mutex_lock(&m_mutex);
+      m_current = nullptr;
+      pthread_cond_broadcast(&m_done_cond);
+      continue;
+    }
+
+    if ( ! m_warm_ups.empty() && m_running ) {
+      WarmUp* w = m_warm_ups.front();
+
+      m_current = w->region;
+      pthread_mutex_unlock(&m_mutex);
+
+      bool more = warm_up_batch(w);
+
+      pthread_mutex_lock(&m_mutex);
+      if ( ! more ) {
+        UMAP_LOG(Debug, "warm up of " << (void*)w->region->start() << " done");
+        m_warm_ups.pop_front();
+        delete w;
+      }
+      m_current = nullptr;
+      pthread_cond_broadcast(&m_done_cond);
+      continue;
+    }
+
+    if ( ! m_running )
+      break;
+
+    pthread_cond_wait(&m_cond, &m_mutex);
+  }
+
+  pthread_mutex_unlock(&m_mutex);
+}
+} // end of namespace Umap
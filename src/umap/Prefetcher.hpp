@@ -0,0 +1,87 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_Prefetcher_HPP
+#define _UMAP_Prefetcher_HPP
+
+#include <cstdint>
+#include <deque>
+#include <pthread.h>
+#include <utility>
+#include <vector>
+
+#include "umap/Flusher.hpp"
+#include "umap/RegionDescriptor.hpp"
+
+namespace Umap {
+  class Buffer;
+  class RegionManager;
+
+  //
+  // Background thread that processes the requests of umap_prefetch_range(),
+  // so that the application does not wait for free page descriptors.  A
+  // request is a FlushFence over the range, complete once the pages that
+  // were not present have been filled.
+  //
+  // It also warms regions up with the pages they had in the Buffer when
+  // last unmapped, see RegionManager::warm_up(), between the requests.
+  //
+  class Prefetcher {
+    public:
+      Prefetcher( RegionManager& rm, Buffer* buffer );
+      ~Prefetcher( void );
+
+      //
+      // Queues the prefetch request of the fence and returns it
+      //
+      FlushFence* prefetch_async( FlushFence* fence );
+
+      //
+      // Queues the prefetch of the runs [first, end) of page indices of rd,
+      // in order.  At most batch_pages pages are in flight at a time, and
+      // the requests queued meanwhile are served first.
+      //
+      void warm_up( RegionDescriptor* rd, const std::vector<std::pair<uint64_t, uint64_t>>& extents
+                  , uint64_t batch_pages );
+
+      //
+      // Drops the queued requests for rd and waits for the one being
+      // processed, if for rd, before rd goes away
+      //
+      void wait_for_region( RegionDescriptor* rd );
+
+    private:
+      RegionManager& m_rm;
+      Buffer* m_buffer;
+
+      pthread_t m_thread;
+      pthread_mutex_t m_mutex;
+      pthread_cond_t m_cond;
+      pthread_cond_t m_done_cond;
+      std::deque<FlushFence*> m_requests;
+      RegionDescriptor* m_current;  // Region of the request being processed
+      bool m_running;
+
+      struct WarmUp {
+        RegionDescriptor* region;
+        std::vector<std::pair<uint64_t, uint64_t>> extents;
+        uint64_t next;              // Extent, or page of it, prefetched next
+        uint64_t next_page;
+        uint64_t batch_pages;
+      };
+      std::deque<WarmUp*> m_warm_ups;
+
+      void run( void );
+      bool warm_up_batch( WarmUp* w );
+
+      static void* ThreadEntryFunc( void* This ) {
+        ((Prefetcher*)This)->run();
+        return NULL;
+      }
+  };
+} // end of namespace Umap
+
+#endif // _UMAP_Prefetcher_HPP
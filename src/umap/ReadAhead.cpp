@@ -0,0 +1,352 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include "umap/ReadAhead.hpp"
+#include "umap/util/Macros.hpp"
+
+namespace Umap {
+
+ReadAhead::ReadAhead( uint64_t num_pages, uint64_t max_window )
+  :   m_num_pages(num_pages)
+    , m_max_window(max_window)
+    , m_window( (max_window < 4) ? max_window : 4 )
+    , m_clock(0)
+    , m_last(-1)
+    , m_d1(0)
+    , m_d2(0)
+    , m_expect(-1)
+    , m_expect_last(0)
+    , m_expect_d1(0)
+    , m_expect_d2(0)
+    , m_pending(0)
+    , m_num_deltas(0)
+    , m_degree( (max_window < 4) ? max_window : 4 )
+    , m_issued(0)
+    , m_used(0)
+    , m_throttled_faults(0)
+    , m_issued_total(0)
+    , m_used_total(0)
+{
+  for ( auto& s : m_streams )
+    s = { 0, 0, 0, false, 0 };
+
+  for ( auto& c : m_correlations )
+    c = { 0, 0, 0, 0 };
+}
+
+ReadAhead::~ReadAhead( void )
+{
+  if ( m_issued_total != 0 )
+    UMAP_LOG(Info, "Read-ahead pages: " << m_issued_total << ", reached: " << m_used_total);
+}
+
+//
+// True if page is the next fault expected from stream s: either one stride
+// past its latest fault or, once it has been confirmed, any page up to the
+// end of what has been prefetched for it.
+//
+bool ReadAhead::follows( Stream& s, uint64_t page )
+{
+  if ( s.stride == 0 )
+    return false;
+
+  int64_t d = (int64_t)page - s.last;
+
+  if ( d % s.stride != 0 || d / s.stride <= 0 )
+    return false;
+
+  if ( d == s.stride )
+    return true;
+
+  return s.confirmed && d / s.stride <= (s.next - s.last) / s.stride;
+}
+
+//
+// True if page has been prefetched for stream s and has not been reached yet
+//
+bool ReadAhead::in_window( Stream& s, uint64_t page )
+{
+  if ( ! s.confirmed )
+    return false;
+
+  int64_t d = (int64_t)page - s.last;
+
+  return d % s.stride == 0 && d / s.stride > 0
+      && d / s.stride < (s.next - s.last) / s.stride;
+}
+
+void ReadAhead::grow( void )
+{
+  m_window = (m_window * 2 > m_max_window) ? m_max_window : m_window * 2;
+}
+
+void ReadAhead::shrink( void )
+{
+  m_window = (m_window > 1) ? m_window / 2 : 1;
+}
+
+void ReadAhead::issued( uint64_t num_pages )
+{
+  m_issued += num_pages;
+  m_issued_total += num_pages;
+
+  if ( m_issued > 4096 ) {
+    m_issued /= 2;
+    m_used /= 2;
+  }
+}
+
+void ReadAhead::used( uint64_t num_pages )
+{
+  m_used_total += num_pages;
+  m_used = ( m_used + num_pages > m_issued ) ? m_issued : m_used + num_pages;
+}
+
+bool ReadAhead::throttled( void )
+{
+  return m_issued >= 64 && m_used * 4 < m_issued;
+}
+
+ReadAhead::Correlation& ReadAhead::correlation( int64_t d1, int64_t d2 )
+{
+  uint64_t h = ((uint64_t)d1 * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)d2;
+
+  return m_correlations[(h ^ (h >> 29)) % NUM_CORRELATIONS];
+}
+
+//
+// Called for the faults that no confirmed stream followed.  Learns the
+// delta from the previous such fault and predicts up to m_degree pages by
+// walking the table from the latest two deltas.
+//
+bool ReadAhead::correlate( uint64_t page, Window* w )
+{
+  if ( m_expect != -1 ) {
+    if ( (int64_t)page == m_expect ) {
+      //
+      // The predicted pages were reached without faulting, carry on as if
+      // they had
+      //
+      used(m_pending);
+      m_last = m_expect_last;
+      m_d1 = m_expect_d1;
+      m_d2 = m_expect_d2;
+
+      if ( m_degree * 2 <= (uint64_t)MAX_PATTERN_PAGES && m_degree * 2 <= m_max_window )
+        m_degree *= 2;
+    }
+    else if ( m_degree > 1 ) {
+      m_degree /= 2;
+    }
+    m_expect = -1;
+  }
+
+  if ( m_last == -1 ) {
+    m_last = page;
+    return false;
+  }
+
+  int64_t d = (int64_t)page - m_last;
+
+  if ( d == 0 )
+    return false;
+
+  if ( m_num_deltas == 2 ) {
+    Correlation& c = correlation(m_d1, m_d2);
+
+    if ( c.confidence != 0 && c.d1 == m_d1 && c.d2 == m_d2 ) {
+      if ( c.next == d ) {
+        if ( c.confidence < 3 )
+          ++c.confidence;
+      }
+      else if ( --c.confidence == 0 ) {
+        c.next = d;
+        c.confidence = 1;
+      }
+    }
+    else {
+      c = { m_d1, m_d2, d, 1 };
+    }
+  }
+  else {
+    ++m_num_deltas;
+  }
+
+  m_d1 = m_d2;
+  m_d2 = d;
+  m_last = page;
+
+  if ( m_num_deltas < 2 || throttled() )
+    return false;
+
+  int64_t p = page;
+  int64_t d1 = m_d1;
+  int64_t d2 = m_d2;
+  uint64_t n = 0;
+
+  while ( n < m_degree ) {
+    Correlation& c = correlation(d1, d2);
+
+    if ( c.confidence < 2 || c.d1 != d1 || c.d2 != d2 )
+      break;
+    if ( p + c.next < 0 || p + c.next >= (int64_t)m_num_pages )
+      break;
+
+    p += c.next;
+    w->pages[n++] = p;
+    d1 = d2;
+    d2 = c.next;
+  }
+
+  if ( n == 0 )
+    return false;
+
+  //
+  // The prediction is confirmed by a fault on the page that the table
+  // predicts after the last predicted page
+  //
+  Correlation& c = correlation(d1, d2);
+
+  if ( c.confidence >= 2 && c.d1 == d1 && c.d2 == d2 ) {
+    m_expect = p + c.next;
+    m_expect_last = p;
+    m_expect_d1 = d1;
+    m_expect_d2 = d2;
+    m_pending = n;
+  }
+
+  w->first = w->pages[0];
+  w->count = n;
+  w->stride = 0;
+  issued(n);
+
+  UMAP_LOG(Debug, "page: " << page << ", predicted: " << n << ", first: " << w->first);
+  return true;
+}
+
+bool ReadAhead::on_fault( uint64_t page, Window* w )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  Stream* lru = &m_streams[0];
+  Stream* closest = nullptr;
+  uint64_t closest_distance = m_max_window + 1;
+
+  ++m_clock;
+
+  //
+  // While throttled, nothing is prefetched that could show whether
+  // predictions have become useful again, so the count decays instead
+  //
+  if ( throttled() && ++m_throttled_faults % 256 == 0 )
+    m_issued /= 2;
+
+  for ( auto& s : m_streams ) {
+    if ( follows(s, page) ) {
+      if ( s.confirmed ) {
+        //
+        // The pages prefetched between the previous fault and this one
+        // have been read
+        //
+        int64_t steps = ((int64_t)page - s.last) / s.stride - 1;
+        int64_t ahead = (s.next - s.last) / s.stride - 1;
+
+        if ( steps > ahead )
+          steps = ahead;
+        if ( steps > 0 )
+          used(steps);
+
+        if ( ! throttled() )
+          grow();
+      }
+
+      s.confirmed = true;
+      s.last = page;
+      s.used = m_clock;
+
+      //
+      // Prefetch the pages from the first one not yet prefetched up to one
+      // window past this fault, staying within the region.
+      //
+      int64_t first_step = (s.next - s.last) / s.stride;
+      int64_t last_step = m_window;
+      int64_t max_step = (s.stride > 0)
+                          ? ((int64_t)m_num_pages - 1 - s.last) / s.stride
+                          : s.last / -s.stride;
+
+      if ( first_step < 1 )
+        first_step = 1;
+
+      if ( last_step > max_step )
+        last_step = max_step;
+
+      if ( last_step < first_step )
+        return false;
+
+      w->first = s.last + first_step * s.stride;
+      w->count = last_step - first_step + 1;
+      w->stride = s.stride;
+      s.next = s.last + (last_step + 1) * s.stride;
+
+      issued(w->count);
+
+      UMAP_LOG(Debug, "page: " << page << ", stride: " << w->stride
+          << ", first: " << w->first << ", count: " << w->count);
+      return true;
+    }
+
+    if ( (uint64_t)s.last == page )
+      return false;
+
+    if ( ! s.confirmed ) {
+      uint64_t distance = (page > (uint64_t)s.last) ? (page - s.last) : (s.last - page);
+
+      if ( distance < closest_distance ) {
+        closest_distance = distance;
+        closest = &s;
+      }
+    }
+
+    if ( s.used < lru->used )
+      lru = &s;
+  }
+
+  if ( closest != nullptr ) {
+    //
+    // Second fault of a possible stream: remember its stride
+    //
+    closest->stride = (int64_t)page - closest->last;
+    closest->next = page + closest->stride;
+  }
+  else {
+    //
+    // This fault belongs to no stream that we know of
+    //
+    shrink();
+    closest = lru;
+    closest->stride = 0;
+    closest->next = page + 1;
+  }
+
+  closest->last = page;
+  closest->confirmed = false;
+  closest->used = m_clock;
+
+  return correlate(page, w);
+}
+
+void ReadAhead::on_evict( uint64_t page )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  for ( auto& s : m_streams ) {
+    if ( in_window(s, page) ) {
+      UMAP_LOG(Debug, "unused page: " << page << ", window: " << m_window);
+      shrink();
+      return;
+    }
+  }
+}
+} // end of namespace Umap
@@ -0,0 +1,130 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_ReadAhead_HPP
+#define _UMAP_ReadAhead_HPP
+
+#include <cstdint>
+#include <mutex>
+
+namespace Umap {
+  //
+  // Detects sequential and strided streams of faults within one region and
+  // tells the caller which pages to fill ahead of the faulting thread.
+  //
+  // Once a page has been prefetched, reading it no longer faults, so the
+  // only evidence of a successful read-ahead is the next fault of the
+  // stream arriving at (or just before) the end of the prefetched window.
+  // Each such hit doubles the window, up to the configured maximum.  Faults
+  // that belong to no stream, and prefetched pages that are evicted before
+  // their stream reached them, halve it.
+  //
+  // Faults that follow no stream feed a small delta correlation table
+  // instead: the delta between two such faults is remembered for the two
+  // deltas that preceded it, so that a pattern of irregular but recurring
+  // steps (e.g. alternating strides, or several streams merged) predicts
+  // the next pages once it has been seen twice.  A prediction is confirmed
+  // when the next such fault lands just past the predicted pages.
+  //
+  // The prefetched pages and those that were reached are counted.  When
+  // fewer than a quarter of them are, the windows stop growing and no
+  // correlation is predicted, until enough faults have gone by for the
+  // count to decay.
+  //
+  // Faults reach us in the order of their addresses within a batch of
+  // events (see Uffd::uffd_handler()).  Page numbers are indices of umap
+  // pages within the region.
+  //
+  class ReadAhead {
+    public:
+      static const int MAX_PATTERN_PAGES = 16;
+
+      //
+      // Pages first + i * stride for i < count, or pages[i] if stride is 0
+      //
+      struct Window {
+        uint64_t first;
+        uint64_t count;
+        int64_t  stride;
+        uint64_t pages[MAX_PATTERN_PAGES];
+      };
+
+      ReadAhead( uint64_t num_pages, uint64_t max_window );
+      ~ReadAhead( void );
+
+      //
+      // Called for every fault on the region.  Returns true and sets *w if
+      // pages should be prefetched.
+      //
+      bool on_fault( uint64_t page, Window* w );
+
+      //
+      // Called when a prefetched page is evicted without having faulted
+      //
+      void on_evict( uint64_t page );
+
+      uint64_t window( void ) { return m_window; }
+      uint64_t max_window( void ) { return m_max_window; }
+      uint64_t pages_issued( void ) { return m_issued_total; }
+      uint64_t pages_used( void ) { return m_used_total; }
+
+    private:
+      static const int NUM_STREAMS = 8;
+      static const int NUM_CORRELATIONS = 64;
+
+      struct Stream {
+        int64_t  last;        // Page of the latest fault of the stream
+        int64_t  stride;      // 0 until a second fault has been seen
+        int64_t  next;        // First page that has not been prefetched
+        bool     confirmed;   // The stride has been seen twice
+        uint64_t used;        // For replacement of the least recently used
+      };
+
+      struct Correlation {
+        int64_t  d1;          // Delta before the previous one
+        int64_t  d2;          // Previous delta
+        int64_t  next;        // Delta that followed them
+        uint8_t  confidence;  // Predicts from 2, up to 3
+      };
+
+      std::mutex m_mutex;
+      Stream   m_streams[NUM_STREAMS];
+      uint64_t m_num_pages;
+      uint64_t m_max_window;
+      uint64_t m_window;
+      uint64_t m_clock;
+
+      Correlation m_correlations[NUM_CORRELATIONS];
+      int64_t  m_last;        // Latest fault that no stream followed, -1 if none
+      int64_t  m_d1;
+      int64_t  m_d2;
+      int64_t  m_expect;      // Fault that confirms the last prediction, -1 if none
+      int64_t  m_expect_last; // Last page of the last prediction
+      int64_t  m_expect_d1;   // Deltas at the end of the last prediction
+      int64_t  m_expect_d2;
+      uint64_t m_pending;     // Pages of the last prediction
+      int      m_num_deltas;  // Deltas seen, up to 2
+      uint64_t m_degree;      // Pages predicted at a time
+
+      uint64_t m_issued;      // Decayed counts of prefetched pages
+      uint64_t m_used;        // and of those that were reached
+      uint64_t m_throttled_faults;
+      uint64_t m_issued_total;
+      uint64_t m_used_total;
+
+      bool follows( Stream& s, uint64_t page );
+      bool in_window( Stream& s, uint64_t page );
+      void grow( void );
+      void shrink( void );
+      bool correlate( uint64_t page, Window* w );
+      Correlation& correlation( int64_t d1, int64_t d2 );
+      void issued( uint64_t num_pages );
+      void used( uint64_t num_pages );
+      bool throttled( void );
+  };
+} // end of namespace Umap
+
+#endif // _UMAP_ReadAhead_HPP
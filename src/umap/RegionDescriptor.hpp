@@ -7,27 +7,110 @@
 #ifndef _UMAP_RegionDescriptor_HPP
 #define _UMAP_RegionDescriptor_HPP
 
+#include <atomic>
 #include <cassert>
 #include <cstdint>
-#include <pthread.h>
+#include <map>
+#include <mutex>
+#include <string>
 #include <string.h>
-#include <unordered_set>
+#include <sys/mman.h>           // mincore()
+#include <unistd.h>             // sysconf()
+#include <vector>
 
 #include "umap/PageDescriptor.hpp"
+#include "umap/ReadAhead.hpp"
 #include "umap/store/Store.hpp"
+#include "umap/umap.h"
 #include "umap/util/Macros.hpp"
 
 namespace Umap {
+  //
+  // Each region keeps a two-level table that maps every umap page of the
+  // region to the descriptor of the page while it is in the Buffer.  The
+  // directory is allocated with the region; the leaf chunks are allocated
+  // lazily the first time one of their pages is faulted in, so sparse
+  // accesses to very large regions only pay for the chunks they touch.
+  //
+  // A slot is only ever modified with the lock of the Buffer shard owning
+  // its page held.  Reads that do not hold that lock (e.g. when walking the
+  // table) must re-validate the slot after acquiring the lock.
+  //
+  // Alongside the table, each chunk has a bitmap of its dirty pages and a
+  // count of them, so that flushes only visit the pages that need to be
+  // written back.  A bit is set when the page is first written to and
+  // cleared once it has been written back; as with the table, a walker must
+  // still check the descriptor under the shard lock.  A second bitmap of the
+  // chunk remembers the pages written since the last umap_snapshot() of the
+  // region, written back or not.
+  //
   class RegionDescriptor {
     public:
+      typedef std::atomic<PageDescriptor*> PageSlot;
+
+      static const uint64_t CHUNK_SHIFT = 12;
+      static const uint64_t CHUNK_PAGES = (1UL << CHUNK_SHIFT);
+      static const uint64_t CHUNK_WORDS = (CHUNK_PAGES / 64);
+
       RegionDescriptor(   char* umap_region, uint64_t umap_size
                         , char* mmap_region, uint64_t mmap_size
-                        , Store* store )
+                        , Store* store, uint64_t page_size
+                        , std::atomic<uint64_t>* over_quota_count
+                        , uint64_t read_ahead
+                        , uint64_t max_run_pages
+                        , bool huge_pages )
         : m_umap_region(umap_region), m_umap_region_size(umap_size)
         , m_mmap_region(mmap_region), m_mmap_region_size(mmap_size)
-        , m_store(store) {}
+        , m_store(store), m_page_size(page_size)
+        , m_num_pages(umap_size / page_size)
+        , m_max_run_pages(max_run_pages)
+        , m_huge_pages(huge_pages)
+        , m_num_chunks((m_num_pages + CHUNK_PAGES - 1) / CHUNK_PAGES)
+        , m_count(0)
+        , m_num_dirty(0)
+        , m_min_pages(0)
+        , m_max_pages(0)
+        , m_numa_policy(0)
+        , m_numa_node(0)
+        , m_over_quota_count(over_quota_count)
+        , m_read_ahead(nullptr)
+        , m_unmapping(false)
+        , m_read_only(false)
+        , m_shared_fd(-1)
+        , m_shared_claims(nullptr)
+        , m_advised(0)
+        , m_bytes_read(0)
+        , m_bytes_written(0)
+        , m_pages_written(0)
+      {
+        if ( read_ahead != 0 )
+          m_read_ahead = new ReadAhead(m_num_pages, read_ahead);
 
-      ~RegionDescriptor( void ) {}
+        m_page_table = new std::atomic<PageSlot*>[m_num_chunks];
+        m_dirty_map = new std::atomic<std::atomic<uint64_t>*>[m_num_chunks];
+        m_chunk_dirty = new std::atomic<uint64_t>[m_num_chunks];
+        m_chunk_changed = new std::atomic<uint64_t>[m_num_chunks];
+
+        for ( uint64_t i = 0; i < m_num_chunks; ++i ) {
+          m_page_table[i] = nullptr;
+          m_dirty_map[i] = nullptr;
+          m_chunk_dirty[i] = 0;
+          m_chunk_changed[i] = 0;
+        }
+      }
+
+      ~RegionDescriptor( void ) {
+        for ( uint64_t i = 0; i < m_num_chunks; ++i ) {
+          delete [] m_page_table[i].load();
+          delete [] m_dirty_map[i].load();
+        }
+
+        delete [] m_page_table;
+        delete [] m_dirty_map;
+        delete [] m_chunk_dirty;
+        delete [] m_chunk_changed;
+        delete m_read_ahead;
+      }
 
       inline uint64_t store_offset( char* addr ) {
         assert("Invalid address for calculating offset" && addr >= start() && addr < end());
@@ -38,27 +121,324 @@ namespace Umap {
       inline Store*   store( void )    { return m_store;                    }
       inline char*    start( void )    { return m_umap_region;              }
       inline char*    end( void )      { return start() + size();           }
-      inline uint64_t count( void )    { return m_active_pages.size();      }
+      inline uint64_t count( void )    { return m_count;                    }
+      inline uint64_t page_size( void ) { return m_page_size;               }
+      inline uint64_t num_pages( void ) { return m_num_pages;               }
+      inline uint64_t max_run_pages( void ) { return m_max_run_pages;       }
+
+      //
+      // Backed by hugetlb pages, which cannot take the zero page and must be
+      // copied in, protected and released whole
+      //
+      inline bool     huge_pages( void ) { return m_huge_pages;             }
+      inline uint64_t min_pages( void ) { return m_min_pages;               }
+      inline uint64_t max_pages( void ) { return m_max_pages;               }
+      inline ReadAhead* read_ahead( void ) { return m_read_ahead;           }
+
+      //
+      // Set before the pages of the region are evicted for uunmap().  A
+      // fault handler that looked the region up just before may still be
+      // working on it (read-ahead in particular), and must no longer bring
+      // pages in once the Buffer has been drained of them.
+      //
+      inline void set_unmapping( void ) { m_unmapping = true;               }
+      inline bool unmapping( void )     { return m_unmapping;               }
+
+      //
+      // A region mapped PROT_READ cannot be written, so it takes missing
+      // page faults only: its pages are filled without write protection, may
+      // be the zero page, and are never dirty.
+      //
+      inline void set_read_only( void ) { m_read_only = true;               }
+      inline bool read_only( void )     { return m_read_only;               }
+
+      //
+      // Serializes the scans for written pages of the region, see
+      // Buffer::collect_written_pages()
+      //
+      inline std::mutex& scan_mutex( void ) { return m_scan_mutex;        }
+
+      //
+      // A UMAP_SHARED region maps the shared memory object name, open as fd,
+      // in which the processes mapping the same file find the pages filled
+      // by any of them.  Such regions are read-only and not write protected.
+      // The object also holds a word per page, claimed by the process that
+      // fills the page, see FillWorkers::claim_shared_pages().
+      //
+      inline void set_shared( int fd, const std::string& name, std::atomic<uint32_t>* claims ) {
+        m_shared_fd = fd;
+        m_shared_name = name;
+        m_shared_claims = claims;
+      }
+      inline bool shared( void )        { return m_shared_fd != -1;         }
+      inline int  shared_fd( void )     { return m_shared_fd;               }
+      inline const std::string& shared_name( void ) { return m_shared_name; }
+      inline std::atomic<uint32_t>* shared_claim( char* page ) {
+        return &m_shared_claims[page_index(page)];
+      }
+      inline std::atomic<uint32_t>* shared_claims( void ) { return m_shared_claims; }
+
+      //
+      // The claims follow the pages in the shared memory object
+      //
+      static uint64_t shared_claims_size( uint64_t num_pages ) {
+        uint64_t sys_psize = sysconf(_SC_PAGESIZE);
+        return (num_pages * sizeof(uint32_t) + sys_psize - 1) / sys_psize * sys_psize;
+      }
+
+      //
+      // Pages of a shared region are resident as long as its shared memory
+      // holds them, whichever process filled them
+      //
+      bool shared_resident( char* page, uint64_t len ) {
+        uint64_t sys_psize = sysconf(_SC_PAGESIZE);
+        std::vector<unsigned char> vec(len / sys_psize);
+
+        if ( mincore(page, len, vec.data()) == -1 )
+          UMAP_ERROR("mincore failed: " << strerror(errno));
+
+        for ( auto v : vec )
+          if ( ! (v & 1) )
+            return false;
+        return true;
+      }
+
+      //
+      // Advice given with umap_advise() is kept as runs of pages [first, end)
+      // keyed by their first page, which do not overlap.  Pages outside of
+      // the runs have UMAP_ADVICE_NORMAL.  The fault handlers and evictors
+      // only look the runs up for regions that have some.
+      //
+      void set_advice( uint64_t first, uint64_t end, int advice ) {
+        std::lock_guard<std::mutex> lock(m_advice_mutex);
+        auto it = m_advice.lower_bound(first);
+
+        //
+        // A run starting before first keeps its head, and its tail past
+        // end if it has one
+        //
+        if ( it != m_advice.begin() ) {
+          auto prev = std::prev(it);
+
+          if ( prev->second.end > first ) {
+            if ( prev->second.end > end )
+              m_advice[end] = AdviceRun{prev->second.end, prev->second.advice};
+            prev->second.end = first;
+          }
+        }
+
+        while ( it != m_advice.end() && it->first < end ) {
+          if ( it->second.end > end )
+            m_advice[end] = AdviceRun{it->second.end, it->second.advice};
+          it = m_advice.erase(it);
+        }
+
+        if ( advice != UMAP_ADVICE_NORMAL )
+          m_advice[first] = AdviceRun{end, advice};
+
+        int advised = 0;
+
+        for ( auto& run : m_advice )
+          advised |= 1 << run.second.advice;
+        m_advised = advised;
+      }
+
+      int advice( uint64_t idx ) {
+        if ( m_advised == 0 )
+          return UMAP_ADVICE_NORMAL;
+
+        std::lock_guard<std::mutex> lock(m_advice_mutex);
+        auto it = m_advice.upper_bound(idx);
+
+        if ( it == m_advice.begin() || idx >= (--it)->second.end )
+          return UMAP_ADVICE_NORMAL;
+        return it->second.advice;
+      }
+
+      inline bool has_advice( void ) { return m_advised != 0;             }
+
+      //
+      // Some pages of the region have been given this advice
+      //
+      inline bool advised( int advice ) { return ( m_advised & (1 << advice) ) != 0; }
+
+      inline uint64_t page_index( char* page ) {
+        return store_offset(page) / m_page_size;
+      }
+
+      //
+      // A region may be guaranteed a minimum number of pages in the Buffer
+      // (they are only evicted when nothing else can be) and may be limited
+      // to a maximum (0 means unlimited).  The number of regions currently
+      // holding more than their maximum is kept in *m_over_quota_count.
+      //
+      inline void set_quota( uint64_t min_pages, uint64_t max_pages ) {
+        bool was_over = over_quota();
+
+        m_min_pages = min_pages;
+        m_max_pages = max_pages;
+
+        bool is_over = over_quota();
+
+        if ( is_over && !was_over )
+          ++*m_over_quota_count;
+        else if ( was_over && !is_over )
+          --*m_over_quota_count;
+      }
+
+      //
+      // With UMAP_NUMA, the node the pages of the region are filled on: that
+      // of the faulting thread, interleaved over the nodes, or bound to a
+      // node (see umap_region_set_numa_policy())
+      //
+      inline void set_numa_policy( int policy, uint64_t node ) {
+        m_numa_policy = policy;
+        m_numa_node = node;
+      }
+
+      inline int      numa_policy( void ) { return m_numa_policy;           }
+      inline uint64_t numa_node( void )   { return m_numa_node;             }
+
+      inline bool over_quota( void ) {
+        return m_max_pages != 0 && m_count > m_max_pages;
+      }
+
+      inline PageDescriptor* get_page_descriptor( char* page ) {
+        uint64_t idx = store_offset(page) / m_page_size;
+        PageSlot* chunk = m_page_table[idx >> CHUNK_SHIFT].load(std::memory_order_acquire);
+
+        if ( chunk == nullptr )
+          return nullptr;
+
+        return chunk[idx & (CHUNK_PAGES - 1)].load(std::memory_order_acquire);
+      }
+
+      //
+      // Returns the descriptor of the idx'th page of the region (or nullptr)
+      //
+      inline PageDescriptor* get_page_descriptor_at( uint64_t idx ) {
+        PageSlot* chunk = m_page_table[idx >> CHUNK_SHIFT].load(std::memory_order_acquire);
+
+        if ( chunk == nullptr )
+          return nullptr;
+
+        return chunk[idx & (CHUNK_PAGES - 1)].load(std::memory_order_acquire);
+      }
+
+      //
+      // Returns false if no page of the chunk holding the idx'th page has
+      // ever been faulted in
+      //
+      inline bool chunk_allocated( uint64_t idx ) {
+        return m_page_table[idx >> CHUNK_SHIFT].load(std::memory_order_acquire) != nullptr;
+      }
 
-      inline void insert_page_descriptor(PageDescriptor* pd) {
-        m_active_pages.insert(pd);
+      //
+      // Returns true if this insertion took the region over its maximum
+      //
+      inline bool insert_page_descriptor(PageDescriptor* pd) {
+        slot(pd->page)->store(pd, std::memory_order_release);
+        return count_up();
       }
 
       inline void erase_page_descriptor(PageDescriptor* pd) {
         UMAP_LOG(Debug, "Erasing PD: " << pd);
-        m_active_pages.erase(pd);
+        PageDescriptor* expected = pd;
+
+        if ( slot(pd->page)->compare_exchange_strong(expected, nullptr) )
+          count_down();
       }
 
-      inline PageDescriptor* get_next_page_descriptor( void ) {
-        if ( m_active_pages.size() == 0 )
-          return nullptr;
+      //
+      // Removes pd from the table if it still describes the given page of
+      // this region.  Returns true if the descriptor was removed.
+      //
+      inline bool take_page_descriptor( PageDescriptor* pd, char* page ) {
+        PageDescriptor* expected = pd;
+
+        if ( pd->page != page
+            || ! slot(page)->compare_exchange_strong(expected, nullptr) )
+          return false;
+
+        count_down();
+        pd->deferred = false;
+        return true;
+      }
+
+      inline uint64_t num_dirty( void ) { return m_num_dirty; }
+
+      //
+      // Traffic with the store, counted once per run by the workers
+      //
+      inline void count_read( uint64_t nb ) {
+        m_bytes_read.fetch_add(nb, std::memory_order_relaxed);
+      }
+
+      inline void count_written( uint64_t nb, uint64_t num_pages ) {
+        m_bytes_written.fetch_add(nb, std::memory_order_relaxed);
+        m_pages_written.fetch_add(num_pages, std::memory_order_relaxed);
+      }
+
+      inline uint64_t bytes_read( void ) { return m_bytes_read; }
+      inline uint64_t bytes_written( void ) { return m_bytes_written; }
+      inline uint64_t pages_written( void ) { return m_pages_written; }
 
-        auto it = m_active_pages.begin();
-        auto rval = *it;
-        rval->deferred = false;
-        erase_page_descriptor(rval);
+      //
+      // Record that the page has been written to, or written back
+      //
+      inline void set_dirty( char* page ) {
+        uint64_t idx = page_index(page);
+        uint64_t bit = 1UL << (idx & 63);
+        std::atomic<uint64_t>* words = dirty_words(idx);
 
-        return rval;
+        if ( ( words[(idx & (CHUNK_PAGES - 1)) / 64].fetch_or(bit) & bit ) == 0 ) {
+          ++m_chunk_dirty[idx >> CHUNK_SHIFT];
+          ++m_num_dirty;
+        }
+
+        if ( ( words[CHUNK_WORDS + (idx & (CHUNK_PAGES - 1)) / 64].fetch_or(bit) & bit ) == 0 )
+          ++m_chunk_changed[idx >> CHUNK_SHIFT];
+      }
+
+      inline void clear_dirty( char* page ) {
+        uint64_t idx = page_index(page);
+        uint64_t bit = 1UL << (idx & 63);
+        std::atomic<uint64_t>* words = m_dirty_map[idx >> CHUNK_SHIFT].load(std::memory_order_acquire);
+
+        if ( words == nullptr )
+          return;
+
+        if ( ( words[(idx & (CHUNK_PAGES - 1)) / 64].fetch_and(~bit) & bit ) != 0 ) {
+          --m_chunk_dirty[idx >> CHUNK_SHIFT];
+          --m_num_dirty;
+        }
+      }
+
+      //
+      // Returns the index of the first dirty page in [idx, end), or end if
+      // there is none.  Chunks without dirty pages are skipped whole.
+      //
+      inline uint64_t next_dirty( uint64_t idx, uint64_t end ) {
+        return next_set(idx, end, 0, m_chunk_dirty);
+      }
+
+      //
+      // The pages written since the last snapshot, see umap_snapshot()
+      //
+      inline void clear_changed( char* page ) {
+        uint64_t idx = page_index(page);
+        uint64_t bit = 1UL << (idx & 63);
+        std::atomic<uint64_t>* words = m_dirty_map[idx >> CHUNK_SHIFT].load(std::memory_order_acquire);
+
+        if ( words == nullptr )
+          return;
+
+        if ( ( words[CHUNK_WORDS + (idx & (CHUNK_PAGES - 1)) / 64].fetch_and(~bit) & bit ) != 0 )
+          --m_chunk_changed[idx >> CHUNK_SHIFT];
+      }
+
+      inline uint64_t next_changed( uint64_t idx, uint64_t end ) {
+        return next_set(idx, end, CHUNK_WORDS, m_chunk_changed);
       }
 
     private:
@@ -67,8 +447,135 @@ namespace Umap {
       char*    m_mmap_region;
       uint64_t m_mmap_region_size;
       Store*   m_store;
+      uint64_t m_page_size;
+      uint64_t m_num_pages;
+      uint64_t m_max_run_pages;  // Most pages filled or written back as one job
+      bool     m_huge_pages;
+      uint64_t m_num_chunks;
+
+      std::atomic<uint64_t> m_count;
+      std::atomic<PageSlot*>* m_page_table;
+      std::atomic<uint64_t> m_num_dirty;
+      std::atomic<std::atomic<uint64_t>*>* m_dirty_map;   // 2 * CHUNK_WORDS per chunk
+      std::atomic<uint64_t>* m_chunk_dirty;               // Dirty pages per chunk
+      std::atomic<uint64_t>* m_chunk_changed;             // Changed pages per chunk
 
-      std::unordered_set<PageDescriptor*> m_active_pages;
+      uint64_t m_min_pages;
+      uint64_t m_max_pages;
+      int      m_numa_policy;
+      uint64_t m_numa_node;      // Dense node number, for UMAP_NUMA_BIND
+      std::atomic<uint64_t>* m_over_quota_count;
+      ReadAhead* m_read_ahead;   // nullptr when read-ahead is disabled
+      std::atomic<bool> m_unmapping;
+      bool m_read_only;
+      int m_shared_fd;
+      std::string m_shared_name;
+      std::atomic<uint32_t>* m_shared_claims;
+
+      struct AdviceRun {
+        uint64_t end;
+        int      advice;
+      };
+
+      std::mutex m_advice_mutex;
+      std::mutex m_scan_mutex;
+      std::map<uint64_t, AdviceRun> m_advice;
+      std::atomic<int> m_advised;    // Bit of each advice of the runs
+      std::atomic<uint64_t> m_bytes_read;
+      std::atomic<uint64_t> m_bytes_written;
+      std::atomic<uint64_t> m_pages_written;
+
+      inline bool count_up( void ) {
+        uint64_t n = ++m_count;
+
+        if ( m_max_pages != 0 && n == m_max_pages + 1 ) {
+          ++*m_over_quota_count;
+          return true;
+        }
+        return false;
+      }
+
+      inline void count_down( void ) {
+        uint64_t n = m_count--;
+
+        if ( m_max_pages != 0 && n == m_max_pages + 1 )
+          --*m_over_quota_count;
+      }
+
+      inline PageSlot* slot( char* page ) {
+        uint64_t idx = store_offset(page) / m_page_size;
+        std::atomic<PageSlot*>& dir = m_page_table[idx >> CHUNK_SHIFT];
+        PageSlot* chunk = dir.load(std::memory_order_acquire);
+
+        if ( chunk == nullptr ) {
+          PageSlot* new_chunk = new PageSlot[CHUNK_PAGES];
+
+          for ( uint64_t i = 0; i < CHUNK_PAGES; ++i )
+            new_chunk[i] = nullptr;
+
+          //
+          // Pages of one chunk may belong to different shards, so two
+          // threads may race to allocate the same chunk.
+          //
+          if ( dir.compare_exchange_strong(chunk, new_chunk) )
+            chunk = new_chunk;
+          else
+            delete [] new_chunk;
+        }
+
+        return &chunk[idx & (CHUNK_PAGES - 1)];
+      }
+
+      //
+      // Returns the index of the first page in [idx, end) whose bit is set
+      // in the bitmap found first words into those of each chunk
+      //
+      inline uint64_t next_set( uint64_t idx, uint64_t end, uint64_t first
+                              , std::atomic<uint64_t>* chunk_counts ) {
+        while ( idx < end ) {
+          uint64_t c = idx >> CHUNK_SHIFT;
+          std::atomic<uint64_t>* words = m_dirty_map[c].load(std::memory_order_acquire);
+
+          if ( words == nullptr || chunk_counts[c] == 0 ) {
+            idx = (c + 1) << CHUNK_SHIFT;
+            continue;
+          }
+
+          uint64_t w = first + (idx & (CHUNK_PAGES - 1)) / 64;
+          uint64_t bits = words[w].load() & (~0UL << (idx & 63));
+
+          if ( bits != 0 ) {
+            idx = (idx & ~63UL) + __builtin_ctzl(bits);
+            return idx < end ? idx : end;
+          }
+
+          idx = (idx & ~63UL) + 64;
+        }
+
+        return end;
+      }
+
+      //
+      // The dirty bits of a chunk, followed by its changed bits
+      //
+      inline std::atomic<uint64_t>* dirty_words( uint64_t idx ) {
+        std::atomic<std::atomic<uint64_t>*>& dir = m_dirty_map[idx >> CHUNK_SHIFT];
+        std::atomic<uint64_t>* words = dir.load(std::memory_order_acquire);
+
+        if ( words == nullptr ) {
+          std::atomic<uint64_t>* new_words = new std::atomic<uint64_t>[2 * CHUNK_WORDS];
+
+          for ( uint64_t i = 0; i < 2 * CHUNK_WORDS; ++i )
+            new_words[i] = 0;
+
+          if ( dir.compare_exchange_strong(words, new_words) )
+            words = new_words;
+          else
+            delete [] new_words;
+        }
+
+        return words;
+      }
   };
 } // end of namespace Umap
-#endif // _UMAP_RegionDescripto_HPP
+#endif // _UMAP_RegionDescriptor_HPP
@@ -0,0 +1,115 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include <algorithm>
+#include <new>                  // placement new
+#include <sched.h>              // sched_yield()
+#include <stdlib.h>             // posix_memalign()
+
+#include "umap/RegionDescriptor.hpp"
+#include "umap/RegionIndex.hpp"
+#include "umap/util/Macros.hpp"
+
+namespace Umap {
+  RegionIndex::RegionIndex( void )
+    : m_current(new Version), m_epoch(0)
+  {
+    void* slots;
+
+    if ( posix_memalign(&slots, CACHE_LINE, NUM_SLOTS * sizeof(Slot)) != 0 )
+      UMAP_ERROR("posix_memalign failed to allocate " << NUM_SLOTS * sizeof(Slot) << " bytes of memory");
+
+    m_slots = (Slot*)slots;
+    for ( uint64_t i = 0; i < NUM_SLOTS; ++i ) {
+      new (&m_slots[i]) Slot;
+      m_slots[i].readers[0] = 0;
+      m_slots[i].readers[1] = 0;
+    }
+  }
+
+  RegionIndex::~RegionIndex( void ) {
+    delete m_current.load();
+    free(m_slots);
+  }
+
+  uint64_t RegionIndex::my_slot( void ) {
+    static std::atomic<uint64_t> next_slot(0);
+    static thread_local uint64_t slot = next_slot++ % NUM_SLOTS;
+
+    return slot;
+  }
+
+  std::atomic<uint64_t>* RegionIndex::enter( void ) {
+    Slot& slot = m_slots[my_slot()];
+    std::atomic<uint64_t>* readers;
+
+    //
+    // Counts in the epoch that is still current once counted, which the
+    // next writer waits for
+    //
+    while ( 1 ) {
+      uint64_t epoch = m_epoch.load();
+
+      readers = &slot.readers[epoch & 1];
+      readers->fetch_add(1);
+
+      if ( m_epoch.load() == epoch )
+        break;
+
+      readers->fetch_sub(1);
+    }
+
+    return readers;
+  }
+
+  RegionDescriptor* RegionIndex::find( char* addr ) {
+    Reader reader(*this);
+    const std::vector<RegionDescriptor*>& regions = m_current.load()->regions;
+    RegionDescriptor* rd = nullptr;
+
+    //
+    // The last region starting at or below addr
+    //
+    auto it = std::upper_bound(regions.begin(), regions.end(), addr
+        , [](char* a, RegionDescriptor* r) { return a < r->start(); });
+
+    if ( it != regions.begin() && addr < (*--it)->end() )
+      rd = *it;
+
+    return rd;
+  }
+
+  void RegionIndex::insert( RegionDescriptor* rd ) {
+    Version* v = new Version(*m_current.load());
+    auto it = std::upper_bound(v->regions.begin(), v->regions.end(), rd
+        , [](RegionDescriptor* a, RegionDescriptor* b) { return a->start() < b->start(); });
+
+    v->regions.insert(it, rd);
+    publish(v);
+  }
+
+  void RegionIndex::remove( RegionDescriptor* rd ) {
+    Version* v = new Version(*m_current.load());
+
+    v->regions.erase(std::remove(v->regions.begin(), v->regions.end(), rd), v->regions.end());
+    publish(v);
+  }
+
+  //
+  // A lookup that may have read the previous version counted itself in the
+  // epoch before the flip
+  //
+  void RegionIndex::publish( Version* version ) {
+    Version* old = m_current.exchange(version);
+    uint64_t epoch = m_epoch.fetch_add(1) & 1;
+
+    for ( uint64_t i = 0; i < NUM_SLOTS; ++i )
+      while ( m_slots[i].readers[epoch].load() != 0 )
+        sched_yield();
+
+    delete old;
+  }
+} // end of namespace Umap
@@ -0,0 +1,80 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_RegionIndex_HPP
+#define _UMAP_RegionIndex_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace Umap {
+  class RegionDescriptor;
+
+  //
+  // Regions of a RegionManager by address, for the fault path.  Lookups
+  // take no lock: they search an immutable array of the regions sorted by
+  // start address.  insert() and remove() publish a new array and free the
+  // previous one once no lookup may still be reading it.
+  //
+  // Lookups announce themselves in a counter of the current epoch, spread
+  // over slots so that threads do not share a cache line.  A writer flips
+  // the epoch after publishing, so that lookups starting from then on count
+  // in the other epoch, and waits for the counters of the previous epoch to
+  // drain.  Writers are serialized by the caller.
+  //
+  // A region found by find() is not deleted by the RegionManager before it
+  // has been removed from the index, so a Reader held across a lookup and
+  // the use of its region keeps the region alive.  Readers must not wait
+  // for anything that needs the lock of the RegionManager.
+  //
+  class RegionIndex {
+    public:
+      class Reader {
+        public:
+          Reader( RegionIndex& index ) : m_readers(index.enter()) {}
+          ~Reader( void ) { m_readers->fetch_sub(1); }
+        private:
+          std::atomic<uint64_t>* m_readers;
+      };
+
+      RegionIndex( void );
+      ~RegionIndex( void );
+
+      RegionDescriptor* find( char* addr );
+      void insert( RegionDescriptor* rd );
+      void remove( RegionDescriptor* rd );
+
+    private:
+      static const uint64_t NUM_SLOTS = 64;
+
+      struct Version {
+        std::vector<RegionDescriptor*> regions;     // Sorted by start()
+      };
+
+      //
+      // A cache line of its own.  The index is a member of RegionManagers
+      // allocated with new, which does not honour alignas() beyond that of
+      // max_align_t before C++17, so the slots are padded and allocated
+      // aligned by hand.
+      //
+      static const uint64_t CACHE_LINE = 64;
+
+      struct Slot {
+        std::atomic<uint64_t> readers[2];
+        char pad[CACHE_LINE - 2 * sizeof(std::atomic<uint64_t>)];
+      };
+
+      std::atomic<Version*> m_current;
+      std::atomic<uint64_t> m_epoch;
+      Slot* m_slots;
+
+      std::atomic<uint64_t>* enter( void );
+      void publish( Version* version );
+      static uint64_t my_slot( void );
+  };
+} // end of namespace Umap
+#endif // _UMAP_RegionIndex_HPP
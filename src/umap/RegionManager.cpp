@@ -6,26 +6,52 @@
 //////////////////////////////////////////////////////////////////////////////
 #include "umap/config.h"
 
+#include <algorithm>      // min(), max()
 #include <cstdint>        // uint64_t
 #include <fstream>        // for reading meminfo
+#include <iomanip>        // setw()
 #include <mutex>
+#include <stdio.h>        // rename()
 #include <stdlib.h>       // getenv()
+#include <string.h>       // memset()
 #include <sstream>        // string to integer operations
 #include <string>         // string to integer operations
 #include <thread>         // for max_concurrency
 #include <unordered_map>
 #include <unistd.h>       // sysconf()
+#include <sys/file.h>     // flock()
+#include <sys/mman.h>     // shm_unlink()
 
 #include "umap/Buffer.hpp"
 #include "umap/EvictManager.hpp"
 #include "umap/FillWorkers.hpp"
+#include "umap/Flusher.hpp"
+#include "umap/Prefetcher.hpp"
 #include "umap/RegionManager.hpp"
 #include "umap/RegionDescriptor.hpp"
+#include "umap/ReplacementPolicy.hpp"
 #include "umap/store/Store.hpp"
+#include "umap/util/Annotation.hpp"
 #include "umap/util/Macros.hpp"
+#include "umap/util/Trace.hpp"
 
 namespace Umap {
 
+//
+// Every context, starting with the default one once it exists
+//
+static std::mutex& contexts_mutex( void )
+{
+  static std::mutex mutex;
+  return mutex;
+}
+
+static std::vector<RegionManager*>& contexts( void )
+{
+  static std::vector<RegionManager*> all;
+  return all;
+}
+
 RegionManager&
 RegionManager::getInstance( void )
 {
@@ -34,21 +60,97 @@ RegionManager::getInstance( void )
   return region_manager_instance;
 }
 
+RegionManager*
+RegionManager::create_context( void )
+{
+  getInstance();
+  return new RegionManager();
+}
+
+RegionManager&
+RegionManager::for_address( void* addr )
+{
+  RegionManager& rm = getInstance();
+  std::lock_guard<std::mutex> lock(contexts_mutex());
+
+  for ( auto c : contexts() )
+    if ( c != &rm && c->contains(addr) )
+      return *c;
+
+  return rm;
+}
+
+std::vector<RegionManager*>
+RegionManager::get_contexts( void )
+{
+  getInstance();
+
+  std::lock_guard<std::mutex> lock(contexts_mutex());
+  return contexts();
+}
+
+//
+// A context is only destroyed once it has no region left, except for the
+// default one at exit, whose engine is left to the end of the process
+//
+RegionManager::~RegionManager( void )
+{
+  {
+    std::lock_guard<std::mutex> lock(contexts_mutex());
+    auto& all = contexts();
+
+    all.erase(std::remove(all.begin(), all.end(), this), all.end());
+  }
+
+  if ( m_latency != nullptr )
+    log_latency_histograms();
+
+  if ( m_active_regions.empty() ) {
+    delete m_numa;
+    delete [] m_latency;
+  }
+}
+
+bool
+RegionManager::contains( void* vaddr )
+{
+  return m_region_index.find((char*)vaddr) != nullptr;
+}
+
 void
-RegionManager::addRegion(Store* store, char* region, uint64_t region_size, char* mmap_region, uint64_t mmap_region_size)
+RegionManager::addRegion(Store* store, char* region, uint64_t region_size, char* mmap_region, uint64_t mmap_region_size, uint64_t page_size, bool huge_pages, bool read_only, int shared_fd, const std::string& shared_name, std::atomic<uint32_t>* shared_claims)
 {
   std::lock_guard<std::mutex> lock(m_mutex);
 
-  if ( m_active_regions.empty() ) {
+  if ( m_buffer == nullptr ) {
     UMAP_LOG(Debug, "No active regions, initializing engine");
-    m_buffer = new Buffer();
-    m_uffd = new Uffd();
-    m_fill_workers = new FillWorkers();
-    m_evict_manager = new EvictManager();
+    start_engine();
   }
 
-  auto rd = new RegionDescriptor(region, region_size, mmap_region, mmap_region_size, store);
+  //
+  // A job holds at most m_max_fill_pages pages of UMAP_PAGESIZE bytes, and
+  // at least one page, whatever the page size of the region
+  //
+  uint64_t max_run_pages = (m_max_fill_pages * m_umap_page_size) / page_size;
+  max_run_pages = std::min(std::max(max_run_pages, (uint64_t)1), m_max_fill_pages);
+
+  auto rd = new RegionDescriptor(region, region_size, mmap_region, mmap_region_size
+                                 , store, page_size, &m_regions_over_quota
+                                 , m_read_ahead, max_run_pages, huge_pages);
+
+  rd->set_numa_policy(m_numa_policy, 0);
+
+  if ( read_only )
+    rd->set_read_only();
+
+  if ( shared_fd != -1 )
+    rd->set_shared(shared_fd, shared_name, shared_claims);
+
+  if ( page_size != (uint64_t)m_umap_page_size )
+    ++m_num_region_page_sizes;
+
   m_active_regions[(void*)region] = rd;
+  m_region_index.insert(rd);
 
   UMAP_LOG(Debug,
       "region: " << (void*)(rd->start()) << " - " << (void*)(rd->end())
@@ -57,7 +159,9 @@ RegionManager::addRegion(Store* store, char* region, uint64_t region_size, char*
   );
 
   m_uffd->register_region(rd);
-  m_last_iter = m_active_regions.end();
+
+  if ( m_warm_restart && ! store->hot_pages_path().empty() && access(store->hot_pages_path().c_str(), R_OK) == 0 )
+    warm_up(rd, store->hot_pages_path());
 }
 
 void
@@ -69,49 +173,883 @@ RegionManager::removeRegion( char* region )
   if (it == m_active_regions.end())
     UMAP_ERROR("umap fault monitor not found for: " << (void*)region);
 
-  UMAP_LOG(Debug,
-      "region: " << (void*)(it->second->start()) << " - " << (void*)(it->second->end())
-      << ", region_size: " << it->second->size()
-      << ", number of regions: " << m_active_regions.size()
-  );
+  UMAP_LOG(Debug,
+      "region: " << (void*)(it->second->start()) << " - " << (void*)(it->second->end())
+      << ", region_size: " << it->second->size()
+      << ", number of regions: " << m_active_regions.size()
+  );
+
+  m_flusher->wait_for_region(it->second);
+  it->second->set_unmapping();
+  m_prefetcher->wait_for_region(it->second);
+
+  //
+  // Pinned pages are off the replacement policy, which the Buffer is
+  // drained through
+  //
+  m_buffer->unpin_range(it->second, 0, it->second->num_pages());
+
+  if ( m_warm_restart && ! it->second->store()->hot_pages_path().empty() )
+    save_hot_pages(it->second, it->second->store()->hot_pages_path());
+
+  m_uffd->unregister_region(it->second);
+
+  //
+  // Every process mapping a shared buffer holds a shared lock on it, so the
+  // one that gets the exclusive lock is the last and removes its name.  The
+  // pages are released once no process maps them any more.
+  //
+  if ( it->second->shared() ) {
+    RegionDescriptor* rd = it->second;
+
+    if ( flock(rd->shared_fd(), LOCK_EX | LOCK_NB) == 0 ) {
+      UMAP_LOG(Debug, "removing shared buffer " << rd->shared_name());
+      shm_unlink(rd->shared_name().c_str());
+    }
+    madvise(rd->start(), rd->size(), MADV_DONTNEED);
+    munmap(rd->shared_claims(), RegionDescriptor::shared_claims_size(rd->num_pages()));
+    close(rd->shared_fd());
+  }
+
+  if ( it->second->page_size() != (uint64_t)m_umap_page_size )
+    --m_num_region_page_sizes;
+
+  if ( it->second->advised(UMAP_ADVICE_NOREUSE) )
+    --m_regions_noreuse;
+
+  m_past_bytes_read += it->second->bytes_read();
+  m_past_bytes_written += it->second->bytes_written();
+  m_past_writebacks += it->second->pages_written();
+
+  m_region_index.remove(it->second);
+  delete it->second;
+  m_active_regions.erase(it);
+
+  if ( m_active_regions.empty() && ! m_keep_alive && ! m_engine_held )
+    stop_engine();
+}
+
+void
+RegionManager::init_engine( void )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  m_engine_held = true;
+  if ( m_buffer == nullptr )
+    start_engine();
+}
+
+void
+RegionManager::finalize_engine( void )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  m_engine_held = false;
+  if ( m_active_regions.empty() && m_buffer != nullptr )
+    stop_engine();
+}
+
+//
+// Called with m_mutex held
+//
+void
+RegionManager::start_engine( void )
+{
+  m_buffer = new Buffer(*this);
+  m_uffd = new Uffd(*this);
+  m_fill_workers = new FillWorkers(*this);
+  m_evict_manager = new EvictManager(*this);
+  m_flusher = new Flusher(*this, m_buffer);
+  m_prefetcher = new Prefetcher(*this, m_buffer);
+
+  if ( m_buffer_controller_interval != 0 )
+    m_buffer_controller = new BufferController(*this, m_buffer
+        , m_buffer_controller_interval, m_buffer_psi_threshold);
+
+  if ( m_monitor_interval_ms != 0 )
+    m_monitor = new Monitor(*this, m_buffer, m_monitor_interval_ms
+        , (uint64_t)m_monitor_freq * 1000, m_metrics_shm);
+}
+
+void
+RegionManager::stop_engine( void )
+{
+  UMAP_LOG(Debug, "Stopping engine");
+
+  delete m_monitor; m_monitor = nullptr;
+
+  m_past_buffer_stats += m_buffer->get_stats();
+
+  delete m_buffer_controller; m_buffer_controller = nullptr;
+  delete m_prefetcher; m_prefetcher = nullptr;
+  delete m_flusher; m_flusher = nullptr;
+  delete m_evict_manager; m_evict_manager = nullptr;
+  delete m_fill_workers; m_fill_workers = nullptr;
+  delete m_uffd; m_uffd = nullptr;
+  delete m_buffer; m_buffer = nullptr;
+}
+
+void
+RegionManager::set_region_quota( char* region, uint64_t min_pages, uint64_t max_pages )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto it = m_active_regions.find(region);
+
+  if (it == m_active_regions.end())
+    UMAP_ERROR("umap region not found for: " << (void*)region);
+
+  if ( max_pages != 0 && min_pages > max_pages )
+    UMAP_ERROR("Minimum pages (" << min_pages
+        << ") is larger than maximum pages (" << max_pages << ")");
+
+  //
+  // The guaranteed minimums of all regions must fit in the buffer below the
+  // eviction low water mark, or eviction could not make progress.
+  //
+  uint64_t reserved = min_pages;
+  for ( auto& r : m_active_regions )
+    if ( r.second != it->second )
+      reserved += r.second->min_pages();
+
+  uint64_t limit = ( get_max_pages_in_buffer() * get_evict_low_water_threshold() ) / 100;
+  if ( reserved > limit )
+    UMAP_ERROR("Cannot guarantee " << min_pages << " pages to region "
+        << (void*)region << ": " << reserved
+        << " pages would be reserved, the limit is " << limit);
+
+  UMAP_LOG(Debug, "region: " << (void*)region
+      << ", min_pages: " << min_pages << ", max_pages: " << max_pages);
+
+  it->second->set_quota(min_pages, max_pages);
+
+  if ( it->second->over_quota() )
+    m_buffer->kick_evict_manager();
+}
+
+//
+// Changes the size of the Buffer of the active regions, if any, as well as
+// the size that later Buffers are created with
+//
+void
+RegionManager::set_buffer_pages( uint64_t max_pages )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  if ( max_pages == 0 )
+    UMAP_ERROR("The Buffer must hold at least one page");
+
+  uint64_t reserved = 0;
+  for ( auto& r : m_active_regions )
+    reserved += r.second->min_pages();
+
+  uint64_t limit = ( max_pages * get_evict_low_water_threshold() ) / 100;
+  if ( reserved > limit )
+    UMAP_ERROR("Cannot resize the Buffer to " << max_pages << " pages: "
+        << reserved << " pages are guaranteed to regions, the limit would be " << limit);
+
+  set_max_pages_in_buffer(max_pages);
+
+  if ( m_buffer != nullptr )
+    m_buffer->resize(max_pages);
+}
+
+void
+RegionManager::reconfigure( Setting setting, uint64_t value )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  if ( setting > MAX_PINNED_PAGES && m_buffer != nullptr )
+    UMAP_ERROR("Cannot change this setting while the engine is running ("
+        << m_active_regions.size() << " regions are mapped)");
+
+  switch ( setting ) {
+    case NUM_FILLERS:
+    case NUM_EVICTORS:
+    case MAX_FAULT_EVENTS:
+    case NUM_BUFFER_SHARDS:
+    case NUM_UFFD_THREADS:
+    case MAX_FILL_PAGES:
+      if ( value == 0 )
+        UMAP_ERROR("The value of this setting must not be 0");
+      break;
+    case EVICT_LOW_WATER_THRESHOLD:
+    case EVICT_HIGH_WATER_THRESHOLD:
+    case DIRTY_RATIO:
+      if ( value > 100 )
+        UMAP_ERROR("Invalid percentage: " << value << " (expected 0 to 100)");
+      break;
+    default:
+      break;
+  }
+
+  switch ( setting ) {
+    case NUM_FILLERS:
+      set_num_fillers(value);
+      m_min_fillers = std::min(m_min_fillers, m_num_fillers);
+      if ( m_fill_workers != nullptr )
+        m_fill_workers->set_max_threads(value, m_worker_idle_timeout);
+      break;
+    case NUM_EVICTORS:
+      set_num_evictors(value);
+      m_min_evictors = std::min(m_min_evictors, m_num_evictors);
+      if ( m_evict_manager != nullptr )
+        m_evict_manager->set_max_evict_workers(value);
+      break;
+    case EVICT_LOW_WATER_THRESHOLD:
+    case EVICT_HIGH_WATER_THRESHOLD: {
+      int low = ( setting == EVICT_LOW_WATER_THRESHOLD ) ? (int)value : m_evict_low_water_threshold;
+      int high = ( setting == EVICT_HIGH_WATER_THRESHOLD ) ? (int)value : m_evict_high_water_threshold;
+
+      if ( low > high )
+        UMAP_ERROR("The eviction low water threshold (" << low
+            << ") is above the high water threshold (" << high << ")");
+
+      //
+      // As in set_buffer_pages(), the minimums of the regions must stay
+      // below the low water mark
+      //
+      uint64_t reserved = 0;
+      for ( auto& r : m_active_regions )
+        reserved += r.second->min_pages();
+
+      uint64_t limit = ( get_max_pages_in_buffer() * low ) / 100;
+      if ( reserved > limit )
+        UMAP_ERROR("Cannot lower the low water threshold to " << low << "%: "
+            << reserved << " pages are guaranteed to regions, the limit would be " << limit);
+
+      set_evict_low_water_threshold(low);
+      set_evict_high_water_threshold(high);
+      if ( m_buffer != nullptr )
+        m_buffer->watermarks_changed();
+      break;
+    }
+    case DIRTY_RATIO:
+      set_dirty_ratio((int)value);
+      if ( m_buffer != nullptr )
+        m_buffer->watermarks_changed();
+      break;
+    case MAX_FAULT_EVENTS:
+      set_max_fault_events(value);
+      if ( m_uffd != nullptr )
+        m_uffd->set_max_fault_events(value);
+      break;
+    case READ_AHEAD:
+      set_read_ahead(value);
+      break;
+    case MAX_PINNED_PAGES:
+      set_max_pinned_pages(value);
+      break;
+    case UMAP_PAGE_SIZE:
+      set_umap_page_size(value);
+      break;
+    case NUM_BUFFER_SHARDS:
+      set_num_buffer_shards(value);
+      break;
+    case NUM_UFFD_THREADS:
+      set_num_uffd_threads(value);
+      break;
+    case MAX_FILL_PAGES:
+      set_max_fill_pages(value);
+      break;
+    case IO_DEPTH:
+      set_io_depth(value);
+      break;
+  }
+}
+
+uint64_t
+RegionManager::get_num_active_fillers( void )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return ( m_fill_workers != nullptr ) ? m_fill_workers->num_threads() : 0;
+}
+
+uint64_t
+RegionManager::get_num_active_evictors( void )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return ( m_evict_manager != nullptr ) ? m_evict_manager->num_evict_workers() : 0;
+}
+
+void
+RegionManager::set_region_numa_policy( char* region, int policy, int node )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto it = m_active_regions.find(region);
+
+  if (it == m_active_regions.end())
+    UMAP_ERROR("umap region not found for: " << (void*)region);
+
+  if ( policy != UMAP_NUMA_LOCAL && policy != UMAP_NUMA_INTERLEAVE && policy != UMAP_NUMA_BIND )
+    UMAP_ERROR("Invalid NUMA policy: " << policy);
+
+  int dense_node = 0;
+
+  if ( policy == UMAP_NUMA_BIND ) {
+    if ( m_numa == nullptr )
+      UMAP_ERROR("UMAP_NUMA_BIND needs UMAP_NUMA to be set");
+
+    if ( (dense_node = m_numa->node_of_id(node)) < 0 )
+      UMAP_ERROR("Invalid NUMA node: " << node);
+  }
+
+  UMAP_LOG(Debug, "region: " << (void*)region
+      << ", policy: " << policy << ", node: " << node);
+
+  it->second->set_numa_policy(policy, (uint64_t)dense_node);
+}
+
+//
+// Called with m_mutex held.  The counters of the Buffer are read without
+// the locks of its shards, as relaxed atomics, so the counters of a total
+// may be a few events apart from each other.
+//
+void
+RegionManager::total_stats( struct umap_stats* stats )
+{
+  BufferStats b = m_past_buffer_stats;
+
+  memset(stats, 0, sizeof(*stats));
+
+  if ( m_buffer != nullptr ) {
+    b += m_buffer->get_stats();
+
+    stats->resident_pages = m_buffer->num_busy_pages();
+    stats->dirty_pages = m_buffer->num_dirty_pages();
+    stats->pinned_pages = m_buffer->num_pinned_pages();
+    stats->fill_queue_depth = m_fill_workers->wq_size();
+    stats->evict_queue_depth = m_evict_manager->num_queued_runs();
+  }
+
+  stats->faults = b.events_processed + b.spurious_faults;
+  stats->spurious_faults = b.spurious_faults;
+  stats->fills = b.pages_inserted;
+  stats->prefetches = b.pages_prefetched;
+  stats->evictions = b.pages_deleted;
+  stats->lock_collisions = b.lock_collision;
+  stats->waits = b.waits;
+  stats->free_page_waits = b.not_avail;
+
+  stats->bytes_read = m_past_bytes_read;
+  stats->bytes_written = m_past_bytes_written;
+  stats->writebacks = m_past_writebacks;
+
+  for ( auto& r : m_active_regions ) {
+    stats->bytes_read += r.second->bytes_read();
+    stats->bytes_written += r.second->bytes_written();
+    stats->writebacks += r.second->pages_written();
+  }
+}
+
+void
+RegionManager::get_stats( struct umap_stats* stats )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  struct umap_stats t;
+
+  total_stats(&t);
+
+  stats->faults += t.faults - m_stats_base.faults;
+  stats->spurious_faults += t.spurious_faults - m_stats_base.spurious_faults;
+  stats->fills += t.fills - m_stats_base.fills;
+  stats->prefetches += t.prefetches - m_stats_base.prefetches;
+  stats->evictions += t.evictions - m_stats_base.evictions;
+  stats->writebacks += t.writebacks - m_stats_base.writebacks;
+  stats->bytes_read += t.bytes_read - m_stats_base.bytes_read;
+  stats->bytes_written += t.bytes_written - m_stats_base.bytes_written;
+  stats->lock_collisions += t.lock_collisions - m_stats_base.lock_collisions;
+  stats->waits += t.waits - m_stats_base.waits;
+  stats->free_page_waits += t.free_page_waits - m_stats_base.free_page_waits;
+
+  stats->resident_pages += t.resident_pages;
+  stats->dirty_pages += t.dirty_pages;
+  stats->pinned_pages += t.pinned_pages;
+  stats->fill_queue_depth += t.fill_queue_depth;
+  stats->evict_queue_depth += t.evict_queue_depth;
+}
+
+//
+// The counters themselves are left alone, so that resetting does not race
+// with the threads updating them
+//
+void
+RegionManager::reset_stats( void )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  total_stats(&m_stats_base);
+
+  if ( m_latency != nullptr )
+    for ( int i = 0; i < UMAP_LATENCY_STAGES; ++i )
+      m_latency[i].clear();
+}
+
+//
+// Adds the latencies of a stage to hist
+//
+void
+RegionManager::get_latency_histogram( int stage, struct umap_latency_histogram* hist )
+{
+  if ( stage < 0 || stage >= UMAP_LATENCY_STAGES )
+    UMAP_ERROR("Invalid latency stage: " << stage);
+
+  if ( m_latency == nullptr )
+    return;
+
+  struct umap_latency_histogram h;
+
+  m_latency[stage].read(&h);
+
+  hist->count += h.count;
+  hist->total_ns += h.total_ns;
+  hist->max_ns = std::max(hist->max_ns, h.max_ns);
+  for ( int i = 0; i < UMAP_LATENCY_BUCKETS; ++i )
+    hist->buckets[i] += h.buckets[i];
+}
+
+void
+RegionManager::log_latency_histograms( void )
+{
+  static const char* names[UMAP_LATENCY_STAGES] = {
+    "handler", "descriptor wait", "fill queue", "store read", "copy", "fault"
+  };
+  std::stringstream ss;
+
+  ss << "Latencies (ns):         count       mean        p50        p99      p99.9        max";
+
+  for ( int i = 0; i < UMAP_LATENCY_STAGES; ++i ) {
+    struct umap_latency_histogram h;
+
+    m_latency[i].read(&h);
+    ss << "\n" << std::setw(22) << names[i]
+      << std::setw(12) << h.count
+      << std::setw(11) << ( h.count ? h.total_ns / h.count : 0 )
+      << std::setw(11) << umap_latency_percentile(&h, 50.0)
+      << std::setw(11) << umap_latency_percentile(&h, 99.0)
+      << std::setw(11) << umap_latency_percentile(&h, 99.9)
+      << std::setw(11) << h.max_ns;
+  }
+
+  UMAP_LOG(Info, ss.str());
+}
+
+bool
+RegionManager::sample_metrics( struct umap_stats* stats, MetricsFormat::Segment* m )
+{
+  std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+
+  if ( ! lock.owns_lock() || m_buffer == nullptr )
+    return false;
+
+  total_stats(stats);
+
+  m->total_regions = (uint32_t)m_active_regions.size();
+  m->num_regions = 0;
+
+  for ( auto& r : m_active_regions ) {
+    if ( m->num_regions == MetricsFormat::MAX_REGIONS )
+      break;
+
+    RegionDescriptor* rd = r.second;
+    MetricsFormat::Region& mr = m->regions[m->num_regions++];
+
+    mr.start = (uint64_t)rd->start();
+    mr.size = rd->size();
+    mr.page_size = rd->page_size();
+    mr.resident_pages = rd->count();
+    mr.dirty_pages = rd->num_dirty();
+    mr.bytes_read = rd->bytes_read();
+    mr.bytes_written = rd->bytes_written();
+    mr.writebacks = rd->pages_written();
+  }
+  return true;
+}
+
+void
+RegionManager::get_region_stats( char* region, struct umap_region_stats* stats )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto it = m_active_regions.find(region);
+
+  if (it == m_active_regions.end())
+    UMAP_ERROR("umap region not found for: " << (void*)region);
+
+  RegionDescriptor* rd = it->second;
+
+  stats->bytes_read = rd->bytes_read();
+  stats->bytes_written = rd->bytes_written();
+  stats->writebacks = rd->pages_written();
+  stats->resident_pages = rd->count();
+  stats->dirty_pages = rd->num_dirty();
+}
+
+//
+// The flush itself is done by the Flusher thread, so we do not hold our
+// lock (which the fault handlers need) while waiting for it.
+//
+int 
+RegionManager::flush_buffer(){
+
+  FlushFence* fence = flush_async(nullptr, 0);
+
+  fence->wait();
+  delete fence;
+
+  return 0;
+}
+
+//
+// Flush the pages of [addr, addr + length), which must be within a single
+// region, or of the whole Buffer if addr is nullptr.  A length of 0 means
+// up to the end of the region.
+//
+FlushFence*
+RegionManager::flush_async( char* addr, uint64_t length )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  if ( m_active_regions.empty() ) {
+    FlushFence* fence = new FlushFence(nullptr, nullptr, nullptr);
+    fence->walk_done();   // Nothing to flush
+    return fence;
+  }
+
+  if ( addr == nullptr ) {
+    std::vector<RegionDescriptor*> regions;
+
+    for ( auto it : m_active_regions )
+      regions.push_back(it.second);
+
+    return m_flusher->flush_async(new FlushFence(regions));
+  }
+
+  auto iter = m_active_regions.upper_bound(reinterpret_cast<void*>(addr));
+
+  if ( iter == m_active_regions.begin() || addr >= (--iter)->second->end() )
+    UMAP_ERROR("umap region not found for: " << (void*)addr);
+
+  RegionDescriptor* rd = iter->second;
+  char* end = ( length == 0 || length > (uint64_t)(rd->end() - addr) ) ? rd->end() : addr + length;
+  char* start = rd->start() + ((addr - rd->start()) / rd->page_size()) * rd->page_size();
+
+  UMAP_LOG(Debug, "region: " << (void*)rd->start() << ", range: "
+      << (void*)start << " - " << (void*)end);
+
+  return m_flusher->flush_async(new FlushFence(rd, start, end));
+}
+
+//
+// Pins are counted per page, so that overlapping ranges may be pinned and
+// unpinned independently.  The range is extended to whole pages and cut at
+// the end of the region.
+//
+void
+RegionManager::pin( char* addr, uint64_t length )
+{
+  UMAP_ANNOTATE_SCOPE("umap.pin");
+  std::lock_guard<std::mutex> pin_lock(m_pin_mutex);
+  RegionDescriptor* rd;
+  uint64_t first, last;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto iter = m_active_regions.upper_bound(reinterpret_cast<void*>(addr));
+
+    if ( iter == m_active_regions.begin() || addr >= (--iter)->second->end() )
+      UMAP_ERROR("umap region not found for: " << (void*)addr);
+
+    rd = iter->second;
+    char* end = ( length == 0 || length > (uint64_t)(rd->end() - addr) ) ? rd->end() : addr + length;
+    first = rd->page_index(addr);
+    last = ( end - rd->start() + rd->page_size() - 1 ) / rd->page_size();
+  }
+
+  uint64_t needed = m_buffer->num_unpinned_pages(rd, first, last);
+  uint64_t limit = get_max_pinned_pages();
+
+  if ( m_buffer->num_pinned_pages() + needed > limit )
+    UMAP_ERROR("Cannot pin " << needed << " more pages: " << m_buffer->num_pinned_pages()
+        << " pages are pinned, the limit is " << limit);
+
+  UMAP_LOG(Debug, "region: " << (void*)rd->start() << ", pages: "
+      << first << " - " << last << ", newly pinned: " << needed);
+
+  m_buffer->pin_range(rd, first, last);
+}
+
+void
+RegionManager::unpin( char* addr, uint64_t length )
+{
+  std::lock_guard<std::mutex> pin_lock(m_pin_mutex);
+  RegionDescriptor* rd;
+  uint64_t first, last;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto iter = m_active_regions.upper_bound(reinterpret_cast<void*>(addr));
+
+    if ( iter == m_active_regions.begin() || addr >= (--iter)->second->end() )
+      UMAP_ERROR("umap region not found for: " << (void*)addr);
+
+    rd = iter->second;
+    char* end = ( length == 0 || length > (uint64_t)(rd->end() - addr) ) ? rd->end() : addr + length;
+    first = rd->page_index(addr);
+    last = ( end - rd->start() + rd->page_size() - 1 ) / rd->page_size();
+  }
+
+  m_buffer->unpin_range(rd, first, last);
+}
+
+//
+// The dirty pages of the region are written back first, by the Flusher, so
+// that the changed pages can then be copied from the Buffer or the store
+// without holding anything up, see Buffer::snapshot_range()
+//
+uint64_t
+RegionManager::snapshot( char* addr, Store* target )
+{
+  UMAP_ANNOTATE_SCOPE("umap.snapshot");
+  RegionDescriptor* rd;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto iter = m_active_regions.upper_bound(reinterpret_cast<void*>(addr));
+
+    if ( iter == m_active_regions.begin() || addr >= (--iter)->second->end() )
+      UMAP_ERROR("umap region not found for: " << (void*)addr);
+
+    rd = iter->second;
+  }
+
+  if ( rd->shared() )
+    UMAP_ERROR("umap_snapshot: shared region " << (void*)rd->start() << " is not supported");
+
+  FlushFence* fence = flush_async(rd->start(), 0);
+
+  fence->wait();
+  delete fence;
+
+  uint64_t pages = m_buffer->snapshot_range(rd, target);
+
+  UMAP_LOG(Info, "region: " << (void*)rd->start() << ", pages copied: " << pages);
+  return pages;
+}
+
+//
+// The list of hot pages is a header followed by runs of bytes of the store,
+// as (offset, length) pairs, in the order they are to be prefetched.  It is
+// written to a temporary file renamed over the old list, so that a crash
+// leaves one list or the other.
+//
+static const uint64_t HOT_PAGES_MAGIC = 0x554d4150484f5431; // "UMAPHOT1"
+
+bool
+RegionManager::save_hot_pages( char* addr, const std::string& path )
+{
+  RegionDescriptor* rd;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto iter = m_active_regions.upper_bound(reinterpret_cast<void*>(addr));
+
+    if ( iter == m_active_regions.begin() || addr >= (--iter)->second->end() )
+      UMAP_ERROR("umap region not found for: " << (void*)addr);
+
+    rd = iter->second;
+  }
+
+  return save_hot_pages(rd, path);
+}
+
+bool
+RegionManager::save_hot_pages( RegionDescriptor* rd, const std::string& path )
+{
+  std::vector<std::pair<uint64_t, uint64_t>> extents;
+  std::vector<uint64_t> list;
+
+  m_buffer->hot_pages(rd, extents);
+
+  list.push_back(HOT_PAGES_MAGIC);
+  list.push_back(extents.size());
+  for ( auto& e : extents ) {
+    list.push_back(rd->store_offset(rd->start() + e.first * rd->page_size()));
+    list.push_back((e.second - e.first) * rd->page_size());
+  }
+
+  std::string tmp = path + ".tmp";
+  std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+
+  out.write((const char*)list.data(), list.size() * sizeof(uint64_t));
+  out.close();
+
+  if ( ! out || rename(tmp.c_str(), path.c_str()) != 0 ) {
+    UMAP_LOG(Warning, "Failed to save the hot pages of " << (void*)rd->start() << " to " << path);
+    unlink(tmp.c_str());
+    return false;
+  }
+
+  UMAP_LOG(Info, "region: " << (void*)rd->start() << ", " << extents.size()
+      << " runs of hot pages saved to " << path);
+  return true;
+}
+
+bool
+RegionManager::warm_up( char* addr, const std::string& path )
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto iter = m_active_regions.upper_bound(reinterpret_cast<void*>(addr));
+
+  if ( iter == m_active_regions.begin() || addr >= (--iter)->second->end() )
+    UMAP_ERROR("umap region not found for: " << (void*)addr);
+
+  return warm_up(iter->second, path);
+}
+
+//
+// The runs of the list that fall within the region are prefetched in order
+// until the pages prefetched would reach the low water mark of the Buffer,
+// so that the warm up does not evict what it brought in.  One batch of as
+// many pages as the fill workers take at once is in flight at a time.
+//
+bool
+RegionManager::warm_up( RegionDescriptor* rd, const std::string& path )
+{
+  std::ifstream in(path.c_str(), std::ios::binary);
+  uint64_t header[2];
+
+  if ( ! in.read((char*)header, sizeof(header)) || header[0] != HOT_PAGES_MAGIC ) {
+    UMAP_LOG(Warning, "No list of hot pages in " << path);
+    return false;
+  }
 
-  m_uffd->unregister_region(it->second);
+  const uint64_t psize = rd->page_size();
+  const uint64_t base = rd->store_offset(rd->start());
+  uint64_t budget = ( get_max_pages_in_buffer() * get_evict_low_water_threshold() / 100 )
+                  * m_umap_page_size / psize;
+  std::vector<std::pair<uint64_t, uint64_t>> extents;
+  uint64_t pages = 0;
+  uint64_t run[2];
 
-  delete it->second;
-  m_active_regions.erase(it);
+  for ( uint64_t i = 0; i < header[1] && budget != 0 && in.read((char*)run, sizeof(run)); ++i ) {
+    if ( run[0] + run[1] <= base || run[0] >= base + rd->size() )
+      continue;
 
-  m_last_iter = m_active_regions.end();
+    uint64_t first = ( std::max(run[0], base) - base ) / psize;
+    uint64_t end = ( std::min(run[0] + run[1], base + rd->size()) - base + psize - 1 ) / psize;
 
-  if ( m_active_regions.empty() ) {
-    delete m_evict_manager; m_evict_manager = nullptr;
-    delete m_fill_workers; m_fill_workers = nullptr;
-    delete m_uffd; m_uffd = nullptr;
-    delete m_buffer; m_buffer = nullptr;
+    end = std::min(end, first + budget);
+    budget -= end - first;
+    pages += end - first;
+    extents.push_back(std::make_pair(first, end));
   }
+
+  UMAP_LOG(Info, "region: " << (void*)rd->start() << ", warming up " << pages
+      << " pages in " << extents.size() << " runs from " << path);
+
+  m_prefetcher->warm_up(rd, extents, get_max_fill_pages() * get_num_fillers());
+  return true;
 }
 
-int 
-RegionManager::flush_buffer(){
+uint64_t
+RegionManager::get_max_pinned_pages( void )
+{
+  uint64_t limit = ( get_max_pages_in_buffer() * get_evict_low_water_threshold() ) / 100;
 
+  if ( m_max_pinned_pages == 0 )
+    return std::min(get_max_pages_in_buffer() / 2, limit);
+  return std::min(m_max_pinned_pages, limit);
+}
+
+
+//
+// Queues the prefetch of the pages of a range, returned as a fence that is
+// complete once they have been brought in.  A length of 0 means up to the
+// end of the region.
+//
+FlushFence*
+RegionManager::prefetch_async( char* addr, uint64_t length )
+{
   std::lock_guard<std::mutex> lock(m_mutex);
+  auto iter = m_active_regions.upper_bound(reinterpret_cast<void*>(addr));
 
-  m_buffer->flush_dirty_pages();
+  if ( iter == m_active_regions.begin() || addr >= (--iter)->second->end() )
+    UMAP_ERROR("umap region not found for: " << (void*)addr);
 
-  return 0;
+  RegionDescriptor* rd = iter->second;
+  char* end = ( length == 0 || length > (uint64_t)(rd->end() - addr) ) ? rd->end() : addr + length;
+  char* start = rd->start() + ((addr - rd->start()) / rd->page_size()) * rd->page_size();
+
+  UMAP_LOG(Debug, "region: " << (void*)rd->start() << ", range: "
+      << (void*)start << " - " << (void*)end);
+
+  return m_prefetcher->prefetch_async(new FlushFence(rd, start, end));
 }
 
+//
+// The range is extended to whole pages.  WILLNEED and DONTNEED act on the
+// pages now, the other advice is remembered by the region.
+//
 void
-RegionManager::fetch_and_pin( char* paddr, uint64_t size )
+RegionManager::advise( char* addr, uint64_t length, int advice )
 {
-  m_buffer->fetch_and_pin(paddr, size);
-}
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto iter = m_active_regions.upper_bound(reinterpret_cast<void*>(addr));
+
+  if ( iter == m_active_regions.begin() || addr >= (--iter)->second->end() )
+    UMAP_ERROR("umap region not found for: " << (void*)addr);
+
+  RegionDescriptor* rd = iter->second;
+  char* end = ( length == 0 || length > (uint64_t)(rd->end() - addr) ) ? rd->end() : addr + length;
+  uint64_t first = rd->page_index(addr);
+  uint64_t last = ( end - rd->start() + rd->page_size() - 1 ) / rd->page_size();
+
+  UMAP_LOG(Debug, "region: " << (void*)rd->start() << ", pages: "
+      << first << " - " << last << ", advice: " << advice);
 
+  switch ( advice ) {
+    case UMAP_ADVICE_WILLNEED:
+      m_prefetcher->prefetch_async(new FlushFence(rd, rd->start() + first * rd->page_size()
+                                                 , rd->start() + last * rd->page_size()))->detach();
+      break;
+    case UMAP_ADVICE_DONTNEED:
+      m_buffer->evict_range(rd, first, last);
+      break;
+    case UMAP_ADVICE_NORMAL:
+    case UMAP_ADVICE_SEQUENTIAL:
+    case UMAP_ADVICE_RANDOM:
+    case UMAP_ADVICE_NOREUSE:
+    case UMAP_ADVICE_HOT: {
+      bool was_noreuse = rd->advised(UMAP_ADVICE_NOREUSE);
+
+      rd->set_advice(first, last, advice);
+
+      if ( rd->advised(UMAP_ADVICE_NOREUSE) && !was_noreuse )
+        ++m_regions_noreuse;
+      else if ( was_noreuse && !rd->advised(UMAP_ADVICE_NOREUSE) )
+        --m_regions_noreuse;
+      break;
+    }
+    default:
+      UMAP_ERROR("Invalid advice: " << advice);
+  }
+}
 
 void
 RegionManager::prefetch(int npages, umap_prefetch_item* page_array)
 {
-  for (int i{0}; i < npages; ++i)
-    m_uffd->process_page(false, (char*)(page_array[i].page_base_addr));
+  for (int i{0}; i < npages; ++i) {
+    char* addr = (char*)(page_array[i].page_base_addr);
+
+    if ( Trace::enabled() ) {
+      RegionIndex::Reader reader(m_region_index);
+      auto rd = containing_region(addr);
+
+      if ( rd != nullptr )
+        Trace::record(TraceFormat::PREFETCH, addr, rd->start(), 0);
+    }
+
+    m_uffd->process_page(false, addr);
+  }
 }
 
 RegionManager::RegionManager()
@@ -120,7 +1058,23 @@ RegionManager::RegionManager()
   m_version.minor = UMAP_VERSION_MINOR;
   m_version.patch = UMAP_VERSION_PATCH;
 
-  m_last_iter = m_active_regions.end();
+  m_regions_over_quota = 0;
+  m_regions_noreuse = 0;
+  m_num_region_page_sizes = 0;
+  m_buffer = nullptr;
+  m_uffd = nullptr;
+  m_fill_workers = nullptr;
+  m_evict_manager = nullptr;
+  m_flusher = nullptr;
+  m_buffer_controller = nullptr;
+  m_monitor = nullptr;
+  m_prefetcher = nullptr;
+  m_numa = nullptr;
+  m_past_bytes_read = 0;
+  m_past_bytes_written = 0;
+  m_past_writebacks = 0;
+  memset(&m_stats_base, 0, sizeof(m_stats_base));
+  m_latency = nullptr;
 
   m_system_page_size = sysconf(_SC_PAGESIZE);
 
@@ -131,6 +1085,13 @@ RegionManager::RegionManager()
   else
     set_max_fault_events(MAX_FAULT_EVENTS);
 
+  //
+  // The worker pools start small and grow up to UMAP_PAGE_FILLERS and
+  // UMAP_PAGE_EVICTORS threads while work queues up
+  //
+  const uint64_t MIN_WORKERS = 2;
+  const long WORKER_IDLE_TIMEOUT = 1000;    // ms
+
   unsigned int nthreads = std::thread::hardware_concurrency();
   nthreads = (nthreads == 0) ? 16 : nthreads;
 
@@ -144,6 +1105,40 @@ RegionManager::RegionManager()
   else
     set_num_evictors(nthreads);
 
+  m_min_fillers = std::min<uint64_t>(MIN_WORKERS, m_num_fillers);
+  if ( (read_env_var("UMAP_PAGE_FILLERS_MIN", &env_value)) != nullptr )
+    m_min_fillers = std::min(env_value, m_num_fillers);
+
+  m_min_evictors = std::min<uint64_t>(MIN_WORKERS, m_num_evictors);
+  if ( (read_env_var("UMAP_PAGE_EVICTORS_MIN", &env_value)) != nullptr )
+    m_min_evictors = std::min(env_value, m_num_evictors);
+
+  if ( (read_env_var("UMAP_WORKER_IDLE_TIMEOUT", &env_value)) != nullptr )
+    m_worker_idle_timeout = (long)env_value;
+  else
+    m_worker_idle_timeout = WORKER_IDLE_TIMEOUT;
+
+  if ( (read_env_var("UMAP_UFFD_THREADS", &env_value)) != nullptr )
+    set_num_uffd_threads(env_value);
+  else
+    set_num_uffd_threads(1);
+
+  const uint64_t WORK_QUEUE_SIZE = 4096;
+  std::string env_str;
+  uint64_t wq_size = WORK_QUEUE_SIZE;
+  if ( (read_env_var("UMAP_WORK_QUEUE_SIZE", &env_value)) != nullptr )
+    wq_size = env_value;
+
+  if ( (read_env_str("UMAP_WORK_QUEUE", &env_str)) != nullptr )
+    set_work_queue(env_str, wq_size);
+  else
+    set_work_queue("list", wq_size);
+
+  if ( (read_env_var("UMAP_WORK_QUEUES", &env_value)) != nullptr )
+    m_num_work_queues = env_value;
+  else
+    m_num_work_queues = 1;
+
   if ( (read_env_var("UMAP_EVICT_HIGH_WATER_THRESHOLD", &env_value)) != nullptr )
     set_evict_high_water_threshold(env_value);
   else
@@ -154,6 +1149,11 @@ RegionManager::RegionManager()
   else
     set_evict_low_water_threshold(70);
 
+  if ( (read_env_str("UMAP_EVICT_POLICY", &env_str)) != nullptr )
+    set_evict_policy(env_str);
+  else
+    set_evict_policy("fifo");
+
   if ( (read_env_var("UMAP_PAGESIZE", &env_value)) != nullptr )
     set_umap_page_size(env_value);
   else
@@ -164,11 +1164,150 @@ RegionManager::RegionManager()
   else
     set_max_pages_in_buffer( get_max_pages_in_memory() );
 
+  //
+  // By default, use one shard per hardware thread, but keep enough pages in
+  // each shard for the watermarks to remain meaningful.
+  //
+  const uint64_t MIN_PAGES_PER_SHARD = 256;
+  if ( (read_env_var("UMAP_BUFFER_SHARDS", &env_value)) != nullptr ) {
+    set_num_buffer_shards(env_value);
+  }
+  else {
+    uint64_t num_shards = get_max_pages_in_buffer() / MIN_PAGES_PER_SHARD;
+    num_shards = (num_shards > nthreads) ? nthreads : num_shards;
+    set_num_buffer_shards( (num_shards == 0) ? 1 : num_shards );
+  }
+
+  if ( (read_env_var("UMAP_READ_AHEAD", &env_value)) != nullptr )
+    set_read_ahead(env_value);
+  else
+    set_read_ahead(0);
+
+  //
+  // Runs of adjacent pages are filled together, up to 32 pages or 4MB
+  //
+  const uint64_t MAX_FILL_PAGES = 32;
+  const uint64_t MAX_FILL_BYTES = 4 * 1024 * 1024;
+  if ( (read_env_var("UMAP_MAX_FILL_PAGES", &env_value)) != nullptr ) {
+    set_max_fill_pages(env_value);
+  }
+  else {
+    uint64_t max_pages = MAX_FILL_BYTES / get_umap_page_size();
+    max_pages = (max_pages > MAX_FILL_PAGES) ? MAX_FILL_PAGES : max_pages;
+    set_max_fill_pages( (max_pages == 0) ? 1 : max_pages );
+  }
+
+  if ( (read_env_str("UMAP_IO_ENGINE", &env_str)) != nullptr )
+    set_io_engine(env_str);
+  else
+    set_io_engine("sync");
+
+  if ( (read_env_var("UMAP_IO_DEPTH", &env_value)) != nullptr )
+    set_io_depth(env_value);
+  else
+    set_io_depth(32);
+
+  if ( (read_env_var("UMAP_DIRTY_RATIO", &env_value)) != nullptr )
+    set_dirty_ratio(env_value);
+  else
+    set_dirty_ratio(0);
+
+  if ( (read_env_var("UMAP_HUGETLB", &env_value)) != nullptr )
+    set_hugetlb(env_value);
+  else
+    set_hugetlb(0);
+
+  if ( (read_env_var("UMAP_DIRECT_IO", &env_value)) != nullptr )
+    set_direct_io(env_value);
+  else
+    set_direct_io(0);
+
+  if ( (read_env_var("UMAP_WP_ASYNC", &env_value)) != nullptr )
+    set_wp_async(env_value);
+  else
+    set_wp_async(0);
+
+  if ( (read_env_var("UMAP_FILL_MOVE", &env_value)) != nullptr )
+    set_fill_move(env_value);
+  else
+    set_fill_move(0);
+
+  if ( (read_env_var("UMAP_WARM_RESTART", &env_value)) != nullptr )
+    set_warm_restart(env_value);
+  else
+    set_warm_restart(0);
+
+  m_engine_held = false;
+  if ( (read_env_var("UMAP_KEEP_ALIVE", &env_value)) != nullptr )
+    set_keep_alive(env_value);
+  else
+    set_keep_alive(0);
+
+  if ( (read_env_var("UMAP_LATENCY_HISTOGRAMS", &env_value)) != nullptr )
+    set_latency_histograms(env_value);
+  else
+    set_latency_histograms(0);
+
+  //
+  // The trace is kept for the whole process, the first context to read
+  // UMAP_TRACE starts it
+  //
+  const uint64_t TRACE_RECORDS = 65536;
+
+  if ( (read_env_str("UMAP_TRACE", &env_str)) != nullptr ) {
+    if ( (read_env_var("UMAP_TRACE_RECORDS", &env_value)) == nullptr )
+      env_value = TRACE_RECORDS;
+    Trace::enable(env_str, env_value);
+  }
+
+  if ( (read_env_var("UMAP_MAX_PINNED_PAGES", &env_value)) != nullptr )
+    set_max_pinned_pages(env_value);
+  else
+    set_max_pinned_pages(0);
+
+  if ( (read_env_str("UMAP_NUMA", &env_str)) != nullptr )
+    set_numa(env_str);
+  else
+    set_numa("none");
+
+  read_placement_env();
+
+  if ( (read_env_var("UMAP_BUFFER_CONTROLLER", &env_value)) != nullptr )
+    m_buffer_controller_interval = env_value;
+  else
+    m_buffer_controller_interval = 0;
+
+  if ( (read_env_var("UMAP_BUFFER_PSI_THRESHOLD", &env_value)) != nullptr )
+    set_buffer_psi_threshold(env_value);
+  else
+    set_buffer_psi_threshold(10);
+
   if ( (read_env_var("UMAP_MONITOR_FREQ", &env_value)) != nullptr )
     m_monitor_freq = env_value;
   else
     m_monitor_freq = 0;
 
+  if ( (read_env_str("UMAP_METRICS_SHM", &env_str)) != nullptr )
+    m_metrics_shm = env_str;
+
+  //
+  // Published metrics are sampled every second unless asked otherwise, the
+  // log alone as often as it is written
+  //
+  const uint64_t METRICS_INTERVAL_MS = 1000;
+
+  if ( (read_env_var("UMAP_MONITOR_INTERVAL_MS", &env_value)) != nullptr )
+    m_monitor_interval_ms = env_value;
+  else if ( ! m_metrics_shm.empty() )
+    m_monitor_interval_ms = METRICS_INTERVAL_MS;
+  else
+    m_monitor_interval_ms = (uint64_t)m_monitor_freq * 1000;
+
+  std::lock_guard<std::mutex> lock(contexts_mutex());
+  static uint64_t next_context_id = 0;
+
+  m_context_id = next_context_id++;
+  contexts().push_back(this);
 }
 
 uint64_t
@@ -219,18 +1358,28 @@ RegionManager::set_max_pages_in_buffer( uint64_t max_pages )
     << " to " << get_max_pages_in_buffer() << " pages");
 }
 
+//
+// Pages must be a power of two multiple of the system page size, since
+// addresses are rounded to them with a mask
+//
 void
-RegionManager::set_umap_page_size( uint64_t page_size )
+RegionManager::check_page_size( uint64_t page_size )
 {
-  //
-  // Must be multiple of system page size
-  //
-  if ( page_size % get_system_page_size() ) {
+  if ( page_size == 0 || page_size % get_system_page_size() ) {
     UMAP_ERROR("Specified page size (" << page_size
         << ") must be a multiple of the system page size ("
         << get_system_page_size() << ")");
   }
 
+  if ( page_size & (page_size - 1) )
+    UMAP_ERROR("Specified page size (" << page_size << ") must be a power of two");
+}
+
+void
+RegionManager::set_umap_page_size( uint64_t page_size )
+{
+  check_page_size(page_size);
+
   UMAP_LOG(Debug,
       "Adjusting page size from "
       << get_umap_page_size() << " to " << page_size);
@@ -258,38 +1407,29 @@ RegionManager::read_env_var( const char* env, uint64_t*  val )
   return nullptr;
 }
 
-RegionDescriptor*
-RegionManager::containing_region( char* vaddr )
+std::string*
+RegionManager::read_env_str( const char* env, std::string* val )
 {
-  std::lock_guard<std::mutex> lock(m_mutex);
-
-  //
-  // Since the list of pages coming in are usually sorted, we have a special
-  // check here to see if the region found for the previous check will work.
-  // If this is the case, we can return early.
-  //
-  if ( m_last_iter != m_active_regions.end() ) {
-    char* b = m_last_iter->second->start();
-    char* e = m_last_iter->second->end();
-
-    if ( vaddr >= b && vaddr < e )
-      return m_last_iter->second;
+  // return a pointer to val on success, null on failure
+  char* val_ptr = 0;
+  if ( (val_ptr = getenv(env)) && *val_ptr != '\0' ) {
+    *val = val_ptr;
+    return val;
   }
+  return nullptr;
+}
 
-  auto iter = m_active_regions.upper_bound(reinterpret_cast<void*>(vaddr));
-
-  if ( iter != m_active_regions.begin() ) {
-    // Back up the iterator
-    --iter;
-
-    char* b = iter->second->start();
-    char* e = iter->second->end();
+//
+// Called on every fault, so the regions are looked up without taking
+// m_mutex, see RegionIndex
+//
+RegionDescriptor*
+RegionManager::containing_region( char* vaddr )
+{
+  RegionDescriptor* rd = m_region_index.find(vaddr);
 
-    if ( vaddr >= b && vaddr < e ) {
-      m_last_iter = iter;
-      return iter->second;
-    }
-  }
+  if ( rd != nullptr )
+    return rd;
 
   UMAP_LOG(Debug, "Unable to find addr: "
       << (void*)vaddr
@@ -321,6 +1461,230 @@ RegionManager::set_evict_low_water_threshold( int percent )
   m_evict_low_water_threshold = percent;
 }
 void
+RegionManager::set_num_buffer_shards( uint64_t num_shards )
+{
+  m_num_buffer_shards = num_shards;
+}
+void
+RegionManager::set_num_uffd_threads( uint64_t num_threads )
+{
+  m_num_uffd_threads = num_threads;
+}
+
+void
+RegionManager::set_read_ahead( uint64_t max_pages )
+{
+  //
+  // A single stream may not prefetch more than a quarter of the Buffer
+  //
+  uint64_t limit = get_max_pages_in_buffer() / 4;
+
+  if ( max_pages > limit ) {
+    UMAP_LOG(Info, "Limiting read-ahead from " << max_pages << " to " << limit << " pages");
+    max_pages = limit;
+  }
+
+  m_read_ahead = max_pages;
+}
+
+void
+RegionManager::set_max_fill_pages( uint64_t max_pages )
+{
+  m_max_fill_pages = max_pages;
+}
+
+void
+RegionManager::set_work_queue( const std::string& type, uint64_t size )
+{
+  if ( type == "list" )
+    m_ring_work_queue = false;
+  else if ( type == "ring" )
+    m_ring_work_queue = true;
+  else
+    UMAP_ERROR("Invalid work queue type: " << type << " (expected list or ring)");
+
+  m_work_queue_size = size;
+}
+void
+RegionManager::set_evict_policy( const std::string& policy )
+{
+  if ( ! ReplacementPolicy::is_valid_policy(policy) )
+    UMAP_ERROR("Invalid eviction policy: " << policy
+        << " (expected fifo, clock, 2q or lfu)");
+
+  m_evict_policy = policy;
+}
+void
+RegionManager::set_io_engine( const std::string& engine )
+{
+  if ( engine != "sync" && engine != "io_uring" )
+    UMAP_ERROR("Invalid I/O engine: " << engine << " (expected sync or io_uring)");
+
+  m_io_engine = engine;
+}
+void
+RegionManager::set_io_depth( uint64_t depth )
+{
+  //
+  // The depth is the number of store requests each worker keeps in flight
+  //
+  const uint64_t MAX_IO_DEPTH = 4096;
+
+  if ( depth == 0 || depth > MAX_IO_DEPTH )
+    UMAP_ERROR("Invalid I/O depth: " << depth << " (expected 1 to " << MAX_IO_DEPTH << ")");
+
+  m_io_depth = depth;
+}
+void
+RegionManager::set_hugetlb( uint64_t enable )
+{
+  if ( enable > 1 )
+    UMAP_ERROR("Invalid UMAP_HUGETLB value: " << enable << " (expected 0 or 1)");
+
+  m_hugetlb = ( enable == 1 );
+}
+
+void
+RegionManager::set_direct_io( uint64_t enable )
+{
+  if ( enable > 1 )
+    UMAP_ERROR("Invalid UMAP_DIRECT_IO value: " << enable << " (expected 0 or 1)");
+
+  m_direct_io = ( enable == 1 );
+}
+
+void
+RegionManager::set_wp_async( uint64_t enable )
+{
+  if ( enable > 1 )
+    UMAP_ERROR("Invalid UMAP_WP_ASYNC value: " << enable << " (expected 0 or 1)");
+
+  m_wp_async = ( enable == 1 );
+}
+
+void
+RegionManager::set_fill_move( uint64_t enable )
+{
+  if ( enable > 1 )
+    UMAP_ERROR("Invalid UMAP_FILL_MOVE value: " << enable << " (expected 0 or 1)");
+
+  m_fill_move = ( enable == 1 );
+}
+
+void
+RegionManager::set_warm_restart( uint64_t enable )
+{
+  if ( enable > 1 )
+    UMAP_ERROR("Invalid UMAP_WARM_RESTART value: " << enable << " (expected 0 or 1)");
+
+  m_warm_restart = ( enable == 1 );
+}
+
+void
+RegionManager::set_keep_alive( uint64_t enable )
+{
+  if ( enable > 1 )
+    UMAP_ERROR("Invalid UMAP_KEEP_ALIVE value: " << enable << " (expected 0 or 1)");
+
+  m_keep_alive = ( enable == 1 );
+}
+
+void
+RegionManager::set_latency_histograms( uint64_t enable )
+{
+  if ( enable > 1 )
+    UMAP_ERROR("Invalid UMAP_LATENCY_HISTOGRAMS value: " << enable << " (expected 0 or 1)");
+
+  if ( enable == 1 )
+    m_latency = new LatencyHistogram[UMAP_LATENCY_STAGES];
+}
+
+void
+RegionManager::set_max_pinned_pages( uint64_t max_pages )
+{
+  m_max_pinned_pages = max_pages;
+}
+
+//
+// The kernel has a pool directory for each huge page size it supports
+//
+bool
+RegionManager::is_huge_page_size( uint64_t page_size )
+{
+  std::stringstream path;
+
+  path << "/sys/kernel/mm/hugepages/hugepages-" << (page_size / 1024) << "kB";
+  return access(path.str().c_str(), F_OK) == 0;
+}
+
+void
+RegionManager::read_placement_env( void )
+{
+  std::string env_str;
+
+  if ( (read_env_str("UMAP_CPUS", &env_str)) != nullptr )
+    m_umap_placement.set_cpus(env_str);
+
+  m_filler_placement = m_umap_placement;
+  m_evictor_placement = m_umap_placement;
+  m_uffd_placement = m_umap_placement;
+  m_monitor_placement = m_umap_placement;
+
+  if ( (read_env_str("UMAP_FILLER_CPUS", &env_str)) != nullptr )
+    m_filler_placement.set_cpus(env_str);
+
+  if ( (read_env_str("UMAP_EVICTOR_CPUS", &env_str)) != nullptr )
+    m_evictor_placement.set_cpus(env_str);
+
+  if ( (read_env_str("UMAP_UFFD_CPUS", &env_str)) != nullptr )
+    m_uffd_placement.set_cpus(env_str);
+
+  if ( (read_env_str("UMAP_UFFD_PRIORITY", &env_str)) != nullptr )
+    m_uffd_placement.set_priority(env_str);
+
+  if ( (read_env_str("UMAP_MONITOR_CPUS", &env_str)) != nullptr )
+    m_monitor_placement.set_cpus(env_str);
+
+  if ( (read_env_str("UMAP_MONITOR_PRIORITY", &env_str)) != nullptr )
+    m_monitor_placement.set_priority(env_str);
+}
+
+void
+RegionManager::set_numa( const std::string& policy )
+{
+  if ( policy == "none" ) {
+    m_numa_policy = UMAP_NUMA_LOCAL;
+    return;
+  }
+
+  if ( policy == "local" )
+    m_numa_policy = UMAP_NUMA_LOCAL;
+  else if ( policy == "interleave" )
+    m_numa_policy = UMAP_NUMA_INTERLEAVE;
+  else
+    UMAP_ERROR("Invalid UMAP_NUMA value: " << policy << " (expected none, local or interleave)");
+
+  m_numa = new Numa();
+}
+
+void
+RegionManager::set_buffer_psi_threshold( uint64_t percent )
+{
+  if ( percent > 100 )
+    UMAP_ERROR("Invalid PSI threshold: " << percent << " (expected at most 100)");
+
+  m_buffer_psi_threshold = percent;
+}
+
+void
+RegionManager::set_dirty_ratio( int percent )
+{
+  if ( percent < 0 || percent > 100 )
+    UMAP_ERROR("Invalid dirty ratio: " << percent << " (expected 0 to 100)");
+
+  m_dirty_ratio = percent;
+}
+void
 RegionManager::set_max_fault_events( uint64_t max_events )
 {
   m_max_fault_events = max_events;
@@ -7,16 +7,28 @@
 #ifndef _UMAP_RegionManager_HPP
 #define _UMAP_RegionManager_HPP
 
+#include <atomic>
 #include <cstdint>
 #include <mutex>
 #include <map>
+#include <string>
+#include <vector>
 
 #include "umap/Buffer.hpp"
+#include "umap/BufferController.hpp"
 #include "umap/EvictManager.hpp"
 #include "umap/FillWorkers.hpp"
+#include "umap/Flusher.hpp"
+#include "umap/Monitor.hpp"
+#include "umap/Numa.hpp"
+#include "umap/Prefetcher.hpp"
+#include "umap/RegionIndex.hpp"
 #include "umap/Uffd.hpp"
 #include "umap/umap.h"
 #include "umap/store/Store.hpp"
+#include "umap/util/LatencyHistogram.hpp"
+#include "umap/util/Trace.hpp"
+#include "umap/util/ThreadPlacement.hpp"
 #include "umap/RegionDescriptor.hpp"
 
 namespace Umap {
@@ -32,12 +44,26 @@ struct Version {
 //
 // Implemented as a singleton for now.  Things can get too weird attempting to
 // manage changes in configuration parameters when we have active monitors
-// working.  So, we only allow changing configuration when there are no active
-// monitors
+// working.  So, most of the configuration may only be changed when there are
+// no active monitors, see reconfigure()
+//
+// The singleton is the default context.  Applications may create more
+// contexts with create_context(), each with a Buffer, fault handlers,
+// workers and configuration of its own, read from the environment like
+// those of the singleton.
 //
 class RegionManager {
   public:
     static RegionManager& getInstance( void );
+    static RegionManager* create_context( void );
+
+    //
+    // The context of the region containing addr, the default one if none
+    //
+    static RegionManager& for_address( void* addr );
+    static std::vector<RegionManager*> get_contexts( void );
+
+    ~RegionManager( void );
 
     // delete copy, move, and assign operators
     RegionManager(RegionManager const&) = delete;             // Copy construct
@@ -51,52 +77,286 @@ class RegionManager {
         , uint64_t region_size
         , char*    mmap_region
         , uint64_t mmap_region_size
+        , uint64_t page_size
+        , bool     huge_pages
+        , bool     read_only
+        , int      shared_fd = -1
+        , const std::string& shared_name = ""
+        , std::atomic<uint32_t>* shared_claims = nullptr
     );
 
     int flush_buffer();
+    FlushFence* flush_async( char* addr, uint64_t length );
+    FlushFence* prefetch_async( char* addr, uint64_t length );
+    void advise( char* addr, uint64_t length, int advice );
     void prefetch(int npages, umap_prefetch_item* page_array);
-    void fetch_and_pin( char* paddr, uint64_t size );
+    void pin( char* addr, uint64_t length );
+    void unpin( char* addr, uint64_t length );
+    uint64_t snapshot( char* addr, Store* target );
+    bool save_hot_pages( char* addr, const std::string& path );
+    bool warm_up( char* addr, const std::string& path );
     void removeRegion( char* mmap_region );
+
+    //
+    // The engine (Buffer, fault handlers and workers) is started by the
+    // first region and stopped with the last one, unless UMAP_KEEP_ALIVE is
+    // set or init_engine() was called, in which case it runs until
+    // finalize_engine() is called with no region mapped.
+    //
+    void init_engine( void );
+    void finalize_engine( void );
+    void set_region_quota( char* region, uint64_t min_pages, uint64_t max_pages );
+    void set_buffer_pages( uint64_t max_pages );
+
+    //
+    // Settings that may be changed after the environment has been read.
+    // Those up to MAX_PINNED_PAGES apply to the running engine, the others
+    // only while the engine is stopped.  The values are those of UMAP_CONFIG_*
+    // in umap.h.
+    //
+    enum Setting {
+        NUM_FILLERS                 = UMAP_CONFIG_NUM_FILLERS
+      , NUM_EVICTORS                = UMAP_CONFIG_NUM_EVICTORS
+      , EVICT_LOW_WATER_THRESHOLD   = UMAP_CONFIG_EVICT_LOW_WATER_THRESHOLD
+      , EVICT_HIGH_WATER_THRESHOLD  = UMAP_CONFIG_EVICT_HIGH_WATER_THRESHOLD
+      , DIRTY_RATIO                 = UMAP_CONFIG_DIRTY_RATIO
+      , MAX_FAULT_EVENTS            = UMAP_CONFIG_MAX_FAULT_EVENTS
+      , READ_AHEAD                  = UMAP_CONFIG_READ_AHEAD
+      , MAX_PINNED_PAGES            = UMAP_CONFIG_MAX_PINNED_PAGES
+      , UMAP_PAGE_SIZE              = UMAP_CONFIG_UMAP_PAGE_SIZE
+      , NUM_BUFFER_SHARDS           = UMAP_CONFIG_NUM_BUFFER_SHARDS
+      , NUM_UFFD_THREADS            = UMAP_CONFIG_NUM_UFFD_THREADS
+      , MAX_FILL_PAGES              = UMAP_CONFIG_MAX_FILL_PAGES
+      , IO_DEPTH                    = UMAP_CONFIG_IO_DEPTH
+    };
+    void reconfigure( Setting setting, uint64_t value );
+    void set_region_numa_policy( char* region, int policy, int node );
+
+    //
+    // Counters of umap_get_stats(), including those of the regions removed
+    // and engines stopped since reset_stats().  get_stats() adds to stats.
+    //
+    void get_stats( struct umap_stats* stats );
+    void reset_stats( void );
+    void get_region_stats( char* region, struct umap_region_stats* stats );
+
+    //
+    // Totals since the process started and the regions, for the Monitor.
+    // Returns false, having done nothing, if the mutex of the context is
+    // held.
+    //
+    bool sample_metrics( struct umap_stats* stats, MetricsFormat::Segment* m );
+
+    //
+    // With UMAP_LATENCY_HISTOGRAMS or UMAP_TRACE, the stages of a fault are
+    // timed from a latency_clock() reading to record_latency().
+    // latency_clock() is 0 otherwise, which the callers take as not to
+    // record.
+    //
+    uint64_t latency_clock( void ) {
+      return ( m_latency != nullptr || Trace::enabled() ) ? now_ns() : 0;
+    }
+    void record_latency( int stage, uint64_t since ) {
+      if ( m_latency != nullptr )
+        m_latency[stage].record(now_ns() - since);
+    }
+    void get_latency_histogram( int stage, struct umap_latency_histogram* hist );
+    uint64_t get_num_regions_over_quota( void ) { return m_regions_over_quota; }
+    uint64_t get_num_regions_noreuse( void ) { return m_regions_noreuse; }
+
+    //
+    // Regions may use a page size other than UMAP_PAGESIZE, in which case
+    // fault addresses have to be rounded with the page size of their region
+    //
+    bool has_region_page_sizes( void ) { return m_num_region_page_sizes != 0; }
+    void check_page_size( uint64_t page_size );
+
+    //
+    // With UMAP_HUGETLB, regions whose page size is one of the huge page
+    // sizes of the system are backed by hugetlb pages
+    //
+    bool get_hugetlb( void ) { return m_hugetlb; }
+    bool is_huge_page_size( uint64_t page_size );
+
+    //
+    // With UMAP_DIRECT_IO, the stores of regions backed by a file descriptor
+    // bypass the page cache as if the regions were mapped UMAP_DIRECT_IO
+    //
+    bool get_direct_io( void ) { return m_direct_io; }
+
+    //
+    // With UMAP_WP_ASYNC, the kernel resolves the write protect faults of
+    // clean pages itself, where it supports it, and umap finds the written
+    // pages by scanning the page tables, see Buffer::collect_written_pages()
+    //
+    bool get_wp_async( void ) { return m_wp_async; }
+
+    //
+    // With UMAP_FILL_MOVE, the pages of private read-write regions are read
+    // into staging pages of the fill workers that are then moved into the
+    // region (UFFDIO_MOVE), instead of being copied in, where the kernel
+    // supports it
+    //
+    bool get_fill_move( void ) { return m_fill_move; }
+
+    //
+    // With UMAP_WARM_RESTART, the pages in the Buffer when a region is
+    // unmapped are listed where its store tells (Store::hot_pages_path()),
+    // and prefetched in the background by the next region of the store
+    //
+    bool get_warm_restart( void ) { return m_warm_restart; }
+    bool get_keep_alive( void ) { return m_keep_alive; }
+
+    //
+    // Most pages that may be pinned at once: UMAP_MAX_PINNED_PAGES, or half
+    // of the Buffer by default, never more than the eviction low water mark
+    // leaves to the Buffer
+    //
+    uint64_t get_max_pinned_pages( void );
     Version  get_umap_version( void ) { return m_version; }
     long     get_system_page_size( void ) { return m_system_page_size; }
     uint64_t get_max_pages_in_buffer( void ) { return m_max_pages_in_buffer; }
     int      get_monitor_freq( void ) { return m_monitor_freq; }
+    uint64_t get_monitor_interval_ms( void ) { return m_monitor_interval_ms; }
+    const std::string& get_metrics_shm( void ) { return m_metrics_shm; }
+    uint64_t get_context_id( void ) { return m_context_id; }
     uint64_t get_umap_page_size( void ) { return m_umap_page_size; }
     uint64_t get_num_fillers( void ) { return m_num_fillers; }
     uint64_t get_num_evictors( void ) { return m_num_evictors; }
+
+    //
+    // The fill and evict worker pools run between these and the numbers
+    // above, idle workers leave after get_worker_idle_timeout() ms
+    //
+    uint64_t get_min_fillers( void ) { return m_min_fillers; }
+    uint64_t get_min_evictors( void ) { return m_min_evictors; }
+    long get_worker_idle_timeout( void ) { return m_worker_idle_timeout; }
+
+    //
+    // Number of fill and evict workers running right now
+    //
+    uint64_t get_num_active_fillers( void );
+    uint64_t get_num_active_evictors( void );
     int get_evict_low_water_threshold( void ) { return m_evict_low_water_threshold; }
     int get_evict_high_water_threshold( void ) { return m_evict_high_water_threshold; }
     uint64_t get_max_fault_events( void ) { return m_max_fault_events; }
+    uint64_t get_num_buffer_shards( void ) { return m_num_buffer_shards; }
+    uint64_t get_num_uffd_threads( void ) { return m_num_uffd_threads; }
+    uint64_t get_read_ahead( void ) { return m_read_ahead; }
+    uint64_t get_max_fill_pages( void ) { return m_max_fill_pages; }
+    uint64_t get_work_queue_size( void ) { return m_work_queue_size; }
+    const std::string& get_evict_policy( void ) { return m_evict_policy; }
+    const std::string& get_io_engine( void ) { return m_io_engine; }
+    uint64_t get_io_depth( void ) { return m_io_depth; }
+    int get_dirty_ratio( void ) { return m_dirty_ratio; }
+    uint64_t get_buffer_controller_interval( void ) { return m_buffer_controller_interval; }
+    uint64_t get_buffer_psi_threshold( void ) { return m_buffer_psi_threshold; }
+    uint64_t get_ring_work_queue_size( void ) { return m_ring_work_queue ? m_work_queue_size : 0; }
+
+    //
+    // Work queues of the fill (per NUMA node) and evict worker pools, whose
+    // workers steal from each other
+    //
+    uint64_t get_num_work_queues( void ) { return m_num_work_queues; }
     Buffer* get_buffer_h() { return m_buffer; }
     Uffd* get_uffd_h() { return m_uffd; }
     FillWorkers* get_fill_workers_h() { return m_fill_workers; }
     EvictManager* get_evict_manager() { return m_evict_manager; }
+    Flusher* get_flusher_h() { return m_flusher; }
+
+    //
+    // nullptr unless UMAP_NUMA is set
+    //
+    Numa* get_numa_h() { return m_numa; }
+
+    //
+    // CPUs and priorities of the threads of umap.  Threads without a
+    // placement of their own (the flusher and buffer controller) use that
+    // of UMAP_CPUS, which is also the default of all others.
+    //
+    const ThreadPlacement& get_umap_placement( void ) { return m_umap_placement; }
+    const ThreadPlacement& get_filler_placement( void ) { return m_filler_placement; }
+    const ThreadPlacement& get_evictor_placement( void ) { return m_evictor_placement; }
+    const ThreadPlacement& get_uffd_placement( void ) { return m_uffd_placement; }
+    const ThreadPlacement& get_monitor_placement( void ) { return m_monitor_placement; }
     RegionDescriptor* containing_region( char* vaddr );
+    bool contains( void* vaddr );
+    RegionIndex& get_region_index( void ) { return m_region_index; }
     uint64_t get_num_active_regions( void ) { return (uint64_t)m_active_regions.size(); }
 
   private:
     Version  m_version;
     uint64_t m_max_pages_in_buffer;
     int      m_monitor_freq;
+    uint64_t m_monitor_interval_ms;   // 0 without a monitor
+    std::string m_metrics_shm;        // Empty if not published
+    uint64_t m_context_id;            // 0 for the default context
     long     m_umap_page_size;
     uint64_t m_system_page_size;
     uint64_t m_num_fillers;
     uint64_t m_num_evictors;
+    uint64_t m_min_fillers;
+    uint64_t m_min_evictors;
+    long m_worker_idle_timeout;
     int m_evict_low_water_threshold;
     int m_evict_high_water_threshold;
     uint64_t m_max_fault_events;
+    uint64_t m_num_buffer_shards;
+    uint64_t m_num_uffd_threads;
+    uint64_t m_read_ahead;
+    uint64_t m_max_fill_pages;
+    bool     m_ring_work_queue;
+    uint64_t m_work_queue_size;
+    uint64_t m_num_work_queues;
+    std::string m_evict_policy;
+    std::string m_io_engine;
+    uint64_t m_io_depth;
+    int m_dirty_ratio;
+    bool m_hugetlb;
+    bool m_direct_io;
+    bool m_wp_async;
+    bool m_fill_move;
+    bool m_warm_restart;
+    bool m_keep_alive;      // Keep the engine running without regions
+    bool m_engine_held;     // By init_engine()
+    uint64_t m_max_pinned_pages;            // 0 for the default
+    uint64_t m_buffer_controller_interval;  // In milliseconds, 0 if none
+    uint64_t m_buffer_psi_threshold;
     Buffer* m_buffer;
     Uffd* m_uffd;
     FillWorkers* m_fill_workers;
     EvictManager* m_evict_manager;
+    Flusher* m_flusher;
+    Prefetcher* m_prefetcher;
+    BufferController* m_buffer_controller;
+    Monitor* m_monitor;
+    Numa* m_numa;
+    int m_numa_policy;      // Of new regions
+    ThreadPlacement m_umap_placement;
+    ThreadPlacement m_filler_placement;
+    ThreadPlacement m_evictor_placement;
+    ThreadPlacement m_uffd_placement;
+    ThreadPlacement m_monitor_placement;
     std::mutex m_mutex;
+    std::mutex m_pin_mutex;   // Held by pin() and unpin(), never with m_mutex
 
+    std::atomic<uint64_t> m_regions_over_quota;
+    std::atomic<uint64_t> m_regions_noreuse;        // Regions with pages advised NOREUSE
+    std::atomic<uint64_t> m_num_region_page_sizes;  // Regions not using UMAP_PAGESIZE
     std::map<void*, RegionDescriptor*> m_active_regions;
-    std::map<void*, RegionDescriptor*>::iterator m_last_iter;
+    RegionIndex m_region_index;     // m_active_regions, for the fault path
+
+    BufferStats m_past_buffer_stats;  // Of the engines stopped
+    uint64_t m_past_bytes_read;       // Of the regions removed
+    uint64_t m_past_bytes_written;
+    uint64_t m_past_writebacks;
+    struct umap_stats m_stats_base;   // Totals at reset_stats()
+    LatencyHistogram* m_latency;      // Of each stage, nullptr if not timed
 
     RegionManager( void );
 
     uint64_t* read_env_var( const char* env, uint64_t* val);
+    std::string* read_env_str( const char* env, std::string* val);
     uint64_t        get_max_pages_in_memory( void );
     void set_max_fault_events( uint64_t max_events );
     void set_max_pages_in_buffer( uint64_t max_pages );
@@ -105,6 +365,32 @@ class RegionManager {
     void set_num_evictors( uint64_t num_evictors );
     void set_evict_low_water_threshold( int percent );
     void set_evict_high_water_threshold( int percent );
+    void set_num_buffer_shards( uint64_t num_shards );
+    void set_num_uffd_threads( uint64_t num_threads );
+    void set_read_ahead( uint64_t max_pages );
+    void set_max_fill_pages( uint64_t max_pages );
+    void set_work_queue( const std::string& type, uint64_t size );
+    void set_evict_policy( const std::string& policy );
+    void set_io_engine( const std::string& engine );
+    void set_io_depth( uint64_t depth );
+    void set_dirty_ratio( int percent );
+    void set_hugetlb( uint64_t enable );
+    void set_direct_io( uint64_t enable );
+    void set_wp_async( uint64_t enable );
+    void set_fill_move( uint64_t enable );
+    void set_warm_restart( uint64_t enable );
+    bool save_hot_pages( RegionDescriptor* rd, const std::string& path );
+    bool warm_up( RegionDescriptor* rd, const std::string& path );
+    void set_keep_alive( uint64_t enable );
+    void set_latency_histograms( uint64_t enable );
+    void log_latency_histograms( void );
+    void start_engine( void );
+    void stop_engine( void );
+    void set_max_pinned_pages( uint64_t max_pages );
+    void set_buffer_psi_threshold( uint64_t percent );
+    void set_numa( const std::string& policy );
+    void read_placement_env( void );
+    void total_stats( struct umap_stats* stats );
 };
 
 } // end of namespace Umap
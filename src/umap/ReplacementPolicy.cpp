@@ -0,0 +1,510 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include <stdlib.h>       // malloc(), calloc()
+
+#include "umap/ReplacementPolicy.hpp"
+#include "umap/util/Macros.hpp"
+
+namespace Umap {
+//
+// PageList
+//
+void PageList::push_front( PageDescriptor* pd )
+{
+  pd->policy_prev = nullptr;
+  pd->policy_next = head;
+
+  if ( head != nullptr )
+    head->policy_prev = pd;
+  else
+    tail = pd;
+
+  head = pd;
+  pd->policy_list = id;
+  ++size;
+}
+
+void PageList::remove( PageDescriptor* pd )
+{
+  if ( pd->policy_prev != nullptr )
+    pd->policy_prev->policy_next = pd->policy_next;
+  else
+    head = pd->policy_next;
+
+  if ( pd->policy_next != nullptr )
+    pd->policy_next->policy_prev = pd->policy_prev;
+  else
+    tail = pd->policy_prev;
+
+  pd->policy_prev = pd->policy_next = nullptr;
+  pd->policy_list = 0;
+  --size;
+}
+
+//
+// GhostList
+//
+GhostList::GhostList( uint64_t max_entries )
+  :   m_max(0), m_head(0), m_count(0), m_ring(nullptr), m_slots(nullptr)
+    , m_slot_mask(0), m_slot_shift(63)
+{
+  set_capacity(max_entries);
+}
+
+GhostList::~GhostList( void )
+{
+  free(m_ring);
+  free(m_slots);
+}
+
+//
+// The newest entries are kept, as many as fit
+//
+void GhostList::set_capacity( uint64_t max_entries )
+{
+  if ( max_entries == m_max )
+    return;
+
+  Entry* old_ring = m_ring;
+  uint32_t* old_slots = m_slots;
+  uint64_t old_max = m_max;
+  uint64_t old_head = m_head;
+  uint64_t old_count = m_count;
+
+  if ( max_entries > UINT32_MAX - 1 )
+    UMAP_ERROR("Too many entries for a ghost list: " << max_entries);
+
+  m_max = max_entries;
+  m_head = m_count = 0;
+  m_ring = nullptr;
+  m_slots = nullptr;
+
+  if ( m_max != 0 ) {
+    uint64_t num_slots = 2;
+    m_slot_shift = 63;
+
+    while ( num_slots < 2 * m_max ) {
+      num_slots <<= 1;
+      --m_slot_shift;
+    }
+
+    m_slot_mask = num_slots - 1;
+    m_ring = (Entry*)malloc(m_max * sizeof(Entry));
+    m_slots = (uint32_t*)calloc(num_slots, sizeof(uint32_t));
+
+    if ( m_ring == nullptr || m_slots == nullptr )
+      UMAP_ERROR("Failed to allocate a ghost list of " << m_max << " entries");
+
+    uint64_t first = ( old_count > m_max ) ? old_count - m_max : 0;
+
+    for ( uint64_t i = first; i < old_count; ++i ) {
+      Entry& e = old_ring[(old_head + old_max - old_count + i) % old_max];
+
+      if ( e.page != nullptr )
+        add(e.page, e.value);
+    }
+  }
+
+  free(old_ring);
+  free(old_slots);
+}
+
+uint64_t GhostList::find( char* page )
+{
+  for ( uint64_t i = home(page); ; i = (i + 1) & m_slot_mask ) {
+    if ( m_slots[i] == 0 )
+      return NONE;
+    if ( m_ring[m_slots[i] - 1].page == page )
+      return i;
+  }
+}
+
+//
+// Entries after the slot that could not be placed in their home slot are
+// moved back, so that no lookup stops short of them at the empty slot
+//
+void GhostList::erase_slot( uint64_t slot )
+{
+  uint64_t i = slot;
+
+  m_slots[i] = 0;
+
+  for ( uint64_t j = (i + 1) & m_slot_mask; m_slots[j] != 0; j = (j + 1) & m_slot_mask ) {
+    uint64_t k = home(m_ring[m_slots[j] - 1].page);
+    bool stays = ( i <= j ) ? ( i < k && k <= j ) : ( i < k || k <= j );
+
+    if ( ! stays ) {
+      m_slots[i] = m_slots[j];
+      m_slots[j] = 0;
+      i = j;
+    }
+  }
+}
+
+void GhostList::add( char* page, uint32_t value )
+{
+  if ( m_max == 0 )
+    return;
+
+  uint64_t slot = find(page);
+
+  if ( slot != NONE ) {
+    m_ring[m_slots[slot] - 1].page = nullptr;
+    erase_slot(slot);
+  }
+
+  if ( m_count == m_max ) {
+    Entry& oldest = m_ring[m_head];
+
+    if ( oldest.page != nullptr )
+      erase_slot(find(oldest.page));
+    --m_count;
+  }
+
+  m_ring[m_head].page = page;
+  m_ring[m_head].value = value;
+
+  uint64_t i = home(page);
+  while ( m_slots[i] != 0 )
+    i = (i + 1) & m_slot_mask;
+  m_slots[i] = (uint32_t)(m_head + 1);
+
+  m_head = (m_head + 1 == m_max) ? 0 : m_head + 1;
+  ++m_count;
+}
+
+bool GhostList::take( char* page, uint32_t* value )
+{
+  if ( m_max == 0 )
+    return false;
+
+  uint64_t slot = find(page);
+
+  if ( slot == NONE )
+    return false;
+
+  Entry& e = m_ring[m_slots[slot] - 1];
+
+  *value = e.value;
+  e.page = nullptr;
+  erase_slot(slot);
+  return true;
+}
+
+//
+// ReplacementPolicy
+//
+ReplacementPolicy* ReplacementPolicy::make_policy( const std::string& name, uint64_t capacity )
+{
+  if ( name == "fifo" )
+    return new FifoPolicy(capacity);
+  else if ( name == "clock" )
+    return new ClockPolicy(capacity);
+  else if ( name == "2q" )
+    return new TwoQueuePolicy(capacity);
+  else if ( name == "lfu" )
+    return new LfuPolicy(capacity);
+
+  UMAP_ERROR("Unknown replacement policy: " << name);
+  return nullptr;
+}
+
+bool ReplacementPolicy::is_valid_policy( const std::string& name )
+{
+  return name == "fifo" || name == "clock" || name == "2q" || name == "lfu";
+}
+
+int ReplacementPolicy::take_from_tail( PageList& list, std::vector<PageDescriptor*>& victims, int max, VictimFilter* filter )
+{
+  int taken = 0;
+  PageDescriptor* pd = list.tail;
+
+  while ( pd != nullptr && taken < max ) {
+    PageDescriptor* prev = pd->policy_prev;
+
+    if ( is_evictable(pd, filter) ) {
+      list.remove(pd);
+      --m_size;
+      victims.push_back(pd);
+      ++taken;
+    }
+    pd = prev;
+  }
+  return taken;
+}
+
+void ReplacementPolicy::append_pages( PageList& list, std::vector<PageDescriptor*>& pages )
+{
+  for ( auto pd = list.head; pd != nullptr; pd = pd->policy_next )
+    pages.push_back(pd);
+}
+
+//
+// FIFO
+//
+void FifoPolicy::insert( PageDescriptor* pd )
+{
+  m_list.push_front(pd);
+  ++m_size;
+}
+
+void FifoPolicy::remove( PageDescriptor* pd )
+{
+  m_list.remove(pd);
+  --m_size;
+}
+
+void FifoPolicy::select_victims( std::vector<PageDescriptor*>& victims, int max, VictimFilter* filter )
+{
+  take_from_tail(m_list, victims, max, filter);
+}
+
+//
+// CLOCK
+//
+void ClockPolicy::insert( PageDescriptor* pd )
+{
+  pd->referenced = false;
+  m_list.push_front(pd);
+  ++m_size;
+}
+
+void ClockPolicy::remove( PageDescriptor* pd )
+{
+  m_list.remove(pd);
+  --m_size;
+}
+
+void ClockPolicy::select_victims( std::vector<PageDescriptor*>& victims, int max, VictimFilter* filter )
+{
+  int taken = 0;
+
+  //
+  // Two trips around the clock are enough to clear every reference bit
+  //
+  for ( uint64_t scanned = 0, limit = 2 * m_list.size;
+        m_list.tail != nullptr && taken < max && scanned < limit; ++scanned ) {
+    PageDescriptor* pd = m_list.tail;
+
+    if ( pd->referenced ) {
+      pd->referenced = false;
+      m_list.move_to_front(pd);
+      continue;
+    }
+
+    if ( !is_evictable(pd, filter) ) {
+      m_list.move_to_front(pd);
+      continue;
+    }
+
+    m_list.remove(pd);
+    --m_size;
+    victims.push_back(pd);
+    ++taken;
+  }
+}
+
+//
+// 2Q
+//
+TwoQueuePolicy::TwoQueuePolicy( uint64_t capacity )
+  :   ReplacementPolicy(capacity), m_a1in(1), m_am(2), m_a1out(0)
+{
+  set_capacity(capacity);
+}
+
+void TwoQueuePolicy::set_capacity( uint64_t capacity )
+{
+  //
+  // The sizes suggested in the paper: A1in holds 25% of the pages and A1out
+  // remembers as many pages as 50% of the buffer would hold
+  //
+  m_capacity = capacity;
+  m_kin = (capacity / 4) ? (capacity / 4) : 1;
+  m_a1out.set_capacity(capacity / 2);
+}
+
+void TwoQueuePolicy::insert( PageDescriptor* pd )
+{
+  uint32_t unused;
+
+  if ( m_a1out.take(pd->page, &unused) )
+    m_am.push_front(pd);
+  else
+    m_a1in.push_front(pd);
+
+  ++m_size;
+}
+
+void TwoQueuePolicy::touch( PageDescriptor* pd )
+{
+  //
+  // References while on A1in are considered correlated and are ignored
+  //
+  if ( pd->policy_list == m_am.id )
+    m_am.move_to_front(pd);
+}
+
+void TwoQueuePolicy::remove( PageDescriptor* pd )
+{
+  list_of(pd).remove(pd);
+  --m_size;
+}
+
+void TwoQueuePolicy::select_victims( std::vector<PageDescriptor*>& victims, int max, VictimFilter* filter )
+{
+  int taken = 0;
+
+  if ( m_a1in.size > m_kin || m_am.size == 0 )
+    taken = take_from_a1in(victims, max, filter);
+
+  if ( taken < max )
+    taken += take_from_tail(m_am, victims, max - taken, filter);
+
+  if ( taken < max )
+    take_from_a1in(victims, max - taken, filter);
+}
+
+int TwoQueuePolicy::take_from_a1in( std::vector<PageDescriptor*>& victims, int max, VictimFilter* filter )
+{
+  size_t first = victims.size();
+  int taken = take_from_tail(m_a1in, victims, max, filter);
+
+  for ( size_t i = first; i < victims.size(); ++i )
+    m_a1out.add(victims[i]->page, 0);
+
+  return taken;
+}
+
+void TwoQueuePolicy::get_pages( std::vector<PageDescriptor*>& pages )
+{
+  append_pages(m_a1in, pages);
+  append_pages(m_am, pages);
+}
+
+//
+// LFU
+//
+LfuPolicy::LfuPolicy( uint64_t capacity )
+  :   ReplacementPolicy(capacity), m_history(capacity), m_evictions(0)
+{
+  for ( int i = 0; i < NUM_BUCKETS; ++i )
+    m_buckets.push_back(PageList(i + 1));
+}
+
+void LfuPolicy::set_capacity( uint64_t capacity )
+{
+  m_capacity = capacity;
+  m_history.set_capacity(capacity);
+}
+
+int LfuPolicy::bucket_of( uint32_t frequency )
+{
+  int b = 0;
+
+  while ( frequency > 1 && b < NUM_BUCKETS - 1 ) {
+    frequency >>= 1;
+    ++b;
+  }
+  return b;
+}
+
+void LfuPolicy::insert( PageDescriptor* pd )
+{
+  uint32_t frequency;
+
+  if ( m_history.take(pd->page, &frequency) )
+    pd->frequency = frequency + 1;
+  else
+    pd->frequency = 1;
+
+  m_buckets[bucket_of(pd->frequency)].push_front(pd);
+  ++m_size;
+}
+
+void LfuPolicy::touch( PageDescriptor* pd )
+{
+  int old_bucket = pd->policy_list - 1;
+
+  if ( pd->frequency != UINT32_MAX )
+    ++pd->frequency;
+
+  int new_bucket = bucket_of(pd->frequency);
+
+  if ( new_bucket != old_bucket ) {
+    m_buckets[old_bucket].remove(pd);
+    m_buckets[new_bucket].push_front(pd);
+  }
+}
+
+void LfuPolicy::remove( PageDescriptor* pd )
+{
+  m_buckets[pd->policy_list - 1].remove(pd);
+  --m_size;
+}
+
+void LfuPolicy::select_victims( std::vector<PageDescriptor*>& victims, int max, VictimFilter* filter )
+{
+  int taken = 0;
+  size_t first = victims.size();
+
+  for ( int b = 0; b < NUM_BUCKETS && taken < max; ++b )
+    taken += take_from_tail(m_buckets[b], victims, max - taken, filter);
+
+  for ( size_t i = first; i < victims.size(); ++i )
+    m_history.add(victims[i]->page, victims[i]->frequency);
+
+  m_evictions += taken;
+  if ( m_evictions >= m_capacity ) {
+    m_evictions = 0;
+    age();
+  }
+}
+
+PageDescriptor* LfuPolicy::oldest( void )
+{
+  for ( auto& bucket : m_buckets )
+    if ( bucket.tail != nullptr )
+      return bucket.tail;
+
+  return nullptr;
+}
+
+void LfuPolicy::get_pages( std::vector<PageDescriptor*>& pages )
+{
+  for ( auto& bucket : m_buckets )
+    append_pages(bucket, pages);
+}
+
+void LfuPolicy::age( void )
+{
+  //
+  // Halve every frequency.  Walking each bucket from its tail and pushing
+  // onto the front of the new bucket preserves the relative order of pages.
+  //
+  // The last bucket holds every frequency of 2^(NUM_BUCKETS-1) and more, so
+  // a page halved may stay in it.  Its pages are taken off into a list of
+  // their own first, or those pushed back onto its front would be walked,
+  // and halved, again.
+  //
+  for ( int b = 1; b < NUM_BUCKETS; ++b ) {
+    PageList aging = m_buckets[b];
+    PageDescriptor* pd = aging.tail;
+
+    m_buckets[b] = PageList(b + 1);
+
+    while ( pd != nullptr ) {
+      PageDescriptor* prev = pd->policy_prev;
+
+      pd->frequency = (pd->frequency > 1) ? (pd->frequency >> 1) : 1;
+      aging.remove(pd);
+      m_buckets[bucket_of(pd->frequency)].push_front(pd);
+      pd = prev;
+    }
+  }
+}
+} // end of namespace Umap
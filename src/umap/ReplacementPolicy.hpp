@@ -0,0 +1,251 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_ReplacementPolicy_HPP
+#define _UMAP_ReplacementPolicy_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "umap/PageDescriptor.hpp"
+
+namespace Umap {
+  //
+  // Intrusive doubly linked list of page descriptors.  A descriptor is on at
+  // most one list at a time and pd->policy_list tells which one.
+  //
+  struct PageList {
+    PageList( uint8_t list_id )
+      : head(nullptr), tail(nullptr), size(0), id(list_id) {}
+
+    void push_front( PageDescriptor* pd );
+    void remove( PageDescriptor* pd );
+    void move_to_front( PageDescriptor* pd ) { remove(pd); push_front(pd); }
+
+    PageDescriptor* head;
+    PageDescriptor* tail;
+    uint64_t size;
+    uint8_t id;
+  };
+
+  //
+  // Bounded FIFO history of the addresses of recently evicted pages, with a
+  // small value remembered for each of them.  The history is a ring of
+  // entries found through an open addressing hash table, both allocated as
+  // the capacity is set, so that pages are added and taken without
+  // allocating.  A page taken, or added again, leaves a hole in the ring
+  // that still counts against the capacity until it is overwritten.
+  //
+  class GhostList {
+    public:
+      GhostList( uint64_t max_entries );
+      ~GhostList( void );
+
+      GhostList( const GhostList& ) = delete;
+      GhostList& operator=( const GhostList& ) = delete;
+
+      void set_capacity( uint64_t max_entries );
+      void add( char* page, uint32_t value );
+      bool take( char* page, uint32_t* value );
+
+    private:
+      struct Entry { char* page; uint32_t value; };   // page is nullptr once taken
+
+      uint64_t m_max;
+      uint64_t m_head;        // Entry of the ring written next, the oldest once full
+      uint64_t m_count;       // Entries of the ring written, holes included
+      Entry* m_ring;
+      uint32_t* m_slots;      // Index in m_ring plus one, 0 when empty
+      uint64_t m_slot_mask;
+      int m_slot_shift;
+
+      static const uint64_t NONE = ~0UL;
+
+      uint64_t home( char* page ) {
+        return (((uint64_t)page >> 12) * 0x9E3779B97F4A7C15UL) >> m_slot_shift;
+      }
+      uint64_t find( char* page );
+      void erase_slot( uint64_t slot );
+  };
+
+  //
+  // Lets the Buffer restrict which evictable pages a policy may choose.
+  // accept() is only asked about pages that are otherwise evictable and a
+  // page is chosen if it returns true.
+  //
+  class VictimFilter {
+    public:
+      virtual ~VictimFilter( void ) {}
+      virtual bool accept( PageDescriptor* pd ) = 0;
+  };
+
+  //
+  // A replacement policy decides which of the busy pages of a Buffer shard
+  // are evicted next.  All methods are called with the lock of the owning
+  // shard held.
+  //
+  // The only reference information available to us comes from the page
+  // faults we see: a fault on a page that is already present, a write
+  // protect fault on a clean page, and a fault on a page that was evicted
+  // recently.  Policies that need more than insertion order build on these.
+  //
+  class ReplacementPolicy {
+    public:
+      static ReplacementPolicy* make_policy( const std::string& name, uint64_t capacity );
+      static bool is_valid_policy( const std::string& name );
+
+      ReplacementPolicy( uint64_t capacity ) : m_capacity(capacity), m_size(0) {}
+      virtual ~ReplacementPolicy( void ) {}
+
+      //
+      // A page has been brought into the Buffer
+      //
+      virtual void insert( PageDescriptor* pd ) = 0;
+
+      //
+      // A page that is in the Buffer has been referenced
+      //
+      virtual void touch( PageDescriptor* pd ) = 0;
+
+      //
+      // A page leaves the Buffer without having been chosen as a victim
+      //
+      virtual void remove( PageDescriptor* pd ) = 0;
+
+      //
+      // Choose up to max present, non-deferred pages to be evicted that are
+      // accepted by filter (if any).  The chosen pages are removed from the
+      // policy and appended to victims.
+      //
+      virtual void select_victims( std::vector<PageDescriptor*>& victims, int max, VictimFilter* filter ) = 0;
+
+      //
+      // The page that would next be considered for eviction, regardless of
+      // its state (used when draining the Buffer)
+      //
+      virtual PageDescriptor* oldest( void ) = 0;
+
+      virtual void get_pages( std::vector<PageDescriptor*>& pages ) = 0;
+
+      virtual void set_capacity( uint64_t capacity ) { m_capacity = capacity; }
+
+      uint64_t size( void ) { return m_size; }
+      bool contains( PageDescriptor* pd ) { return pd->policy_list != 0; }
+
+    protected:
+      uint64_t m_capacity;
+      uint64_t m_size;
+
+      static bool is_evictable( PageDescriptor* pd, VictimFilter* filter ) {
+        return !pd->deferred && pd->state == PageDescriptor::State::PRESENT
+          && ( filter == nullptr || filter->accept(pd) );
+      }
+
+      //
+      // Move up to max evictable pages from the tail of list to victims
+      //
+      int take_from_tail( PageList& list, std::vector<PageDescriptor*>& victims, int max, VictimFilter* filter );
+      void append_pages( PageList& list, std::vector<PageDescriptor*>& pages );
+  };
+
+  //
+  // Pages are evicted in the order in which they were brought in
+  //
+  class FifoPolicy : public ReplacementPolicy {
+    public:
+      FifoPolicy( uint64_t capacity ) : ReplacementPolicy(capacity), m_list(1) {}
+
+      void insert( PageDescriptor* pd );
+      void touch( PageDescriptor* ) {}
+      void remove( PageDescriptor* pd );
+      void select_victims( std::vector<PageDescriptor*>& victims, int max, VictimFilter* filter );
+      PageDescriptor* oldest( void ) { return m_list.tail; }
+      void get_pages( std::vector<PageDescriptor*>& pages ) { append_pages(m_list, pages); }
+
+    private:
+      PageList m_list;
+  };
+
+  //
+  // Second chance: a referenced page at the hand gets its reference bit
+  // cleared and goes around once more
+  //
+  class ClockPolicy : public ReplacementPolicy {
+    public:
+      ClockPolicy( uint64_t capacity ) : ReplacementPolicy(capacity), m_list(1) {}
+
+      void insert( PageDescriptor* pd );
+      void touch( PageDescriptor* pd ) { pd->referenced = true; }
+      void remove( PageDescriptor* pd );
+      void select_victims( std::vector<PageDescriptor*>& victims, int max, VictimFilter* filter );
+      PageDescriptor* oldest( void ) { return m_list.tail; }
+      void get_pages( std::vector<PageDescriptor*>& pages ) { append_pages(m_list, pages); }
+
+    private:
+      PageList m_list;
+  };
+
+  //
+  // 2Q (Johnson & Shasha).  New pages enter the A1in FIFO.  Pages evicted
+  // from A1in are remembered in the A1out history; refaulting on one of
+  // them places the page in the Am LRU, which is only evicted from once
+  // A1in is down to its share of the Buffer.  This keeps a scan from
+  // flushing the frequently used pages out of the Buffer.
+  //
+  class TwoQueuePolicy : public ReplacementPolicy {
+    public:
+      TwoQueuePolicy( uint64_t capacity );
+
+      void insert( PageDescriptor* pd );
+      void touch( PageDescriptor* pd );
+      void remove( PageDescriptor* pd );
+      void select_victims( std::vector<PageDescriptor*>& victims, int max, VictimFilter* filter );
+      PageDescriptor* oldest( void ) { return m_a1in.tail ? m_a1in.tail : m_am.tail; }
+      void get_pages( std::vector<PageDescriptor*>& pages );
+      void set_capacity( uint64_t capacity );
+
+    private:
+      PageList m_a1in;
+      PageList m_am;
+      GhostList m_a1out;
+      uint64_t m_kin;
+
+      PageList& list_of( PageDescriptor* pd ) { return (pd->policy_list == m_am.id) ? m_am : m_a1in; }
+      int take_from_a1in( std::vector<PageDescriptor*>& victims, int max, VictimFilter* filter );
+  };
+
+  //
+  // Least frequently used.  Pages are kept in buckets of log2(frequency) and
+  // frequencies survive a short stay out of the Buffer through a history of
+  // evicted pages.  Frequencies are halved every time the equivalent of the
+  // whole shard has been evicted so that formerly hot pages eventually age out.
+  //
+  class LfuPolicy : public ReplacementPolicy {
+    public:
+      static const int NUM_BUCKETS = 16;
+
+      LfuPolicy( uint64_t capacity );
+
+      void insert( PageDescriptor* pd );
+      void touch( PageDescriptor* pd );
+      void remove( PageDescriptor* pd );
+      void select_victims( std::vector<PageDescriptor*>& victims, int max, VictimFilter* filter );
+      PageDescriptor* oldest( void );
+      void get_pages( std::vector<PageDescriptor*>& pages );
+      void set_capacity( uint64_t capacity );
+
+    private:
+      std::vector<PageList> m_buckets;
+      GhostList m_history;
+      uint64_t m_evictions;
+
+      static int bucket_of( uint32_t frequency );
+      void age( void );
+  };
+} // end of namespace Umap
+
+#endif // _UMAP_ReplacementPolicy_HPP
@@ -0,0 +1,349 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_RingWorkQueue_HPP
+#define _UMAP_RingWorkQueue_HPP
+
+#include <atomic>
+#include <climits>
+#include <list>
+
+#include <cstdint>
+#include <linux/futex.h>        // FUTEX_WAIT_PRIVATE
+#include <pthread.h>
+#include <sys/syscall.h>        // syscall()
+#include <time.h>
+#include <unistd.h>
+
+#include "umap/WorkQueue.hpp"
+#include "umap/util/Macros.hpp"
+
+namespace Umap {
+//
+// Bounded multi-producer/multi-consumer queue.  Items are exchanged through
+// a ring of sequenced cells, so neither enqueue() nor dequeue() allocates or
+// takes a lock in the common case.  Consumers that find the queue empty
+// park on a futex that producers only touch when somebody is sleeping.
+//
+// Should the ring ever fill up, further items are placed on an overflow
+// list (protected by a mutex) until the consumers have drained it, so
+// enqueue() never blocks the producer.
+//
+template <typename T>
+class RingWorkQueue : public WorkQueue<T> {
+  public:
+    RingWorkQueue(int max_workers, uint64_t capacity)
+      :   m_max_waiting(max_workers)
+        , m_head(0)
+        , m_tail(0)
+        , m_count(0)
+        , m_overflow_size(0)
+        , m_work_futex(0)
+        , m_sleepers(0)
+        , m_waiting_workers(0)
+        , m_idle_futex(0)
+        , m_idle_waiters(0)
+        , m_kicks(0)
+    {
+      uint64_t size = 2;
+
+      while ( size < capacity )
+        size <<= 1;
+
+      m_mask = size - 1;
+      m_cells = new Cell[size];
+
+      for ( uint64_t i = 0; i < size; ++i )
+        m_cells[i].seq.store(i, std::memory_order_relaxed);
+
+      pthread_mutex_init(&m_overflow_mutex, NULL);
+    }
+
+    ~RingWorkQueue() {
+      pthread_mutex_destroy(&m_overflow_mutex);
+      delete [] m_cells;
+    }
+
+    void enqueue(T item) {
+      ++m_count;
+
+      if ( m_overflow_size != 0 || ! try_push(item) ) {
+        pthread_mutex_lock(&m_overflow_mutex);
+        m_overflow.push_back(item);
+        ++m_overflow_size;
+        pthread_mutex_unlock(&m_overflow_mutex);
+      }
+
+      ++m_work_futex;
+      if ( m_sleepers != 0 )
+        futex_wake(&m_work_futex, 1);
+    }
+
+    T dequeue() {
+      T item;
+
+      (void) wait_and_pop(item, nullptr);
+      return item;
+    }
+
+    bool dequeue_for(T& item, long timeout_ms) {
+      struct timespec deadline;
+
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec += timeout_ms / 1000;
+      deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+      if ( deadline.tv_nsec >= 1000000000L ) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+      }
+
+      return wait_and_pop(item, &deadline);
+    }
+
+    bool try_dequeue(T& item) {
+      if ( ! try_pop(item) )
+        return false;
+
+      --m_count;
+      return true;
+    }
+
+    void wait_for_idle( void ) {
+      ++m_idle_waiters;
+
+      while ( 1 ) {
+        int seq = m_idle_futex;
+
+        if ( m_count == 0 && m_waiting_workers == m_max_waiting )
+          break;
+
+        futex_wait(&m_idle_futex, seq, nullptr);
+      }
+
+      --m_idle_waiters;
+    }
+
+    bool is_empty() {
+      return m_count == 0;
+    }
+
+    void set_max_workers( uint64_t max_workers ) {
+      m_max_waiting = max_workers;
+
+      if ( m_idle_waiters != 0 ) {
+        ++m_idle_futex;
+        futex_wake(&m_idle_futex, INT_MAX);
+      }
+    }
+
+    bool backlogged() {
+      return m_count > (int64_t)m_waiting_workers.load();
+    }
+
+    bool kick() {
+      int64_t kicks = m_kicks;
+
+      if ( (int64_t)m_waiting_workers.load() <= m_count + kicks )
+        return false;
+
+      ++m_kicks;
+      ++m_work_futex;
+      futex_wake(&m_work_futex, INT_MAX);
+      return true;
+    }
+
+    uint64_t size() {
+      return m_count;
+    }
+
+  private:
+    struct Cell {
+      std::atomic<uint64_t> seq;
+      T data;
+    };
+
+    Cell*    m_cells;
+    uint64_t m_mask;
+    std::atomic<uint64_t> m_max_waiting;
+
+    //
+    // The producer and consumer positions are kept on separate cache lines
+    //
+    char m_pad0[64];
+    std::atomic<uint64_t> m_head;
+    char m_pad1[64];
+    std::atomic<uint64_t> m_tail;
+    char m_pad2[64];
+
+    std::atomic<int64_t> m_count;   // Items in the ring and overflow list
+
+    pthread_mutex_t m_overflow_mutex;
+    std::list<T> m_overflow;
+    std::atomic<uint64_t> m_overflow_size;
+
+    std::atomic<int> m_work_futex;
+    std::atomic<int> m_sleepers;
+
+    std::atomic<uint64_t> m_waiting_workers;
+    std::atomic<int> m_idle_futex;
+    std::atomic<int> m_idle_waiters;
+    std::atomic<int64_t> m_kicks;
+
+    //
+    // The deadline, if any, is on the monotonic clock.  Returns false if
+    // there still was no item at the deadline.
+    //
+    bool wait_and_pop(T& item, const struct timespec* deadline) {
+      ++m_waiting_workers;
+
+      while ( ! try_pop(item) ) {
+        int seq = m_work_futex;
+
+        ++m_sleepers;
+
+        if ( try_pop(item) ) {
+          --m_sleepers;
+          break;
+        }
+
+        if ( m_waiting_workers == m_max_waiting && m_idle_waiters != 0 ) {
+          ++m_idle_futex;
+          futex_wake(&m_idle_futex, INT_MAX);
+        }
+
+        if ( deadline == nullptr ) {
+          futex_wait(&m_work_futex, seq, nullptr);
+        }
+        else {
+          struct timespec now, left;
+
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          left.tv_sec = deadline->tv_sec - now.tv_sec;
+          left.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+          if ( left.tv_nsec < 0 ) {
+            left.tv_sec -= 1;
+            left.tv_nsec += 1000000000L;
+          }
+
+          if ( left.tv_sec < 0 ) {
+            --m_sleepers;
+            --m_waiting_workers;
+            return false;
+          }
+
+          futex_wait(&m_work_futex, seq, &left);
+
+          if ( take_kick() ) {
+            --m_sleepers;
+            --m_waiting_workers;
+            return false;
+          }
+        }
+        --m_sleepers;
+      }
+
+      //
+      // We must stop counting ourselves as waiting before the item is
+      // accounted as gone, otherwise wait_for_idle() could see an idle
+      // queue while this item is still being worked on.
+      //
+      --m_waiting_workers;
+      --m_count;
+
+      return true;
+    }
+
+    bool take_kick( void ) {
+      int64_t kicks = m_kicks;
+
+      while ( kicks > 0 )
+        if ( m_kicks.compare_exchange_weak(kicks, kicks - 1) )
+          return true;
+      return false;
+    }
+
+    bool try_push(const T& item) {
+      uint64_t pos = m_head.load(std::memory_order_relaxed);
+      Cell* cell;
+
+      while ( 1 ) {
+        cell = &m_cells[pos & m_mask];
+        uint64_t seq = cell->seq.load(std::memory_order_acquire);
+        int64_t diff = (int64_t)seq - (int64_t)pos;
+
+        if ( diff == 0 ) {
+          if ( m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) )
+            break;
+        }
+        else if ( diff < 0 ) {
+          return false;     // Full
+        }
+        else {
+          pos = m_head.load(std::memory_order_relaxed);
+        }
+      }
+
+      cell->data = item;
+      cell->seq.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool try_pop(T& item) {
+      uint64_t pos = m_tail.load(std::memory_order_relaxed);
+      Cell* cell;
+
+      while ( 1 ) {
+        cell = &m_cells[pos & m_mask];
+        uint64_t seq = cell->seq.load(std::memory_order_acquire);
+        int64_t diff = (int64_t)seq - (int64_t)(pos + 1);
+
+        if ( diff == 0 ) {
+          if ( m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) )
+            break;
+        }
+        else if ( diff < 0 ) {
+          return try_pop_overflow(item);    // Ring is empty
+        }
+        else {
+          pos = m_tail.load(std::memory_order_relaxed);
+        }
+      }
+
+      item = cell->data;
+      cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool try_pop_overflow(T& item) {
+      if ( m_overflow_size == 0 )
+        return false;
+
+      bool rval = false;
+
+      pthread_mutex_lock(&m_overflow_mutex);
+      if ( m_overflow.size() != 0 ) {
+        item = m_overflow.front();
+        m_overflow.pop_front();
+        --m_overflow_size;
+        rval = true;
+      }
+      pthread_mutex_unlock(&m_overflow_mutex);
+
+      return rval;
+    }
+
+    static void futex_wait(std::atomic<int>* addr, int val, const struct timespec* timeout) {
+      syscall(SYS_futex, reinterpret_cast<int*>(addr), FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+    }
+
+    static void futex_wake(std::atomic<int>* addr, int count) {
+      syscall(SYS_futex, reinterpret_cast<int*>(addr), FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+    }
+};
+
+} // end of namespace Umap
+
+#endif // _UMAP_RingWorkQueue_HPP
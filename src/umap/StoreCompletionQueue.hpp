@@ -0,0 +1,75 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_StoreCompletionQueue_HPP
+#define _UMAP_StoreCompletionQueue_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <sys/types.h>
+
+#include "umap/store/Store.hpp"
+
+namespace Umap {
+  //
+  // Collects the completions of the asynchronous store requests of one
+  // worker, which stores may report from any thread.  Each job slot of the
+  // worker has a Request, tagged with the index of the slot.
+  //
+  class StoreCompletionQueue {
+    public:
+      class Request : public StoreRequest {
+        public:
+          void complete( ssize_t done ) { m_queue->push(m_slot, done); }
+
+          StoreCompletionQueue* m_queue;
+          uint64_t m_slot;
+      };
+
+      void init( Request& req, uint64_t slot ) {
+        req.m_queue = this;
+        req.m_slot = slot;
+      }
+
+      void push( uint64_t slot, ssize_t done ) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_done.push_back(std::make_pair(slot, done));
+        m_cond.notify_one();
+      }
+
+      //
+      // Reap one completion, waiting up to wait_ms milliseconds for it, or
+      // for ever if wait_ms is negative.  Returns false if there is none.
+      //
+      bool next_completion( uint64_t* slot, ssize_t* done, long wait_ms ) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        if ( wait_ms < 0 )
+          m_cond.wait(lock, [this] { return ! m_done.empty(); });
+        else if ( wait_ms > 0 )
+          m_cond.wait_for(lock, std::chrono::milliseconds(wait_ms), [this] { return ! m_done.empty(); });
+
+        if ( m_done.empty() )
+          return false;
+
+        *slot = m_done.front().first;
+        *done = m_done.front().second;
+        m_done.pop_front();
+        return true;
+      }
+
+    private:
+      std::mutex m_mutex;
+      std::condition_variable m_cond;
+      std::deque<std::pair<uint64_t, ssize_t>> m_done;
+  };
+} // end of namespace Umap
+#endif // _UMAP_StoreCompletionQueue_HPP
@@ -9,28 +9,90 @@
 #include <cstdint>              // uint64_t
 #include <iomanip>
 #include <iostream>
+#include <utility>              // pair
 #include <vector>               // We all have lists to manage
 
 #include <errno.h>              // strerror()
 #include <fcntl.h>              // O_CLOEXEC
+#include <linux/fs.h>           // ioctl(PAGEMAP_SCAN)
 #include <linux/userfaultfd.h>  // ioctl(UFFDIO_*)
 #include <poll.h>               // poll()
 #include <string.h>             // strerror()
+#include <sys/eventfd.h>        // eventfd()
 #include <sys/ioctl.h>          // ioctl()
 #include <sys/syscall.h>        // syscall()
 #include <unistd.h>             // syscall()
 
 #include "umap/config.h"
+#include "umap/FillWorkers.hpp"
 #include "umap/Uffd.hpp"
 #include "umap/RegionDescriptor.hpp"
 #include "umap/RegionManager.hpp"
 #include "umap/util/Macros.hpp"
+#include "umap/util/Trace.hpp"
 
 #ifdef CALIPER
 #include "caliper/cali.h"
 cali_id_t pagefault_address_attribute;
 #endif
 
+//
+// Asynchronous write protection and the scan of the page tables for the
+// pages written since came with Linux 6.7.  Older headers lack their ABI,
+// which is stable, so it is defined here and the kernel asked at run time.
+//
+#ifndef UFFD_FEATURE_WP_ASYNC
+#define UFFD_FEATURE_WP_ASYNC   (1 << 15)
+#endif
+
+#ifndef PAGEMAP_SCAN
+struct page_region {
+  __u64 start;
+  __u64 end;
+  __u64 categories;
+};
+
+struct pm_scan_arg {
+  __u64 size;
+  __u64 flags;
+  __u64 start;
+  __u64 end;
+  __u64 walk_end;
+  __u64 vec;
+  __u64 vec_len;
+  __u64 max_pages;
+  __u64 category_inverted;
+  __u64 category_mask;
+  __u64 category_anyof_mask;
+  __u64 return_mask;
+};
+
+#define PAGEMAP_SCAN            _IOWR('f', 16, struct pm_scan_arg)
+#define PAGE_IS_WRITTEN         (1 << 1)
+#define PM_SCAN_WP_MATCHING     (1 << 0)
+#endif
+
+//
+// UFFDIO_MOVE, which maps pages of one anonymous mapping into another
+// without copying them, came with Linux 6.8
+//
+#ifndef UFFD_FEATURE_MOVE
+#define UFFD_FEATURE_MOVE       (1 << 16)
+#endif
+
+#ifndef UFFDIO_MOVE
+struct uffdio_move {
+  __u64 dst;
+  __u64 src;
+  __u64 len;
+  __u64 mode;
+  __s64 move;
+};
+
+#define _UFFDIO_MOVE            (0x05)
+#define UFFDIO_MOVE             _IOWR(UFFDIO, _UFFDIO_MOVE, struct uffdio_move)
+#endif
+
 namespace Umap {
 
 struct less_than_key {
@@ -45,10 +107,14 @@ struct less_than_key {
 void
 Uffd::uffd_handler( void )
 {
-  struct pollfd pollfd[3] = {
+  UffdHandler* self = m_handlers[m_next_handler++];
+  FillBatch batch(m_rm);
+
+  struct pollfd pollfd[4] = {
       { .fd = m_uffd_fd, .events = POLLIN }
     , { .fd = m_pipe[0], .events = POLLIN }
     , { .fd = m_pipe[1], .events = POLLIN }
+    , { .fd = self->inbox_fd, .events = POLLIN }
   };
 
   //
@@ -57,16 +123,13 @@ Uffd::uffd_handler( void )
   // from the m_uffd_fd kernel module.
   //
   while ( wq_is_empty() ) {
-    int pollres = poll(&pollfd[0], 3, -1);
-
-    switch (pollres) {
-      case 1:
-        break;
-      case -1:
-        UMAP_ERROR("poll failed: " << strerror(errno));
-      default:
-        UMAP_ERROR("poll: unexpected result: " << pollres);
-    }
+    int pollres = poll(&pollfd[0], 4, -1);
+
+    if (pollres == -1)
+      UMAP_ERROR("poll failed: " << strerror(errno));
+
+    if (pollres == 0)
+      UMAP_ERROR("poll: unexpected result: " << pollres);
 
     if (pollfd[1].revents & POLLIN || pollfd[2].revents & POLLIN)
       break;
@@ -74,68 +137,174 @@ Uffd::uffd_handler( void )
     if (pollfd[0].revents & POLLERR)
       UMAP_ERROR("POLLERR: ");
 
-    if ( !(pollfd[0].revents & POLLIN) )
-      continue;
+    int msgs = 0;
+    uint64_t read_time = m_rm.latency_clock();
 
-    int readres = read(m_uffd_fd, &m_events[0], m_max_fault_events * sizeof(struct uffd_msg));
+    if ( pollfd[0].revents & POLLIN ) {
+      //
+      // The number of events may be changed while we run, see
+      // set_max_fault_events()
+      //
+      uint64_t max_events = m_max_fault_events;
 
-    if (readres == -1) {
-      if (errno == EAGAIN)
-        continue;
+      if ( self->events.size() < max_events )
+        self->events.resize(max_events);
 
-      UMAP_ERROR("read failed: " << strerror(errno));
-    }
+      int readres = read(m_uffd_fd, &self->events[0], max_events * sizeof(struct uffd_msg));
 
-    assert("Invalid read result returned" && (readres % sizeof(struct uffd_msg) == 0));
+      if (readres == -1) {
+        //
+        // Another handler may have consumed the events we were woken for
+        //
+        if (errno != EAGAIN)
+          UMAP_ERROR("read failed: " << strerror(errno));
+      }
+      else {
+        assert("Invalid read result returned" && (readres % sizeof(struct uffd_msg) == 0));
 
-    int msgs = readres / sizeof(struct uffd_msg);
+        msgs = readres / sizeof(struct uffd_msg);
 
-    assert("invalid message size" && msgs >= 1 && msgs <= m_max_fault_events);
+        assert("invalid message size" && msgs >= 1 && (uint64_t)msgs <= max_events);
+      }
+    }
 
     //
     // Since uffd page events arrive on the system page boundary which could
     // be different from umap's page size, the page address for the incoming
-    // events are adjusted to the beginning of the umap page address.  The
-    // events are then sorted in page base address / operation type order and
-    // are processed only once while duplicates are skipped.
+    // events are adjusted to the beginning of the umap page address.  Events
+    // for pages owned by other handlers are handed off to them.
     //
-    for (int i = 0; i < msgs; ++i)
-      m_events[i].arg.pagefault.address &= ~(m_page_size-1);
+    int owned = 0;
+    for (int i = 0; i < msgs; ++i) {
+      self->events[i].arg.pagefault.address = (uint64_t)page_base(self->events[i].arg.pagefault.address);
+
+      uint64_t owner = m_handlers.size() > 1
+          ? owner_of((char*)(self->events[i].arg.pagefault.address)) : 0;
+
+      if ( m_handlers[owner] != self )
+        self->outbox[owner].push_back(self->events[i]);
+      else
+        self->events[owned++] = self->events[i];
+    }
+    if ( owned != msgs )
+      forward_events(self);
+    msgs = owned;
 
-    std::sort(&m_events[0], &m_events[msgs], less_than_key());
+    if ( pollfd[3].revents & POLLIN )
+      msgs = receive_events(self, msgs);
+
+    //
+    // The events are then sorted in page base address / operation type order
+    // and are processed only once while duplicates are skipped.
+    //
+    std::sort(&self->events[0], &self->events[0] + msgs, less_than_key());
 
-    char* last_addr = nullptr;
+    self->faults.clear();
     for (int i = 0; i < msgs; ++i) {
-      if ((char*)(m_events[i].arg.pagefault.address) == last_addr)
-        continue;
+      char* paddr = (char*)(self->events[i].arg.pagefault.address);
 
-      last_addr = (char*)(m_events[i].arg.pagefault.address);
+      if ( ! self->faults.empty() && self->faults.back().paddr == paddr )
+        continue;
 
 #ifndef UMAP_RO_MODE
-      bool iswrite = (m_events[i].arg.pagefault.flags & (UFFD_PAGEFAULT_FLAG_WP | UFFD_PAGEFAULT_FLAG_WRITE) != 0);
+      bool iswrite = (self->events[i].arg.pagefault.flags & (UFFD_PAGEFAULT_FLAG_WP | UFFD_PAGEFAULT_FLAG_WRITE) != 0);
 #else
       bool iswrite = false;
 #endif
 
-      //
-      // TODO: Since the addresses are sorted, we could optimize the
-      // search to continue from where it last found something.
-      //
-      process_page(iswrite, last_addr);
+      self->faults.push_back({ paddr, iswrite, (pid_t)self->events[i].arg.pagefault.feat.ptid });
 
       /* providing page fault information to Caliper Toolkit */
 #ifdef CALIPER
-      cali_variant_t v_addr = cali_make_variant(CALI_TYPE_ADDR, &last_addr, sizeof(char*));
+      cali_variant_t v_addr = cali_make_variant(CALI_TYPE_ADDR, &paddr, sizeof(char*));
       cali_push_snapshot(CALI_SCOPE_PROCESS, 1, &pagefault_address_attribute, &v_addr);
 #endif
     }
+
+    m_buffer->process_fault_events(self->faults.data(), self->faults.size(), read_time, &batch);
+    batch.flush();
   }
   UMAP_LOG(Debug, "Good bye");
 }
 
+//
+// Rounds a fault address down to the start of its umap page.  Only when some
+// region has a page size of its own do we need to look the region up.  The
+// caller's fill batch must be empty, as for Buffer::process_fault_events().
+//
+char*
+Uffd::page_base( uint64_t fault_addr )
+{
+  if ( m_rm.has_region_page_sizes() ) {
+    RegionIndex::Reader reader(m_rm.get_region_index());
+    RegionDescriptor* rd = m_rm.containing_region((char*)fault_addr);
+
+    if ( rd != nullptr )
+      return (char*)(fault_addr & ~(rd->page_size() - 1));
+  }
+
+  return (char*)(fault_addr & ~(m_page_size - 1));
+}
+
+//
+// Hands the events of our outboxes to their owners, each of which is
+// woken once
+//
+void
+Uffd::forward_events( UffdHandler* self )
+{
+  uint64_t one = 1;
+
+  for ( uint64_t h = 0; h < m_handlers.size(); ++h ) {
+    std::vector<uffd_msg>& out = self->outbox[h];
+    UffdHandler* owner = m_handlers[h];
+
+    if ( out.empty() )
+      continue;
+
+    UMAP_LOG(Debug, out.size() << " events -> handler " << owner);
+
+    pthread_mutex_lock(&owner->inbox_mutex);
+    owner->inbox.insert(owner->inbox.end(), out.begin(), out.end());
+    pthread_mutex_unlock(&owner->inbox_mutex);
+
+    out.clear();
+
+    if (write(owner->inbox_fd, &one, sizeof(one)) != sizeof(one))
+      UMAP_ERROR("failed to wake handler: " << strerror(errno));
+  }
+}
+
+//
+// Append the events forwarded to us by other handlers to the first msgs
+// events of our own.  Returns the new number of events.
+//
+int
+Uffd::receive_events( UffdHandler* self, int msgs )
+{
+  uint64_t count;
+
+  if (read(self->inbox_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    UMAP_ERROR("failed to read handler inbox: " << strerror(errno));
+
+  pthread_mutex_lock(&self->inbox_mutex);
+
+  if ( msgs + self->inbox.size() > self->events.size() )
+    self->events.resize(msgs + self->inbox.size());
+
+  for ( auto& msg : self->inbox )
+    self->events[msgs++] = msg;
+
+  self->inbox.clear();
+  pthread_mutex_unlock(&self->inbox_mutex);
+
+  return msgs;
+}
+
 void
 Uffd::process_page( bool iswrite, char* addr )
 {
+  RegionIndex::Reader reader(m_rm.get_region_index());
   auto rd = m_rm.containing_region(addr);
 
   if ( rd != nullptr )
@@ -148,15 +317,21 @@ Uffd::ThreadEntry()
   uffd_handler();
 }
 
-Uffd::Uffd( void )
-  :   WorkerPool("Uffd Manager", 1)
-    , m_rm(RegionManager::getInstance())
+Uffd::Uffd( RegionManager& rm )
+  :   WorkerPool("Uffd Manager", rm.get_num_uffd_threads())
+    , m_rm(rm)
     , m_max_fault_events(m_rm.get_max_fault_events())
     , m_page_size(m_rm.get_umap_page_size())
+    , m_hash_unit(m_page_size * m_rm.get_max_fill_pages())
     , m_buffer(m_rm.get_buffer_h())
+    , m_wp_async(false)
+    , m_move(false)
+    , m_pagemap_fd(-1)
+    , m_next_handler(0)
 {
   UMAP_LOG(Debug, "\n maximum fault events: " << m_max_fault_events
-                  << "\n            page size: " << m_page_size);
+                  << "\n            page size: " << m_page_size
+                  << "\n      fault handlers: " << m_rm.get_num_uffd_threads());
 
   if ((m_uffd_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK)) < 0)
     UMAP_ERROR("userfaultfd syscall not available in this kernel: "
@@ -166,8 +341,21 @@ Uffd::Uffd( void )
     UMAP_ERROR("userfaultfd pipe failed: " << strerror(errno));
 
   check_uffd_compatibility();
-  m_events.resize(m_max_fault_events);
 
+  for ( uint64_t i = 0; i < m_rm.get_num_uffd_threads(); ++i ) {
+    UffdHandler* h = new UffdHandler();
+
+    h->events.resize(m_max_fault_events);
+    h->outbox.resize(m_rm.get_num_uffd_threads());
+    pthread_mutex_init(&h->inbox_mutex, NULL);
+
+    if ((h->inbox_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+      UMAP_ERROR("handler eventfd failed: " << strerror(errno));
+
+    m_handlers.push_back(h);
+  }
+
+  set_placement(m_rm.get_uffd_placement());
   start_thread_pool();
 
 #ifdef CALIPER
@@ -188,6 +376,16 @@ Uffd::~Uffd()
   write(m_pipe[1], bye, 3);
 
   stop_thread_pool();
+
+  for ( auto h : m_handlers ) {
+    close(h->inbox_fd);
+    pthread_mutex_destroy(&h->inbox_mutex);
+    delete h;
+  }
+  m_handlers.clear();
+
+  if ( m_pagemap_fd >= 0 )
+    close(m_pagemap_fd);
 }
 
 void
@@ -195,12 +393,16 @@ Uffd::enable_write_protect(
           void*
 #ifndef UMAP_RO_MODE
           page_address
+#endif
+        , uint64_t
+#ifndef UMAP_RO_MODE
+          len
 #endif
       )
 {
 #ifndef UMAP_RO_MODE
   struct uffdio_writeprotect wp = {
-      .range = { .start = (uint64_t)page_address, .len = m_page_size }
+      .range = { .start = (uint64_t)page_address, .len = len }
     , .mode = UFFDIO_WRITEPROTECT_MODE_WP
   };
 
@@ -211,15 +413,19 @@ Uffd::enable_write_protect(
 
 void
 Uffd::disable_write_protect(
-  void*
+          void*
 #ifndef UMAP_RO_MODE
-  page_address
+          page_address
+#endif
+        , uint64_t
+#ifndef UMAP_RO_MODE
+          len
 #endif
-)
+      )
 {
 #ifndef UMAP_RO_MODE
   struct uffdio_writeprotect wp = {
-      .range = { .start = (uint64_t)page_address, .len = m_page_size }
+      .range = { .start = (uint64_t)page_address, .len = len }
     , .mode = 0
   };
 
@@ -228,57 +434,189 @@ Uffd::disable_write_protect(
 #endif // UMAP_RO_MODE
 }
 
+//
+// Copies len bytes of adjacent umap pages in with a single UFFDIO_COPY.  The
+// kernel may copy only part of the range and ask us to retry the rest.
+//
 void
-Uffd::copy_in_page(char* data, void* page_address)
+Uffd::copy_in_pages(char* data, void* page_address, uint64_t len, bool
+#ifndef UMAP_RO_MODE
+    write_protect
+#endif
+  )
 {
-  struct uffdio_copy copy = {
-      .dst = (uint64_t)page_address
-    , .src = (uint64_t)data
-    , .len = m_page_size
-    , .mode = 0
-  };
+  uint64_t done = 0;
 
-  if (ioctl(m_uffd_fd, UFFDIO_COPY, &copy) == -1)
-    UMAP_ERROR("UFFDIO_COPY failed: " << strerror(errno));
-}
+  UMAP_LOG(Debug, "(page_address = " << page_address << ", len = " << len << ")");
 
-void
-Uffd::copy_in_page_and_write_protect(char* data, void* page_address)
-{
-  UMAP_LOG(Debug, "(page_address = " << page_address << ")");
-  struct uffdio_copy copy = {
-      .dst = (uint64_t)page_address
-    , .src = (uint64_t)data
-    , .len = m_page_size
+  while ( done < len ) {
+    struct uffdio_copy copy = {
+        .dst = (uint64_t)page_address + done
+      , .src = (uint64_t)data + done
+      , .len = len - done
 #ifndef UMAP_RO_MODE
-    , .mode = UFFDIO_COPY_MODE_WP
+      , .mode = write_protect ? UFFDIO_COPY_MODE_WP : 0
 #else
-    , .mode = 0
+      , .mode = 0
 #endif
-  };
+    };
 
-  if (ioctl(m_uffd_fd, UFFDIO_COPY, &copy) == -1) {
-    UMAP_ERROR("UFFDIO_COPY failed @ " 
-        << page_address << " : "
-        << strerror(errno) << std::endl
-    );
+    if (ioctl(m_uffd_fd, UFFDIO_COPY, &copy) == -1) {
+      if ( errno == EAGAIN ) {
+        if ( copy.copy > 0 )
+          done += copy.copy;
+        continue;
+      }
+
+      //
+      // Another process sharing the buffer of the region has filled the
+      // page first.  The threads waiting for it here still need waking.
+      //
+      if ( errno == EEXIST ) {
+        uint64_t psize = sysconf(_SC_PAGESIZE);
+
+        wake_pages((char*)page_address + done, psize);
+        done += psize;
+        continue;
+      }
+
+      UMAP_ERROR("UFFDIO_COPY failed @ "
+          << (void*)((char*)page_address + done) << " : "
+          << strerror(errno) << std::endl
+      );
+    }
+
+    done += copy.copy;
   }
 }
 
+//
+// Moves len bytes of adjacent pages at data, which must be of a private
+// anonymous mapping with the protection of the region, to the umap pages at
+// page_address.  The pages moved are writable.  The kernel refuses pages it
+// cannot move, e.g. those shared with a forked child, and regions whose
+// protection differs, so the bytes moved are returned and the caller copies
+// in the rest.
+//
+uint64_t
+Uffd::move_in_pages(char* data, void* page_address, uint64_t len)
+{
+  UMAP_LOG(Debug, "(page_address = " << page_address << ", len = " << len << ")");
+
+  return move_pages((char*)page_address, data, len);
+}
+
+//
+// Moves len bytes of adjacent umap pages at page_address out of the region,
+// to the staging pages at data, see register_staging().  A write to the
+// pages moved faults from then on.  The kernel refuses pages it cannot
+// move, e.g. those shared with a forked child, so the bytes moved are
+// returned and the rest is left in the region.
+//
+uint64_t
+Uffd::move_out_pages(void* page_address, char* data, uint64_t len)
+{
+  UMAP_LOG(Debug, "(page_address = " << page_address << ", len = " << len << ")");
+
+  return move_pages(data, (char*)page_address, len);
+}
+
+uint64_t
+Uffd::move_pages(char* dst, char* src, uint64_t len)
+{
+  uint64_t done = 0;
+
+  while ( done < len ) {
+    struct uffdio_move move = {
+        .dst = (uint64_t)dst + done
+      , .src = (uint64_t)src + done
+      , .len = len - done
+      , .mode = 0
+      , .move = 0
+    };
+
+    if (ioctl(m_uffd_fd, UFFDIO_MOVE, &move) == -1) {
+      if ( move.move > 0 )
+        done += move.move;
+
+      if ( errno == EAGAIN )
+        continue;
+
+      UMAP_LOG(Debug, "UFFDIO_MOVE failed @ "
+          << (void*)(src + done) << " : " << strerror(errno));
+      break;
+    }
+
+    done += move.move;
+  }
+
+  return done;
+}
+
+//
+// Maps the zero page at len bytes of adjacent umap pages.  UFFDIO_ZEROPAGE
+// has no write protect mode, so this may only be used for pages that are to
+// be writable.
+//
+void
+Uffd::zero_pages(void* page_address, uint64_t len)
+{
+  uint64_t done = 0;
+
+  UMAP_LOG(Debug, "(page_address = " << page_address << ", len = " << len << ")");
+
+  while ( done < len ) {
+    struct uffdio_zeropage zero = {
+        .range = { .start = (uint64_t)page_address + done, .len = len - done }
+      , .mode = 0
+    };
+
+    if (ioctl(m_uffd_fd, UFFDIO_ZEROPAGE, &zero) == -1) {
+      if ( errno == EAGAIN ) {
+        if ( zero.zeropage > 0 )
+          done += zero.zeropage;
+        continue;
+      }
+
+      UMAP_ERROR("UFFDIO_ZEROPAGE failed @ "
+          << (void*)((char*)page_address + done) << " : "
+          << strerror(errno) << std::endl
+      );
+    }
+
+    done += zero.zeropage;
+  }
+}
+
+void
+Uffd::wake_pages(void* page_address, uint64_t len)
+{
+  struct uffdio_range range = { .start = (uint64_t)page_address, .len = len };
+
+  if (ioctl(m_uffd_fd, UFFDIO_WAKE, &range) == -1)
+    UMAP_ERROR("UFFDIO_WAKE failed @ " << page_address << " : " << strerror(errno));
+}
+
+//
+// Read-only regions cannot be written, so they only take missing page
+// faults.  Shared regions are always read-only; write protection of shared
+// memory would need UFFD_FEATURE_WP_HUGETLBFS_SHMEM.
+//
 void
 Uffd::register_region( RegionDescriptor* rd )
 {
   struct uffdio_register uffdio_register = {
       .range = {  .start = (__u64)(rd->start()), .len = rd->size() }
 #ifndef UMAP_RO_MODE
-    , .mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP
+    , .mode = rd->read_only() ? UFFDIO_REGISTER_MODE_MISSING
+                           : UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP
 #else
     , .mode = UFFDIO_REGISTER_MODE_MISSING
 #endif
   };
 
   UMAP_LOG(Debug,
-    "Registering " << (uffdio_register.range.len / m_page_size)
+    "Registering " << (uffdio_register.range.len / rd->page_size())
     << " pages from: " << (void*)(uffdio_register.range.start)
     << " - " << (void*)(uffdio_register.range.start +
                               (uffdio_register.range.len-1)));
@@ -291,12 +629,30 @@ Uffd::register_region( RegionDescriptor* rd )
   
   if( !(uffdio_register.ioctls & (1 << _UFFDIO_COPY))
 #ifdef UFFDIO_WRITEPROTECT
-      || !(uffdio_register.ioctls & (1 << _UFFDIO_WRITEPROTECT))
+      || (!rd->read_only() && !(uffdio_register.ioctls & (1 << _UFFDIO_WRITEPROTECT)))
 #endif
     )
     UMAP_ERROR("unexpected userfaultfd ioctl set: " << uffdio_register.ioctls);
 }
 
+//
+// UFFDIO_MOVE only moves pages to a mapping registered with the same
+// userfaultfd, so the staging pages the evict workers move runs out of the
+// regions to are registered like a read-only region.  Nothing touches them
+// but the pages moved in, so they take no faults.
+//
+void
+Uffd::register_staging( char* start, uint64_t len )
+{
+  struct uffdio_register uffdio_register = {
+      .range = {  .start = (__u64)start, .len = len }
+    , .mode = UFFDIO_REGISTER_MODE_MISSING
+  };
+
+  if (ioctl(m_uffd_fd, UFFDIO_REGISTER, &uffdio_register) == -1)
+    UMAP_ERROR("ioctl(UFFDIO_REGISTER) of staging pages failed: " << strerror(errno));
+}
+
 void
 Uffd::unregister_region( RegionDescriptor* rd )
 {
@@ -312,7 +668,7 @@ Uffd::unregister_region( RegionDescriptor* rd )
   };
 
   UMAP_LOG(Debug,
-    "Unregistering " << (uffdio_register.range.len / m_page_size)
+    "Unregistering " << (uffdio_register.range.len / rd->page_size())
     << " pages from: " << (void*)(uffdio_register.range.start)
     << " - " << (void*)(uffdio_register.range.start +
                               (uffdio_register.range.len-1)));
@@ -324,23 +680,155 @@ Uffd::unregister_region( RegionDescriptor* rd )
 void
 Uffd::check_uffd_compatibility( void )
 {
-  struct uffdio_api uffdio_api = {
-      .api = UFFD_API
-#ifdef UMAP_RO_MODE
-    , .features = 0
-#else
-    , .features = UFFD_FEATURE_PAGEFAULT_FLAG_WP
+  uint64_t features = 0;
+
+#ifndef UMAP_RO_MODE
+  features |= UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+#endif
+
+  //
+  // Write protection of hugetlb pages is only available when asked for
+  //
+#if !defined(UMAP_RO_MODE) && defined(UFFD_FEATURE_WP_HUGETLBFS_SHMEM)
+  if ( m_rm.get_hugetlb() )
+    features |= UFFD_FEATURE_WP_HUGETLBFS_SHMEM;
+#endif
+
+  //
+  // UMAP_NUMA fills pages on the node of the thread that faulted on them,
+  // and UMAP_TRACE records that thread with the fault
+  //
+  if ( m_rm.get_numa_h() != nullptr || Trace::enabled() )
+    features |= UFFD_FEATURE_THREAD_ID;
+
+#ifndef UMAP_RO_MODE
+  if ( m_rm.get_wp_async() && probe_wp_async() ) {
+    features |= UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_MOVE;
+    m_wp_async = true;
+  }
 #endif
 
+  if ( m_rm.get_fill_move() && probe_move() ) {
+    features |= UFFD_FEATURE_MOVE;
+    m_move = true;
+  }
+
+  struct uffdio_api uffdio_api = {
+      .api = UFFD_API
+    , .features = features
     , .ioctls = 0
   };
 
 if (ioctl(m_uffd_fd, UFFDIO_API, &uffdio_api) == -1)
-  UMAP_ERROR("ioctl(UFFDIO_API) Failed: " << strerror(errno));
+  UMAP_ERROR("ioctl(UFFDIO_API) Failed: " << strerror(errno)
+      << ( m_rm.get_hugetlb() ? " (UMAP_HUGETLB needs userfaultfd write protection of hugetlb pages)" : "" ));
 
 #ifndef UMAP_RO_MODE
 if ( !(uffdio_api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP) )
   UMAP_ERROR("UFFD Compatibilty Check - unsupported userfaultfd WP");
 #endif
 }
+
+//
+// UFFDIO_API can only be called once per userfaultfd, so the features the
+// kernel offers are asked of a throwaway one
+//
+uint64_t
+Uffd::probe_features( void )
+{
+  int fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  struct uffdio_api uffdio_api = { .api = UFFD_API , .features = 0 , .ioctls = 0 };
+  uint64_t features = 0;
+
+  if ( fd >= 0 ) {
+    if ( ioctl(fd, UFFDIO_API, &uffdio_api) == 0 )
+      features = uffdio_api.features;
+    close(fd);
+  }
+
+  return features;
+}
+
+//
+// Written pages are found with PAGEMAP_SCAN, which must be there too, and
+// the evict workers move the pages they drop out of the regions with
+// UFFDIO_MOVE, which does not move hugetlb pages
+//
+bool
+Uffd::probe_wp_async( void )
+{
+  const uint64_t needed = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_MOVE;
+
+  if ( m_rm.get_hugetlb() ) {
+    UMAP_LOG(Warning, "UMAP_WP_ASYNC: asynchronous write protection does not "
+        << "apply with UMAP_HUGETLB, writes are tracked by write faults");
+    return false;
+  }
+
+  bool supported = (probe_features() & needed) == needed;
+
+  if ( supported ) {
+    struct pm_scan_arg arg;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.size = sizeof(arg);
+
+    m_pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    supported = m_pagemap_fd >= 0 && ioctl(m_pagemap_fd, PAGEMAP_SCAN, &arg) == 0;
+
+    if ( !supported && m_pagemap_fd >= 0 ) {
+      close(m_pagemap_fd);
+      m_pagemap_fd = -1;
+    }
+  }
+
+  if ( !supported )
+    UMAP_LOG(Warning, "UMAP_WP_ASYNC: asynchronous write protection is not "
+        << "supported by this kernel, writes are tracked by write faults");
+
+  return supported;
+}
+
+bool
+Uffd::probe_move( void )
+{
+  bool supported = (probe_features() & UFFD_FEATURE_MOVE) != 0;
+
+  if ( !supported )
+    UMAP_LOG(Warning, "UMAP_FILL_MOVE: UFFDIO_MOVE is not supported by this "
+        << "kernel, pages are copied in");
+
+  return supported;
+}
+
+void
+Uffd::collect_written( char* start, char* end, std::vector<std::pair<char*, char*>>& ranges )
+{
+  struct page_region vec[64];
+  struct pm_scan_arg arg;
+
+  while ( start < end ) {
+    memset(&arg, 0, sizeof(arg));
+    arg.size = sizeof(arg);
+    arg.flags = PM_SCAN_WP_MATCHING;
+    arg.start = (uint64_t)start;
+    arg.end = (uint64_t)end;
+    arg.vec = (uint64_t)vec;
+    arg.vec_len = sizeof(vec) / sizeof(vec[0]);
+    arg.category_mask = PAGE_IS_WRITTEN;
+    arg.return_mask = PAGE_IS_WRITTEN;
+
+    long n = ioctl(m_pagemap_fd, PAGEMAP_SCAN, &arg);
+
+    if ( n < 0 )
+      UMAP_ERROR("ioctl(PAGEMAP_SCAN): " << strerror(errno));
+
+    for ( long i = 0; i < n; ++i )
+      ranges.push_back(std::make_pair((char*)vec[i].start, (char*)vec[i].end));
+
+    if ( (char*)arg.walk_end <= start )
+      break;
+    start = (char*)arg.walk_end;
+  }
+}
 } // end of namespace Umap
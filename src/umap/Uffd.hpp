@@ -8,6 +8,7 @@
 #define _UMAP_Uffd_HPP
 
 #include <algorithm>            // sort()
+#include <atomic>
 #include <cassert>              // assert()
 #include <cstdint>              // uint64_t
 #include <iomanip>
@@ -18,6 +19,7 @@
 #include <fcntl.h>              // O_CLOEXEC
 #include <linux/userfaultfd.h>  // ioctl(UFFDIO_*)
 #include <poll.h>               // poll()
+#include <pthread.h>
 #include <string.h>             // strerror()
 #include <sys/ioctl.h>          // ioctl()
 #include <sys/syscall.h>        // syscall()
@@ -31,6 +33,7 @@
 #define UMAP_RO_MODE
 #endif
 
+#include "umap/Buffer.hpp"
 #include "umap/RegionDescriptor.hpp"
 #include "umap/RegionManager.hpp"
 #include "umap/WorkerPool.hpp"
@@ -43,32 +46,102 @@ namespace Umap {
       PageEvent(void* paddr, bool iswrite);
   };
 
+  //
+  // Per-thread state of a fault handler.  Events read by one handler for a
+  // page owned by another handler are gathered in its outbox for that
+  // handler, and moved to the owner's inbox once the events of the read are
+  // sorted out, waking the owner through its eventfd.
+  //
+  struct UffdHandler {
+    std::vector<uffd_msg> events;
+    std::vector<std::vector<uffd_msg>> outbox;  // By owner
+    std::vector<uffd_msg> inbox;
+    std::vector<Buffer::FaultEvent> faults;     // Distinct events, sorted
+    pthread_mutex_t       inbox_mutex;
+    int                   inbox_fd;
+  };
+
   class Uffd : public WorkerPool {
     public:
-      Uffd( void );
+      Uffd( RegionManager& rm );
       ~Uffd( void);
 
       void process_page(bool iswrite, char* addr );
       void register_region( RegionDescriptor* region );
       void unregister_region( RegionDescriptor* region );
 
-      void  enable_write_protect( void* );
-      void disable_write_protect( void* );
-      void copy_in_page(char* data, void* page_address);
-      void copy_in_page_and_write_protect(char* data, void* page_address);
+      //
+      // Lengths are in bytes, since pages of different regions may have
+      // different sizes
+      //
+      void  enable_write_protect( void*, uint64_t len );
+      void disable_write_protect( void*, uint64_t len );
+      void copy_in_pages(char* data, void* page_address, uint64_t len, bool write_protect);
+      uint64_t move_in_pages(char* data, void* page_address, uint64_t len);
+      uint64_t move_out_pages(void* page_address, char* data, uint64_t len);
+      void register_staging( char* start, uint64_t len );
+      void zero_pages(void* page_address, uint64_t len);
+      void wake_pages(void* page_address, uint64_t len);
+
+      //
+      // Whether writes to write protected pages are resolved by the kernel
+      // (UFFD_FEATURE_WP_ASYNC) instead of being reported to the handlers
+      //
+      bool wp_async( void ) const { return m_wp_async; }
+
+      //
+      // Whether fills may move the pages they read into the region
+      // (UFFDIO_MOVE), see RegionManager::get_fill_move()
+      //
+      bool move( void ) const { return m_move; }
+
+      //
+      // Appends the ranges of [start, end) written since they were last
+      // write protected, and write protects them again
+      //
+      void collect_written( char* start, char* end, std::vector<std::pair<char*, char*>>& ranges );
+
+      //
+      // Number of events each handler reads at once, from its next read on
+      //
+      void set_max_fault_events( uint64_t max_events ) { m_max_fault_events = max_events; }
 
     private:
       RegionManager&        m_rm;
-      uint64_t              m_max_fault_events;
+      std::atomic<uint64_t> m_max_fault_events;
       uint64_t              m_page_size;
+      uint64_t              m_hash_unit;      // Granularity of owner_of()
       Buffer*               m_buffer;
       int                   m_uffd_fd;
+      bool                  m_wp_async;
+      bool                  m_move;
+      int                   m_pagemap_fd;
       int                   m_pipe[2];
-      std::vector<uffd_msg> m_events;
+      std::vector<UffdHandler*> m_handlers;
+      std::atomic<uint64_t> m_next_handler;
+
+      //
+      // Every umap page is owned by exactly one handler so that all of the
+      // events for a given page are processed, in order, by the same thread.
+      // Pages are owned in extents of the unit the Buffer hashes pages to
+      // its shards with, so that the faults of a sequential run go to one
+      // handler, which fills them with one request.
+      //
+      inline uint64_t owner_of( char* page_addr ) {
+        uint64_t h = ((uint64_t)page_addr / m_hash_unit) * 0x9E3779B97F4A7C15ULL;
+        return (h >> 32) % m_handlers.size();
+      }
 
+      uint64_t move_pages(char* dst, char* src, uint64_t len);
+      char* page_base( uint64_t fault_addr );
       void uffd_handler( void );
+      void forward_events( UffdHandler* self );
+      int  receive_events( UffdHandler* self, int msgs );
       void ThreadEntry( void );
       void check_uffd_compatibility( void );
+      uint64_t probe_features( void );
+      bool probe_wp_async( void );
+      bool probe_move( void );
   };
 } // end of namespace Umap
 #endif // _UMAP_Uffd_HPP
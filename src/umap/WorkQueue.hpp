@@ -10,7 +10,9 @@
 #include <list>
 
 #include <cstdint>
+#include <errno.h>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "umap/Uffd.hpp"
@@ -18,51 +20,108 @@
 #include "umap/util/Macros.hpp"
 
 namespace Umap {
+//
+// Interface of the queues used to hand work to the threads of a WorkerPool.
+//
+// dequeue() blocks until an item is available, try_dequeue() returns false
+// instead of blocking, and dequeue_for() returns false if no item came
+// within timeout_ms milliseconds.  wait_for_idle() blocks until the queue is
+// empty and every one of the max_workers consumers is waiting in dequeue()
+// for more work.  The number of consumers changes with set_max_workers().
+// backlogged() tells whether more items are queued than there are consumers
+// waiting for them.  kick() makes one consumer waiting in dequeue_for() for
+// an item that is not there return false right away, and returns false if
+// there is none.  size() is the number of items queued at the time of the
+// call.
+//
 template <typename T>
 class WorkQueue {
   public:
-    WorkQueue(int max_workers)
+    virtual ~WorkQueue() {}
+
+    virtual void enqueue(T item) = 0;
+    virtual T dequeue() = 0;
+    virtual bool dequeue_for(T& item, long timeout_ms) = 0;
+    virtual bool try_dequeue(T& item) = 0;
+    virtual void wait_for_idle( void ) = 0;
+    virtual bool is_empty() = 0;
+    virtual void set_max_workers( uint64_t max_workers ) = 0;
+    virtual bool backlogged() = 0;
+    virtual bool kick() = 0;
+    virtual uint64_t size() = 0;
+};
+
+template <typename T>
+class ListWorkQueue : public WorkQueue<T> {
+  public:
+    ListWorkQueue(int max_workers)
       :   m_max_waiting(max_workers)
         , m_waiting_workers(0)
         , m_idle_waiters(0)
+        , m_kicks(0)
     {
       pthread_mutex_init(&m_mutex, NULL);
       pthread_cond_init(&m_cond, NULL);
       pthread_cond_init(&m_idle_cond, NULL);
     }
 
-    ~WorkQueue() {
+    ~ListWorkQueue() {
       pthread_mutex_destroy(&m_mutex);
       pthread_cond_destroy(&m_cond);
       pthread_cond_destroy(&m_idle_cond);
     }
 
+    //
+    // The nodes of the list are kept on m_spare once their items have been
+    // taken, and spliced back in for the next items, so that a queue only
+    // allocates until it has held as many items as it ever will at once.
+    //
     void enqueue(T item) {
       pthread_mutex_lock(&m_mutex);
-      m_queue.push_back(item);
+      if ( m_spare.empty() ) {
+        m_queue.push_back(item);
+      }
+      else {
+        m_queue.splice(m_queue.end(), m_spare, m_spare.begin());
+        m_queue.back() = item;
+      }
       pthread_cond_signal(&m_cond);
       pthread_mutex_unlock(&m_mutex);
     }
 
     T dequeue() {
-      pthread_mutex_lock(&m_mutex);
+      T item;
 
-      ++m_waiting_workers;
+      (void) wait_and_pop(item, nullptr);
+      return item;
+    }
 
-      while ( m_queue.size() == 0 ) {
-        if (m_waiting_workers == m_max_waiting && m_idle_waiters)
-          pthread_cond_signal(&m_idle_cond);
+    bool dequeue_for(T& item, long timeout_ms) {
+      struct timespec deadline;
 
-        pthread_cond_wait(&m_cond, &m_mutex);
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += timeout_ms / 1000;
+      deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+      if ( deadline.tv_nsec >= 1000000000L ) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
       }
 
-      --m_waiting_workers;
+      return wait_and_pop(item, &deadline);
+    }
 
-      auto item = m_queue.front();
-      m_queue.pop_front();
+    bool try_dequeue(T& item) {
+      bool rval = false;
 
+      pthread_mutex_lock(&m_mutex);
+      if ( m_queue.size() != 0 ) {
+        item = m_queue.front();
+        m_spare.splice(m_spare.begin(), m_queue, m_queue.begin());
+        rval = true;
+      }
       pthread_mutex_unlock(&m_mutex);
-      return item;
+
+      return rval;
     }
 
     void wait_for_idle( void ) {
@@ -83,14 +142,84 @@ class WorkQueue {
       return empty;
     }
 
+    void set_max_workers( uint64_t max_workers ) {
+      pthread_mutex_lock(&m_mutex);
+      m_max_waiting = max_workers;
+      if ( m_idle_waiters )
+        pthread_cond_broadcast(&m_idle_cond);
+      pthread_mutex_unlock(&m_mutex);
+    }
+
+    bool backlogged() {
+      pthread_mutex_lock(&m_mutex);
+      bool rval = ( m_queue.size() > m_waiting_workers );
+      pthread_mutex_unlock(&m_mutex);
+      return rval;
+    }
+
+    bool kick() {
+      pthread_mutex_lock(&m_mutex);
+      bool rval = ( m_waiting_workers > m_queue.size() + m_kicks );
+      if ( rval ) {
+        ++m_kicks;
+        pthread_cond_broadcast(&m_cond);
+      }
+      pthread_mutex_unlock(&m_mutex);
+      return rval;
+    }
+
+    uint64_t size() {
+      pthread_mutex_lock(&m_mutex);
+      uint64_t rval = m_queue.size();
+      pthread_mutex_unlock(&m_mutex);
+      return rval;
+    }
+
   private:
     pthread_mutex_t m_mutex;
     pthread_cond_t m_cond;
     pthread_cond_t m_idle_cond;
     std::list<T> m_queue;
+    std::list<T> m_spare;
     uint64_t m_max_waiting;
     uint64_t m_waiting_workers;
     int m_idle_waiters;
+    uint64_t m_kicks;
+
+    //
+    // Returns false if there still was no item at the deadline, if any
+    //
+    bool wait_and_pop(T& item, const struct timespec* deadline) {
+      pthread_mutex_lock(&m_mutex);
+
+      ++m_waiting_workers;
+
+      while ( m_queue.size() == 0 ) {
+        if (m_waiting_workers == m_max_waiting && m_idle_waiters)
+          pthread_cond_broadcast(&m_idle_cond);
+
+        if ( deadline == nullptr ) {
+          pthread_cond_wait(&m_cond, &m_mutex);
+        }
+        else if ( ( pthread_cond_timedwait(&m_cond, &m_mutex, deadline) == ETIMEDOUT
+                    || m_kicks != 0 )
+                  && m_queue.size() == 0 ) {
+          if ( m_kicks != 0 )
+            --m_kicks;
+          --m_waiting_workers;
+          pthread_mutex_unlock(&m_mutex);
+          return false;
+        }
+      }
+
+      --m_waiting_workers;
+
+      item = m_queue.front();
+      m_spare.splice(m_spare.begin(), m_queue, m_queue.begin());
+
+      pthread_mutex_unlock(&m_mutex);
+      return true;
+    }
 };
 
 } // end of namespace Umap
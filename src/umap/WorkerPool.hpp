@@ -7,20 +7,28 @@
 #ifndef _UMAP_Pthread_HPP
 #define _UMAP_Pthread_HPP
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <pthread.h>
+#include <sched.h>              // sched_getcpu(), sched_yield()
 #include <string>
 #include <vector>
 
 #include "umap/PageDescriptor.hpp"
+#include "umap/RingWorkQueue.hpp"
 #include "umap/WorkQueue.hpp"
 #include "umap/util/Macros.hpp"
+#include "umap/util/ThreadPlacement.hpp"
 
 namespace Umap {
   struct WorkItem {
     enum WorkType { NONE, EXIT, THRESHOLD, EVICT, FAST_EVICT, FLUSH };
     PageDescriptor* page_desc;
     WorkType type;
+    uint32_t faults;      // Pages of a fill that were faulted on
+    uint64_t time;        // Sent to the fill workers, with latency histograms
+    uint64_t fault_time;  // When those faults were read, 0 if not timed
   };
 
   static std::ostream& operator<<(std::ostream& os, const Umap::WorkItem& b)
@@ -43,60 +51,262 @@ namespace Umap {
 
   class WorkerPool {
     public:
-      WorkerPool(const std::string& pool_name, uint64_t num_threads)
+      //
+      // A non-zero ring_size selects a lock-free RingWorkQueue of (at least)
+      // that many entries instead of the default ListWorkQueue.
+      //
+      // The threads may be split into num_domains domains (e.g. NUMA
+      // nodes), each with queues_per_domain work queues.  Every queue has
+      // a group of threads of its own, so there must be at least as many
+      // threads as queues.  Work sent to a domain goes to one of its queues,
+      // and threads that find their own queue empty steal work from the
+      // other queues of their domain before waiting for more.
+      //
+      WorkerPool(const std::string& pool_name, uint64_t num_threads, uint64_t ring_size = 0
+               , uint64_t num_domains = 1, uint64_t queues_per_domain = 1)
         :   m_pool_name(pool_name)
           , m_num_threads(num_threads)
-          , m_wq(new WorkQueue<WorkItem>(num_threads))
+          , m_idle_timeout_ms(0)
+          , m_elastic_timeout_ms(0)
+          , m_queues_per_domain(std::max<uint64_t>(queues_per_domain, 1))
+          , m_next_queue(0)
+          , m_num_stolen(0)
+          , m_thieves(0)
+          , m_stopping(false)
       {
+        uint64_t num_groups = std::max<uint64_t>(num_domains, 1) * m_queues_per_domain;
+
+        for ( uint64_t g = 0; g < num_groups; ++g ) {
+          Group* group = new Group;
+          uint64_t group_threads = split(num_threads, num_groups, g);
+
+          if (ring_size)
+            group->wq = new RingWorkQueue<WorkItem>(group_threads, ring_size);
+          else
+            group->wq = new ListWorkQueue<WorkItem>(group_threads);
+
+          group->min_threads = group_threads;
+          group->max_threads = group_threads;
+          group->num_threads = 0;
+          m_groups.push_back(group);
+        }
+
         if (m_pool_name.length() > 15)
           m_pool_name.resize(15);
+
+        pthread_mutex_init(&m_mutex, NULL);
       }
 
       virtual ~WorkerPool() {
         stop_thread_pool();
-        delete m_wq;
+        for ( auto group : m_groups ) {
+          delete group->wq;
+          delete group;
+        }
+        pthread_mutex_destroy(&m_mutex);
       }
 
-      void send_work(const WorkItem& work) {
-        m_wq->enqueue(work);
+      //
+      // Lets the pool run between min_threads and the num_threads it was
+      // created with.  It starts with min_threads, adds a thread whenever
+      // work is sent while more work is queued than there are threads
+      // waiting for it, and lets a thread go once it has found no work for
+      // idle_timeout_ms milliseconds.  Has to be called before
+      // start_thread_pool().
+      //
+      void set_elastic( uint64_t min_threads, long idle_timeout_ms ) {
+        uint64_t ngroups = m_groups.size();
+
+        min_threads = std::max(std::min(min_threads, m_num_threads), ngroups);
+
+        for ( uint64_t g = 0; g < ngroups; ++g )
+          m_groups[g]->min_threads = split(min_threads, ngroups, g);
+
+        m_elastic_timeout_ms = idle_timeout_ms;
+        m_idle_timeout_ms = ( min_threads < m_num_threads ) ? idle_timeout_ms : 0;
+      }
+
+      //
+      // Changes the number of threads of a running pool.  An elastic pool
+      // may grow to max_threads from now on, and a pool of fixed size is
+      // brought to max_threads right away.  Threads beyond a lowered number
+      // leave once they have been idle for idle_timeout_ms milliseconds, or
+      // for the timeout given to set_elastic().
+      //
+      void set_max_threads( uint64_t max_threads, long idle_timeout_ms ) {
+        uint64_t ngroups = m_groups.size();
+        bool elastic = ( m_elastic_timeout_ms != 0 );
+
+        pthread_mutex_lock(&m_mutex);
+
+        m_num_threads = std::max(max_threads, ngroups);
+
+        for ( uint64_t g = 0; g < ngroups; ++g ) {
+          Group* group = m_groups[g];
+
+          group->max_threads = split(m_num_threads, ngroups, g);
+
+          if ( elastic )
+            group->min_threads = std::min<uint64_t>(group->min_threads, group->max_threads);
+          else
+            group->min_threads = group->max_threads;
+
+          if ( ! m_stopping ) {
+            while ( group->num_threads < group->min_threads )
+              create_thread(g);
+            group->wq->set_max_workers(group->num_threads);
+          }
+        }
+
+        if ( elastic )
+          m_idle_timeout_ms = m_elastic_timeout_ms;
+        else if ( num_threads() > m_num_threads )
+          m_idle_timeout_ms = idle_timeout_ms;
+
+        pthread_mutex_unlock(&m_mutex);
+
+        UMAP_LOG(Debug, m_pool_name << " may now run up to " << m_num_threads << " threads");
+      }
+
+      //
+      // Queues work in a domain.  With several queues per domain, work goes
+      // to the queue of the CPU the caller runs on, or of hint when it is
+      // not -1, and a thread of another queue is woken to steal it when
+      // none of that queue is waiting for work.
+      //
+      void send_work(const WorkItem& work, uint64_t domain = 0, int64_t hint = -1) {
+        uint64_t q = 0;
+
+        if ( m_queues_per_domain > 1 ) {
+          if ( hint < 0 )
+            hint = sched_getcpu();
+          q = (uint64_t)std::max<int64_t>(hint, 0) % m_queues_per_domain;
+        }
+
+        uint64_t first = (domain % num_domains()) * m_queues_per_domain;
+        Group* g = m_groups[first + q];
+
+        g->wq->enqueue(work);
+
+        if ( g->wq->backlogged() ) {
+          if ( g->num_threads < g->max_threads )
+            grow(g);
+
+          for ( uint64_t i = 1; i < m_queues_per_domain; ++i )
+            if ( m_groups[first + (q + i) % m_queues_per_domain]->wq->kick() )
+              break;
+        }
+      }
+
+      //
+      // Cycles through the queues of a domain, for callers that have no
+      // better hint for send_work()
+      //
+      int64_t next_queue( void ) {
+        return (int64_t)(m_next_queue++ % m_queues_per_domain);
       }
 
       WorkItem get_work() {
-        return m_wq->dequeue();
+        if ( m_queues_per_domain > 1 )
+          return get_or_steal_work();
+
+        if ( m_idle_timeout_ms == 0 )
+          return my_group()->wq->dequeue();
+
+        WorkItem work;
+
+        while ( ! my_group()->wq->dequeue_for(work, m_idle_timeout_ms) ) {
+          if ( try_retire(my_group()) ) {
+            work.page_desc = nullptr;
+            work.type = Umap::WorkItem::WorkType::EXIT;
+            break;
+          }
+        }
+
+        return work;
+      }
+
+      bool try_get_work(WorkItem& work) {
+        return my_group()->wq->try_dequeue(work);
       }
 
       bool wq_is_empty( void ) {
-        return m_wq->is_empty();
+        for ( auto group : m_groups )
+          if ( ! group->wq->is_empty() )
+            return false;
+        return true;
+      }
+
+      //
+      // Items waiting in the queues of every group
+      //
+      uint64_t wq_size( void ) {
+        uint64_t n = 0;
+
+        for ( auto group : m_groups )
+          n += group->wq->size();
+        return n;
+      }
+
+      uint64_t num_groups( void ) { return m_groups.size(); }
+      uint64_t num_domains( void ) { return m_groups.size() / m_queues_per_domain; }
+
+      //
+      // Items taken by threads from queues other than their own
+      //
+      uint64_t num_stolen( void ) { return m_num_stolen; }
+
+      //
+      // Number of threads running right now
+      //
+      uint64_t num_threads( void ) {
+        uint64_t n = 0;
+
+        for ( auto group : m_groups )
+          n += group->num_threads;
+        return n;
+      }
+
+      //
+      // Placement of the threads started from now on
+      //
+      void set_placement( const ThreadPlacement& placement ) {
+        m_placement = placement;
       }
 
       void start_thread_pool() {
         UMAP_LOG(Debug, "Starting " <<  m_pool_name << " Pool of "
             << m_num_threads << " threads");
 
-        for ( uint64_t i = 0; i < m_num_threads; ++i) {
-          pthread_t t;
-
-          if (pthread_create(&t, NULL, ThreadEntryFunc, this) != 0)
-            UMAP_ERROR("Failed to launch thread");
+        pthread_mutex_lock(&m_mutex);
+        m_stopping = false;
+        for ( uint64_t g = 0; g < m_groups.size(); ++g ) {
+          Group* group = m_groups[g];
 
-          if (pthread_setname_np(t, m_pool_name.c_str()) != 0)
-            UMAP_ERROR("Failed to set thread name");
+          for ( uint64_t i = 0; i < group->min_threads; ++i )
+            create_thread(g);
 
-          m_threads.push_back(t);
+          group->wq->set_max_workers(group->num_threads);
         }
+        pthread_mutex_unlock(&m_mutex);
       }
 
       void stop_thread_pool() {
         UMAP_LOG(Debug, "Stopping " <<  m_pool_name << " Pool of "
-            << m_num_threads << " threads");
+            << num_threads() << " threads, " << m_num_stolen << " items stolen");
 
         WorkItem w = {.page_desc = nullptr, .type = Umap::WorkItem::WorkType::EXIT };
 
         //
-        // This will inform all of the threads it is time to go away
+        // This will inform all of the threads it is time to go away.  No
+        // thread is added or let go once m_stopping is set.
         //
-        for ( uint64_t i = 0; i < m_num_threads; ++i)
-          send_work(w);
+        pthread_mutex_lock(&m_mutex);
+        m_stopping = true;
+        for ( auto group : m_groups )
+          for ( uint64_t i = 0; i < group->num_threads; ++i )
+            group->wq->enqueue(w);
+        pthread_mutex_unlock(&m_mutex);
 
         //
         // Wait for all of the threads to exit
@@ -104,28 +314,255 @@ namespace Umap {
         for ( auto pt : m_threads )
           (void) pthread_join(pt, NULL);
 
+        for ( auto pt : m_retired )
+          (void) pthread_join(pt, NULL);
+
         m_threads.clear();
+        m_retired.clear();
+        for ( auto group : m_groups )
+          group->num_threads = 0;
 
         UMAP_LOG(Debug, m_pool_name << " stopped");
       }
 
+      //
+      // Stolen work is not seen by the queue it was taken from, so the
+      // queues are waited for again until no work was stolen meanwhile
+      //
       void wait_for_idle( void ) {
-        m_wq->wait_for_idle();
+        while ( 1 ) {
+          uint64_t stolen = m_num_stolen;
+
+          for ( auto group : m_groups )
+            group->wq->wait_for_idle();
+
+          if ( m_thieves == 0 && m_num_stolen == stolen )
+            break;
+          sched_yield();
+        }
       }
 
     protected:
       virtual void ThreadEntry() = 0;
 
+      //
+      // Group of the calling pool thread
+      //
+      static uint64_t& thread_group( void ) {
+        static thread_local uint64_t group = 0;
+        return group;
+      }
+
+      //
+      // Domain of the calling pool thread
+      //
+      uint64_t thread_domain( void ) {
+        return thread_group() / m_queues_per_domain;
+      }
+
     private:
-      static void* ThreadEntryFunc(void * This) {
-        ((WorkerPool *)This)->ThreadEntry();
+      struct Group {
+        WorkQueue<WorkItem>* wq;
+        uint64_t min_threads;
+        std::atomic<uint64_t> max_threads;
+        std::atomic<uint64_t> num_threads;
+      };
+
+      struct ThreadArg {
+        WorkerPool* pool;
+        uint64_t group;
+      };
+
+      static void* ThreadEntryFunc(void * arg) {
+        ThreadArg t = *(ThreadArg*)arg;
+
+        delete (ThreadArg*)arg;
+
+        thread_group() = t.group;
+        t.pool->m_placement.apply();
+        t.pool->ThreadEntry();
         return NULL;
       }
 
+      //
+      // Share of group g when n threads are spread over ngroups groups
+      //
+      static uint64_t split( uint64_t n, uint64_t ngroups, uint64_t g ) {
+        return n / ngroups + ( g < n % ngroups ? 1 : 0 );
+      }
+
+      Group* my_group( void ) {
+        return m_groups.size() == 1 ? m_groups[0] : m_groups[thread_group() % m_groups.size()];
+      }
+
+      //
+      // Set while the calling thread works on stolen items, which
+      // wait_for_idle() cannot see
+      //
+      static bool& holds_stolen( void ) {
+        static thread_local bool stolen = false;
+        return stolen;
+      }
+
+      //
+      // get_work() with several queues per domain.  Waiting threads are
+      // woken by send_work() when there is work to steal, and otherwise
+      // leave the pool as in get_work() once idle for m_idle_timeout_ms.
+      //
+      WorkItem get_or_steal_work( void ) {
+        const long WAIT_MS = 1000;
+        uint64_t g = thread_group() % m_groups.size();
+        uint64_t first = (g / m_queues_per_domain) * m_queues_per_domain;
+        Group* group = m_groups[g];
+        long idle_ms = 0;
+        WorkItem work;
+
+        if ( holds_stolen() ) {
+          holds_stolen() = false;
+          --m_thieves;
+        }
+
+        while ( 1 ) {
+          if ( group->wq->try_dequeue(work) )
+            return work;
+
+          ++m_thieves;
+          for ( uint64_t i = 1; i < m_queues_per_domain; ++i ) {
+            Group* victim = m_groups[first + (g - first + i) % m_queues_per_domain];
+
+            if ( ! victim->wq->try_dequeue(work) )
+              continue;
+
+            //
+            // Each thread is sent an EXIT of its own by stop_thread_pool()
+            //
+            if ( work.type == Umap::WorkItem::WorkType::EXIT ) {
+              victim->wq->enqueue(work);
+              continue;
+            }
+
+            ++m_num_stolen;
+            holds_stolen() = true;
+            return work;
+          }
+          --m_thieves;
+
+          long timeout = ( m_idle_timeout_ms != 0 ) ? std::min<long>(m_idle_timeout_ms, WAIT_MS) : WAIT_MS;
+          struct timespec start, end;
+
+          clock_gettime(CLOCK_MONOTONIC, &start);
+          if ( group->wq->dequeue_for(work, timeout) )
+            return work;
+          clock_gettime(CLOCK_MONOTONIC, &end);
+
+          idle_ms += (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+          if ( m_idle_timeout_ms != 0 && idle_ms >= m_idle_timeout_ms ) {
+            idle_ms = 0;
+            if ( try_retire(group) ) {
+              work.page_desc = nullptr;
+              work.type = Umap::WorkItem::WorkType::EXIT;
+              return work;
+            }
+          }
+        }
+      }
+
+      //
+      // Called with m_mutex held
+      //
+      void create_thread( uint64_t g ) {
+        ThreadArg* arg = new ThreadArg;
+        pthread_t t;
+
+        arg->pool = this;
+        arg->group = g;
+
+        if (pthread_create(&t, NULL, ThreadEntryFunc, arg) != 0)
+          UMAP_ERROR("Failed to launch thread");
+
+        if (pthread_setname_np(t, m_pool_name.c_str()) != 0)
+          UMAP_ERROR("Failed to set thread name");
+
+        m_threads.push_back(t);
+        ++m_groups[g]->num_threads;
+      }
+
+      void grow( Group* group ) {
+        pthread_mutex_lock(&m_mutex);
+
+        if ( ! m_stopping && group->num_threads < group->max_threads ) {
+          uint64_t g = 0;
+
+          while ( m_groups[g] != group )
+            ++g;
+
+          //
+          // Threads that have been let go are gone by now, or soon will be
+          //
+          for ( auto it = m_retired.begin(); it != m_retired.end(); ) {
+            if ( pthread_tryjoin_np(*it, NULL) == 0 )
+              it = m_retired.erase(it);
+            else
+              ++it;
+          }
+
+          create_thread(g);
+          group->wq->set_max_workers(group->num_threads);
+
+          UMAP_LOG(Debug, m_pool_name << " grew to " << group->num_threads
+              << " threads in group " << g);
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+      }
+
+      //
+      // Returns true if the calling thread, having been idle for a while,
+      // is to leave the pool
+      //
+      bool try_retire( Group* group ) {
+        bool rval = false;
+
+        pthread_mutex_lock(&m_mutex);
+
+        if ( ! m_stopping && group->num_threads > group->min_threads ) {
+          pthread_t self = pthread_self();
+
+          for ( auto it = m_threads.begin(); it != m_threads.end(); ++it ) {
+            if ( pthread_equal(*it, self) ) {
+              m_threads.erase(it);
+              break;
+            }
+          }
+          m_retired.push_back(self);
+
+          --group->num_threads;
+          group->wq->set_max_workers(group->num_threads);
+          rval = true;
+
+          UMAP_LOG(Debug, m_pool_name << " shrank to " << group->num_threads << " threads");
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+        return rval;
+      }
+
       std::string             m_pool_name;
       uint64_t                m_num_threads;
-      WorkQueue<WorkItem>*    m_wq;
+      std::atomic<long>       m_idle_timeout_ms;
+      long                    m_elastic_timeout_ms;
+      uint64_t                m_queues_per_domain;
+      std::atomic<uint64_t>   m_next_queue;
+      std::atomic<uint64_t>   m_num_stolen;
+      std::atomic<uint64_t>   m_thieves;    // Stealing or working on stolen items
+      std::vector<Group*>     m_groups;
+      ThreadPlacement         m_placement;
+
+      pthread_mutex_t         m_mutex;
+      bool                    m_stopping;
       std::vector<pthread_t>  m_threads;
+      std::vector<pthread_t>  m_retired;
   };
 } // end of namespace Umap
 #endif // _UMAP_WorkerPool_HPP
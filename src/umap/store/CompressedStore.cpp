@@ -0,0 +1,571 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include "umap/config.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <stdio.h>              // rename()
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef UMAP_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef UMAP_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef UMAP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <umap/store/CompressedStore.h>
+#include <umap/util/Macros.hpp>
+
+namespace Umap {
+  //
+  // The log is compacted once it holds at least this much garbage, and
+  // more garbage than live data
+  //
+  static const uint64_t COMPACTION_MIN_BYTES = 16 * 1024 * 1024;
+  static const uint32_t RECORD_MAGIC = 0x554d435a;    // "UMCZ"
+
+  //
+  // Per thread buffers for a block and for its compressed form
+  //
+  static char* scratch(std::vector<char>& v, size_t nb) {
+    if (v.size() < nb)
+      v.resize(nb);
+    return v.data();
+  }
+
+  static thread_local std::vector<char> tl_block;
+  static thread_local std::vector<char> tl_cbuf;
+
+  static void pread_all(int fd, char* buf, size_t nb, off_t off) {
+    while (nb) {
+      ssize_t rval = pread(fd, buf, nb, off);
+
+      if (rval == -1 && errno == EINTR)
+        continue;
+      if (rval <= 0)
+        UMAP_ERROR("CompressedStore: pread(fd=" << fd << ", nb=" << nb << ", off=" << off << ") failed - "
+            << (rval == 0 ? "unexpected end of file" : strerror(errno)));
+      buf += rval; nb -= rval; off += rval;
+    }
+  }
+
+  static void pwrite_all(int fd, const char* buf, size_t nb, off_t off) {
+    while (nb) {
+      ssize_t rval = pwrite(fd, buf, nb, off);
+
+      if (rval == -1 && errno == EINTR)
+        continue;
+      if (rval == -1)
+        UMAP_ERROR("CompressedStore: pwrite(fd=" << fd << ", nb=" << nb << ", off=" << off << ") failed - " << strerror(errno));
+      buf += rval; nb -= rval; off += rval;
+    }
+  }
+
+  static bool is_zero(const char* buf, size_t nb) {
+    return nb == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, nb - 1) == 0);
+  }
+
+  // Create mode
+  CompressedStore::CompressedStore(size_t _rsize_, size_t _block_size_, std::string _root_path_, Codec _codec_, int _level_)
+    : rsize{_rsize_}, block_size{_block_size_}, root_path{_root_path_}, codec{_codec_}, level{_level_}, read_only{false}, fd{-1}
+  {
+    if (block_size == 0)
+      UMAP_ERROR("CompressedStore: the block size must not be 0");
+
+    if (codec == BEST)
+      codec = codec_supported(ZSTD) ? ZSTD : codec_supported(LZ4) ? LZ4 : codec_supported(ZLIB) ? ZLIB : NONE;
+
+    if (!codec_supported(codec))
+      UMAP_ERROR("CompressedStore: umap was built without " << codec_name(codec) << " support");
+
+    DIR* directory;
+    if ((directory = opendir(root_path.c_str())) != NULL) {
+      closedir(directory);
+      UMAP_ERROR("Directory already exist. Needs to be opened in open mode: store = new CompressedStore(root_path,is_read_only); ");
+    }
+
+    if (mkdir(root_path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0)
+      UMAP_ERROR("ERROR: Failed to create directory" << " - " << strerror(errno));
+
+    std::string metadata_file_path = root_path + "/_metadata";
+    std::ofstream metadata(metadata_file_path.c_str());
+    if (!metadata.is_open())
+      UMAP_ERROR("Failed to open metadata file" << " - " << strerror(errno));
+
+    metadata << block_size << std::endl << rsize << std::endl << codec_name(codec) << std::endl << level << std::endl;
+    metadata.close();
+
+    init();
+    open_log(O_RDWR | O_CREAT | O_TRUNC);
+  }
+
+  // Open mode
+  CompressedStore::CompressedStore(std::string _root_path_, bool _read_only_)
+    : root_path{_root_path_}, read_only{_read_only_}, fd{-1}
+  {
+    std::string metadata_file_path = root_path + "/_metadata";
+    std::ifstream metadata(metadata_file_path.c_str());
+    std::string name;
+
+    if (!metadata.is_open())
+      UMAP_ERROR("Failed to open metadata file" << " - " << strerror(errno));
+
+    metadata >> block_size >> rsize >> name >> level;
+    if (!metadata || block_size == 0)
+      UMAP_ERROR("CompressedStore: " << metadata_file_path << " is corrupt");
+
+    codec = BEST;
+    for (Codec c : { NONE, ZLIB, LZ4, ZSTD })
+      if (name == codec_name(c))
+        codec = c;
+
+    if (codec == BEST)
+      UMAP_ERROR("CompressedStore: unknown codec " << name << " in " << metadata_file_path);
+    if (!codec_supported(codec))
+      UMAP_ERROR("CompressedStore: umap was built without " << name << " support");
+
+    init();
+    open_log(read_only ? O_RDONLY : O_RDWR);
+    scan_log();
+  }
+
+  CompressedStore::~CompressedStore() {
+    UMAP_LOG(Info, "CompressedStore Total Reads: " << numreads);
+    UMAP_LOG(Info, "CompressedStore Total Writes: " << numwrites);
+    UMAP_LOG(Info, "CompressedStore " << stored_bytes << " bytes stored in " << live_bytes
+        << " bytes (" << codec_name(codec) << ")");
+
+    if (fd != -1)
+      close_files();
+    pthread_rwlock_destroy(&log_lock);
+  }
+
+  void CompressedStore::init( void ) {
+    num_blocks = (rsize + block_size - 1) / block_size;
+    index.assign(num_blocks, extent{0, 0, ABSENT});
+    log_end = 0;
+    live_bytes = dead_bytes = stored_bytes = 0;
+    numreads = numwrites = 0;
+    pthread_rwlock_init(&log_lock, NULL);
+  }
+
+  void CompressedStore::open_log( int flags ) {
+    fd = open(log_path().c_str(), flags | O_LARGEFILE, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+      UMAP_ERROR("CompressedStore: Failed to open " << log_path() << " - " << strerror(errno));
+  }
+
+  //
+  // Rebuilds the index from the log.  Later records of a block replace the
+  // earlier ones.  A record cut short, e.g. by a crash while it was being
+  // appended, ends the log.
+  //
+  void CompressedStore::scan_log( void ) {
+    struct stat st;
+    uint64_t off = 0;
+
+    if (fstat(fd, &st) != 0)
+      UMAP_ERROR("CompressedStore: fstat failed - " << strerror(errno));
+
+    while (off + sizeof(record) <= (uint64_t)st.st_size) {
+      record r;
+
+      pread_all(fd, (char*)&r, sizeof(r), off);
+      if (r.magic != RECORD_MAGIC || r.block >= num_blocks || r.state > PACKED || r.state == ABSENT
+          || r.size > block_size || off + sizeof(r) + r.size > (uint64_t)st.st_size)
+        break;
+
+      extent& e = index[r.block];
+      if (e.state != ABSENT) {
+        dead_bytes += sizeof(record) + e.size;
+        live_bytes -= e.size;
+      }
+      else {
+        stored_bytes += block_size;
+      }
+
+      e = extent{off, (uint32_t)r.size, r.state};
+      live_bytes += r.size;
+      off += sizeof(r) + r.size;
+    }
+
+    log_end = off;
+
+    if (off != (uint64_t)st.st_size) {
+      UMAP_LOG(Warning, "CompressedStore: ignoring " << st.st_size - off << " bytes at the end of " << log_path());
+      if (!read_only && ftruncate(fd, off) != 0)
+        UMAP_ERROR("CompressedStore: ftruncate failed - " << strerror(errno));
+    }
+  }
+
+  CompressedStore::extent CompressedStore::get_extent(uint64_t b) {
+    std::lock_guard<std::mutex> lock(index_mutex);
+    return index[b];
+  }
+
+  //
+  // Called with log_lock held
+  //
+  void CompressedStore::read_block(uint64_t b, char* dst) {
+    extent e = get_extent(b);
+
+    switch (e.state) {
+      case ABSENT:
+      case ZERO:
+        memset(dst, 0, block_size);
+        break;
+      case RAW:
+        pread_all(fd, dst, block_size, e.offset + sizeof(record));
+        break;
+      case PACKED: {
+        char* cbuf = scratch(tl_cbuf, e.size);
+
+        pread_all(fd, cbuf, e.size, e.offset + sizeof(record));
+        decompress(cbuf, e.size, dst, block_size);
+        break;
+      }
+    }
+  }
+
+  //
+  // Called with log_lock and the lock of the block held.  The record is
+  // appended to the log before the index points to it, so readers see
+  // either the old or the new extent of the block.
+  //
+  void CompressedStore::write_block(uint64_t b, const char* src) {
+    size_t cap = sizeof(record) + std::max(block_size, compress_bound(codec, block_size));
+    char* wbuf = scratch(tl_cbuf, cap);
+    record* r = (record*)wbuf;
+
+    r->magic = RECORD_MAGIC;
+    r->block = b;
+
+    if (is_zero(src, block_size)) {
+      r->state = ZERO;
+      r->size = 0;
+    }
+    else {
+      size_t csize = compress(src, block_size, wbuf + sizeof(record), cap - sizeof(record));
+
+      if (csize == 0 || csize >= block_size) {
+        r->state = RAW;
+        r->size = block_size;
+        memcpy(wbuf + sizeof(record), src, block_size);
+      }
+      else {
+        r->state = PACKED;
+        r->size = csize;
+      }
+    }
+
+    uint64_t len = sizeof(record) + r->size;
+    uint64_t off = log_end.fetch_add(len);
+
+    pwrite_all(fd, wbuf, len, off);
+
+    std::lock_guard<std::mutex> lock(index_mutex);
+    extent& e = index[b];
+
+    if (e.state != ABSENT) {
+      dead_bytes += sizeof(record) + e.size;
+      live_bytes -= e.size;
+    }
+    else {
+      stored_bytes += block_size;
+    }
+
+    e = extent{off, (uint32_t)r->size, r->state};
+    live_bytes += r->size;
+  }
+
+  ssize_t CompressedStore::read_from_store(char* buf, size_t nb, off_t off) {
+    uint64_t pos = off;
+    uint64_t end = off + nb;
+
+    pthread_rwlock_rdlock(&log_lock);
+
+    while (pos < end) {
+      uint64_t b = pos / block_size;
+      uint64_t boff = pos % block_size;
+      uint64_t len = std::min(block_size - boff, end - pos);
+      char* dst = buf + (pos - off);
+
+      if (b >= num_blocks) {
+        memset(dst, 0, end - pos);
+        break;
+      }
+
+      if (boff == 0 && len == block_size) {
+        read_block(b, dst);
+      }
+      else {
+        char* block = scratch(tl_block, block_size);
+
+        read_block(b, block);
+        memcpy(dst, block + boff, len);
+      }
+      pos += len;
+    }
+
+    pthread_rwlock_unlock(&log_lock);
+
+    numreads++;
+    return nb;
+  }
+
+  ssize_t CompressedStore::write_to_store(char* buf, size_t nb, off_t off) {
+    uint64_t pos = off;
+    uint64_t end = off + nb;
+
+    if (read_only)
+      UMAP_ERROR("CompressedStore: " << root_path << " was opened read only");
+
+    if ((end + block_size - 1) / block_size > num_blocks)
+      UMAP_ERROR("CompressedStore: write of " << nb << " bytes at " << off
+          << " goes past the capacity of " << rsize << " bytes");
+
+    pthread_rwlock_rdlock(&log_lock);
+
+    while (pos < end) {
+      uint64_t b = pos / block_size;
+      uint64_t boff = pos % block_size;
+      uint64_t len = std::min(block_size - boff, end - pos);
+      const char* src = buf + (pos - off);
+      std::lock_guard<std::mutex> lock(block_locks[b % NUM_BLOCK_LOCKS]);
+
+      if (boff == 0 && len == block_size) {
+        write_block(b, src);
+      }
+      else {
+        char* block = scratch(tl_block, block_size);
+
+        read_block(b, block);
+        memcpy(block + boff, src, len);
+        write_block(b, block);
+      }
+      pos += len;
+    }
+
+    pthread_rwlock_unlock(&log_lock);
+
+    numwrites++;
+
+    if (needs_compaction())
+      compact();
+
+    return nb;
+  }
+
+  bool CompressedStore::is_zero_range(off_t off, size_t nb) {
+    if (nb == 0)
+      return false;
+
+    uint64_t first = off / block_size;
+    uint64_t last = (off + nb - 1) / block_size;
+    std::lock_guard<std::mutex> lock(index_mutex);
+
+    for (uint64_t b = first; b <= last && b < num_blocks; b++) {
+      if (index[b].state != ABSENT && index[b].state != ZERO)
+        return false;
+    }
+    return true;
+  }
+
+  bool CompressedStore::needs_compaction( void ) {
+    return dead_bytes >= COMPACTION_MIN_BYTES && dead_bytes > live_bytes;
+  }
+
+  //
+  // Copies the live records to a new log that then replaces the old one.
+  // Reads and writes wait until it is done.
+  //
+  void CompressedStore::compact( void ) {
+    if (read_only)
+      return;
+
+    pthread_rwlock_wrlock(&log_lock);
+
+    if (dead_bytes == 0) {
+      pthread_rwlock_unlock(&log_lock);
+      return;
+    }
+
+    std::string tmp_path = root_path + "/log.compact";
+    int new_fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR);
+    if (new_fd == -1)
+      UMAP_ERROR("CompressedStore: Failed to open " << tmp_path << " - " << strerror(errno));
+
+    std::vector<char> buf(sizeof(record) + block_size);
+    uint64_t old_end = log_end;
+    uint64_t new_off = 0;
+
+    for (uint64_t b = 0; b < num_blocks; b++) {
+      extent e = get_extent(b);
+
+      if (e.state == ABSENT)
+        continue;
+
+      uint64_t len = sizeof(record) + e.size;
+
+      pread_all(fd, buf.data(), len, e.offset);
+      pwrite_all(new_fd, buf.data(), len, new_off);
+
+      {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        index[b].offset = new_off;
+      }
+      new_off += len;
+    }
+
+    if (fsync(new_fd) != 0)
+      UMAP_ERROR("CompressedStore: fsync failed - " << strerror(errno));
+
+    if (rename(tmp_path.c_str(), log_path().c_str()) != 0)
+      UMAP_ERROR("CompressedStore: Failed to rename " << tmp_path << " - " << strerror(errno));
+
+    close(fd);
+    fd = new_fd;
+    log_end = new_off;
+    dead_bytes = 0;
+
+    pthread_rwlock_unlock(&log_lock);
+
+    UMAP_LOG(Info, "CompressedStore: compacted " << log_path() << " from " << old_end << " to " << new_off << " bytes");
+  }
+
+  int CompressedStore::close_files() {
+    int return_status = 0;
+
+    if (fd == -1)
+      return 0;
+
+    if (!read_only && fsync(fd) != 0) {
+      UMAP_LOG(Warning, "CompressedStore: Failed to sync " << log_path() << " - " << strerror(errno));
+      return_status = -1;
+    }
+
+    if (close(fd) != 0) {
+      UMAP_LOG(Warning, "CompressedStore: Failed to close " << log_path() << " - " << strerror(errno));
+      return_status = -1;
+    }
+
+    fd = -1;
+    return return_status;
+  }
+
+  bool CompressedStore::codec_supported(Codec codec) {
+    switch (codec) {
+      case NONE: return true;
+#ifdef UMAP_HAVE_ZLIB
+      case ZLIB: return true;
+#endif
+#ifdef UMAP_HAVE_LZ4
+      case LZ4: return true;
+#endif
+#ifdef UMAP_HAVE_ZSTD
+      case ZSTD: return true;
+#endif
+      default: return false;
+    }
+  }
+
+  const char* CompressedStore::codec_name(Codec codec) {
+    switch (codec) {
+      case NONE: return "none";
+      case ZLIB: return "zlib";
+      case LZ4: return "lz4";
+      case ZSTD: return "zstd";
+      default: return "best";
+    }
+  }
+
+  size_t CompressedStore::compress_bound(Codec codec, size_t nb) {
+    switch (codec) {
+#ifdef UMAP_HAVE_ZLIB
+      case ZLIB: return compressBound(nb);
+#endif
+#ifdef UMAP_HAVE_LZ4
+      case LZ4: return LZ4_compressBound(nb);
+#endif
+#ifdef UMAP_HAVE_ZSTD
+      case ZSTD: return ZSTD_compressBound(nb);
+#endif
+      default: return nb;
+    }
+  }
+
+  //
+  // Returns the size of the compressed data, or 0 if it could not be
+  // compressed into cap bytes
+  //
+  size_t CompressedStore::compress(const char* src, size_t nb, char* dst, size_t cap) {
+    switch (codec) {
+#ifdef UMAP_HAVE_ZLIB
+      case ZLIB: {
+        uLongf dlen = cap;
+
+        if (compress2((Bytef*)dst, &dlen, (const Bytef*)src, nb, level ? level : Z_DEFAULT_COMPRESSION) != Z_OK)
+          return 0;
+        return dlen;
+      }
+#endif
+#ifdef UMAP_HAVE_LZ4
+      case LZ4: {
+        int rval = LZ4_compress_default(src, dst, (int)nb, (int)cap);
+        return rval > 0 ? rval : 0;
+      }
+#endif
+#ifdef UMAP_HAVE_ZSTD
+      case ZSTD: {
+        size_t rval = ZSTD_compress(dst, cap, src, nb, level ? level : 3);
+        return ZSTD_isError(rval) ? 0 : rval;
+      }
+#endif
+      default:
+        return 0;
+    }
+  }
+
+  void CompressedStore::decompress(const char* src, size_t csize, char* dst, size_t nb) {
+    bool ok = false;
+
+    switch (codec) {
+#ifdef UMAP_HAVE_ZLIB
+      case ZLIB: {
+        uLongf dlen = nb;
+        ok = uncompress((Bytef*)dst, &dlen, (const Bytef*)src, csize) == Z_OK && dlen == nb;
+        break;
+      }
+#endif
+#ifdef UMAP_HAVE_LZ4
+      case LZ4:
+        ok = LZ4_decompress_safe(src, dst, (int)csize, (int)nb) == (int)nb;
+        break;
+#endif
+#ifdef UMAP_HAVE_ZSTD
+      case ZSTD:
+        ok = ZSTD_decompress(dst, nb, src, csize) == nb;
+        break;
+#endif
+      default:
+        break;
+    }
+
+    if (!ok)
+      UMAP_ERROR("CompressedStore: failed to decompress " << csize << " bytes of " << log_path());
+  }
+}
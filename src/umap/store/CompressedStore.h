@@ -0,0 +1,116 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_COMPRESSED_STORE_H_
+#define _UMAP_COMPRESSED_STORE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "umap/store/Store.hpp"
+#include "umap/umap.h"
+
+namespace Umap {
+  //
+  // Store that keeps the region compressed in a directory.  The region is
+  // cut into blocks of block_size bytes (one or more umap pages), each of
+  // which is compressed on its own and appended to a log file.  An index
+  // in memory maps block numbers to their latest extent in the log, and is
+  // rebuilt from the log when the store is opened again.
+  //
+  // Blocks that were never written, or were written as zeros, take no
+  // space and are filled without I/O.  Overwritten extents become garbage
+  // that compact() reclaims by rewriting the live extents to a new log; it
+  // is also run from write_to_store() once there is more garbage than live
+  // data.
+  //
+  class CompressedStore : public Store {
+  public:
+    enum Codec { NONE, ZLIB, LZ4, ZSTD, BEST };
+
+    // Create mode
+    CompressedStore(size_t _rsize_, size_t _block_size_, std::string _root_path_, Codec _codec_ = BEST, int _level_ = 0);
+    // Open mode
+    CompressedStore(std::string _root_path_, bool _read_only_);
+    ~CompressedStore();
+
+    ssize_t read_from_store(char* buf, size_t nb, off_t off);
+    ssize_t write_to_store(char* buf, size_t nb, off_t off);
+    bool is_zero_range(off_t off, size_t nb);
+
+    void compact();
+    int close_files();
+    size_t get_capacity() { return rsize; }
+    Codec get_codec() { return codec; }
+
+    //
+    // Bytes of the region written to the store, and of the live extents
+    // in the log
+    //
+    uint64_t get_stored_bytes() { return stored_bytes; }
+    uint64_t get_compressed_bytes() { return live_bytes; }
+
+    static bool codec_supported(Codec codec);
+
+  private:
+    enum extent_state : uint32_t { ABSENT, ZERO, RAW, PACKED };
+    struct extent {
+      uint64_t offset;    // Of the record in the log
+      uint32_t size;      // Of the data following the record header
+      extent_state state;
+    };
+    struct record {
+      uint32_t magic;
+      extent_state state;
+      uint64_t block;
+      uint64_t size;
+    };
+
+    static const int NUM_BLOCK_LOCKS = 64;
+
+    size_t rsize;
+    size_t block_size;
+    uint64_t num_blocks;
+    std::string root_path;
+    Codec codec;
+    int level;
+    bool read_only;
+    int fd;
+
+    std::vector<extent> index;
+    std::mutex index_mutex;
+    std::atomic<uint64_t> log_end;
+    std::atomic<uint64_t> live_bytes;
+    std::atomic<uint64_t> dead_bytes;
+    std::atomic<uint64_t> stored_bytes;
+
+    // Held shared by reads and writes, and exclusively by compact()
+    pthread_rwlock_t log_lock;
+    // Serializes the read-modify-write of partially written blocks
+    std::mutex block_locks[NUM_BLOCK_LOCKS];
+
+    std::atomic<int64_t> numreads;
+    std::atomic<int64_t> numwrites;
+
+    void init( void );
+    void open_log( int flags );
+    void scan_log( void );
+    extent get_extent(uint64_t b);
+    void read_block(uint64_t b, char* dst);
+    void write_block(uint64_t b, const char* src);
+    bool needs_compaction( void );
+    std::string log_path( void ) { return root_path + "/log"; }
+
+    size_t compress(const char* src, size_t nb, char* dst, size_t cap);
+    void decompress(const char* src, size_t csize, char* dst, size_t nb);
+    static size_t compress_bound(Codec codec, size_t nb);
+    static const char* codec_name(Codec codec);
+  };
+}
+#endif
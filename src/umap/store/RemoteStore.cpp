@@ -0,0 +1,366 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include <algorithm>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <umap/store/RemoteStore.h>
+#include <umap/store/RemoteStoreProtocol.hpp>
+#include <umap/util/Macros.hpp>
+
+namespace Umap {
+  RemoteStore::RemoteStore(std::string _servers_, size_t _rsize_, size_t _stripe_size_, uint64_t _base_)
+    : rsize{_rsize_}, stripe_size{_stripe_size_}, base{_base_}
+  {
+    size_t pos = 0;
+
+    while (pos < _servers_.size()) {
+      size_t end = _servers_.find(',', pos);
+
+      if (end == std::string::npos)
+        end = _servers_.size();
+
+      std::string hp = _servers_.substr(pos, end - pos);
+      size_t colon = hp.rfind(':');
+
+      if (colon == std::string::npos || colon == 0 || colon == hp.size() - 1)
+        UMAP_ERROR("RemoteStore: " << hp << " is not of the form host:port");
+
+      server* s = new server;
+      s->host = hp.substr(0, colon);
+      s->port = hp.substr(colon + 1);
+      servers.push_back(s);
+
+      pos = end + 1;
+    }
+
+    if (servers.empty())
+      UMAP_ERROR("RemoteStore: no server given");
+    if (stripe_size == 0)
+      UMAP_ERROR("RemoteStore: the stripe size must not be 0");
+
+    // Fail now rather than on the first page fault
+    for (auto s : servers) {
+      put_connection(s, get_connection(s));
+
+      s->async.fd = get_connection(s);
+      s->async.broken = false;
+      s->async.receiver = std::thread(&RemoteStore::receive, this, s);
+    }
+
+    UMAP_LOG(Debug, "servers: " << servers.size() << " rsize: " << rsize
+        << " stripe_size: " << stripe_size << " base: " << base);
+  }
+
+  RemoteStore::~RemoteStore() {
+    for (auto s : servers) {
+      // Makes the receiver fail what is still pending and leave
+      shutdown(s->async.fd, SHUT_RDWR);
+      s->async.receiver.join();
+      close(s->async.fd);
+
+      for (auto fd : s->idle)
+        close(fd);
+      delete s;
+    }
+  }
+
+  ssize_t RemoteStore::read_from_store(char* buf, size_t nb, off_t off) {
+    return transfer(false, buf, nb, off);
+  }
+
+  ssize_t RemoteStore::write_to_store(char* buf, size_t nb, off_t off) {
+    return transfer(true, buf, nb, off);
+  }
+
+  ssize_t RemoteStore::transfer(bool put, char* buf, size_t nb, off_t off) {
+    using namespace RemoteProtocol;
+    std::vector<int> fds(servers.size(), -1);
+    bool failed = false;
+
+    if (off < 0 || (size_t)off >= rsize)
+      return 0;
+
+    std::vector<std::vector<piece>> pieces = split(buf, nb, off);
+
+    //
+    // Send every request before waiting for any response
+    //
+    for (size_t i = 0; i < servers.size() && !failed; i++) {
+      if (pieces[i].empty())
+        continue;
+
+      fds[i] = get_connection(servers[i]);
+
+      for (auto& p : pieces[i]) {
+        Request req{MAGIC, put ? PUT : GET, p.offset, p.length};
+
+        if (!send_all(fds[i], &req, sizeof(req))
+            || (put && !send_all(fds[i], p.buf, p.length))) {
+          UMAP_LOG(Warning, "RemoteStore: failed to send to " << servers[i]->host
+              << ":" << servers[i]->port << " - " << strerror(errno));
+          failed = true;
+          break;
+        }
+      }
+    }
+
+    for (size_t i = 0; i < servers.size(); i++) {
+      if (fds[i] == -1)
+        continue;
+
+      bool ok = !failed;
+
+      for (size_t j = 0; ok && j < pieces[i].size(); j++) {
+        piece& p = pieces[i][j];
+        Response rsp;
+
+        if (!recv_all(fds[i], &rsp, sizeof(rsp)) || rsp.magic != MAGIC) {
+          UMAP_LOG(Warning, "RemoteStore: bad response from " << servers[i]->host
+              << ":" << servers[i]->port);
+          ok = false;
+        }
+        else if (rsp.status != 0) {
+          UMAP_LOG(Warning, "RemoteStore: " << (put ? "PUT" : "GET") << " of " << p.length
+              << " bytes at " << p.offset << " on " << servers[i]->host << ":" << servers[i]->port
+              << " failed - " << strerror(rsp.status));
+          ok = false;
+        }
+        else if (!put && (rsp.length != p.length || !recv_all(fds[i], p.buf, p.length))) {
+          UMAP_LOG(Warning, "RemoteStore: short response from " << servers[i]->host
+              << ":" << servers[i]->port);
+          ok = false;
+        }
+      }
+
+      //
+      // A connection left with responses in flight cannot be reused
+      //
+      if (ok)
+        put_connection(servers[i], fds[i]);
+      else
+        close(fds[i]);
+      failed = failed || !ok;
+    }
+
+    if (failed) {
+      errno = EIO;
+      return -1;
+    }
+    return nb;
+  }
+
+  //
+  // Splits a range into stripes, and the stripes by server.  nb is cut at
+  // the end of the region.
+  //
+  std::vector<std::vector<RemoteStore::piece>> RemoteStore::split(char* buf, size_t& nb, off_t off) {
+    std::vector<std::vector<piece>> pieces(servers.size());
+
+    if (nb > rsize - off)
+      nb = rsize - off;
+
+    for (size_t done = 0; done < nb; ) {
+      uint64_t o = off + done;
+      uint64_t stripe = o / stripe_size;
+      uint64_t len = std::min<uint64_t>(nb - done, stripe_size - o % stripe_size);
+      piece p;
+
+      p.buf = buf + done;
+      p.offset = base + (stripe / servers.size()) * stripe_size + o % stripe_size;
+      p.length = len;
+      pieces[stripe % servers.size()].push_back(p);
+      done += len;
+    }
+    return pieces;
+  }
+
+  bool RemoteStore::read_async(char* buf, size_t nb, off_t off, StoreRequest* req) {
+    return start_async(false, buf, nb, off, req);
+  }
+
+  bool RemoteStore::write_async(char* buf, size_t nb, off_t off, StoreRequest* req) {
+    return start_async(true, buf, nb, off, req);
+  }
+
+  //
+  // Sends the pieces of a request on the asynchronous connections of their
+  // servers.  The receivers complete the request once all of them are
+  // answered.  Requests are only refused when a connection is broken, in
+  // which case umap makes them synchronously.
+  //
+  bool RemoteStore::start_async(bool put, char* buf, size_t nb, off_t off, StoreRequest* req) {
+    using namespace RemoteProtocol;
+
+    if (off < 0 || (size_t)off >= rsize || nb == 0)
+      return false;
+
+    std::vector<std::vector<piece>> pieces = split(buf, nb, off);
+    uint64_t num_pieces = 0;
+
+    for (size_t i = 0; i < servers.size(); i++) {
+      if (!pieces[i].empty() && servers[i]->async.broken)
+        return false;
+      num_pieces += pieces[i].size();
+    }
+
+    async_request* r = new async_request;
+
+    r->req = req;
+    r->nb = nb;
+    r->pieces_left = num_pieces;
+    r->failed = false;
+
+    for (size_t i = 0; i < servers.size(); i++) {
+      channel& c = servers[i]->async;
+      std::lock_guard<std::mutex> send_lock(c.send_mutex);
+
+      for (auto& p : pieces[i]) {
+        Request rq{MAGIC, put ? PUT : GET, p.offset, p.length};
+
+        {
+          std::lock_guard<std::mutex> lock(c.mutex);
+
+          if (c.broken) {
+            piece_done(r, false, num_pieces);
+            return true;
+          }
+          c.queue.push_back(pending{r, p, put});
+        }
+        num_pieces--;
+
+        //
+        // The receiver fails what is queued once the connection is shut
+        // down, including the piece just queued
+        //
+        if (!send_all(c.fd, &rq, sizeof(rq)) || (put && !send_all(c.fd, p.buf, p.length))) {
+          UMAP_LOG(Warning, "RemoteStore: failed to send to " << servers[i]->host
+              << ":" << servers[i]->port << " - " << strerror(errno));
+          c.broken = true;
+          shutdown(c.fd, SHUT_RDWR);
+          if (num_pieces)
+            piece_done(r, false, num_pieces);
+          return true;
+        }
+      }
+    }
+    return true;
+  }
+
+  void RemoteStore::receive(server* s) {
+    using namespace RemoteProtocol;
+    channel& c = s->async;
+
+    while (1) {
+      Response rsp;
+      bool ok = recv_all(c.fd, &rsp, sizeof(rsp)) && rsp.magic == MAGIC;
+      pending pd;
+
+      {
+        std::lock_guard<std::mutex> lock(c.mutex);
+
+        if (!ok || c.queue.empty()) {
+          c.broken = true;
+          break;
+        }
+        pd = c.queue.front();
+        c.queue.pop_front();
+      }
+
+      if (rsp.status != 0) {
+        UMAP_LOG(Warning, "RemoteStore: " << (pd.put ? "PUT" : "GET") << " of " << pd.p.length
+            << " bytes at " << pd.p.offset << " on " << s->host << ":" << s->port
+            << " failed - " << strerror(rsp.status));
+        piece_done(pd.parent, false);
+      }
+      else if (!pd.put && (rsp.length != pd.p.length || !recv_all(c.fd, pd.p.buf, pd.p.length))) {
+        std::lock_guard<std::mutex> lock(c.mutex);
+
+        c.broken = true;
+        c.queue.push_front(pd);   // Failed below with the rest
+        break;
+      }
+      else {
+        piece_done(pd.parent, true);
+      }
+    }
+
+    //
+    // The connection is done for, and so is everything sent on it
+    //
+    std::lock_guard<std::mutex> lock(c.mutex);
+
+    shutdown(c.fd, SHUT_RDWR);
+    for (auto& pd : c.queue)
+      piece_done(pd.parent, false);
+    c.queue.clear();
+  }
+
+  void RemoteStore::piece_done(async_request* r, bool ok, uint64_t n) {
+    if (!ok)
+      r->failed = true;
+
+    if (r->pieces_left.fetch_sub(n) == n) {
+      r->req->complete(r->failed ? -1 : r->nb);
+      delete r;
+    }
+  }
+
+  int RemoteStore::get_connection(server* s) {
+    {
+      std::lock_guard<std::mutex> lock(s->mutex);
+
+      if (!s->idle.empty()) {
+        int fd = s->idle.back();
+        s->idle.pop_back();
+        return fd;
+      }
+    }
+
+    struct addrinfo hints;
+    struct addrinfo* res;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rval = getaddrinfo(s->host.c_str(), s->port.c_str(), &hints, &res);
+
+    if (rval != 0)
+      UMAP_ERROR("RemoteStore: cannot resolve " << s->host << ":" << s->port << " - " << gai_strerror(rval));
+
+    for (struct addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+      if (fd == -1)
+        continue;
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        break;
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd == -1)
+      UMAP_ERROR("RemoteStore: cannot connect to " << s->host << ":" << s->port << " - " << strerror(errno));
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return fd;
+  }
+
+  void RemoteStore::put_connection(server* s, int fd) {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    s->idle.push_back(fd);
+  }
+}
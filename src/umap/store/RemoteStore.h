@@ -0,0 +1,100 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_REMOTE_STORE_H_
+#define _UMAP_REMOTE_STORE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "umap/store/Store.hpp"
+#include "umap/umap.h"
+
+namespace Umap {
+  //
+  // Store that keeps a region in the memory of umap-memserver processes,
+  // typically running on other nodes of a cluster.  The region is striped
+  // over the servers in units of stripe_size bytes, and lives at offset
+  // base of the memory of each server, so that several regions may share
+  // the same servers.
+  //
+  // servers is a comma separated list of host:port, e.g. built by the
+  // application from the host names gathered with MPI_Allgather.
+  //
+  // A request spanning several stripes is sent to all the servers involved
+  // before any of their responses is read, and the stripes of one server
+  // are sent as a pipelined batch on one connection.  Each server has a
+  // pool of connections, so that fillers and evictors do not wait for each
+  // other.
+  //
+  // Asynchronous requests go through one more connection per server, whose
+  // responses are read by a thread of the store, so that a few workers can
+  // keep many requests in flight.
+  //
+  class RemoteStore : public Store {
+  public:
+    RemoteStore(std::string _servers_, size_t _rsize_, size_t _stripe_size_ = 1024 * 1024, uint64_t _base_ = 0);
+    ~RemoteStore();
+
+    ssize_t read_from_store(char* buf, size_t nb, off_t off);
+    ssize_t write_to_store(char* buf, size_t nb, off_t off);
+    bool read_async(char* buf, size_t nb, off_t off, StoreRequest* req);
+    bool write_async(char* buf, size_t nb, off_t off, StoreRequest* req);
+
+    size_t get_num_servers() { return servers.size(); }
+
+  private:
+    struct piece {
+      char* buf;
+      uint64_t offset;            // On the server
+      uint64_t length;
+    };
+    struct async_request {
+      StoreRequest* req;
+      ssize_t nb;
+      std::atomic<uint64_t> pieces_left;
+      std::atomic<bool> failed;
+    };
+    struct pending {
+      async_request* parent;
+      piece p;
+      bool put;
+    };
+    struct channel {
+      int fd;
+      std::mutex send_mutex;      // Keeps the queue in the order of sending
+      std::mutex mutex;
+      std::deque<pending> queue;  // Sent, waiting for their response
+      std::atomic<bool> broken;
+      std::thread receiver;
+    };
+    struct server {
+      std::string host;
+      std::string port;
+      std::mutex mutex;
+      std::vector<int> idle;      // Connections not in use
+      channel async;
+    };
+
+    std::vector<server*> servers;
+    size_t rsize;
+    size_t stripe_size;
+    uint64_t base;
+
+    ssize_t transfer(bool put, char* buf, size_t nb, off_t off);
+    std::vector<std::vector<piece>> split(char* buf, size_t& nb, off_t off);
+    bool start_async(bool put, char* buf, size_t nb, off_t off, StoreRequest* req);
+    void receive(server* s);
+    void piece_done(async_request* r, bool ok, uint64_t n = 1);
+    int get_connection(server* s);
+    void put_connection(server* s, int fd);
+  };
+}
+#endif
@@ -0,0 +1,78 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_REMOTE_STORE_PROTOCOL_HPP
+#define _UMAP_REMOTE_STORE_PROTOCOL_HPP
+
+#include <cstdint>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+//
+// Messages exchanged by the RemoteStore and umap-memserver.  Both ends are
+// expected to have the same byte order.
+//
+// A GET is answered by a response followed by length bytes of data when
+// its status is 0.  A PUT is followed by length bytes of data and answered
+// by a response.  Requests on one connection are answered in order, so a
+// client may send several before reading the responses.
+//
+namespace Umap {
+  namespace RemoteProtocol {
+    const uint32_t MAGIC = 0x554d5253;    // "UMRS"
+
+    enum Op : uint32_t { GET = 1, PUT = 2 };
+
+    struct Request {
+      uint32_t magic;
+      Op op;
+      uint64_t offset;
+      uint64_t length;
+    };
+
+    struct Response {
+      uint32_t magic;
+      int32_t status;     // 0 or an errno value
+      uint64_t length;
+    };
+
+    //
+    // Return false if the connection failed or was closed
+    //
+    inline bool send_all(int fd, const void* buf, size_t nb) {
+      const char* p = (const char*)buf;
+
+      while (nb) {
+        ssize_t rval = send(fd, p, nb, MSG_NOSIGNAL);
+
+        if (rval == -1 && errno == EINTR)
+          continue;
+        if (rval <= 0)
+          return false;
+        p += rval; nb -= rval;
+      }
+      return true;
+    }
+
+    inline bool recv_all(int fd, void* buf, size_t nb) {
+      char* p = (char*)buf;
+
+      while (nb) {
+        ssize_t rval = recv(fd, p, nb, MSG_WAITALL);
+
+        if (rval == -1 && errno == EINTR)
+          continue;
+        if (rval <= 0)
+          return false;
+        p += rval; nb -= rval;
+      }
+      return true;
+    }
+  }
+}
+
+#endif // _UMAP_REMOTE_STORE_PROTOCOL_HPP
@@ -0,0 +1,778 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include "umap/config.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>             // getenv(), strtoull()
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#ifdef UMAP_HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/ssl.h>
+#endif
+
+#include <umap/store/S3Store.h>
+#include <umap/util/Macros.hpp>
+
+namespace Umap {
+  struct S3Store::connection {
+    int fd;
+    void* ssl;                  // SSL*, for https
+    bool keep;                  // May be reused for another request
+    bool reused;
+    size_t rpos;
+    size_t rlen;
+    char rbuf[16384];
+  };
+
+  namespace {
+    // SHA-256 of an empty payload
+    const char* empty_sha256 = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+
+    //
+    // Size and ETag of the objects mapped by the process, so that mapping
+    // one again does not cost a round trip
+    //
+    struct object_info {
+      uint64_t size;
+      std::string etag;
+    };
+    std::mutex info_mutex;
+    std::unordered_map<std::string, object_info> info_cache;
+    const size_t max_cached_objects = 1024;
+
+    std::string env_str(const char* name) {
+      const char* value = getenv(name);
+      return value != nullptr ? value : "";
+    }
+
+    std::string uri_encode(const std::string& str) {
+      static const char* hex = "0123456789ABCDEF";
+      std::string out;
+
+      for (unsigned char c : str) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+          out += c;
+        }
+        else {
+          out += '%';
+          out += hex[c >> 4];
+          out += hex[c & 15];
+        }
+      }
+      return out;
+    }
+
+#ifdef UMAP_HAVE_OPENSSL
+    std::string to_hex(const unsigned char* data, size_t nb) {
+      static const char* hex = "0123456789abcdef";
+      std::string out;
+
+      for (size_t i = 0; i < nb; i++) {
+        out += hex[data[i] >> 4];
+        out += hex[data[i] & 15];
+      }
+      return out;
+    }
+
+    std::string sha256_hex(const std::string& data) {
+      unsigned char md[EVP_MAX_MD_SIZE];
+      unsigned int len = 0;
+
+      EVP_Digest(data.data(), data.size(), md, &len, EVP_sha256(), nullptr);
+      return to_hex(md, len);
+    }
+
+    std::string hmac_sha256(const std::string& key, const std::string& data) {
+      unsigned char md[EVP_MAX_MD_SIZE];
+      unsigned int len = 0;
+
+      HMAC(EVP_sha256(), key.data(), key.size(), (const unsigned char*)data.data(), data.size(), md, &len);
+      return std::string((const char*)md, len);
+    }
+#endif
+  }
+
+  S3Store::S3Store(std::string _url_, size_t _part_size_, uint64_t _max_parallel_
+                 , std::string _region_, std::string _access_key_, std::string _secret_key_)
+    : tls{false}, part_size{_part_size_}, object_size{0}, ssl_ctx{nullptr}, stopping{false}
+  {
+    if (part_size == 0)
+      UMAP_ERROR("S3Store: the part size must not be 0");
+
+    parse_url(_url_);
+
+    region = _region_;
+    if (region == "")
+      region = env_str("AWS_REGION");
+    if (region == "")
+      region = env_str("AWS_DEFAULT_REGION");
+    if (region == "")
+      region = "us-east-1";
+
+    access_key = _access_key_ != "" ? _access_key_ : env_str("AWS_ACCESS_KEY_ID");
+    secret_key = _secret_key_ != "" ? _secret_key_ : env_str("AWS_SECRET_ACCESS_KEY");
+    session_token = env_str("AWS_SESSION_TOKEN");
+
+    if (access_key == "" || secret_key == "") {
+      access_key = secret_key = session_token = "";
+    }
+
+#ifdef UMAP_HAVE_OPENSSL
+    if (tls) {
+      SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+
+      if (ctx == nullptr)
+        UMAP_ERROR("S3Store: SSL_CTX_new failed - " << ERR_error_string(ERR_get_error(), nullptr));
+
+      SSL_CTX_set_default_verify_paths(ctx);
+      SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+      ssl_ctx = ctx;
+    }
+#else
+    if (tls)
+      UMAP_ERROR("S3Store: umap was built without OpenSSL, https is not supported");
+    if (access_key != "")
+      UMAP_ERROR("S3Store: umap was built without OpenSSL, requests cannot be signed");
+#endif
+
+    stat_object(_url_);
+
+    for (uint64_t i = 0; i < std::max<uint64_t>(_max_parallel_, 1); i++)
+      part_threads.emplace_back(&S3Store::part_thread, this);
+
+    UMAP_LOG(Debug, "host: " << host << " port: " << port << " path: " << path
+        << " size: " << object_size << " part_size: " << part_size
+        << " threads: " << part_threads.size() << " signed: " << (access_key != ""));
+  }
+
+  S3Store::~S3Store() {
+    {
+      std::lock_guard<std::mutex> lock(parts_mutex);
+      stopping = true;
+    }
+    parts_cond.notify_all();
+
+    for (auto& t : part_threads)
+      t.join();
+
+    for (auto c : idle)
+      close_connection(c);
+
+#ifdef UMAP_HAVE_OPENSSL
+    if (ssl_ctx != nullptr)
+      SSL_CTX_free((SSL_CTX*)ssl_ctx);
+#endif
+  }
+
+  void S3Store::parse_url(const std::string& url) {
+    size_t scheme_end = url.find("://");
+
+    if (scheme_end == std::string::npos)
+      UMAP_ERROR("S3Store: " << url << " is not of the form http[s]://host[:port]/bucket/key");
+
+    std::string scheme = url.substr(0, scheme_end);
+
+    if (scheme == "https")
+      tls = true;
+    else if (scheme != "http")
+      UMAP_ERROR("S3Store: unsupported scheme " << scheme << " in " << url);
+
+    std::string rest = url.substr(scheme_end + 3);
+    size_t slash = rest.find('/');
+
+    if (slash == std::string::npos || slash == 0 || slash == rest.size() - 1)
+      UMAP_ERROR("S3Store: " << url << " is not of the form http[s]://host[:port]/bucket/key");
+
+    std::string host_port = rest.substr(0, slash);
+    size_t colon = host_port.rfind(':');
+
+    if (colon != std::string::npos) {
+      host = host_port.substr(0, colon);
+      port = host_port.substr(colon + 1);
+    }
+    else {
+      host = host_port;
+      port = tls ? "443" : "80";
+    }
+
+    host_header = (port == (tls ? "443" : "80")) ? host : host + ":" + port;
+    path = uri_encode(rest.substr(slash));
+  }
+
+  void S3Store::stat_object(const std::string& url) {
+    {
+      std::lock_guard<std::mutex> lock(info_mutex);
+      auto it = info_cache.find(url);
+
+      if (it != info_cache.end()) {
+        object_size = it->second.size;
+        etag = it->second.etag;
+        return;
+      }
+    }
+
+    int status = -1;
+
+    for (int attempt = 0; attempt < 4 && (status == -1 || status >= 500); attempt++) {
+      connection* c = get_connection();
+      uint64_t content_length = 0;
+
+      if (c == nullptr)
+        continue;
+
+      status = http_request(c, true, nullptr, 0, 0, &content_length, &etag);
+      if (status == -1 || !c->keep)
+        close_connection(c);
+      else
+        put_connection(c);
+
+      if (status == 200)
+        object_size = content_length;
+    }
+
+    if (status != 200)
+      UMAP_ERROR("S3Store: HEAD of " << url << " failed"
+          << (status == -1 ? std::string(", cannot reach the server") : ", HTTP " + std::to_string(status)));
+
+    std::lock_guard<std::mutex> lock(info_mutex);
+    if (info_cache.size() == max_cached_objects)
+      info_cache.clear();
+    info_cache[url] = object_info{object_size, etag};
+  }
+
+  ssize_t S3Store::read_from_store(char* buf, size_t nb, off_t off) {
+    if (off < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+
+    size_t in_object = ((size_t)off < object_size) ? std::min(nb, object_size - off) : 0;
+
+    memset(buf + in_object, 0, nb - in_object);
+
+    if (in_object == 0)
+      return nb;
+
+    if (in_object <= part_size) {
+      if (!get_range(buf, in_object, off)) {
+        errno = EIO;
+        return -1;
+      }
+      return nb;
+    }
+
+    request_parts r;
+    std::vector<part> ps = split(buf, in_object, off, &r);
+
+    r.req = nullptr;
+    r.nb = nb;
+    r.left = ps.size();
+    r.failed = false;
+
+    {
+      std::lock_guard<std::mutex> lock(parts_mutex);
+      parts.insert(parts.end(), ps.begin(), ps.end());
+    }
+    parts_cond.notify_all();
+
+    std::unique_lock<std::mutex> lock(r.mutex);
+    r.done.wait(lock, [&r] { return r.left == 0; });
+
+    if (r.failed) {
+      errno = EIO;
+      return -1;
+    }
+    return nb;
+  }
+
+  ssize_t S3Store::write_to_store(char*, size_t nb, off_t off) {
+    UMAP_ERROR("S3Store: cannot write " << nb << " bytes at " << off
+        << ", the store is read-only and its regions must not be written");
+  }
+
+  bool S3Store::read_async(char* buf, size_t nb, off_t off, StoreRequest* req) {
+    if (off < 0 || (size_t)off >= object_size)
+      return false;
+
+    size_t in_object = std::min(nb, object_size - off);
+    request_parts* r = new request_parts;
+    std::vector<part> ps = split(buf, in_object, off, r);
+
+    memset(buf + in_object, 0, nb - in_object);
+
+    r->req = req;
+    r->nb = nb;
+    r->left = ps.size();
+    r->failed = false;
+
+    {
+      std::lock_guard<std::mutex> lock(parts_mutex);
+      parts.insert(parts.end(), ps.begin(), ps.end());
+    }
+    parts_cond.notify_all();
+    return true;
+  }
+
+  std::vector<S3Store::part> S3Store::split(char* buf, size_t nb, off_t off, request_parts* parent) {
+    std::vector<part> ps;
+
+    for (size_t done = 0; done < nb; done += part_size)
+      ps.push_back(part{buf + done, std::min(part_size, nb - done), (off_t)(off + done), parent});
+    return ps;
+  }
+
+  void S3Store::part_thread( void ) {
+    while (1) {
+      part p;
+
+      {
+        std::unique_lock<std::mutex> lock(parts_mutex);
+
+        parts_cond.wait(lock, [this] { return stopping || !parts.empty(); });
+        if (parts.empty())
+          return;
+        p = parts.front();
+        parts.pop_front();
+      }
+
+      part_done(p.parent, get_range(p.buf, p.nb, p.off));
+    }
+  }
+
+  void S3Store::part_done(request_parts* r, bool ok) {
+    if (!ok)
+      r->failed = true;
+
+    //
+    // The caller of a synchronous read destroys r as soon as it sees the
+    // last part done, so it is only told so under the mutex it waits with
+    //
+    if (r->req == nullptr) {
+      std::lock_guard<std::mutex> lock(r->mutex);
+
+      if (r->left.fetch_sub(1) == 1)
+        r->done.notify_all();
+      return;
+    }
+
+    if (r->left.fetch_sub(1) != 1)
+      return;
+
+    r->req->complete(r->failed ? -1 : r->nb);
+    delete r;
+  }
+
+  //
+  // Retries what may be transient: connections that went stale while
+  // idle, failures to connect, throttling and server errors
+  //
+  bool S3Store::get_range(char* buf, size_t nb, off_t off) {
+    for (int attempt = 0; attempt < 4; attempt++) {
+      if (attempt != 0)
+        usleep(100000 << (attempt - 1));
+
+      connection* c = get_connection();
+      uint64_t content_length;
+
+      if (c == nullptr)
+        continue;
+
+      bool reused = c->reused;
+      int status = http_request(c, false, buf, nb, off, &content_length, nullptr);
+
+      if (status == -1) {
+        close_connection(c);
+
+        // The others left idle as long are likely stale as well
+        if (reused) {
+          std::lock_guard<std::mutex> lock(pool_mutex);
+
+          for (auto i : idle)
+            close_connection(i);
+          idle.clear();
+        }
+        continue;
+      }
+
+      if (c->keep)
+        put_connection(c);
+      else
+        close_connection(c);
+
+      if (status == 200 || status == 206)
+        return true;
+
+      if (status == 412) {
+        UMAP_LOG(Warning, "S3Store: " << path << " has changed since it was mapped");
+        return false;
+      }
+
+      UMAP_LOG(Warning, "S3Store: GET of " << nb << " bytes at " << off << " of " << path
+          << " returned HTTP " << status);
+
+      if (status != 429 && status < 500)
+        return false;
+    }
+    return false;
+  }
+
+  //
+  // Returns the HTTP status, or -1 if the connection failed.  The body of
+  // a successful GET goes to buf, which must receive exactly nb bytes.
+  //
+  int S3Store::http_request(connection* c, bool head, char* buf, size_t nb, off_t off
+                          , uint64_t* content_length, std::string* etag_out) {
+    std::string method = head ? "HEAD" : "GET";
+    std::string range = head ? "" : "bytes=" + std::to_string(off) + "-" + std::to_string(off + nb - 1);
+    std::string req = method + " " + path + " HTTP/1.1\r\nHost: " + host_header + "\r\n";
+
+    if (range != "")
+      req += "Range: " + range + "\r\n";
+    if (!head && etag != "")
+      req += "If-Match: " + etag + "\r\n";
+
+    if (access_key != "") {
+      char amz_date[32];
+      struct tm tm;
+      time_t now = time(nullptr);
+
+      gmtime_r(&now, &tm);
+      strftime(amz_date, sizeof(amz_date), "%Y%m%dT%H%M%SZ", &tm);
+
+      req += std::string("x-amz-content-sha256: ") + empty_sha256 + "\r\n";
+      req += std::string("x-amz-date: ") + amz_date + "\r\n";
+      if (session_token != "")
+        req += "x-amz-security-token: " + session_token + "\r\n";
+      req += "Authorization: " + sign(method, amz_date, range) + "\r\n";
+    }
+    req += "\r\n";
+
+    if (!send_all(c, req.data(), req.size()))
+      return -1;
+
+    std::string line;
+    int status;
+    bool chunked = false;
+    bool have_length = false;
+
+    if (!read_line(c, line) || line.compare(0, 5, "HTTP/") != 0)
+      return -1;
+
+    size_t sp = line.find(' ');
+    if (sp == std::string::npos || (status = atoi(line.c_str() + sp + 1)) < 100)
+      return -1;
+
+    if (line.compare(0, 8, "HTTP/1.0") == 0)
+      c->keep = false;
+
+    *content_length = 0;
+    while (1) {
+      if (!read_line(c, line))
+        return -1;
+      if (line.empty())
+        break;
+
+      size_t colon = line.find(':');
+      if (colon == std::string::npos)
+        continue;
+
+      std::string name = line.substr(0, colon);
+      std::string value = line.substr(colon + 1);
+
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      value.erase(0, value.find_first_not_of(" \t"));
+      value.erase(value.find_last_not_of(" \t") + 1);
+
+      if (name == "content-length") {
+        *content_length = strtoull(value.c_str(), nullptr, 10);
+        have_length = true;
+      }
+      else if (name == "etag" && etag_out != nullptr) {
+        *etag_out = value;
+      }
+      else if (name == "connection") {
+        std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+        if (value == "close")
+          c->keep = false;
+      }
+      else if (name == "transfer-encoding") {
+        chunked = true;
+      }
+    }
+
+    // A HEAD has no body, whatever its headers say
+    if (head)
+      return status;
+
+    if (status == 200 || status == 206) {
+      if (chunked || *content_length != nb)
+        return -1;
+      return read_body(c, buf, nb) ? status : -1;
+    }
+
+    // Error documents are skipped, or the connection is given up
+    if (chunked || !have_length) {
+      c->keep = false;
+      return status;
+    }
+    return read_body(c, nullptr, *content_length) ? status : -1;
+  }
+
+  //
+  // AWS Signature Version 4 of a request without payload
+  //
+  std::string S3Store::sign(const std::string& method, const std::string& amz_date, const std::string& range) {
+#ifdef UMAP_HAVE_OPENSSL
+    std::string date = amz_date.substr(0, 8);
+    std::string scope = date + "/" + region + "/s3/aws4_request";
+    std::string signed_headers = std::string("host") + (range != "" ? ";range" : "")
+                               + ";x-amz-content-sha256;x-amz-date"
+                               + (session_token != "" ? ";x-amz-security-token" : "");
+    std::string canonical = method + "\n" + path + "\n\n"
+                          + "host:" + host_header + "\n"
+                          + (range != "" ? "range:" + range + "\n" : "")
+                          + "x-amz-content-sha256:" + empty_sha256 + "\n"
+                          + "x-amz-date:" + amz_date + "\n"
+                          + (session_token != "" ? "x-amz-security-token:" + session_token + "\n" : "")
+                          + "\n" + signed_headers + "\n" + empty_sha256;
+    std::string to_sign = "AWS4-HMAC-SHA256\n" + amz_date + "\n" + scope + "\n" + sha256_hex(canonical);
+    std::string key = hmac_sha256("AWS4" + secret_key, date);
+
+    key = hmac_sha256(key, region);
+    key = hmac_sha256(key, "s3");
+    key = hmac_sha256(key, "aws4_request");
+
+    std::string signature = hmac_sha256(key, to_sign);
+
+    return "AWS4-HMAC-SHA256 Credential=" + access_key + "/" + scope
+         + ", SignedHeaders=" + signed_headers
+         + ", Signature=" + to_hex((const unsigned char*)signature.data(), signature.size());
+#else
+    return "";
+#endif
+  }
+
+  S3Store::connection* S3Store::get_connection( void ) {
+    {
+      std::lock_guard<std::mutex> lock(pool_mutex);
+
+      if (!idle.empty()) {
+        connection* c = idle.back();
+        idle.pop_back();
+        c->reused = true;
+        return c;
+      }
+    }
+
+    struct addrinfo hints;
+    struct addrinfo* res;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rval = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+
+    if (rval != 0) {
+      UMAP_LOG(Warning, "S3Store: cannot resolve " << host << " - " << gai_strerror(rval));
+      return nullptr;
+    }
+
+    for (struct addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+      if (fd == -1)
+        continue;
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        break;
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd == -1) {
+      UMAP_LOG(Warning, "S3Store: cannot connect to " << host << ":" << port << " - " << strerror(errno));
+      return nullptr;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    connection* c = new connection;
+
+    c->fd = fd;
+    c->ssl = nullptr;
+    c->keep = true;
+    c->reused = false;
+    c->rpos = c->rlen = 0;
+
+#ifdef UMAP_HAVE_OPENSSL
+    if (tls) {
+      SSL* ssl = SSL_new((SSL_CTX*)ssl_ctx);
+
+      SSL_set_fd(ssl, fd);
+      SSL_set_tlsext_host_name(ssl, host.c_str());
+      SSL_set1_host(ssl, host.c_str());
+      c->ssl = ssl;
+
+      if (SSL_connect(ssl) != 1) {
+        UMAP_LOG(Warning, "S3Store: TLS handshake with " << host << " failed - "
+            << ERR_error_string(ERR_get_error(), nullptr));
+        close_connection(c);
+        return nullptr;
+      }
+    }
+#endif
+
+    return c;
+  }
+
+  void S3Store::put_connection(connection* c) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    idle.push_back(c);
+  }
+
+  void S3Store::close_connection(connection* c) {
+#ifdef UMAP_HAVE_OPENSSL
+    if (c->ssl != nullptr)
+      SSL_free((SSL*)c->ssl);
+#endif
+    close(c->fd);
+    delete c;
+  }
+
+  bool S3Store::send_all(connection* c, const char* data, size_t nb) {
+#ifdef UMAP_HAVE_OPENSSL
+    if (c->ssl != nullptr) {
+      //
+      // SSL_write() cannot pass MSG_NOSIGNAL, so SIGPIPE is held back while
+      // writing, and dropped if the write raised it
+      //
+      sigset_t pipe_set, old_set;
+      struct timespec no_wait = {0, 0};
+      bool ok = true;
+
+      sigemptyset(&pipe_set);
+      sigaddset(&pipe_set, SIGPIPE);
+      pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+      while (nb && ok) {
+        int rval = SSL_write((SSL*)c->ssl, data, (int)std::min<size_t>(nb, 1 << 30));
+
+        if (rval <= 0) {
+          ok = false;
+          if (errno == EPIPE)
+            sigtimedwait(&pipe_set, nullptr, &no_wait);
+        }
+        else {
+          data += rval; nb -= rval;
+        }
+      }
+
+      pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+      return ok;
+    }
+#endif
+
+    while (nb) {
+      ssize_t rval = send(c->fd, data, nb, MSG_NOSIGNAL);
+
+      if (rval == -1 && errno == EINTR)
+        continue;
+      if (rval <= 0)
+        return false;
+      data += rval; nb -= rval;
+    }
+    return true;
+  }
+
+  ssize_t S3Store::recv_some(connection* c, char* data, size_t nb) {
+#ifdef UMAP_HAVE_OPENSSL
+    if (c->ssl != nullptr)
+      return SSL_read((SSL*)c->ssl, data, (int)std::min<size_t>(nb, 1 << 30));
+#endif
+
+    while (1) {
+      ssize_t rval = recv(c->fd, data, nb, 0);
+
+      if (rval == -1 && errno == EINTR)
+        continue;
+      return rval;
+    }
+  }
+
+  bool S3Store::read_line(connection* c, std::string& line) {
+    line.clear();
+
+    while (1) {
+      if (c->rpos == c->rlen) {
+        ssize_t rval = recv_some(c, c->rbuf, sizeof(c->rbuf));
+
+        if (rval <= 0)
+          return false;
+        c->rpos = 0;
+        c->rlen = rval;
+      }
+
+      char ch = c->rbuf[c->rpos++];
+
+      if (ch == '\n') {
+        if (!line.empty() && line.back() == '\r')
+          line.pop_back();
+        return true;
+      }
+
+      line += ch;
+      if (line.size() > sizeof(c->rbuf))
+        return false;
+    }
+  }
+
+  //
+  // Reads nb bytes of body to dst, or drops them if dst is nullptr
+  //
+  bool S3Store::read_body(connection* c, char* dst, size_t nb) {
+    size_t buffered = std::min(nb, c->rlen - c->rpos);
+
+    if (dst != nullptr)
+      memcpy(dst, c->rbuf + c->rpos, buffered);
+    c->rpos += buffered;
+    nb -= buffered;
+
+    if (dst != nullptr)
+      dst += buffered;
+
+    while (nb) {
+      char* to = (dst != nullptr) ? dst : c->rbuf;
+      size_t n = (dst != nullptr) ? nb : std::min(nb, sizeof(c->rbuf));
+      ssize_t rval = recv_some(c, to, n);
+
+      if (rval <= 0)
+        return false;
+      nb -= rval;
+      if (dst != nullptr)
+        dst += rval;
+    }
+
+    if (dst == nullptr)
+      c->rpos = c->rlen = 0;
+    return true;
+  }
+}
@@ -0,0 +1,114 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_S3_STORE_H_
+#define _UMAP_S3_STORE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "umap/store/Store.hpp"
+#include "umap/umap.h"
+
+namespace Umap {
+  //
+  // Read-only store serving an object of an S3-compatible object store in
+  // place, with HTTP range GETs.  url is of the form
+  // http[s]://host[:port]/bucket/key (path-style addressing).
+  //
+  // Requests larger than part_size are split into parts fetched by up to
+  // max_parallel threads of the store at once, each on a connection of a
+  // pool kept alive between requests.  The size and ETag of objects are
+  // cached for the process, and range GETs are made If-Match the ETag so
+  // that an object replaced while mapped is noticed.
+  //
+  // Requests are signed with AWS Signature Version 4 when credentials are
+  // given, or found in AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY and
+  // AWS_SESSION_TOKEN, and are anonymous otherwise.  The region defaults
+  // to AWS_REGION, AWS_DEFAULT_REGION, then us-east-1.  https and signing
+  // need umap to be built with OpenSSL.
+  //
+  // Bytes past the end of the object read as zeros, so a region may be
+  // rounded up to whole pages.
+  //
+  class S3Store : public Store {
+  public:
+    S3Store(std::string _url_, size_t _part_size_ = 4 * 1024 * 1024, uint64_t _max_parallel_ = 8
+          , std::string _region_ = "", std::string _access_key_ = "", std::string _secret_key_ = "");
+    ~S3Store();
+
+    ssize_t read_from_store(char* buf, size_t nb, off_t off);
+    ssize_t write_to_store(char* buf, size_t nb, off_t off);
+    bool read_async(char* buf, size_t nb, off_t off, StoreRequest* req);
+
+    size_t get_size() { return object_size; }
+
+  private:
+    struct connection;
+    struct request_parts {
+      StoreRequest* req;          // nullptr for a synchronous request
+      ssize_t nb;
+      std::atomic<uint64_t> left;
+      std::atomic<bool> failed;
+      std::mutex mutex;
+      std::condition_variable done;
+    };
+    struct part {
+      char* buf;
+      size_t nb;
+      off_t off;
+      request_parts* parent;
+    };
+
+    bool tls;
+    std::string host;
+    std::string port;
+    std::string host_header;      // Host, with the port unless the default
+    std::string path;             // URI encoded
+    std::string region;
+    std::string access_key;
+    std::string secret_key;
+    std::string session_token;
+    size_t part_size;
+    size_t object_size;
+    std::string etag;
+    void* ssl_ctx;
+
+    std::mutex pool_mutex;
+    std::vector<connection*> idle;
+
+    std::mutex parts_mutex;
+    std::condition_variable parts_cond;
+    std::deque<part> parts;
+    bool stopping;
+    std::vector<std::thread> part_threads;
+
+    void parse_url(const std::string& url);
+    void stat_object(const std::string& url);
+    std::vector<part> split(char* buf, size_t nb, off_t off, request_parts* parent);
+    void part_thread( void );
+    void part_done(request_parts* r, bool ok);
+    bool get_range(char* buf, size_t nb, off_t off);
+    int http_request(connection* c, bool head, char* buf, size_t nb, off_t off
+                   , uint64_t* content_length, std::string* etag_out);
+    std::string sign(const std::string& method, const std::string& amz_date
+                   , const std::string& range);
+
+    connection* get_connection( void );
+    void put_connection(connection* c);
+    void close_connection(connection* c);
+    bool send_all(connection* c, const char* data, size_t nb);
+    ssize_t recv_some(connection* c, char* data, size_t nb);
+    bool read_line(connection* c, std::string& line);
+    bool read_body(connection* c, char* dst, size_t nb);
+  };
+}
+#endif
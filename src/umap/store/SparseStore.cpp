@@ -9,15 +9,21 @@
 #define _GNU_SOURCE
 #endif
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <math.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <limits.h>           // PATH_MAX, IOV_MAX
+#include <numeric>            // iota()
+#include <stdio.h>            // snprintf()
 #include <atomic>
 #include <string.h>
 
@@ -39,7 +45,13 @@ namespace Umap {
       file_descriptors = new file_descriptor[num_files];
       for (int i = 0 ; i < num_files ; i++){
         file_descriptors[i].id = -1;
+        file_descriptors[i].users = 0;
+        file_descriptors[i].referenced = false;
+        file_descriptors[i].state = ABSENT; // The store directory is new
       }
+      max_open_files = 0;
+      num_open_files = 0;
+      clock_hand = 0;
       DIR *directory;
       struct dirent *ent;
       std::string metadata_file_path = root_path + "/_metadata";
@@ -60,6 +72,8 @@ namespace Umap {
           // set current capacity to be the file granularity
           metadata << std::max(file_size,rsize);
         }
+        current_capacity = std::max(file_size,rsize);
+        map_allocation_bitmap(true);
       }
     }
 
@@ -87,26 +101,210 @@ namespace Umap {
           file_descriptors = new file_descriptor[num_files];
           for (int i = 0 ; i < num_files ; i++){
             file_descriptors[i].id = -1;
+            file_descriptors[i].users = 0;
+            file_descriptors[i].referenced = false;
+            file_descriptors[i].state = UNKNOWN;
           }
+          max_open_files = 0;
+          num_open_files = 0;
+          clock_hand = 0;
+          map_allocation_bitmap(false);
         }
       }
 
       closedir(directory);
 
     }
+
+    // Open mode, composing generations
+    SparseStore::SparseStore(const std::vector<std::string>& _generations_, bool _read_only_)
+    : SparseStore(newest(_generations_), _read_only_){
+      if (alloc_bits == nullptr && _generations_.size() > 1)
+        UMAP_ERROR("SparseStore: " << root_path << " has no allocation bitmap and cannot hold a generation");
+
+      for (size_t i = _generations_.size() - 1 ; i > 0 ; i--)
+        older.push_back(new SparseStore(_generations_[i - 1], true));
+    }
+
+    const std::string& SparseStore::newest(const std::vector<std::string>& generations){
+      if (generations.empty())
+        UMAP_ERROR("SparseStore: no generation to open");
+      return generations.back();
+    }
     
 
     SparseStore::~SparseStore(){
       UMAP_LOG(Info,"SparseStore Total Reads: " << numreads);
       UMAP_LOG(Info,"SparseStore Total Writes: " << numwrites); 
+      for (auto g : older)
+        delete g;
       delete [] file_descriptors;
+      if (alloc_map != nullptr)
+        munmap(alloc_map, alloc_map_size);
+    }
+
+    static const uint64_t ALLOCATION_MAGIC = 0x554d4150414c4c43; // "UMAPALLC"
+
+    /**
+     * The bitmap is mapped shared, so that the bits set by writes reach the
+     * file without further I/O.  A bit is only set once its page has been
+     * written, so a crash may lose bits of pages in flight but never claims
+     * a page holds data that it does not.
+    **/
+    void SparseStore::map_allocation_bitmap(bool create){
+      std::string path = root_path + "/_allocated";
+      int flags = create ? (O_RDWR | O_CREAT | O_EXCL) : (read_only ? O_RDONLY : O_RDWR);
+      int fd = open(path.c_str(), flags, S_IRUSR | S_IWUSR);
+
+      alloc_bits = nullptr;
+      alloc_map = nullptr;
+      alloc_map_size = 0;
+      alloc_page_size = 0;
+
+      if (fd == -1){
+        if (create || errno != ENOENT)
+          UMAP_ERROR("SparseStore: Failed to open " << path << " - " << strerror(errno));
+        UMAP_LOG(Info, "SparseStore: " << root_path << " has no allocation bitmap, files are allocated whole");
+        return;
+      }
+
+      allocation_header h;
+      if (create){
+        h.magic = ALLOCATION_MAGIC;
+        h.page_size = aligned_size;
+        h.num_pages = num_files * (file_size / aligned_size);
+      }
+      else if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != ALLOCATION_MAGIC
+               || h.page_size == 0 || file_size % h.page_size != 0){
+        close(fd);
+        UMAP_ERROR("SparseStore: " << path << " is corrupt");
+      }
+
+      alloc_page_size = h.page_size;
+      alloc_map_size = sizeof(h) + ((h.num_pages + 63) / 64) * sizeof(uint64_t);
+
+      if (create && (ftruncate(fd, alloc_map_size) != 0 || pwrite(fd, &h, sizeof(h), 0) != sizeof(h))){
+        close(fd);
+        UMAP_ERROR("SparseStore: Failed to initialize " << path << " - " << strerror(errno));
+      }
+
+      alloc_map = mmap(NULL, alloc_map_size, read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      if (alloc_map == MAP_FAILED){
+        alloc_map = nullptr;
+        UMAP_ERROR("SparseStore: Failed to map " << path << " - " << strerror(errno));
+      }
+      alloc_bits = (uint64_t*)((char*)alloc_map + sizeof(h));
+    }
+
+    bool SparseStore::range_written(off_t off, size_t nb){
+      uint64_t first = off / alloc_page_size;
+      uint64_t last = (off + nb - 1) / alloc_page_size;
+
+      for (uint64_t p = first ; p <= last ; p++){
+        if (__atomic_load_n(&alloc_bits[p / 64], __ATOMIC_ACQUIRE) & (1ULL << (p % 64)))
+          return true;
+      }
+      return false;
+    }
+
+    bool SparseStore::range_written_whole(off_t off, size_t nb){
+      uint64_t first = off / alloc_page_size;
+      uint64_t last = (off + nb - 1) / alloc_page_size;
+
+      for (uint64_t p = first ; p <= last ; p++){
+        if (!(__atomic_load_n(&alloc_bits[p / 64], __ATOMIC_ACQUIRE) & (1ULL << (p % 64))))
+          return false;
+      }
+      return true;
+    }
+
+    /**
+     * A generation without an allocation bitmap holds every page of its
+     * capacity, those with one the pages they had written to them.
+    **/
+    bool SparseStore::holds(off_t off, size_t nb){
+      if ((uint64_t)(off + nb) > num_files * file_size)
+        return false;
+      return alloc_bits == nullptr || range_written(off, nb);
+    }
+
+    SparseStore* SparseStore::holder(off_t off, size_t nb){
+      if (holds(off, nb))
+        return this;
+      for (auto g : older){
+        if (g->holds(off, nb))
+          return g;
+      }
+      return nullptr;
+    }
+
+    /**
+     * Whether the range may be read from the files of this generation as
+     * it is, e.g. by a merged request or by umap itself
+    **/
+    bool SparseStore::read_here(off_t off, size_t nb){
+      if (alloc_bits == nullptr)
+        return true;
+      return older.empty() ? range_written(off, nb) : range_written_whole(off, nb);
+    }
+
+    /**
+     * Reads the pages at the start of the range that are held by the same
+     * generation, or by none, in which case they read as zeros
+    **/
+    ssize_t SparseStore::read_composed(char* buf, size_t nb, off_t off){
+      size_t n = std::min(nb, file_size - (size_t)(off % file_size));
+      off_t page_end = (off / alloc_page_size + 1) * alloc_page_size;
+      size_t len = std::min<size_t>(n, page_end - off);
+      SparseStore* g = holder(off, len);
+
+      while (len < n && holder(off + len, std::min<size_t>(n - len, alloc_page_size)) == g)
+        len = std::min<size_t>(n, len + alloc_page_size);
+
+      if (g == nullptr){
+        memset(buf, 0, len);
+        numreads++;
+        return len;
+      }
+      return g == this ? read_from_store(buf, len, off) : g->read_from_store(buf, len, off);
+    }
+
+    void SparseStore::mark_written(off_t off, size_t nb){
+      uint64_t first = off / alloc_page_size;
+      uint64_t last = (off + nb - 1) / alloc_page_size;
+
+      for (uint64_t p = first ; p <= last ; p++){
+        uint64_t bit = 1ULL << (p % 64);
+
+        if (!(__atomic_load_n(&alloc_bits[p / 64], __ATOMIC_RELAXED) & bit))
+          __atomic_fetch_or(&alloc_bits[p / 64], bit, __ATOMIC_RELEASE);
+      }
     }
 
     ssize_t SparseStore::read_from_store(char* buf, size_t nb, off_t off) {
       ssize_t read = 0;
       off_t file_offset;
-      int fd = get_fd(off, file_offset); 
+      uint64_t fd_index;
+
+      if (!older.empty() && nb != 0 && !range_written_whole(off, std::min(nb, file_size - (size_t)(off % file_size))))
+        return read_composed(buf, nb, off);
+
+      // Pages that were never written read as zeros, without any I/O
+      if (alloc_bits != nullptr && nb != 0){
+        size_t n = std::min(nb, file_size - (size_t)(off % file_size));
+        if (!range_written(off, n)){
+          memset(buf, 0, n);
+          numreads++;
+          return n;
+        }
+      }
+
+      int fd = acquire_fd(off, file_offset, fd_index);
+      // A request may not go past the end of the file holding its start
+      nb = std::min(nb, file_size - (size_t)file_offset);
       read = pread(fd,buf,nb,file_offset);
+      release_fd(fd_index);
       if(read == -1){
         UMAP_ERROR("pread(fd=" << fd << ", buff=" << (void*)buf <<  ", nb=" << nb << ", off=" << off << ") Failed - " << strerror(errno));
       }
@@ -117,20 +315,176 @@ namespace Umap {
     ssize_t SparseStore::write_to_store(char* buf, size_t nb, off_t off) {
       ssize_t written = 0;
       off_t file_offset;
-      int fd = get_fd(off, file_offset);
+      uint64_t fd_index;
+      int fd = acquire_fd(off, file_offset, fd_index);
+      nb = std::min(nb, file_size - (size_t)file_offset);
       written = pwrite(fd,buf,nb,file_offset);
+      release_fd(fd_index);
       if(written == -1){
         UMAP_ERROR("pwrite(fd=" << fd << ", buff=" << (void*)buf <<  ", nb=" << nb << ", off=" << off << ") Failed - " << strerror(errno));
       }
+      if (alloc_bits != nullptr && written > 0)
+        mark_written(off, written);
       numwrites++;
       return written;
     }
 
+    int SparseStore::read_batch(StoreIo* ios, size_t n) {
+      batch(false, ios, n);
+      return 0;
+    }
+
+    int SparseStore::write_batch(StoreIo* ios, size_t n) {
+      batch(true, ios, n);
+      return 0;
+    }
+
+    /**
+     * Requests that follow each other in one partition file are merged into
+     * a single preadv() or pwritev().  Those that cross into the next file,
+     * and reads of ranges that were never written, are made on their own.
+    **/
+    void SparseStore::batch(bool write, StoreIo* ios, size_t n) {
+      std::vector<size_t> order(n);
+      std::vector<struct iovec> iov;
+
+      std::iota(order.begin(), order.end(), 0);
+      std::sort(order.begin(), order.end(),
+          [ios](size_t a, size_t b) { return ios[a].off < ios[b].off; });
+
+      auto mergeable = [&](const StoreIo& io, uint64_t file) {
+        return io.nb != 0
+            && (uint64_t)io.off / file_size == file
+            && (uint64_t)(io.off + io.nb - 1) / file_size == file
+            && (write || read_here(io.off, io.nb));
+      };
+
+      for (size_t i = 0; i < n; ) {
+        StoreIo& first = ios[order[i]];
+        uint64_t file = first.off / file_size;
+
+        if (!mergeable(first, file)) {
+          first.done = write ? write_to_store(first.buf, first.nb, first.off)
+                             : read_from_store(first.buf, first.nb, first.off);
+          i++;
+          continue;
+        }
+
+        off_t end = first.off;
+        size_t j = i;
+
+        iov.clear();
+        while (j < n && j - i < IOV_MAX && ios[order[j]].off == end && mergeable(ios[order[j]], file)) {
+          iov.push_back({ios[order[j]].buf, ios[order[j]].nb});
+          end += ios[order[j]].nb;
+          j++;
+        }
+
+        off_t file_offset;
+        uint64_t fd_index;
+        int fd = acquire_fd(first.off, file_offset, fd_index);
+        ssize_t rval = write ? pwritev(fd, iov.data(), iov.size(), file_offset)
+                             : preadv(fd, iov.data(), iov.size(), file_offset);
+        release_fd(fd_index);
+        if(rval == -1){
+          UMAP_ERROR((write ? "pwritev" : "preadv") << "(fd=" << fd << ", iovcnt=" << iov.size() << ", nb=" << end - first.off << ", off=" << first.off << ") Failed - " << strerror(errno));
+        }
+        if (write){
+          if (alloc_bits != nullptr && rval > 0)
+            mark_written(first.off, rval);
+          numwrites++;
+        }
+        else {
+          numreads++;
+        }
+
+        for (; i < j; i++){
+          StoreIo& io = ios[order[i]];
+          io.done = std::min<ssize_t>(rval, io.nb);
+          rval -= io.done;
+        }
+      }
+    }
+
+    bool SparseStore::get_file_range(off_t off, size_t nb, int* _fd_, off_t* file_off){
+      if ( max_open_files != 0 || (size_t)(off % file_size) + nb > file_size )
+        return false;
+
+      // The pages held by older generations are read through read_from_store()
+      if ( !older.empty() && nb != 0 && !read_here(off, nb) )
+        return false;
+
+      uint64_t fd_index;
+      *_fd_ = acquire_fd(off, *file_off, fd_index);
+      release_fd(fd_index);
+
+      //
+      // umap may write the range without calling write_to_store(), so it
+      // is taken as written; that only costs a read of zeros if it is not
+      //
+      if (alloc_bits != nullptr && !read_only && nb != 0)
+        mark_written(off, nb);
+      return true;
+    }
+
+    /**
+     * Files are only created when first accessed, so a range held by files
+     * that do not exist yet has never been written and reads as zeros.
+    **/
+    bool SparseStore::is_zero_range(off_t off, size_t nb){
+      if (nb == 0)
+        return false;
+
+      if (!older.empty()){
+        for (off_t p = off - off % alloc_page_size ; p < (off_t)(off + nb) ; p += alloc_page_size){
+          if (holder(p, alloc_page_size) != nullptr)
+            return false;
+        }
+        return (uint64_t)(off + nb) <= num_files * file_size;
+      }
+
+      if (alloc_bits != nullptr)
+        return (uint64_t)(off + nb) <= num_files * file_size && !range_written(off, nb);
+
+      uint64_t first = off / file_size;
+      uint64_t last = (off + nb - 1) / file_size;
+
+      for (uint64_t i = first ; i <= last ; i++){
+        if (i >= num_files || file_descriptors[i].id.load() != -1 || file_exists(i))
+          return false;
+      }
+      return true;
+    }
+
+    bool SparseStore::file_exists(uint64_t fd_index){
+      if (file_descriptors[fd_index].state == UNKNOWN){
+        std::lock_guard<std::mutex> lock(creation_mutex);
+        if (file_descriptors[fd_index].state == UNKNOWN){
+          struct stat st;
+          std::string filename = root_path + "/" + std::to_string(fd_index);
+          file_descriptors[fd_index].state = (stat(filename.c_str(), &st) == 0) ? PRESENT : ABSENT;
+        }
+      }
+      return file_descriptors[fd_index].state == PRESENT;
+    }
+
     int SparseStore::close_files(){
       int return_status = 0;
+      std::lock_guard<std::mutex> lock(close_mutex);
+      if (alloc_map != nullptr && !read_only && msync(alloc_map, alloc_map_size, MS_SYNC) != 0){
+        UMAP_LOG(Warning,"SparseStore: Failed to sync the allocation bitmap - " << strerror(errno));
+        return_status = -1;
+      }
+      for (auto g : older)
+        return_status |= g->close_files();
+      for (auto& d : deferred_closes)
+        close(d.second);
+      deferred_closes.clear();
       for (int i = 0 ; i < num_files ; i++){
-        if (file_descriptors[i].id != -1){
-          int close_status = close(file_descriptors[i].id);
+        int fd = file_descriptors[i].id.exchange(-1);
+        if (fd != -1){
+          num_open_files--;
+          int close_status = close(fd);
           if (close_status != 0){
             UMAP_LOG(Warning,"SparseStore: Failed to close file with id: " << i << " - " << strerror(errno));
           }
@@ -143,6 +497,10 @@ namespace Umap {
     size_t SparseStore::get_current_capacity(){
       return current_capacity;
     }
+
+    std::string SparseStore::hot_pages_path(){
+      return root_path + "/_hot";
+    }
     
     /**
      * To get the size of any persistent region created using SparseStore without the need to instianiate an object
@@ -161,35 +519,138 @@ namespace Umap {
       return capacity;
     }
 
-    int SparseStore::get_fd(off_t offset, off_t &file_offset){
-      int fd_index = offset / file_size;
-      file_offset = offset % file_size; 
-      std::string filename = root_path + "/" + std::to_string(fd_index);
-      if ( file_descriptors[fd_index].id == -1 ){
-            creation_mutex.lock(); // Grab mutex (only in case of creating new file, rather than serializing a larger protion of the code)
-            if (file_descriptors[fd_index].id == -1){ // Recheck the value to make sure that another thread did not already create the file
-              int flags = (read_only ? O_RDONLY :  O_RDWR ) | O_CREAT | O_DIRECT | O_LARGEFILE;
-              int fd = open(filename.c_str(), flags, S_IRUSR | S_IWUSR);
-              if (fd == -1){
-                // Handling FS that do not support O_DIRECT, e.g., TMPFS
-                flags = (read_only ? O_RDONLY :  O_RDWR ) | O_CREAT | O_LARGEFILE;
-                fd = open(filename.c_str(), flags, S_IRUSR | S_IWUSR);
-                if (fd == -1){
-                   UMAP_ERROR("ERROR: Failed to open file with id: " << fd_index << " - " << strerror(errno));
-                }
-              }
-              // when successfully open file:
-              if (!read_only){
-                int fallocate_status;
-                if( (fallocate_status = posix_fallocate(fd,0,file_size) ) != 0){
-                  UMAP_ERROR("SparseStore: fallocate() failed for file with id: " << fd_index << " - " << fallocate_status);
-                }
-              }
-              // when fallocate() succeeds or when read_only
-              file_descriptors[fd_index].id = fd;
-            }
-            creation_mutex.unlock(); // Release mutex
-      }
-      return file_descriptors[fd_index].id;
+    /**
+     * The descriptor of a file that is open is found without any lock or
+     * allocation.  The caller counts as a user of the file, which is not
+     * closed by close_idle_files(), until it calls release_fd().
+    **/
+    int SparseStore::acquire_fd(off_t offset, off_t &file_offset, uint64_t &fd_index){
+      fd_index = offset / file_size;
+      file_offset = offset % file_size;
+
+      file_descriptor& d = file_descriptors[fd_index];
+      int fd;
+
+      d.users++;
+
+      while ((fd = d.id.load()) == -1){
+        int expected = -1;
+        int new_fd = open_file(fd_index);
+
+        if (d.id.compare_exchange_strong(expected, new_fd)){
+          fd = new_fd;
+          if (++num_open_files > max_open_files && max_open_files != 0)
+            close_idle_files();
+          break;
+        }
+        close(new_fd);    // Another thread opened the file first
+      }
+
+      if (!d.referenced.load(std::memory_order_relaxed))
+        d.referenced.store(true, std::memory_order_relaxed);
+      return fd;
+    }
+
+    void SparseStore::release_fd(uint64_t fd_index){
+      file_descriptors[fd_index].users--;
+    }
+
+    int SparseStore::open_file(uint64_t fd_index){
+      char filename[PATH_MAX];
+
+      snprintf(filename, sizeof(filename), "%s/%lu", root_path.c_str(), (unsigned long)fd_index);
+
+      int flags = (read_only ? O_RDONLY :  O_RDWR ) | O_CREAT | O_DIRECT | O_LARGEFILE;
+      int fd = open(filename, flags, S_IRUSR | S_IWUSR);
+      if (fd == -1){
+        // Handling FS that do not support O_DIRECT, e.g., TMPFS
+        flags = (read_only ? O_RDONLY :  O_RDWR ) | O_CREAT | O_LARGEFILE;
+        fd = open(filename, flags, S_IRUSR | S_IWUSR);
+        if (fd == -1){
+          UMAP_ERROR("ERROR: Failed to open file with id: " << fd_index << " - " << strerror(errno));
+        }
+      }
+
+      //
+      // Files are only allocated when they are first opened; threads racing
+      // to do so allocate the same space.  With an allocation bitmap they
+      // are only sized, leaving blocks to be allocated as pages are written.
+      //
+      if (file_descriptors[fd_index].state != PRESENT){
+        if (!read_only && alloc_bits != nullptr){
+          if (ftruncate(fd, file_size) != 0){
+            UMAP_ERROR("SparseStore: ftruncate() failed for file with id: " << fd_index << " - " << strerror(errno));
+          }
+        }
+        else if (!read_only){
+          int fallocate_status;
+          if( (fallocate_status = posix_fallocate(fd,0,file_size) ) != 0){
+            UMAP_ERROR("SparseStore: fallocate() failed for file with id: " << fd_index << " - " << fallocate_status);
+          }
+        }
+        std::lock_guard<std::mutex> lock(creation_mutex);
+        file_descriptors[fd_index].state = PRESENT;
+      }
+      return fd;
+    }
+
+    void SparseStore::set_max_open_files(uint64_t max_files){
+      max_open_files = max_files;
+    }
+
+    /**
+     * Closes files until no more than max_open_files are open, passing
+     * over those used since the last pass (a clock approximation of LRU).
+     * A file that a thread started to use while it was being closed keeps
+     * its descriptor until the file has no users left.  Threads that find
+     * another thread closing files go on without waiting.
+    **/
+    void SparseStore::close_idle_files(){
+      std::unique_lock<std::mutex> lock(close_mutex, std::try_to_lock);
+
+      if (!lock.owns_lock())
+        return;
+
+      for (auto it = deferred_closes.begin(); it != deferred_closes.end(); ){
+        if (file_descriptors[it->first].users.load() == 0){
+          close(it->second);
+          num_open_files--;
+          it = deferred_closes.erase(it);
+        }
+        else{
+          ++it;
+        }
+      }
+
+      for (uint64_t n = 0 ; n < 2 * num_files && num_open_files > max_open_files ; n++){
+        file_descriptor& d = file_descriptors[clock_hand];
+        uint64_t fd_index = clock_hand;
+
+        clock_hand = (clock_hand + 1) % num_files;
+
+        int fd = d.id.load();
+        if (fd == -1 || d.users.load() != 0)
+          continue;
+
+        if (d.referenced.load(std::memory_order_relaxed)){
+          d.referenced.store(false, std::memory_order_relaxed);
+          continue;
+        }
+
+        if (!d.id.compare_exchange_strong(fd, -1))
+          continue;
+
+        //
+        // A thread that counted itself as a user before the descriptor was
+        // taken away may be using it
+        //
+        if (d.users.load() != 0){
+          deferred_closes.push_back(std::make_pair(fd_index, fd));
+          continue;
+        }
+
+        close(fd);
+        num_open_files--;
+      }
     }
 }
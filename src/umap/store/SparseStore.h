@@ -7,6 +7,10 @@
 
 #include <cstdint>
 #include <atomic>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
 #include "umap/store/Store.hpp"
 #include "umap/umap.h"
 
@@ -15,10 +19,34 @@ namespace Umap {
   public:
     SparseStore(size_t _rsize_, size_t _aligned_size_, std::string _root_path_, size_t _file_Size_);
     SparseStore(std::string _root_path, bool _read_only_);
+
+    //
+    // Open mode, composing generations: the stores of _generations_, oldest
+    // first, are seen as one, each page being read from the newest
+    // generation that holds it.  Generations after the first are typically
+    // written by umap_snapshot() and only hold the pages that changed.
+    // Pages are written to the newest generation, which must have an
+    // allocation bitmap; the older ones are opened read only.
+    //
+    SparseStore(const std::vector<std::string>& _generations_, bool _read_only_);
     ~SparseStore();
     ssize_t read_from_store(char* buf, size_t nb, off_t off);
     ssize_t write_to_store(char* buf, size_t nb, off_t off);
+    bool get_file_range(off_t off, size_t nb, int* fd, off_t* file_off);
+    bool is_zero_range(off_t off, size_t nb);
+    int read_batch(StoreIo* ios, size_t n);
+    int write_batch(StoreIo* ios, size_t n);
     size_t get_current_capacity();
+    std::string hot_pages_path();
+
+    //
+    // Keeps at most max_files partition files open, closing the least
+    // recently used ones as others are opened.  0, the default, keeps every
+    // file open once it is used.  With a bound, get_file_range() returns
+    // false so that umap does not hold on to descriptors that may be
+    // closed.  Must be set before the store is used.
+    //
+    void set_max_open_files(uint64_t max_files);
     static size_t get_capacity(std::string base_path);
     int close_files();
   private:
@@ -33,14 +61,59 @@ namespace Umap {
     // reads and writes I/O counters
     std::atomic<int64_t> numreads;
     std::atomic<int64_t> numwrites;
+    enum file_state { UNKNOWN, ABSENT, PRESENT };
     struct file_descriptor{
-      int id;
+      std::atomic<int> id;
+      std::atomic<int> users;       // Threads doing I/O with id
+      std::atomic<bool> referenced; // Used since the last close_idle_files() pass
       off_t beginning;
       off_t end;
+      file_state state; // Whether the file exists, before it is opened
     };
     file_descriptor* file_descriptors; 
     std::mutex creation_mutex;
-    int get_fd(off_t offset, off_t &file_offset);
+
+    uint64_t max_open_files;
+    std::atomic<uint64_t> num_open_files;
+    std::mutex close_mutex;       // Held while closing idle files
+    uint64_t clock_hand;
+    std::vector<std::pair<uint64_t, int>> deferred_closes;
+
+    //
+    // Bitmap of the pages that have ever been written, kept in the
+    // _allocated file of the store directory.  nullptr for stores created
+    // before it existed, whose files are allocated whole when first used.
+    //
+    struct allocation_header {
+      uint64_t magic;
+      uint64_t page_size;
+      uint64_t num_pages;
+    };
+    uint64_t* alloc_bits;
+    void* alloc_map;
+    size_t alloc_map_size;
+    uint64_t alloc_page_size;
+    void map_allocation_bitmap(bool create);
+    bool range_written(off_t off, size_t nb);
+    bool range_written_whole(off_t off, size_t nb);
+    void mark_written(off_t off, size_t nb);
+
+    //
+    // The older generations, newest first, when composing generations
+    //
+    std::vector<SparseStore*> older;
+    bool holds(off_t off, size_t nb);
+    SparseStore* holder(off_t off, size_t nb);
+    bool read_here(off_t off, size_t nb);
+    ssize_t read_composed(char* buf, size_t nb, off_t off);
+    static const std::string& newest(const std::vector<std::string>& generations);
+
+    int acquire_fd(off_t offset, off_t &file_offset, uint64_t &fd_index);
+    void release_fd(uint64_t fd_index);
+    void batch(bool write, StoreIo* ios, size_t n);
+    int open_file(uint64_t fd_index);
+    void close_idle_files();
+    bool file_exists(uint64_t fd_index);
     // ssize_t get_file_size(const std::string file_path);
   };
 }
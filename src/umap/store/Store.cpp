@@ -9,8 +9,8 @@
 #include "umap/store/StoreFile.h"
 
 namespace Umap {
-  Store* Store::make_store(void* _region_, size_t _rsize_, size_t _alignsize_, int _fd_)
+  Store* Store::make_store(void* _region_, size_t _rsize_, size_t _alignsize_, int _fd_, bool _direct_)
   {
-    return new StoreFile{_region_, _rsize_, _alignsize_, _fd_};
+    return new StoreFile{_region_, _rsize_, _alignsize_, _fd_, _direct_};
   }
 }
@@ -7,15 +7,106 @@
 #ifndef _UMAP_STORE_H_
 #define _UMAP_STORE_H_
 #include <cstdint>
+#include <string>
 #include <unistd.h>
 
 namespace Umap {
+//
+// One request of a batch, see Store::read_batch()
+//
+struct StoreIo {
+  char* buf;
+  std::size_t nb;
+  off_t off;
+  ssize_t done;     // What read_from_store() or write_to_store() would return
+};
+
+//
+// Completion of an asynchronous request, see Store::read_async()
+//
+class StoreRequest {
+  public:
+    virtual ~StoreRequest() {}
+    virtual void complete(ssize_t done) = 0;
+};
+
 class Store {
   public:
-    static Store* make_store(void* _region_, std::size_t _rsize_, std::size_t _alignsize_, int _fd_);
+    static Store* make_store(void* _region_, std::size_t _rsize_, std::size_t _alignsize_, int _fd_, bool _direct_ = false);
+
+    virtual ~Store() {}
 
     virtual ssize_t read_from_store(char* buf, std::size_t nb, off_t off) = 0;
     virtual ssize_t  write_to_store(char* buf, std::size_t nb, off_t off) = 0;
+
+    //
+    // Stores that keep their data in files may let umap access them
+    // directly, e.g. for asynchronous I/O.  Returns false (the default) if
+    // the nb bytes at off are not held contiguously by a single file.
+    //
+    virtual bool get_file_range(off_t /*off*/, std::size_t /*nb*/, int* /*fd*/, off_t* /*file_off*/) { return false; }
+
+    //
+    // Returns true if the nb bytes at off are known to read as zeros
+    // without having to read them, e.g. because they were never written.
+    // umap then fills the pages without any I/O.
+    //
+    virtual bool is_zero_range(off_t /*off*/, std::size_t /*nb*/) { return false; }
+
+    //
+    // Called with the nb bytes at off of pages that are about to leave the
+    // Buffer, after any dirty ones among them were written back.  Stores
+    // that cache pages may keep a copy; the default ignores them.
+    //
+    virtual void page_evicted(const char* /*buf*/, std::size_t /*nb*/, off_t /*off*/) {}
+
+    //
+    // Where the list of the pages in the Buffer when a region of the store
+    // is unmapped is kept with UMAP_WARM_RESTART, for the next region of the
+    // store to prefetch them.  Empty, the default, for stores that have no
+    // such place.
+    //
+    virtual std::string hot_pages_path() { return ""; }
+
+    //
+    // Carry out the n requests of a batch, which may be in any order, and
+    // set their done.  Returns -1 if any of them failed, 0 otherwise.
+    // Stores may override these to merge requests, e.g. those adjacent in
+    // a file into a single preadv(); the defaults make one call each.
+    //
+    virtual int read_batch(StoreIo* ios, std::size_t n) {
+      int rval = 0;
+
+      for (std::size_t i = 0; i < n; i++) {
+        ios[i].done = read_from_store(ios[i].buf, ios[i].nb, ios[i].off);
+        if (ios[i].done == -1)
+          rval = -1;
+      }
+      return rval;
+    }
+
+    virtual int write_batch(StoreIo* ios, std::size_t n) {
+      int rval = 0;
+
+      for (std::size_t i = 0; i < n; i++) {
+        ios[i].done = write_to_store(ios[i].buf, ios[i].nb, ios[i].off);
+        if (ios[i].done == -1)
+          rval = -1;
+      }
+      return rval;
+    }
+
+    //
+    // Stores with a high latency per request, e.g. over a network, may
+    // start requests without blocking, so that a few workers keep many of
+    // them in flight.  They return true once the request is started, and
+    // later call req->complete(), once and from any thread, with what
+    // read_from_store() or write_to_store() would have returned.  Until
+    // then buf must be left alone.  Returning false, as the defaults do,
+    // makes umap use the synchronous calls instead.
+    //
+    virtual bool read_async(char* /*buf*/, std::size_t /*nb*/, off_t /*off*/, StoreRequest* /*req*/) { return false; }
+    virtual bool write_async(char* /*buf*/, std::size_t /*nb*/, off_t /*off*/, StoreRequest* /*req*/) { return false; }
 };
 } // end of namespace Umap
 #endif
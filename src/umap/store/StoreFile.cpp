@@ -7,26 +7,104 @@
 #include <unistd.h>
 #include <stdio.h>
 #include "StoreFile.h"
+#include <algorithm>
+#include <fcntl.h>
 #include <iostream>
+#include <limits.h>             // IOV_MAX
+#include <numeric>              // iota()
 #include <sstream>
+#include <stdlib.h>             // posix_memalign()
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <vector>
 
 #include "umap/store/Store.hpp"
 #include "umap/util/Macros.hpp"
 
 namespace Umap {
-  StoreFile::StoreFile(void* _region_, size_t _rsize_, size_t _alignsize_, int _fd_)
+  StoreFile::StoreFile(void* _region_, size_t _rsize_, size_t _alignsize_, int _fd_, bool _direct_)
     : region{_region_}, rsize{_rsize_}, alignsize{_alignsize_}, fd{_fd_}
+    , direct_fd{-1}, mem_align{4096}, off_align{4096}, bounce_size{0}, file_end{0}
   {
+    if (_direct_) {
+      //
+      // Reopening the file, rather than setting O_DIRECT on fd, leaves the
+      // descriptor of the application as it is
+      //
+      std::stringstream path;
+      int flags = fcntl(fd, F_GETFL);
+
+      path << "/proc/self/fd/" << fd;
+      if (flags != -1)
+        direct_fd = open(path.str().c_str(), (flags & O_ACCMODE) | O_DIRECT | O_CLOEXEC);
+
+      if (direct_fd == -1) {
+        UMAP_LOG(Warning, "O_DIRECT is not available for fd " << fd << " - " << strerror(errno)
+            << ", using the page cache");
+      }
+      else {
+#if defined(STATX_DIOALIGN)
+        struct statx stx;
+
+        if (statx(direct_fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0
+            && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_mem_align && stx.stx_dio_offset_align) {
+          mem_align = stx.stx_dio_mem_align;
+          off_align = stx.stx_dio_offset_align;
+        }
+#endif
+        bounce_size = std::max<size_t>(alignsize, 64 * 1024);
+        bounce_size = (bounce_size + off_align - 1) / off_align * off_align;
+
+        struct stat st;
+
+        if (fstat(direct_fd, &st) == 0)
+          file_end = st.st_size;
+      }
+    }
+
     UMAP_LOG(Debug,
         "region: " << region << " rsize: " << rsize
-        << " alignsize: " << alignsize << " fd: " << fd);
+        << " alignsize: " << alignsize << " fd: " << fd << " direct_fd: " << direct_fd
+        << " mem_align: " << mem_align << " off_align: " << off_align);
+  }
+
+  StoreFile::~StoreFile()
+  {
+    for (auto b : bounce_pool)
+      free(b);
+    if (direct_fd != -1)
+      close(direct_fd);
+  }
+
+  //
+  // umap reads and writes whole pages of the region, so in direct mode the
+  // file may be accessed asynchronously as long as pages are aligned as the
+  // file system requires, and do not extend the file
+  //
+  bool StoreFile::get_file_range(off_t off, size_t nb, int* _fd_, off_t* file_off)
+  {
+    if (direct_fd != -1) {
+      if (off % off_align != 0 || nb % off_align != 0 || alignsize % mem_align != 0)
+        return false;
+      if (off + (off_t)nb > file_end)
+        return false;
+      *_fd_ = direct_fd;
+    }
+    else {
+      *_fd_ = fd;
+    }
+    *file_off = off;
+    return true;
   }
 
   ssize_t StoreFile::read_from_store(char* buf, size_t nb, off_t off)
   {
     size_t rval = 0;
 
+    if (direct_fd != -1)
+      return direct_read(buf, nb, off);
+
     UMAP_LOG(Debug, "pread(fd=" << fd << ", buf=" << (void*)buf
                     << ", nb=" << nb << ", off=" << off << ")";);
 
@@ -45,6 +123,9 @@ namespace Umap {
   {
     size_t rval = 0;
 
+    if (direct_fd != -1)
+      return direct_write(buf, nb, off);
+
     UMAP_LOG(Debug, "pwrite(fd=" << fd << ", buf=" << (void*)buf
                     << ", nb=" << nb << ", off=" << off << ")";);
 
@@ -57,4 +138,280 @@ namespace Umap {
     }
     return rval;
   }
+
+  int StoreFile::read_batch(StoreIo* ios, size_t n)
+  {
+    batch(false, ios, n);
+    return 0;
+  }
+
+  int StoreFile::write_batch(StoreIo* ios, size_t n)
+  {
+    batch(true, ios, n);
+    return 0;
+  }
+
+  //
+  // Requests that follow each other in the file are merged into a single
+  // preadv() or pwritev() of up to IOV_MAX buffers
+  //
+  void StoreFile::batch(bool write, StoreIo* ios, size_t n)
+  {
+    std::vector<size_t> order(n);
+    std::vector<struct iovec> iov;
+    int bfd = direct_fd != -1 ? direct_fd : fd;
+
+    if (direct_fd != -1) {
+      for (size_t i = 0; i < n; i++) {
+        if (!is_aligned(ios[i].buf, ios[i].nb, ios[i].off)) {
+          for (size_t j = 0; j < n; j++)
+            ios[j].done = write ? direct_write(ios[j].buf, ios[j].nb, ios[j].off)
+                                : direct_read(ios[j].buf, ios[j].nb, ios[j].off);
+          return;
+        }
+      }
+    }
+
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(),
+        [ios](size_t a, size_t b) { return ios[a].off < ios[b].off; });
+
+    for (size_t i = 0; i < n; ) {
+      off_t off = ios[order[i]].off;
+      off_t end = off;
+      size_t j = i;
+
+      iov.clear();
+      while (j < n && j - i < IOV_MAX && ios[order[j]].off == end) {
+        iov.push_back({ios[order[j]].buf, ios[order[j]].nb});
+        end += ios[order[j]].nb;
+        j++;
+      }
+
+      UMAP_LOG(Debug, (write ? "pwritev" : "preadv") << "(fd=" << bfd << ", iovcnt=" << iov.size()
+                      << ", nb=" << end - off << ", off=" << off << ")");
+
+      ssize_t rval = write ? pwritev(bfd, iov.data(), iov.size(), off)
+                           : preadv(bfd, iov.data(), iov.size(), off);
+
+      if (rval == -1) {
+        int eno = errno;
+        UMAP_ERROR((write ? "pwritev" : "preadv") << "(fd=" << bfd << ", iovcnt=" << iov.size()
+                        << ", nb=" << end - off << ", off=" << off
+                        << "): Failed - " << strerror(eno));
+      }
+
+      // A short transfer, e.g. at the end of the file, ends in some request
+      for (; i < j; i++) {
+        StoreIo& io = ios[order[i]];
+
+        io.done = std::min<ssize_t>(rval, io.nb);
+        rval -= io.done;
+      }
+    }
+  }
+
+  bool StoreFile::is_aligned(const char* buf, size_t nb, off_t off)
+  {
+    return (uintptr_t)buf % mem_align == 0 && nb % off_align == 0 && off % off_align == 0;
+  }
+
+  //
+  // pread() of direct_fd that is only short at the end of the file
+  //
+  ssize_t StoreFile::direct_pread(char* buf, size_t nb, off_t off)
+  {
+    size_t done = 0;
+
+    while (done < nb) {
+      ssize_t rval = pread(direct_fd, buf + done, nb - done, off + done);
+
+      if (rval == -1 && errno == EINTR)
+        continue;
+      if (rval == -1) {
+        int eno = errno;
+        UMAP_ERROR("pread(fd=" << direct_fd << ", buf=" << (void*)(buf + done)
+                        << ", nb=" << nb - done << ", off=" << off + done
+                        << "): Failed - " << strerror(eno));
+      }
+      if (rval == 0)
+        break;
+      done += rval;
+    }
+    return done;
+  }
+
+  //
+  // Aligned runs are read in place, the rest one bounce buffer at a time
+  //
+  ssize_t StoreFile::direct_read(char* buf, size_t nb, off_t off)
+  {
+    size_t done = 0;
+
+    while (done < nb) {
+      char* dst = buf + done;
+      off_t pos = off + done;
+      size_t left = nb - done;
+
+      if ((uintptr_t)dst % mem_align == 0 && pos % off_align == 0 && left >= off_align) {
+        size_t len = left / off_align * off_align;
+        ssize_t rval = direct_pread(dst, len, pos);
+
+        done += rval;
+        if ((size_t)rval < len)
+          break;
+        continue;
+      }
+
+      //
+      // A misaligned buffer goes through the bounce buffer altogether, an
+      // unaligned head or tail a block at a time
+      //
+      off_t blk = pos / off_align * off_align;
+      size_t len = (uintptr_t)dst % mem_align == 0 ? off_align : bounce_size;
+      size_t end = (pos + left + off_align - 1) / off_align * off_align;
+      char* b = get_bounce();
+
+      len = std::min<size_t>(len, end - blk);
+
+      ssize_t rval = direct_pread(b, len, blk);
+      size_t n = 0;
+
+      if (rval > pos - blk)
+        n = std::min<size_t>(rval - (pos - blk), left);
+      memcpy(dst, b + (pos - blk), n);
+      put_bounce(b);
+
+      done += n;
+      if ((size_t)rval < len)
+        break;
+    }
+    return done;
+  }
+
+  ssize_t StoreFile::direct_write(char* buf, size_t nb, off_t off)
+  {
+    if (!is_aligned(buf, nb, off))
+      return bounce_write(buf, nb, off);
+
+    //
+    // A write extending the file must not land while a bounce write cuts
+    // the file back
+    //
+    std::unique_lock<std::mutex> lock(rmw_mutex, std::defer_lock);
+    off_t end = off + nb;
+
+    if (end > file_end)
+      lock.lock();
+
+    size_t done = 0;
+
+    while (done < nb) {
+      ssize_t rval = pwrite(direct_fd, buf + done, nb - done, off + done);
+
+      if (rval == -1 && errno == EINTR)
+        continue;
+      if (rval == -1) {
+        int eno = errno;
+        UMAP_ERROR("pwrite(fd=" << direct_fd << ", buf=" << (void*)(buf + done)
+                        << ", nb=" << nb - done << ", off=" << off + done
+                        << "): Failed - " << strerror(eno));
+      }
+      done += rval;
+    }
+
+    if (lock.owns_lock() && end > file_end)
+      file_end = end;
+    return done;
+  }
+
+  //
+  // The blocks covering an unaligned write are read, updated and written
+  // back whole.  Blocks written past the end of the file are cut back once
+  // written, so that the file does not grow by more than was written,
+  // unless the file was extended past them meanwhile, e.g. by whoever else
+  // has it open.
+  //
+  ssize_t StoreFile::bounce_write(char* buf, size_t nb, off_t off)
+  {
+    std::lock_guard<std::mutex> lock(rmw_mutex);
+    struct stat st;
+    size_t done = 0;
+    char* b = get_bounce();
+
+    if (fstat(direct_fd, &st) == -1) {
+      int eno = errno;
+      put_bounce(b);
+      UMAP_ERROR("fstat(fd=" << direct_fd << "): Failed - " << strerror(eno));
+    }
+
+    while (done < nb) {
+      off_t pos = off + done;
+      off_t blk = pos / off_align * off_align;
+      size_t n = std::min<size_t>(nb - done, bounce_size - (pos - blk));
+      size_t len = (pos - blk + n + off_align - 1) / off_align * off_align;
+
+      if (pos != blk || n != len) {
+        ssize_t rval = direct_pread(b, len, blk);
+        memset(b + rval, 0, len - rval);
+      }
+      memcpy(b + (pos - blk), buf + done, n);
+
+      for (size_t w = 0; w < len; ) {
+        ssize_t rval = pwrite(direct_fd, b + w, len - w, blk + w);
+
+        if (rval == -1 && errno == EINTR)
+          continue;
+        if (rval == -1) {
+          int eno = errno;
+          put_bounce(b);
+          UMAP_ERROR("pwrite(fd=" << direct_fd << ", nb=" << len - w << ", off=" << blk + w
+                          << "): Failed - " << strerror(eno));
+        }
+        w += rval;
+      }
+      done += n;
+    }
+    put_bounce(b);
+
+    off_t size = std::max<off_t>(std::max<off_t>(st.st_size, file_end), off + nb);
+    off_t written_end = (off + nb + off_align - 1) / off_align * off_align;
+
+    if (written_end > size) {
+      if (fstat(direct_fd, &st) == -1) {
+        int eno = errno;
+        UMAP_ERROR("fstat(fd=" << direct_fd << "): Failed - " << strerror(eno));
+      }
+      if (st.st_size == written_end && ftruncate(direct_fd, size) == -1)
+        UMAP_LOG(Warning, "ftruncate(fd=" << direct_fd << ", " << size << "): Failed - " << strerror(errno));
+    }
+    if (size > file_end)
+      file_end = size;
+    return nb;
+  }
+
+  char* StoreFile::get_bounce( void )
+  {
+    {
+      std::lock_guard<std::mutex> lock(bounce_mutex);
+
+      if (!bounce_pool.empty()) {
+        char* b = bounce_pool.back();
+        bounce_pool.pop_back();
+        return b;
+      }
+    }
+
+    char* b;
+
+    if (posix_memalign((void**)&b, std::max<size_t>(mem_align, 4096), bounce_size))
+      UMAP_ERROR("posix_memalign failed to allocate " << bounce_size << " bytes");
+    return b;
+  }
+
+  void StoreFile::put_bounce(char* b)
+  {
+    std::lock_guard<std::mutex> lock(bounce_mutex);
+    bounce_pool.push_back(b);
+  }
 }
@@ -6,23 +6,61 @@
 //////////////////////////////////////////////////////////////////////////////
 #ifndef _UMAP_STORE_FILE_H_
 #define _UMAP_STORE_FILE_H_
+#include <atomic>
 #include <cstdint>
+#include <mutex>
+#include <vector>
 #include "umap/store/Store.hpp"
 #include "umap/umap.h"
 
 namespace Umap {
+  //
+  // Store of a region mapping the file of fd.
+  //
+  // With direct set, the file is also opened with O_DIRECT and transfers
+  // bypass the page cache.  Spans aligned as the file system requires go
+  // straight to the device, while the unaligned head and tail of a span go
+  // through aligned bounce buffers of a pool, written back with a
+  // read-modify-write of the blocks they cover.  Files that cannot be
+  // opened with O_DIRECT, e.g. on tmpfs, are read through the page cache.
+  //
+  // A bounce write past the end of the file cuts back the blocks it wrote
+  // past what it was given, so writes that extend the file all take
+  // rmw_mutex, and get_file_range() only hands out ranges within it.
+  //
   class StoreFile : public Store {
     public:
-      StoreFile(void* _region_, size_t _rsize_, size_t _alignsize_, int _fd_);
+      StoreFile(void* _region_, size_t _rsize_, size_t _alignsize_, int _fd_, bool _direct_ = false);
+      ~StoreFile();
 
       ssize_t read_from_store(char* buf, size_t nb, off_t off);
       ssize_t  write_to_store(char* buf, size_t nb, off_t off);
+      bool get_file_range(off_t off, size_t nb, int* fd, off_t* file_off);
+      int read_batch(StoreIo* ios, size_t n);
+      int write_batch(StoreIo* ios, size_t n);
     private:
       void* region;
-      void* alignment_buffer;
       size_t rsize;
       size_t alignsize;
       int fd;
+
+      int direct_fd;            // -1 unless in direct mode
+      size_t mem_align;         // Of buffers, for direct_fd
+      size_t off_align;         // Of file offsets and lengths, for direct_fd
+      size_t bounce_size;
+      std::mutex bounce_mutex;
+      std::vector<char*> bounce_pool;
+      std::mutex rmw_mutex;     // Serializes read-modify-writes of blocks, and extensions
+      std::atomic<off_t> file_end; // Grows under rmw_mutex only, for direct_fd
+
+      void batch(bool write, StoreIo* ios, size_t n);
+      bool is_aligned(const char* buf, size_t nb, off_t off);
+      ssize_t direct_read(char* buf, size_t nb, off_t off);
+      ssize_t direct_write(char* buf, size_t nb, off_t off);
+      ssize_t bounce_write(char* buf, size_t nb, off_t off);
+      ssize_t direct_pread(char* buf, size_t nb, off_t off);
+      char* get_bounce( void );
+      void put_bounce(char* b);
   };
 }
 #endif
@@ -0,0 +1,360 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include "umap/config.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>             // posix_memalign()
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef UMAP_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <umap/store/TieredStore.h>
+#include <umap/util/Macros.hpp>
+
+namespace Umap {
+  TieredStore::TieredStore(Store* _backend_, size_t _page_size_, size_t _mem_bytes_
+                         , std::string _file_path_, size_t _file_bytes_
+                         , WritePolicy _policy_, bool _compress_)
+    : backend{_backend_}, page_size{_page_size_}, mem_bytes{_mem_bytes_}
+    , file_path{_file_path_}, file_slots{0}, policy{_policy_}, compress{_compress_}, fd{-1}
+    , mem_used{0}, hits{0}, misses{0}
+  {
+    if (backend == nullptr || page_size == 0)
+      UMAP_ERROR("TieredStore: a backend and a page size are needed");
+
+#ifndef UMAP_HAVE_ZLIB
+    if (compress) {
+      UMAP_LOG(Warning, "TieredStore: umap was built without zlib, the memory tier is not compressed");
+      compress = false;
+    }
+#endif
+
+    if (file_path != "" && _file_bytes_ >= page_size) {
+      fd = open(file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR);
+      if (fd == -1)
+        UMAP_ERROR("TieredStore: Failed to open " << file_path << " - " << strerror(errno));
+
+      // The file only lives as long as the store
+      unlink(file_path.c_str());
+
+      file_slots = _file_bytes_ / page_size;
+      for (uint64_t s = file_slots; s > 0; s--)
+        free_slots.push_back(s - 1);
+    }
+
+    if (posix_memalign((void**)&demote_buf, std::max<size_t>(page_size, 4096), page_size))
+      UMAP_ERROR("TieredStore: posix_memalign failed to allocate " << page_size << " bytes");
+
+    UMAP_LOG(Debug, "page_size: " << page_size << " mem_bytes: " << mem_bytes
+        << " file_slots: " << file_slots << " policy: " << (policy == WRITE_BACK ? "write-back" : "write-through"));
+  }
+
+  TieredStore::~TieredStore() {
+    flush();
+
+    UMAP_LOG(Info, "TieredStore Hits: " << hits);
+    UMAP_LOG(Info, "TieredStore Misses: " << misses);
+
+    if (fd != -1)
+      close(fd);
+    free(demote_buf);
+  }
+
+  void TieredStore::check_range(size_t nb, off_t off) {
+    if (off % page_size != 0 || nb % page_size != 0)
+      UMAP_ERROR("TieredStore: " << nb << " bytes at " << off
+          << " is not a range of whole pages of " << page_size << " bytes");
+  }
+
+  ssize_t TieredStore::read_from_store(char* buf, size_t nb, off_t off) {
+    size_t run = 0;       // Length of the run of misses ending at done
+    size_t done = 0;
+
+    check_range(nb, off);
+
+    //
+    // Runs of pages that are not in the tiers are read from the backend
+    // with one request
+    //
+    while (done <= nb) {
+      bool hit = false;
+
+      if (done < nb) {
+        std::lock_guard<std::mutex> lock(mutex);
+        hit = lookup((off + done) / page_size, buf + done);
+      }
+
+      if ((hit || done == nb) && run != 0) {
+        size_t pos = done - run;
+
+        while (pos < done) {
+          ssize_t rval = backend->read_from_store(buf + pos, done - pos, off + pos);
+
+          if (rval == -1)
+            return -1;
+          if (rval == 0) {
+            memset(buf + pos, 0, done - pos);
+            break;
+          }
+          pos += rval;
+        }
+        run = 0;
+      }
+
+      if (done == nb)
+        break;
+
+      if (hit) {
+        hits++;
+      }
+      else {
+        misses++;
+        run += page_size;
+      }
+      done += page_size;
+    }
+
+    return nb;
+  }
+
+  ssize_t TieredStore::write_to_store(char* buf, size_t nb, off_t off) {
+    check_range(nb, off);
+
+    if (policy == WRITE_BACK && (mem_bytes != 0 || fd != -1)) {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      for (size_t done = 0; done < nb; done += page_size)
+        insert((off + done) / page_size, buf + done, true);
+      return nb;
+    }
+
+    return backend->write_to_store(buf, nb, off);
+  }
+
+  bool TieredStore::is_zero_range(off_t off, size_t nb) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      for (uint64_t u = off / page_size; u * page_size < off + nb; u++)
+        if (entries.find(u) != entries.end())
+          return false;
+    }
+
+    return backend->is_zero_range(off, nb);
+  }
+
+  void TieredStore::page_evicted(const char* buf, size_t nb, off_t off) {
+    if (mem_bytes == 0 && fd == -1)
+      return;
+
+    check_range(nb, off);
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (size_t done = 0; done < nb; done += page_size)
+      insert((off + done) / page_size, buf + done, false);
+  }
+
+  int TieredStore::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto& it : entries) {
+      if (it.second.dirty) {
+        load(it.second, demote_buf);
+        write_back(it.first, demote_buf);
+        it.second.dirty = false;
+      }
+    }
+    return 0;
+  }
+
+  //
+  // The remaining functions are called with the mutex held
+  //
+
+  //
+  // A page that is in the tiers already, e.g. one that was written back
+  // with WRITE_BACK, stays dirty
+  //
+  void TieredStore::insert(uint64_t unit, const char* src, bool dirty) {
+    auto it = entries.find(unit);
+
+    if (it != entries.end()) {
+      dirty = dirty || it->second.dirty;
+      remove(unit, it->second);
+    }
+
+    entry& e = entries[unit];
+
+    e.where = MEM;
+    e.dirty = dirty;
+    e.compressed = false;
+
+#ifdef UMAP_HAVE_ZLIB
+    if (compress) {
+      uLongf clen = compressBound(page_size);
+
+      e.data.resize(clen);
+      if (compress2((Bytef*)e.data.data(), &clen, (const Bytef*)src, page_size, Z_BEST_SPEED) == Z_OK
+          && clen < page_size) {
+        e.data.resize(clen);
+        e.data.shrink_to_fit();
+        e.compressed = true;
+      }
+    }
+#endif
+
+    if (!e.compressed)
+      e.data.assign(src, src + page_size);
+
+    mem_used += e.data.size();
+    mem_lru.push_front(unit);
+    e.lru = mem_lru.begin();
+
+    make_room();
+  }
+
+  //
+  // Pages that are clean leave the tiers once they are read
+  //
+  bool TieredStore::lookup(uint64_t unit, char* dst) {
+    auto it = entries.find(unit);
+
+    if (it == entries.end())
+      return false;
+
+    entry& e = it->second;
+
+    load(e, dst);
+
+    if (!e.dirty) {
+      remove(unit, e);
+    }
+    else if (e.where == MEM) {
+      mem_lru.splice(mem_lru.begin(), mem_lru, e.lru);
+    }
+    else {
+      file_lru.splice(file_lru.begin(), file_lru, e.lru);
+    }
+    return true;
+  }
+
+  void TieredStore::load(entry& e, char* dst) {
+    if (e.where == FILE) {
+      size_t done = 0;
+
+      while (done < page_size) {
+        ssize_t rval = pread(fd, dst + done, page_size - done, e.slot * page_size + done);
+
+        if (rval == -1 && errno == EINTR)
+          continue;
+        if (rval <= 0)
+          UMAP_ERROR("TieredStore: pread of " << file_path << " failed - "
+              << (rval == 0 ? "unexpected end of file" : strerror(errno)));
+        done += rval;
+      }
+      return;
+    }
+
+#ifdef UMAP_HAVE_ZLIB
+    if (e.compressed) {
+      uLongf len = page_size;
+
+      if (uncompress((Bytef*)dst, &len, (const Bytef*)e.data.data(), e.data.size()) != Z_OK || len != page_size)
+        UMAP_ERROR("TieredStore: failed to decompress a page");
+      return;
+    }
+#endif
+
+    memcpy(dst, e.data.data(), page_size);
+  }
+
+  void TieredStore::remove(uint64_t unit, entry& e) {
+    if (e.where == MEM) {
+      mem_used -= e.data.size();
+      mem_lru.erase(e.lru);
+    }
+    else {
+      free_slots.push_back(e.slot);
+      file_lru.erase(e.lru);
+    }
+    entries.erase(unit);
+  }
+
+  //
+  // Moves the least recently used pages of the memory tier to the file
+  // tier, and those of the file tier out of the cache
+  //
+  void TieredStore::make_room( void ) {
+    while (mem_used > mem_bytes && !mem_lru.empty()) {
+      uint64_t unit = mem_lru.back();
+      entry& e = entries[unit];
+
+      if (fd == -1) {
+        drop(unit, e);
+        continue;
+      }
+
+      if (free_slots.empty()) {
+        uint64_t victim = file_lru.back();
+        drop(victim, entries[victim]);
+      }
+
+      uint64_t slot = free_slots.back();
+      size_t done = 0;
+
+      load(e, demote_buf);
+
+      while (done < page_size) {
+        ssize_t rval = pwrite(fd, demote_buf + done, page_size - done, slot * page_size + done);
+
+        if (rval == -1 && errno == EINTR)
+          continue;
+        if (rval == -1)
+          UMAP_ERROR("TieredStore: pwrite of " << file_path << " failed - " << strerror(errno));
+        done += rval;
+      }
+
+      free_slots.pop_back();
+      mem_used -= e.data.size();
+      std::vector<char>().swap(e.data);
+      mem_lru.pop_back();
+
+      e.where = FILE;
+      e.slot = slot;
+      e.compressed = false;
+      file_lru.push_front(unit);
+      e.lru = file_lru.begin();
+    }
+  }
+
+  void TieredStore::drop(uint64_t unit, entry& e) {
+    if (e.dirty) {
+      load(e, demote_buf);
+      write_back(unit, demote_buf);
+    }
+    remove(unit, e);
+  }
+
+  void TieredStore::write_back(uint64_t unit, const char* src) {
+    size_t done = 0;
+
+    while (done < page_size) {
+      ssize_t rval = backend->write_to_store((char*)src + done, page_size - done, unit * page_size + done);
+
+      if (rval <= 0)
+        UMAP_ERROR("TieredStore: write of page " << unit << " to the backend failed");
+      done += rval;
+    }
+  }
+}
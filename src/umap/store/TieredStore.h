@@ -0,0 +1,101 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_TIERED_STORE_H_
+#define _UMAP_TIERED_STORE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "umap/store/Store.hpp"
+#include "umap/umap.h"
+
+namespace Umap {
+  //
+  // Store that puts a victim cache in front of another, slower, store.
+  // Pages that leave the Buffer are kept in a memory tier of mem_bytes
+  // bytes, optionally compressed, and pages pushed out of it go to a tier
+  // of file_bytes bytes in a local file, e.g. on NVMe, if a path is given.
+  // A page faulted again is read from the tiers before falling through to
+  // the backend, and leaves them as it goes back into the Buffer.
+  //
+  // With WRITE_THROUGH, dirty pages are written to the backend right away.
+  // With WRITE_BACK, they are kept in the tiers and only written to the
+  // backend once they are pushed out of the last tier, or by flush().
+  // The destructor flushes, but does not delete the backend.
+  //
+  // The cache works in units of page_size bytes, which must divide the
+  // page size of the regions using the store.
+  //
+  class TieredStore : public Store {
+  public:
+    enum WritePolicy { WRITE_THROUGH, WRITE_BACK };
+
+    TieredStore(Store* _backend_, size_t _page_size_, size_t _mem_bytes_
+              , std::string _file_path_ = "", size_t _file_bytes_ = 0
+              , WritePolicy _policy_ = WRITE_THROUGH, bool _compress_ = false);
+    ~TieredStore();
+
+    ssize_t read_from_store(char* buf, size_t nb, off_t off);
+    ssize_t write_to_store(char* buf, size_t nb, off_t off);
+    bool is_zero_range(off_t off, size_t nb);
+    void page_evicted(const char* buf, size_t nb, off_t off);
+
+    //
+    // Writes the dirty pages held by the tiers to the backend
+    //
+    int flush();
+
+    uint64_t get_hits() { return hits; }
+    uint64_t get_misses() { return misses; }
+
+  private:
+    enum tier { MEM, FILE };
+    struct entry {
+      tier where;
+      bool dirty;
+      bool compressed;
+      std::vector<char> data;     // MEM
+      uint64_t slot;              // FILE
+      std::list<uint64_t>::iterator lru;
+    };
+
+    Store* backend;
+    size_t page_size;
+    size_t mem_bytes;
+    std::string file_path;
+    uint64_t file_slots;
+    WritePolicy policy;
+    bool compress;
+    int fd;
+
+    // Protects everything below, including the I/O of the file tier
+    std::mutex mutex;
+    std::unordered_map<uint64_t, entry> entries;
+    std::list<uint64_t> mem_lru;     // Most recently used first
+    std::list<uint64_t> file_lru;
+    size_t mem_used;
+    std::vector<uint64_t> free_slots;
+    char* demote_buf;               // Aligned for backends using O_DIRECT
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+
+    void check_range(size_t nb, off_t off);
+    void insert(uint64_t unit, const char* src, bool dirty);
+    bool lookup(uint64_t unit, char* dst);
+    void load(entry& e, char* dst);
+    void remove(uint64_t unit, entry& e);
+    void make_room( void );
+    void drop(uint64_t unit, entry& e);
+    void write_back(uint64_t unit, const char* src);
+  };
+}
+#endif
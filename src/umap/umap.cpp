@@ -5,17 +5,25 @@
 // SPDX-License-Identifier: LGPL-2.1-only
 //////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>
 #include <cinttypes>
 #include <errno.h>              // strerror()
+#include <fcntl.h>              // O_CREAT
+#include <sstream>
 #include <string.h>             // strerror()
+#include <sys/file.h>           // flock()
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "umap/config.h"
 
+#include "umap/RegionDescriptor.hpp"
 #include "umap/RegionManager.hpp"
 #include "umap/umap.h"
 #include "umap/store/Store.hpp"
 #include "umap/util/Macros.hpp"
+#include "umap/util/Trace.hpp"
 
 void*
 umap(
@@ -41,19 +49,211 @@ int
 uunmap(void*  addr, uint64_t length)
 {
   UMAP_LOG(Debug, "addr: " << addr << ", length: " << length);
-  auto& rm = Umap::RegionManager::getInstance();
+  auto& rm = Umap::RegionManager::for_address(addr);
   rm.removeRegion((char*)addr);
   UMAP_LOG(Debug, "Done");
   return 0;
 }
 
+int
+umap_init( void )
+{
+  Umap::RegionManager::getInstance().init_engine();
+  return 0;
+}
+
+int
+umap_finalize( void )
+{
+  Umap::RegionManager::getInstance().finalize_engine();
+  return 0;
+}
+
 
 int umap_flush(){
   
   UMAP_LOG(Debug,  "umap_flush " );
   
-  return Umap::RegionManager::getInstance().flush_buffer();
+  int rval = 0;
+
+  for ( auto rm : Umap::RegionManager::get_contexts() )
+    if ( rm->flush_buffer() != 0 )
+      rval = -1;
+  return rval;
+
+}
+
+umap_flush_handle
+umap_flush_async(void* addr, uint64_t length)
+{
+  UMAP_LOG(Debug, "addr: " << addr << ", length: " << length);
+  return Umap::RegionManager::for_address(addr).flush_async((char*)addr, length);
+}
+
+int
+umap_flush_test(umap_flush_handle handle)
+{
+  return ((Umap::FlushFence*)handle)->test() ? 1 : 0;
+}
+
+int
+umap_flush_wait(umap_flush_handle handle)
+{
+  Umap::FlushFence* fence = (Umap::FlushFence*)handle;
+
+  fence->wait();
+  delete fence;
+  return 0;
+}
+
+int
+umap_region_set_quota(void* addr, uint64_t min_pages, uint64_t max_pages)
+{
+  UMAP_LOG(Debug, "addr: " << addr << ", min_pages: " << min_pages
+      << ", max_pages: " << max_pages);
+  Umap::RegionManager::for_address(addr).set_region_quota((char*)addr, min_pages, max_pages);
+  return 0;
+}
+
+umap_context*
+umap_context_create( void )
+{
+  return reinterpret_cast<umap_context*>(Umap::RegionManager::create_context());
+}
+
+int
+umap_context_destroy( umap_context* context )
+{
+  Umap::RegionManager* rm = reinterpret_cast<Umap::RegionManager*>(context);
+
+  if ( rm == nullptr || rm == &Umap::RegionManager::getInstance() )
+    UMAP_ERROR("The default context cannot be destroyed");
 
+  if ( rm->get_num_active_regions() != 0 )
+    UMAP_ERROR("Cannot destroy a context while " << rm->get_num_active_regions()
+        << " regions are mapped in it");
+
+  rm->finalize_engine();
+  delete rm;
+  return 0;
+}
+
+void*
+umap_context_map(
+    umap_context* context
+  , void* region_addr
+  , uint64_t region_size
+  , int prot
+  , int flags
+  , int fd
+  , off_t offset
+)
+{
+  return Umap::umap_ex(region_addr, region_size, prot, flags, fd, offset, nullptr, 0, context);
+}
+
+int
+umap_context_set_config( umap_context* context, int setting, uint64_t value )
+{
+  Umap::RegionManager& rm = ( context != nullptr )
+    ? *reinterpret_cast<Umap::RegionManager*>(context)
+    : Umap::RegionManager::getInstance();
+
+  UMAP_LOG(Debug, "context: " << context << ", setting: " << setting << ", value: " << value);
+
+  if ( setting == UMAP_CONFIG_MAX_PAGES_IN_BUFFER )
+    rm.set_buffer_pages(value);
+  else if ( setting >= UMAP_CONFIG_NUM_FILLERS && setting <= UMAP_CONFIG_IO_DEPTH )
+    rm.reconfigure((Umap::RegionManager::Setting)setting, value);
+  else
+    UMAP_ERROR("Invalid setting: " << setting);
+  return 0;
+}
+
+int
+umap_set_buffer_pages(uint64_t max_pages)
+{
+  UMAP_LOG(Debug, "max_pages: " << max_pages);
+  Umap::RegionManager::getInstance().set_buffer_pages(max_pages);
+  return 0;
+}
+
+int
+umap_region_set_numa_policy(void* addr, int policy, int node)
+{
+  UMAP_LOG(Debug, "addr: " << addr << ", policy: " << policy << ", node: " << node);
+  Umap::RegionManager::for_address(addr).set_region_numa_policy((char*)addr, policy, node);
+  return 0;
+}
+
+int
+umap_get_stats(struct umap_stats* stats)
+{
+  memset(stats, 0, sizeof(*stats));
+
+  for ( auto rm : Umap::RegionManager::get_contexts() )
+    rm->get_stats(stats);
+  return 0;
+}
+
+int
+umap_reset_stats( void )
+{
+  UMAP_LOG(Debug, "umap_reset_stats");
+
+  for ( auto rm : Umap::RegionManager::get_contexts() )
+    rm->reset_stats();
+  return 0;
+}
+
+int
+umap_region_get_stats(void* addr, struct umap_region_stats* stats)
+{
+  Umap::RegionManager::for_address(addr).get_region_stats((char*)addr, stats);
+  return 0;
+}
+
+int
+umap_get_latency_histogram(int stage, struct umap_latency_histogram* hist)
+{
+  memset(hist, 0, sizeof(*hist));
+
+  for ( auto rm : Umap::RegionManager::get_contexts() )
+    rm->get_latency_histogram(stage, hist);
+  return 0;
+}
+
+uint64_t
+umap_latency_bucket_floor(int bucket)
+{
+  return Umap::LatencyHistogram::bucket_floor(bucket);
+}
+
+uint64_t
+umap_latency_percentile(const struct umap_latency_histogram* hist, double percent)
+{
+  uint64_t rank = (uint64_t)(hist->count * percent / 100.0);
+  uint64_t seen = 0;
+
+  if ( hist->count == 0 )
+    return 0;
+
+  for ( int i = 0; i < UMAP_LATENCY_BUCKETS; ++i ) {
+    seen += hist->buckets[i];
+    if ( seen > rank )
+      return std::min(Umap::LatencyHistogram::bucket_floor(i), hist->max_ns);
+  }
+  return hist->max_ns;
+}
+
+int
+umap_trace_dump(const char* path)
+{
+  if ( ! Umap::Trace::enabled() ) {
+    errno = EINVAL;
+    return -1;
+  }
+  return Umap::Trace::dump(path);
 }
 
 int umap_has_write_support(){
@@ -66,13 +266,90 @@ int umap_has_write_support(){
 
 void umap_prefetch( int npages, umap_prefetch_item* page_array )
 {
-  Umap::RegionManager::getInstance().prefetch(npages, page_array);
+  for ( int i = 0; i < npages; ++i )
+    Umap::RegionManager::for_address(page_array[i].page_base_addr).prefetch(1, &page_array[i]);
 }
 
 
+umap_prefetch_handle
+umap_prefetch_range(void* addr, uint64_t length, int flags)
+{
+  UMAP_LOG(Debug, "addr: " << addr << ", length: " << length << ", flags: " << flags);
+
+  if ( flags & ~UMAP_PREFETCH_DETACHED )
+    UMAP_ERROR("Invalid flags: " << std::hex << flags);
+
+  Umap::FlushFence* fence = Umap::RegionManager::for_address(addr).prefetch_async((char*)addr, length);
+
+  if ( flags & UMAP_PREFETCH_DETACHED ) {
+    fence->detach();
+    return nullptr;
+  }
+  return fence;
+}
+
+int
+umap_prefetch_test(umap_prefetch_handle handle)
+{
+  return ((Umap::FlushFence*)handle)->test() ? 1 : 0;
+}
+
+int
+umap_prefetch_wait(umap_prefetch_handle handle)
+{
+  Umap::FlushFence* fence = (Umap::FlushFence*)handle;
+
+  fence->wait();
+  delete fence;
+  return 0;
+}
+
+int
+umap_advise(void* addr, uint64_t length, int advice)
+{
+  UMAP_LOG(Debug, "addr: " << addr << ", length: " << length << ", advice: " << advice);
+
+  Umap::RegionManager::for_address(addr).advise((char*)addr, length, advice);
+  return 0;
+}
+
+int
+umap_pin(void* addr, uint64_t length)
+{
+  UMAP_LOG(Debug, "addr: " << addr << ", length: " << length);
+
+  Umap::RegionManager::for_address(addr).pin((char*)addr, length);
+  return 0;
+}
+
+int
+umap_unpin(void* addr, uint64_t length)
+{
+  UMAP_LOG(Debug, "addr: " << addr << ", length: " << length);
+
+  Umap::RegionManager::for_address(addr).unpin((char*)addr, length);
+  return 0;
+}
+
+int
+umap_save_hot_pages(void* addr, const char* path)
+{
+  UMAP_LOG(Debug, "addr: " << addr << ", path: " << path);
+
+  return Umap::RegionManager::for_address(addr).save_hot_pages((char*)addr, path) ? 0 : -1;
+}
+
+int
+umap_warm_up(void* addr, const char* path)
+{
+  UMAP_LOG(Debug, "addr: " << addr << ", path: " << path);
+
+  return Umap::RegionManager::for_address(addr).warm_up((char*)addr, path) ? 0 : -1;
+}
+
 void umap_fetch_and_pin( char* paddr, uint64_t size )
 {
-  Umap::RegionManager::getInstance().fetch_and_pin(paddr, size);
+  Umap::RegionManager::for_address(paddr).pin(paddr, size);
 }
 
 
@@ -106,6 +383,18 @@ umapcfg_get_num_evictors( void )
   return Umap::RegionManager::getInstance().get_num_evictors();
 }
 
+uint64_t
+umapcfg_get_num_active_fillers( void )
+{
+  return Umap::RegionManager::getInstance().get_num_active_fillers();
+}
+
+uint64_t
+umapcfg_get_num_active_evictors( void )
+{
+  return Umap::RegionManager::getInstance().get_num_active_evictors();
+}
+
 int
 umapcfg_get_evict_low_water_threshold( void )
 {
@@ -124,10 +413,206 @@ umapcfg_get_max_fault_events( void )
   return Umap::RegionManager::getInstance().get_max_fault_events();
 }
 
+uint64_t
+umapcfg_get_num_buffer_shards( void )
+{
+  return Umap::RegionManager::getInstance().get_num_buffer_shards();
+}
+
+uint64_t
+umapcfg_get_read_ahead( void )
+{
+  return Umap::RegionManager::getInstance().get_read_ahead();
+}
+
+uint64_t
+umapcfg_get_num_uffd_threads( void )
+{
+  return Umap::RegionManager::getInstance().get_num_uffd_threads();
+}
+
+uint64_t
+umapcfg_get_io_depth( void )
+{
+  return Umap::RegionManager::getInstance().get_io_depth();
+}
+
+int
+umapcfg_get_direct_io( void )
+{
+  return Umap::RegionManager::getInstance().get_direct_io() ? 1 : 0;
+}
+
+int
+umapcfg_get_keep_alive( void )
+{
+  return Umap::RegionManager::getInstance().get_keep_alive() ? 1 : 0;
+}
+
+uint64_t
+umapcfg_get_max_pinned_pages( void )
+{
+  return Umap::RegionManager::getInstance().get_max_pinned_pages();
+}
+
+int
+umapcfg_set_num_fillers( uint64_t num_fillers )
+{
+  UMAP_LOG(Debug, "num_fillers: " << num_fillers);
+  Umap::RegionManager::getInstance().reconfigure(Umap::RegionManager::NUM_FILLERS, num_fillers);
+  return 0;
+}
+
+int
+umapcfg_set_num_evictors( uint64_t num_evictors )
+{
+  UMAP_LOG(Debug, "num_evictors: " << num_evictors);
+  Umap::RegionManager::getInstance().reconfigure(Umap::RegionManager::NUM_EVICTORS, num_evictors);
+  return 0;
+}
+
+int
+umapcfg_set_max_pages_in_buffer( uint64_t max_pages )
+{
+  return umap_set_buffer_pages(max_pages);
+}
+
+int
+umapcfg_set_evict_low_water_threshold( int percent )
+{
+  UMAP_LOG(Debug, "percent: " << percent);
+  if ( percent < 0 )
+    UMAP_ERROR("Invalid percentage: " << percent);
+  Umap::RegionManager::getInstance().reconfigure(Umap::RegionManager::EVICT_LOW_WATER_THRESHOLD, (uint64_t)percent);
+  return 0;
+}
+
+int
+umapcfg_set_evict_high_water_threshold( int percent )
+{
+  UMAP_LOG(Debug, "percent: " << percent);
+  if ( percent < 0 )
+    UMAP_ERROR("Invalid percentage: " << percent);
+  Umap::RegionManager::getInstance().reconfigure(Umap::RegionManager::EVICT_HIGH_WATER_THRESHOLD, (uint64_t)percent);
+  return 0;
+}
+
+int
+umapcfg_set_dirty_ratio( int percent )
+{
+  UMAP_LOG(Debug, "percent: " << percent);
+  if ( percent < 0 )
+    UMAP_ERROR("Invalid percentage: " << percent);
+  Umap::RegionManager::getInstance().reconfigure(Umap::RegionManager::DIRTY_RATIO, (uint64_t)percent);
+  return 0;
+}
+
+int
+umapcfg_set_max_fault_events( uint64_t max_events )
+{
+  UMAP_LOG(Debug, "max_events: " << max_events);
+  Umap::RegionManager::getInstance().reconfigure(Umap::RegionManager::MAX_FAULT_EVENTS, max_events);
+  return 0;
+}
+
+int
+umapcfg_set_max_pinned_pages( uint64_t max_pages )
+{
+  UMAP_LOG(Debug, "max_pages: " << max_pages);
+  Umap::RegionManager::getInstance().reconfigure(Umap::RegionManager::MAX_PINNED_PAGES, max_pages);
+  return 0;
+}
+
+int
+umapcfg_set_read_ahead( uint64_t max_pages )
+{
+  UMAP_LOG(Debug, "max_pages: " << max_pages);
+  Umap::RegionManager::getInstance().reconfigure(Umap::RegionManager::READ_AHEAD, max_pages);
+  return 0;
+}
+
+int
+umapcfg_set_umap_page_size( uint64_t page_size )
+{
+  UMAP_LOG(Debug, "page_size: " << page_size);
+  Umap::RegionManager::getInstance().reconfigure(Umap::RegionManager::UMAP_PAGE_SIZE, page_size);
+  return 0;
+}
+
+int
+umapcfg_set_num_buffer_shards( uint64_t num_shards )
+{
+  UMAP_LOG(Debug, "num_shards: " << num_shards);
+  Umap::RegionManager::getInstance().reconfigure(Umap::RegionManager::NUM_BUFFER_SHARDS, num_shards);
+  return 0;
+}
+
+int
+umapcfg_set_num_uffd_threads( uint64_t num_threads )
+{
+  UMAP_LOG(Debug, "num_threads: " << num_threads);
+  Umap::RegionManager::getInstance().reconfigure(Umap::RegionManager::NUM_UFFD_THREADS, num_threads);
+  return 0;
+}
+
+int
+umapcfg_set_max_fill_pages( uint64_t max_pages )
+{
+  UMAP_LOG(Debug, "max_pages: " << max_pages);
+  Umap::RegionManager::getInstance().reconfigure(Umap::RegionManager::MAX_FILL_PAGES, max_pages);
+  return 0;
+}
+
+int
+umapcfg_set_io_depth( uint64_t depth )
+{
+  UMAP_LOG(Debug, "depth: " << depth);
+  Umap::RegionManager::getInstance().reconfigure(Umap::RegionManager::IO_DEPTH, depth);
+  return 0;
+}
+
 namespace Umap {
   // A global variable to ensure thread-safety
   std::mutex g_mutex;
 
+//
+// Opens the shared memory object holding the pages of a UMAP_SHARED region,
+// creating it for the first process.  Processes share it when they map the
+// same version of the same file, at the same offset, with the same size and
+// page size.  Each holds a shared lock on it while mapped, see
+// RegionManager::removeRegion().
+//
+static int
+open_shared_buffer(int fd, off_t offset, uint64_t size, uint64_t psize, std::string& name)
+{
+  struct stat st;
+
+  if (fstat(fd, &st) == -1)
+    UMAP_ERROR("fstat of fd " << fd << " failed: " << strerror(errno));
+
+  std::stringstream ss;
+
+  ss << "/umap-" << std::hex << st.st_dev << "-" << st.st_ino
+     << "-" << st.st_mtim.tv_sec << "." << st.st_mtim.tv_nsec
+     << "-" << offset << "-" << size << "-" << psize;
+  name = ss.str();
+
+  int shm_fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+  if (shm_fd == -1)
+    UMAP_ERROR("shm_open(" << name << ") failed: " << strerror(errno));
+
+  if (flock(shm_fd, LOCK_SH) == -1
+      || ftruncate(shm_fd, size + RegionDescriptor::shared_claims_size(size / psize)) == -1) {
+    int eno = errno;
+    close(shm_fd);
+    UMAP_ERROR("failed to set up shared buffer " << name << ": " << strerror(eno));
+  }
+
+  UMAP_LOG(Debug, "shared buffer: " << name);
+  return shm_fd;
+}
+
 void*
 umap_ex(
     void* region_addr
@@ -138,10 +623,34 @@ umap_ex(
   , off_t offset
   , Store* store
 )
+{
+  return umap_ex(region_addr, region_size, prot, flags, fd, offset, store, 0, nullptr);
+}
+
+void*
+umap_ex(
+    void* region_addr
+  , uint64_t region_size
+  , int prot
+  , int flags
+  , int fd
+  , off_t offset
+  , Store* store
+  , uint64_t page_size
+  , umap_context* context
+)
 {
   std::lock_guard<std::mutex> lock(g_mutex);
-  auto& rm = RegionManager::getInstance();
-  auto umap_psize = rm.get_umap_page_size();
+  auto& rm = ( context != nullptr ) ? *reinterpret_cast<RegionManager*>(context)
+                                    : RegionManager::getInstance();
+  uint64_t umap_psize = rm.get_umap_page_size();
+
+  if ( page_size != 0 ) {
+    rm.check_page_size(page_size);
+    umap_psize = page_size;
+  }
+
+  bool huge_pages = rm.get_hugetlb() && rm.is_huge_page_size(umap_psize);
 
   if (region_size == 0){
     errno = -EINVAL;
@@ -156,6 +665,7 @@ umap_ex(
       << ", offset: " << offset
       << ", store: " << store
       << ", umap_psize: " << umap_psize
+      << ", huge_pages: " << huge_pages
   );
 
 #ifdef UMAP_RO_MODE
@@ -172,18 +682,39 @@ umap_ex(
   if ( ( region_size % umap_psize ) ) {
     UMAP_ERROR("Region size " << region_size 
                 << " is not a multple of umapPageSize (" 
-                << rm.get_umap_page_size() << ")");
+                << umap_psize << ")");
   }
 
   if ( ( (uint64_t)region_addr & (umap_psize - 1) ) ) {
     UMAP_ERROR("region_addr must be page aligned: " << region_addr
-      << ", page size is: " << rm.get_umap_page_size());
+      << ", page size is: " << umap_psize);
   }
 
-  if (!(flags & UMAP_PRIVATE) || flags & ~(UMAP_PRIVATE|UMAP_FIXED)) {
+  if (!(flags & UMAP_PRIVATE) == !(flags & UMAP_SHARED)
+      || flags & ~(UMAP_PRIVATE|UMAP_SHARED|UMAP_FIXED|UMAP_DIRECT_IO)) {
     UMAP_ERROR("Invalid flags: " << std::hex << flags);
   }
 
+  bool shared = (flags & UMAP_SHARED) != 0;
+
+  if (shared) {
+    if (prot != PROT_READ)
+      UMAP_ERROR("UMAP_SHARED regions must be mapped PROT_READ");
+    if (store != nullptr)
+      UMAP_ERROR("UMAP_SHARED regions must be backed by a file descriptor");
+    if (huge_pages)
+      UMAP_LOG(Info, "UMAP_SHARED regions are not backed by hugetlb pages");
+    huge_pages = false;
+  }
+
+  if ((flags & UMAP_DIRECT_IO) && store != nullptr) {
+    UMAP_ERROR("UMAP_DIRECT_IO only applies to regions backed by a file descriptor");
+  }
+
+  bool direct_io = (flags & UMAP_DIRECT_IO) || rm.get_direct_io();
+
+  flags &= ~UMAP_DIRECT_IO;
+
   //
   // When dealing with umap-page-sizes that could be multiples of the actual
   // system-page-size, it is possible for mmap() to provide a region that is on
@@ -192,10 +723,19 @@ umap_ex(
   // We always allocate an additional umap-page-size set of bytes so that we can
   // make certain that the umap-region begins on a umap-page-size boundary.
   //
+  // Huge pages are asked for by size, as log2 of the size in the bits above
+  // MAP_HUGE_SHIFT.  No pages are reserved, the Buffer never holds more
+  // than UMAP_BUFSIZE of them.
+  //
+  // The buffer of a shared region is then mapped over the region.
+  //
   uint64_t mmap_size = region_size + umap_psize;
+  int mmap_flags = (shared ? (flags & ~UMAP_SHARED) | MAP_PRIVATE : flags) | (MAP_ANONYMOUS | MAP_NORESERVE);
+
+  if ( huge_pages )
+    mmap_flags |= MAP_HUGETLB | (__builtin_ctzl(umap_psize) << MAP_HUGE_SHIFT);
 
-  void* mmap_region = mmap(region_addr, mmap_size,
-                        prot, flags | (MAP_ANONYMOUS | MAP_NORESERVE), -1, 0);
+  void* mmap_region = mmap(region_addr, mmap_size, prot, mmap_flags, -1, 0);
 
   if (mmap_region == MAP_FAILED) {
     UMAP_ERROR("mmap failed: " << strerror(errno));
@@ -206,11 +746,41 @@ umap_ex(
   umap_region = (void*)((uint64_t)mmap_region + umap_psize - 1);
   umap_region = (void*)((uint64_t)umap_region & ~(umap_psize - 1));
 
+  int shared_fd = -1;
+  std::string shared_name;
+  void* shared_claims = nullptr;
+
+  if ( shared ) {
+    uint64_t claims_size = RegionDescriptor::shared_claims_size(umap_size / umap_psize);
+
+    shared_fd = open_shared_buffer(fd, offset, umap_size, umap_psize, shared_name);
+
+    if (mmap(umap_region, umap_size, prot, MAP_SHARED | MAP_FIXED | MAP_NORESERVE, shared_fd, 0) == MAP_FAILED
+        || (shared_claims = mmap(nullptr, claims_size, PROT_READ | PROT_WRITE, MAP_SHARED
+                               , shared_fd, umap_size)) == MAP_FAILED) {
+      int eno = errno;
+      close(shared_fd);
+      munmap(mmap_region, mmap_size);
+      UMAP_ERROR("mmap of shared buffer " << shared_name << " failed: " << strerror(eno));
+    }
+  }
+
   if ( store == nullptr )
-    store = Store::make_store(umap_region, umap_size, umap_psize, fd);
+    store = Store::make_store(umap_region, umap_size, umap_psize, fd, direct_io);
 
-  rm.addRegion(store, (char*)umap_region, umap_size, (char*)mmap_region, mmap_size);
+  rm.addRegion(store, (char*)umap_region, umap_size, (char*)mmap_region, mmap_size, umap_psize, huge_pages
+             , prot == PROT_READ, shared_fd, shared_name, (std::atomic<uint32_t>*)shared_claims);
 
   return umap_region;
 }
+
+int
+umap_snapshot(void* addr, Umap::Store* target)
+{
+  UMAP_LOG(Debug, "addr: " << addr << ", target: " << (void*)target);
+
+  RegionManager::for_address(addr).snapshot((char*)addr, target);
+  return 0;
+}
+
 } // namespace Umap
@@ -18,13 +18,23 @@
 #include <unistd.h>
 #include <sys/mman.h>
 
+/** An engine of its own: buffer, fault handlers, workers and configuration,
+ * see umap_context_create() */
+typedef struct umap_context umap_context;
+
 #ifdef __cplusplus
 namespace Umap {
 /** Allow application to create region of memory to a persistent store
  * \param addr Same as input argument for mmap(2)
  * \param length Same as input argument of mmap(2)
- * \param prot Same as input argument of mmap(2)
+ * \param prot PROT_READ or PROT_READ|PROT_WRITE.  A PROT_READ region is
+ *        filled without write protection and is never written back; its
+ *        protection must not be changed while it is mapped.
  * \param flags Same as input argument of mmap(2)
+ * \param page_size Size of the umap pages of this region, a power of two
+ *        multiple of the system page size, or 0 for UMAP_PAGESIZE
+ * \param context Context the region is mapped in, nullptr for the default
+ *        one
  */
 extern std::mutex m_mutex;
 extern int num_thread;
@@ -36,6 +46,39 @@ void* umap_ex(
   , int           fd
   , off_t         offset
   , Umap::Store*  store
+  , std::size_t   page_size
+  , umap_context* context = nullptr
+);
+
+/** umap_ex() of 2.1.0, with UMAP_PAGESIZE pages in the default context.
+ * It is kept as an overload of its own so that code written for 2.1.0
+ * builds unchanged.  Binaries linked against 2.1.0 must be rebuilt, as
+ * the virtual functions of Umap::Store changed.
+ */
+void* umap_ex(
+    void*         addr
+  , std::size_t   length
+  , int           prot
+  , int           flags
+  , int           fd
+  , off_t         offset
+  , Umap::Store*  store
+);
+
+/** Write the pages of a region written since its previous snapshot, or
+ * since it was mapped, to target, at their offsets in the store of the
+ * region.  Dirty pages are written back to the store of the region first.
+ * Faults are served while the pages are copied; a page written meanwhile
+ * may be copied as it was before or after, and is copied again by the
+ * next snapshot.  The target is typically a new SparseStore, a generation
+ * that only holds the pages that changed, see the SparseStore constructor
+ * that composes generations.  Shared regions are not supported.
+ * \param addr Address within the region
+ * \param target Store the pages are written to
+ */
+int umap_snapshot(
+    void*         addr
+  , Umap::Store*  target
 );
 } // namespace Umap
 #endif // __cplusplus
@@ -46,7 +89,9 @@ extern "C" {
 /** Allow application to create region of memory to a persistent store
  * \param addr Same as input argument for mmap(2)
  * \param length Same as input argument of mmap(2)
- * \param prot Same as input argument of mmap(2)
+ * \param prot PROT_READ or PROT_READ|PROT_WRITE.  A PROT_READ region is
+ *        filled without write protection and is never written back; its
+ *        protection must not be changed while it is mapped.
  * \param flags Same as input argument of mmap(2)
  */
 void* umap(
@@ -63,8 +108,226 @@ int uunmap(
   , size_t length
 );
 
+/** Start the engine of umap (buffer, fault handlers and workers) ahead of
+ * the first umap(), and keep it running when the last region is unmapped,
+ * until umap_finalize().  Applications that map and unmap regions in a
+ * loop then only pay for starting umap once.  See also UMAP_KEEP_ALIVE. */
+int umap_init( void );
+
+/** Stop the engine now if no region is mapped, or else with the last
+ * region unmapped */
+int umap_finalize( void );
+
+/** Create a context: regions mapped in it have a buffer, fault handlers,
+ * fill and evict workers of their own, and do not compete with the regions
+ * of other contexts for them.  Its configuration is read from the
+ * environment like that of the default context, and may then be changed
+ * with umap_context_set_config().  Functions taking the address of a
+ * region apply to the context of the region.
+ */
+umap_context* umap_context_create( void );
+
+/** Destroy a context created by umap_context_create(), once all of its
+ * regions have been unmapped */
+int umap_context_destroy( umap_context* context );
+
+/** Same as umap(), in a context, the default one if context is NULL */
+void* umap_context_map(
+    umap_context* context
+  , void* addr
+  , size_t length
+  , int prot
+  , int flags
+  , int fd
+  , off_t offset
+);
+
+/** Settings of umap_context_set_config(), see the umapcfg_set_*() functions
+ * of the same names for when they take effect */
+#define UMAP_CONFIG_NUM_FILLERS                 0
+#define UMAP_CONFIG_NUM_EVICTORS                1
+#define UMAP_CONFIG_EVICT_LOW_WATER_THRESHOLD   2
+#define UMAP_CONFIG_EVICT_HIGH_WATER_THRESHOLD  3
+#define UMAP_CONFIG_DIRTY_RATIO                 4
+#define UMAP_CONFIG_MAX_FAULT_EVENTS            5
+#define UMAP_CONFIG_READ_AHEAD                  6
+#define UMAP_CONFIG_MAX_PINNED_PAGES            7
+#define UMAP_CONFIG_UMAP_PAGE_SIZE              8
+#define UMAP_CONFIG_NUM_BUFFER_SHARDS           9
+#define UMAP_CONFIG_NUM_UFFD_THREADS            10
+#define UMAP_CONFIG_MAX_FILL_PAGES              11
+#define UMAP_CONFIG_IO_DEPTH                    12
+#define UMAP_CONFIG_MAX_PAGES_IN_BUFFER         13
+
+/** Change a setting of a context, the default one if context is NULL */
+int umap_context_set_config(
+    umap_context* context
+  , int           setting
+  , uint64_t      value
+);
+
 int umap_flush(); 
 
+/** Handle of a flush started with umap_flush_async() */
+typedef void* umap_flush_handle;
+
+/** Start writing back the dirty pages of a range without waiting for it
+ * \param addr Start of the range, within a region returned by umap(), or
+ *        NULL for the pages of every region
+ * \param length Length of the range in bytes, 0 for up to the end of the
+ *        region
+ * \return Handle to be given to umap_flush_test() or umap_flush_wait()
+ */
+umap_flush_handle umap_flush_async(
+    void*    addr
+  , uint64_t length
+);
+
+/** Returns 1 if the flush is complete, 0 otherwise */
+int umap_flush_test( umap_flush_handle handle );
+
+/** Waits for the flush to complete and releases its handle */
+int umap_flush_wait( umap_flush_handle handle );
+
+/** Give a region a share of the umap buffer
+ * \param addr Address of the region as returned by umap(); the region must
+ *        still be mapped
+ * \param min_pages Number of pages of this region that are only evicted
+ *        when no other page can be
+ * \param max_pages Maximum number of pages this region may hold in the
+ *        buffer, 0 for no limit
+ */
+int umap_region_set_quota(
+    void*    addr
+  , uint64_t min_pages
+  , uint64_t max_pages
+);
+
+/** Change the number of pages the umap buffer may hold
+ * \param max_pages New size of the buffer.  Pages are evicted until the
+ *        buffer fits.  This is also the size UMAP_BUFFER_CONTROLLER never
+ *        grows the buffer beyond.
+ */
+int umap_set_buffer_pages( uint64_t max_pages );
+
+/** NUMA policies of umap_region_set_numa_policy() */
+#define UMAP_NUMA_LOCAL      0  /* Node of the thread that faults on the page */
+#define UMAP_NUMA_INTERLEAVE 1  /* Runs of pages spread over all nodes */
+#define UMAP_NUMA_BIND       2  /* A single node */
+
+/** Choose the NUMA node the pages of a region are filled on, when UMAP_NUMA
+ * is set
+ * \param addr Address of the region as returned by umap()
+ * \param policy One of UMAP_NUMA_LOCAL, UMAP_NUMA_INTERLEAVE or
+ *        UMAP_NUMA_BIND
+ * \param node Node of UMAP_NUMA_BIND, ignored otherwise
+ */
+int umap_region_set_numa_policy(
+    void* addr
+  , int   policy
+  , int   node
+);
+
+/** Counters of umap_get_stats().  The counters are totals since the
+ * first region was mapped, or since umap_reset_stats(); the last five
+ * fields are the state of the buffer and queues at the time of the call.
+ */
+struct umap_stats {
+  uint64_t faults;            /* Page faults handled, spurious ones included */
+  uint64_t spurious_faults;   /* Faults on pages that were present already */
+  uint64_t fills;             /* Pages brought into the buffer */
+  uint64_t prefetches;        /* Of which by prefetch or read-ahead */
+  uint64_t evictions;         /* Pages taken out of the buffer */
+  uint64_t writebacks;        /* Dirty pages written to their store */
+  uint64_t bytes_read;        /* From the stores */
+  uint64_t bytes_written;     /* To the stores */
+  uint64_t lock_collisions;   /* Buffer shard locks found taken */
+  uint64_t waits;             /* For pages being filled, evicted or freed */
+  uint64_t free_page_waits;   /* Of which for a free page descriptor */
+  uint64_t resident_pages;
+  uint64_t dirty_pages;
+  uint64_t pinned_pages;
+  uint64_t fill_queue_depth;  /* Runs waiting for a fill worker */
+  uint64_t evict_queue_depth; /* Runs waiting for an evict worker */
+};
+
+/** Gather the counters of all contexts.  The counters are kept by the
+ * threads of umap as they go and are only added up here.
+ */
+int umap_get_stats( struct umap_stats* stats );
+
+/** Start the counters of umap_get_stats() over from zero */
+int umap_reset_stats( void );
+
+/** Counters of umap_region_get_stats(), since the region was mapped */
+struct umap_region_stats {
+  uint64_t bytes_read;        /* From the store of the region */
+  uint64_t bytes_written;     /* To the store of the region */
+  uint64_t writebacks;        /* Dirty pages written to the store */
+  uint64_t resident_pages;
+  uint64_t dirty_pages;
+};
+
+/** Gather the counters of a region
+ * \param addr Address of the region as returned by umap()
+ */
+int umap_region_get_stats(
+    void*                     addr
+  , struct umap_region_stats* stats
+);
+
+/** Stages of the service of a fault timed by umap_get_latency_histogram() */
+#define UMAP_LATENCY_HANDLER          0  /* From the read of the fault to its dispatch */
+#define UMAP_LATENCY_DESCRIPTOR_WAIT  1  /* Waiting for a free page descriptor */
+#define UMAP_LATENCY_FILL_QUEUE       2  /* Queued for a fill worker */
+#define UMAP_LATENCY_STORE_READ       3  /* Reading a run of pages from the store */
+#define UMAP_LATENCY_COPY             4  /* Copying a run of pages in (UFFDIO_COPY) */
+#define UMAP_LATENCY_FAULT            5  /* From the read of the fault to the page being in */
+#define UMAP_LATENCY_STAGES           6
+
+#define UMAP_LATENCY_BUCKETS 256
+
+/** Latencies of one stage in nanoseconds.  Bucket i holds the values from
+ * umap_latency_bucket_floor(i) up to the floor of bucket i + 1.
+ */
+struct umap_latency_histogram {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[UMAP_LATENCY_BUCKETS];
+};
+
+/** Gather the latencies of a stage over all contexts, since the first
+ * region was mapped or since umap_reset_stats().  Latencies are only
+ * measured when UMAP_LATENCY_HISTOGRAMS is set, the histograms are empty
+ * otherwise.
+ * \param stage One of the UMAP_LATENCY_ stages
+ */
+int umap_get_latency_histogram(
+    int                            stage
+  , struct umap_latency_histogram* hist
+);
+
+/** Smallest latency, in nanoseconds, of a bucket of a histogram */
+uint64_t umap_latency_bucket_floor( int bucket );
+
+/** Latency below which percent percent of those of a histogram are, to
+ * within the width of its bucket, 0 if it is empty
+ */
+uint64_t umap_latency_percentile(
+    const struct umap_latency_histogram* hist
+  , double                               percent
+);
+
+/** Write the trace of UMAP_TRACE, as it is so far, to a file for
+ * umap-trace.  The trace is also written to the file of UMAP_TRACE at exit.
+ * \param path File to write, NULL for that of UMAP_TRACE.  A %p in the
+ *        path is replaced by the pid.
+ * \return 0, or -1 with errno set if tracing is off or the file could not
+ *         be written
+ */
+int umap_trace_dump( const char* path );
+
 struct umap_prefetch_item {
   void* page_base_addr;
 };
@@ -72,15 +335,169 @@ struct umap_prefetch_item {
 int umap_has_write_support();
   
 void umap_prefetch( int npages, struct umap_prefetch_item* page_array );
+
+/** Handle of a prefetch started with umap_prefetch_range() */
+typedef void* umap_prefetch_handle;
+
+/** Flags of umap_prefetch_range() */
+#define UMAP_PREFETCH_DETACHED 1  /* No handle is returned */
+
+/** Bring the pages of a range into the buffer without waiting for them.
+ * The pages are read in runs by the fill workers; those that are already
+ * present are skipped.
+ * \param addr Start of the range, within a region returned by umap()
+ * \param length Length of the range in bytes, 0 for up to the end of the
+ *        region
+ * \param flags 0 or UMAP_PREFETCH_DETACHED
+ * \return Handle to be given to umap_prefetch_test() or
+ *         umap_prefetch_wait(), NULL with UMAP_PREFETCH_DETACHED
+ */
+umap_prefetch_handle umap_prefetch_range(
+    void*    addr
+  , uint64_t length
+  , int      flags
+);
+
+/** Returns 1 if the pages of the prefetch are all in, 0 otherwise */
+int umap_prefetch_test( umap_prefetch_handle handle );
+
+/** Waits for the prefetch to complete and releases its handle */
+int umap_prefetch_wait( umap_prefetch_handle handle );
+
+/** Advice of umap_advise(), see madvise(2) */
+#define UMAP_ADVICE_NORMAL     0  /* No particular treatment, clears the advice */
+#define UMAP_ADVICE_SEQUENTIAL 1  /* Read ahead of faults as far as possible */
+#define UMAP_ADVICE_RANDOM     2  /* No read-ahead, faults are filled on their own */
+#define UMAP_ADVICE_WILLNEED   3  /* Prefetch, as umap_prefetch_range() */
+#define UMAP_ADVICE_DONTNEED   4  /* Evict the pages of the range now */
+#define UMAP_ADVICE_NOREUSE    5  /* Accessed once, evicted before other pages */
+#define UMAP_ADVICE_HOT        6  /* Evicted only when nothing else can be */
+
+/** Tell umap how a range of a region is going to be accessed.
+ * SEQUENTIAL, RANDOM, NOREUSE and HOT are remembered for the pages of the
+ * range until other advice is given for them; WILLNEED and DONTNEED act on
+ * the pages present at the time of the call and are not remembered.
+ * \param addr Start of the range, within a region returned by umap()
+ * \param length Length of the range in bytes, 0 for up to the end of the
+ *        region
+ * \param advice One of the UMAP_ADVICE_ values
+ */
+int umap_advise(
+    void*    addr
+  , uint64_t length
+  , int      advice
+);
+
+/** Bring the pages of a range into the buffer and keep them there.
+ * The pages are read in runs by the fill workers and are never evicted
+ * until they have been unpinned as many times as they were pinned.  At
+ * most umapcfg_get_max_pinned_pages() pages may be pinned at once.
+ * \param addr Start of the range, within a region returned by umap()
+ * \param length Length of the range in bytes, 0 for up to the end of the
+ *        region
+ */
+int umap_pin(
+    void*    addr
+  , uint64_t length
+);
+
+/** Release the pins taken by umap_pin() on the pages of a range */
+int umap_unpin(
+    void*    addr
+  , uint64_t length
+);
+
+/** Save the list of the pages of a region that are in the buffer, hottest
+ * first as far as the replacement policy tells, to the file path, for
+ * umap_warm_up() to prefetch them after a restart.  UMAP_WARM_RESTART does
+ * so at uunmap() for the stores that have a place for it.
+ * \return 0 on success, -1 if the file could not be written
+ */
+int umap_save_hot_pages(
+    void*       addr
+  , const char* path
+);
+
+/** Prefetch, in the background and in batches, the pages listed in the
+ * file path by umap_save_hot_pages(), as far as they fit below the low
+ * water mark of the buffer.  Pages are listed by their offsets in the
+ * store, so the region may be mapped at another address.
+ * \return 0 once the prefetch is queued, -1 if path holds no list
+ */
+int umap_warm_up(
+    void*       addr
+  , const char* path
+);
+
+/** Same as umap_pin(), kept for compatibility */
 void umap_fetch_and_pin( char* paddr, uint64_t size );  
 uint64_t umapcfg_get_umap_page_size( void );
 uint64_t umapcfg_get_max_fault_events( void );
 uint64_t umapcfg_get_num_fillers( void );
 uint64_t umapcfg_get_num_evictors( void );
+
+/*
+ * Number of fill and evict workers running right now, 0 while nothing is
+ * mapped
+ */
+uint64_t umapcfg_get_num_active_fillers( void );
+uint64_t umapcfg_get_num_active_evictors( void );
 uint64_t umapcfg_get_max_pages_in_buffer( void );
 uint64_t umapcfg_get_read_ahead( void );
 int      umapcfg_get_evict_low_water_threshold( void );
 int      umapcfg_get_evict_high_water_threshold( void );
+uint64_t umapcfg_get_num_buffer_shards( void );
+uint64_t umapcfg_get_num_uffd_threads( void );
+uint64_t umapcfg_get_io_depth( void );
+int      umapcfg_get_direct_io( void );
+int      umapcfg_get_keep_alive( void );
+uint64_t umapcfg_get_max_pinned_pages( void );
+
+/*
+ * Change the settings read from the environment when umap starts.  These
+ * take effect immediately, regions being mapped or not:
+ */
+
+/** Most fill workers (UMAP_PAGE_FILLERS).  Workers are added as faults
+ * queue up, those above a lowered number leave once idle. */
+int umapcfg_set_num_fillers( uint64_t num_fillers );
+
+/** Most evict workers (UMAP_PAGE_EVICTORS), as umapcfg_set_num_fillers() */
+int umapcfg_set_num_evictors( uint64_t num_evictors );
+
+/** Same as umap_set_buffer_pages() (UMAP_BUFSIZE) */
+int umapcfg_set_max_pages_in_buffer( uint64_t max_pages );
+
+/** Eviction thresholds in percent of the buffer.  The low water threshold
+ * may not be above the high water threshold. */
+int umapcfg_set_evict_low_water_threshold( int percent );
+int umapcfg_set_evict_high_water_threshold( int percent );
+
+/** Percentage of the buffer that may be dirty (UMAP_DIRTY_RATIO), 0 for no
+ * limit */
+int umapcfg_set_dirty_ratio( int percent );
+
+/** Events read by a fault handler at once (UMAP_MAX_FAULT_EVENTS), from the
+ * next read of each handler on */
+int umapcfg_set_max_fault_events( uint64_t max_events );
+
+/** Most pages pinned at once (UMAP_MAX_PINNED_PAGES), 0 for the default.
+ * Pages pinned already stay pinned. */
+int umapcfg_set_max_pinned_pages( uint64_t max_pages );
+
+/** Read-ahead window (UMAP_READ_AHEAD), of regions mapped from now on */
+int umapcfg_set_read_ahead( uint64_t max_pages );
+
+/*
+ * These need the engine to be stopped, all regions being unmapped and no
+ * umap_init() or UMAP_KEEP_ALIVE keeping it running, and fail otherwise.
+ * They apply to the regions mapped next.
+ */
+int umapcfg_set_umap_page_size( uint64_t page_size );
+int umapcfg_set_num_buffer_shards( uint64_t num_shards );
+int umapcfg_set_num_uffd_threads( uint64_t num_threads );
+int umapcfg_set_max_fill_pages( uint64_t max_pages );
+int umapcfg_set_io_depth( uint64_t depth );
 
 #ifdef __cplusplus
 }
@@ -89,8 +506,10 @@ int      umapcfg_get_evict_high_water_threshold( void );
 /*
  * flags
  */
-#define UMAP_PRIVATE    MAP_PRIVATE // Note - UMAP_SHARED not currently supported
+#define UMAP_PRIVATE    MAP_PRIVATE
+#define UMAP_SHARED     MAP_SHARED  // Read-only, the buffer is shared by the processes mapping the file
 #define UMAP_FIXED      MAP_FIXED   // See mmap(2) - This flag is currently then only flag supported.
+#define UMAP_DIRECT_IO  0x00800000  // The file of fd is read and written with O_DIRECT
 
 /*
  * Return codes
@@ -0,0 +1,109 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_Annotation_HPP
+#define _UMAP_Annotation_HPP
+
+#include "umap/config.h"
+
+//
+// Caliper regions around the work of the threads of umap, so that a profile
+// of the application shows where fills, evictions, flushes and store I/O
+// overlap with its own regions.  I/O regions carry the number of bytes in
+// umap.bytes and the type of the store in umap.store.
+//
+// UMAP_ANNOTATE_SCOPE(name) and UMAP_ANNOTATE_IO_SCOPE(name, bytes, store)
+// open a region for the rest of the enclosing scope.  They compile to
+// nothing unless umap is built with caliper_DIR and
+// ENABLE_CALIPER_ANNOTATIONS.
+//
+#ifdef UMAP_CALIPER_ANNOTATIONS
+#include <caliper/cali.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cxxabi.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <typeindex>
+#include <typeinfo>
+
+#include "umap/store/Store.hpp"
+
+namespace Umap {
+  //
+  // Demangled class name of a store, e.g. Umap::StoreFile, worked out once
+  // for each class
+  //
+  inline const char* store_type_name( Store* store ) {
+    static std::mutex mutex;
+    static std::map<std::type_index, std::string> names;
+
+    if ( store == nullptr )
+      return "none";
+
+    std::type_index type(typeid(*store));
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = names.find(type);
+
+    if ( it == names.end() ) {
+      int status;
+      char* name = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+
+      it = names.emplace(type, ( status == 0 ) ? name : type.name()).first;
+      free(name);
+    }
+    return it->second.c_str();
+  }
+}
+
+namespace Umap {
+  //
+  // Region for the rest of the scope, closed on the way out of an
+  // UMAP_ERROR as well.  I/O regions add the attributes, inside the region.
+  //
+  class AnnotationScope {
+    public:
+      AnnotationScope( const char* name ) : m_name(name), m_io(false) {
+        cali_begin_region(m_name);
+      }
+
+      AnnotationScope( const char* name, uint64_t nb, Store* store ) : m_name(name), m_io(true) {
+        cali_begin_region(m_name);
+        cali_begin_int_byname("umap.bytes", (int)nb);
+        cali_begin_string_byname("umap.store", store_type_name(store));
+      }
+
+      ~AnnotationScope( void ) {
+        if ( m_io ) {
+          cali_end_byname("umap.store");
+          cali_end_byname("umap.bytes");
+        }
+        cali_end_region(m_name);
+      }
+
+    private:
+      const char* m_name;
+      bool m_io;
+  };
+}
+
+#define UMAP_ANNOTATE_CAT2(a, b) a ## b
+#define UMAP_ANNOTATE_CAT(a, b) UMAP_ANNOTATE_CAT2(a, b)
+
+#define UMAP_ANNOTATE_SCOPE(name) \
+  Umap::AnnotationScope UMAP_ANNOTATE_CAT(umap_annotation_, __LINE__)(name)
+
+#define UMAP_ANNOTATE_IO_SCOPE(name, nb, store) \
+  Umap::AnnotationScope UMAP_ANNOTATE_CAT(umap_annotation_, __LINE__)(name, nb, store)
+
+#else
+
+#define UMAP_ANNOTATE_SCOPE(name)                 ((void)0)
+#define UMAP_ANNOTATE_IO_SCOPE(name, nb, store)   ((void)0)
+
+#endif // UMAP_CALIPER_ANNOTATIONS
+#endif // _UMAP_Annotation_HPP
@@ -0,0 +1,22 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_Clock_HPP
+#define _UMAP_Clock_HPP
+
+#include <cstdint>
+#include <time.h>
+
+namespace Umap {
+  static inline uint64_t now_ns( void )
+  {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+} // end of namespace Umap
+#endif // _UMAP_Clock_HPP
@@ -0,0 +1,87 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_LatencyHistogram_HPP
+#define _UMAP_LatencyHistogram_HPP
+
+#include <atomic>
+#include <cstdint>
+
+#include "umap/umap.h"
+#include "umap/util/Clock.hpp"
+
+namespace Umap {
+  //
+  // Log-linear histogram of latencies in nanoseconds: values below 16 have a
+  // bucket each, and every power of two above is split in four, so that a
+  // bucket is within 25% of the values it holds.  Threads record into it
+  // concurrently with relaxed atomics.
+  //
+  class LatencyHistogram {
+    public:
+      static const int SUB_BUCKETS = 4;
+      static const int LINEAR = 16;
+
+      LatencyHistogram( void ) { clear(); }
+
+      static int bucket_of( uint64_t ns ) {
+        if ( ns < LINEAR )
+          return (int)ns;
+
+        int e = 63 - __builtin_clzll(ns);   // At least 4
+        int sub = (int)(ns >> (e - 2)) & (SUB_BUCKETS - 1);
+
+        return LINEAR + (e - 4) * SUB_BUCKETS + sub;
+      }
+
+      static uint64_t bucket_floor( int bucket ) {
+        if ( bucket < LINEAR )
+          return (uint64_t)bucket;
+
+        int e = (bucket - LINEAR) / SUB_BUCKETS + 4;
+        int sub = (bucket - LINEAR) % SUB_BUCKETS;
+
+        return (uint64_t)(SUB_BUCKETS + sub) << (e - 2);
+      }
+
+      void record( uint64_t ns ) {
+        m_buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_total.fetch_add(ns, std::memory_order_relaxed);
+
+        uint64_t max = m_max.load(std::memory_order_relaxed);
+        while ( ns > max && ! m_max.compare_exchange_weak(max, ns, std::memory_order_relaxed) )
+          ;
+      }
+
+      void read( struct umap_latency_histogram* h ) const {
+        h->count = m_count.load(std::memory_order_relaxed);
+        h->total_ns = m_total.load(std::memory_order_relaxed);
+        h->max_ns = m_max.load(std::memory_order_relaxed);
+
+        for ( int i = 0; i < UMAP_LATENCY_BUCKETS; ++i )
+          h->buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+      }
+
+      //
+      // Values recorded while clearing may be partly kept
+      //
+      void clear( void ) {
+        m_count = 0;
+        m_total = 0;
+        m_max = 0;
+        for ( int i = 0; i < UMAP_LATENCY_BUCKETS; ++i )
+          m_buckets[i] = 0;
+      }
+
+    private:
+      std::atomic<uint64_t> m_count;
+      std::atomic<uint64_t> m_total;
+      std::atomic<uint64_t> m_max;
+      std::atomic<uint64_t> m_buckets[UMAP_LATENCY_BUCKETS];
+  };
+} // end of namespace Umap
+#endif // _UMAP_LatencyHistogram_HPP
@@ -0,0 +1,89 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_METRICS_FORMAT_HPP
+#define _UMAP_METRICS_FORMAT_HPP
+
+#include <cstdint>
+
+//
+// Shared memory segment the monitor of umap publishes its samples to, with
+// UMAP_METRICS_SHM, and umap-metrics reads.  The monitor makes seq odd while
+// it updates the segment and even again once it is done, so a reader copies
+// the segment and keeps the copy only if seq was the same even number before
+// and after.  Both ends are expected to have the same byte order.
+//
+namespace Umap {
+  namespace MetricsFormat {
+    const uint64_t MAGIC = 0x3154454d50414d55;  // "UMAPMET1" in little endian
+    const uint32_t VERSION = 1;
+    const uint32_t MAX_REGIONS = 64;
+
+    struct Region {
+      uint64_t start;
+      uint64_t size;
+      uint64_t page_size;
+      uint64_t resident_pages;
+      uint64_t dirty_pages;
+      uint64_t bytes_read;
+      uint64_t bytes_written;
+      uint64_t writebacks;
+    };
+
+    //
+    // Counters only grow for the life of the process, whatever
+    // umap_reset_stats() does.  Rates are per second over the last interval.
+    //
+    struct Segment {
+      uint64_t magic;
+      uint32_t version;
+      uint32_t pid;
+      volatile uint64_t seq;
+
+      uint64_t time_ns;             // CLOCK_MONOTONIC of the sample
+      uint64_t interval_ns;         // Since the sample before
+      uint64_t samples;
+
+      // Gauges, in pages
+      uint64_t buffer_pages;
+      uint64_t resident_pages;
+      uint64_t dirty_pages;
+      uint64_t pinned_pages;
+      uint64_t high_water_pages;    // Eviction starts at
+      uint64_t low_water_pages;     // and stops at
+      uint64_t fill_queue_depth;
+      uint64_t evict_queue_depth;
+
+      // Counters
+      uint64_t faults;
+      uint64_t spurious_faults;
+      uint64_t fills;
+      uint64_t prefetches;
+      uint64_t evictions;
+      uint64_t writebacks;
+      uint64_t bytes_read;
+      uint64_t bytes_written;
+      uint64_t free_page_waits;
+      uint64_t high_water_crossings;  // Times eviction was started
+      uint64_t low_water_crossings;   // Times eviction got down to low water
+
+      double fault_rate;
+      double fill_rate;
+      double eviction_rate;
+      double writeback_rate;
+      double read_bytes_rate;
+      double write_bytes_rate;
+      double hit_ratio;             // Of the faults of the interval, 0 if none
+      double dirty_ratio;           // Of the buffer
+
+      uint32_t num_regions;         // At most MAX_REGIONS are listed
+      uint32_t total_regions;
+      Region regions[MAX_REGIONS];
+    };
+  }
+}
+
+#endif // _UMAP_METRICS_FORMAT_HPP
@@ -0,0 +1,111 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include <errno.h>
+#include <sstream>
+#include <string.h>             // strerror()
+#include <sys/resource.h>       // setpriority()
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "umap/util/Macros.hpp"
+#include "umap/util/ThreadPlacement.hpp"
+
+namespace Umap {
+
+bool parse_cpu_list( const std::string& list, cpu_set_t* cpus )
+{
+  std::stringstream ss(list);
+  std::string range;
+
+  CPU_ZERO(cpus);
+
+  while ( std::getline(ss, range, ',') ) {
+    std::stringstream rs(range);
+    int first, last;
+    char dash;
+
+    if ( ! (rs >> first) || first < 0 )
+      return false;
+
+    if ( rs >> dash ) {
+      if ( dash != '-' || ! (rs >> last) || last < first )
+        return false;
+    }
+    else {
+      last = first;
+    }
+
+    for ( int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu )
+      CPU_SET(cpu, cpus);
+  }
+
+  return CPU_COUNT(cpus) != 0;
+}
+
+ThreadPlacement::ThreadPlacement( void )
+  :   m_has_cpus(false), m_has_nice(false), m_nice(0), m_rt_priority(0)
+{
+  CPU_ZERO(&m_cpus);
+}
+
+void ThreadPlacement::set_cpus( const std::string& cpus )
+{
+  if ( ! parse_cpu_list(cpus, &m_cpus) )
+    UMAP_ERROR("Invalid CPU list: \"" << cpus << "\"");
+
+  m_has_cpus = true;
+}
+
+void ThreadPlacement::set_priority( const std::string& priority )
+{
+  std::stringstream ss;
+  int value;
+
+  if ( priority.compare(0, 3, "rt:") == 0 ) {
+    ss.str(priority.substr(3));
+
+    if ( ! (ss >> value) || value < sched_get_priority_min(SCHED_FIFO)
+        || value > sched_get_priority_max(SCHED_FIFO) )
+      UMAP_ERROR("Invalid real-time priority: \"" << priority << "\"");
+
+    m_rt_priority = value;
+    m_has_nice = false;
+  }
+  else {
+    ss.str(priority);
+
+    if ( ! (ss >> value) || value < -20 || value > 19 )
+      UMAP_ERROR("Invalid nice value: \"" << priority << "\" (expected -20 to 19 or rt:<n>)");
+
+    m_nice = value;
+    m_has_nice = true;
+    m_rt_priority = 0;
+  }
+}
+
+void ThreadPlacement::apply( void ) const
+{
+  if ( m_has_cpus && sched_setaffinity(0, sizeof(m_cpus), &m_cpus) != 0 )
+    UMAP_LOG(Warning, "sched_setaffinity failed: " << strerror(errno));
+
+  //
+  // On Linux, the nice value is an attribute of each thread
+  //
+  if ( m_has_nice
+      && setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), m_nice) != 0 )
+    UMAP_LOG(Warning, "setpriority(" << m_nice << ") failed: " << strerror(errno));
+
+  if ( m_rt_priority != 0 ) {
+    struct sched_param param;
+
+    param.sched_priority = m_rt_priority;
+    if ( sched_setscheduler(0, SCHED_FIFO, &param) != 0 )
+      UMAP_LOG(Warning, "sched_setscheduler(SCHED_FIFO, " << m_rt_priority
+          << ") failed: " << strerror(errno));
+  }
+}
+} // end of namespace Umap
@@ -0,0 +1,54 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2020 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_ThreadPlacement_HPP
+#define _UMAP_ThreadPlacement_HPP
+
+#include <sched.h>
+#include <string>
+
+namespace Umap {
+  //
+  // Parses a CPU list such as "0-3,8,10-11" into cpus.  Returns false if the
+  // list is not well formed.
+  //
+  bool parse_cpu_list( const std::string& list, cpu_set_t* cpus );
+
+  //
+  // Where, and how eagerly, the threads of umap run.  By default they may
+  // run on any CPU with the priority they were created with.
+  //
+  class ThreadPlacement {
+    public:
+      ThreadPlacement( void );
+
+      //
+      // cpus is a CPU list, see parse_cpu_list()
+      //
+      void set_cpus( const std::string& cpus );
+
+      //
+      // priority is either a nice value, or "rt:<n>" for SCHED_FIFO with
+      // real-time priority n
+      //
+      void set_priority( const std::string& priority );
+
+      //
+      // Applies the placement to the calling thread.  Failures, such as
+      // not being allowed to raise priorities, are only logged.
+      //
+      void apply( void ) const;
+
+    private:
+      bool m_has_cpus;
+      cpu_set_t m_cpus;
+      bool m_has_nice;
+      int m_nice;
+      int m_rt_priority;      // 0 if not real-time
+  };
+} // end of namespace Umap
+
+#endif // _UMAP_ThreadPlacement_HPP
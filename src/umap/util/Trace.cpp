@@ -0,0 +1,178 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#include <algorithm>
+#include <errno.h>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "umap/util/Macros.hpp"
+#include "umap/util/Trace.hpp"
+
+namespace Umap {
+  std::atomic<bool> Trace::s_enabled(false);
+
+  struct TraceRing {
+    TraceFormat::Record* records;
+    uint64_t mask;
+    std::atomic<uint64_t> head;     // Records written ever
+  };
+
+  namespace {
+    //
+    // The rings outlive their threads, and the tracer itself is left to
+    // the end of the process, when it dumps the trace
+    //
+    struct Tracer {
+      std::mutex mutex;
+      std::string path;
+      uint64_t ring_records;
+      std::vector<TraceRing*> rings;  // Every ring, for dump()
+      std::vector<TraceRing*> idle;   // Rings of threads that have left
+
+      ~Tracer() {
+        if ( Trace::enabled() && Trace::dump(nullptr) == -1 )
+          fprintf(stderr, "umap: failed to write the trace to %s: %s\n", path.c_str(), strerror(errno));
+      }
+    };
+
+    Tracer& tracer( void ) {
+      static Tracer t;
+      return t;
+    }
+
+    TraceRing* take_ring( void ) {
+      Tracer& t = tracer();
+      std::lock_guard<std::mutex> lock(t.mutex);
+      TraceRing* ring;
+
+      if ( ! t.idle.empty() ) {
+        ring = t.idle.back();
+        t.idle.pop_back();
+        return ring;
+      }
+
+      ring = new TraceRing;
+      ring->records = new TraceFormat::Record[t.ring_records];
+      ring->mask = t.ring_records - 1;
+      ring->head = 0;
+      t.rings.push_back(ring);
+      return ring;
+    }
+
+    //
+    // Gives the ring of a thread back when the thread leaves
+    //
+    struct TraceThread {
+      TraceRing* ring;
+      uint32_t tid;
+
+      TraceThread() : ring(nullptr), tid((uint32_t)syscall(SYS_gettid)) {}
+      ~TraceThread() {
+        if ( ring != nullptr ) {
+          Tracer& t = tracer();
+          std::lock_guard<std::mutex> lock(t.mutex);
+
+          t.idle.push_back(ring);
+        }
+      }
+    };
+
+    thread_local TraceThread this_thread;
+  }
+
+  void Trace::enable( const std::string& path, uint64_t ring_records )
+  {
+    Tracer& t = tracer();
+    std::lock_guard<std::mutex> lock(t.mutex);
+
+    if ( enabled() )
+      return;
+
+    uint64_t n = 1;
+    while ( n < ring_records )
+      n <<= 1;
+
+    t.path = path;
+    t.ring_records = n;
+    s_enabled = true;
+
+    UMAP_LOG(Debug, "path: " << path << ", records per thread: " << n);
+  }
+
+  void Trace::append( TraceFormat::Event event, const void* addr, const void* region
+                    , uint64_t since, uint64_t pages, uint32_t flags, uint32_t tid )
+  {
+    TraceThread& self = this_thread;
+
+    if ( self.ring == nullptr )
+      self.ring = take_ring();
+
+    TraceRing* ring = self.ring;
+    uint64_t h = ring->head.load(std::memory_order_relaxed);
+    TraceFormat::Record& r = ring->records[h & ring->mask];
+    uint64_t now = now_ns();
+
+    r.time_ns = now;
+    r.addr = (uint64_t)addr;
+    r.region = (uint64_t)region;
+    r.latency_ns = ( since != 0 ) ? now - since : 0;
+    r.pages = (uint32_t)pages;
+    r.tid = ( tid != 0 ) ? tid : self.tid;
+    r.event = event;
+    r.flags = flags;
+
+    ring->head.store(h + 1, std::memory_order_release);
+  }
+
+  int Trace::dump( const char* path )
+  {
+    Tracer& t = tracer();
+    std::vector<TraceFormat::Record> records;
+    std::string file;
+
+    {
+      std::lock_guard<std::mutex> lock(t.mutex);
+
+      file = ( path != nullptr ) ? path : t.path;
+
+      for ( auto ring : t.rings ) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = ( head > ring->mask + 1 ) ? head - (ring->mask + 1) : 0;
+
+        for ( uint64_t i = first; i < head; ++i )
+          records.push_back(ring->records[i & ring->mask]);
+      }
+    }
+
+    std::sort(records.begin(), records.end(),
+        [](const TraceFormat::Record& a, const TraceFormat::Record& b) { return a.time_ns < b.time_ns; });
+
+    std::string::size_type pos = file.find("%p");
+    if ( pos != std::string::npos )
+      file.replace(pos, 2, std::to_string(getpid()));
+
+    FILE* f = fopen(file.c_str(), "w");
+
+    if ( f == nullptr )
+      return -1;
+
+    TraceFormat::Header header = { TraceFormat::MAGIC, TraceFormat::VERSION
+                                 , sizeof(TraceFormat::Record), records.size() };
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+           && fwrite(records.data(), sizeof(TraceFormat::Record), records.size(), f) == records.size();
+
+    if ( fclose(f) != 0 )
+      ok = false;
+
+    UMAP_LOG(Debug, records.size() << " records written to " << file);
+    return ok ? 0 : -1;
+  }
+} // end of namespace Umap
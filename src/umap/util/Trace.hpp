@@ -0,0 +1,62 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_Trace_HPP
+#define _UMAP_Trace_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "umap/util/Clock.hpp"
+#include "umap/util/TraceFormat.hpp"
+
+namespace Umap {
+  struct TraceRing;
+
+  //
+  // Binary trace of the events of the fault path, enabled with UMAP_TRACE.
+  //
+  // Each thread records into a ring of fixed size records of its own with
+  // no lock and no atomic read-modify-write, overwriting its oldest records
+  // once the ring is full.  dump() writes the records of all rings, in time
+  // order, to a file that umap-trace decodes.  Records being overwritten
+  // while they are dumped may come out torn, so a trace dumped while umap
+  // is busy may have a few bad records at the start of each ring.
+  //
+  // The rings of threads that have left are kept, for dumping, and reused
+  // by the threads that come after them.
+  //
+  class Trace {
+    public:
+      static void enable( const std::string& path, uint64_t ring_records );
+      static bool enabled( void ) { return s_enabled.load(std::memory_order_relaxed); }
+
+      //
+      // since is the time the event started at, 0 for an instant event.  tid
+      // is the thread the event is for, 0 for the calling thread.
+      //
+      static void record( TraceFormat::Event event, const void* addr, const void* region
+                        , uint64_t since, uint64_t pages = 1, uint32_t flags = 0, uint32_t tid = 0 ) {
+        if ( enabled() )
+          append(event, addr, region, since, pages, flags, tid);
+      }
+
+      //
+      // To path, or the path of UMAP_TRACE if nullptr.  A %p in the path is
+      // replaced by the pid.  Returns -1 with errno set if the file could not
+      // be written.
+      //
+      static int dump( const char* path );
+
+    private:
+      static std::atomic<bool> s_enabled;
+
+      static void append( TraceFormat::Event event, const void* addr, const void* region
+                        , uint64_t since, uint64_t pages, uint32_t flags, uint32_t tid );
+  };
+} // end of namespace Umap
+#endif // _UMAP_Trace_HPP
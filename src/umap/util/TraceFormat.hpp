@@ -0,0 +1,71 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef _UMAP_TRACE_FORMAT_HPP
+#define _UMAP_TRACE_FORMAT_HPP
+
+#include <cstdint>
+
+//
+// Files written by the tracer of umap and read by umap-trace.  A header is
+// followed by num_records records in time order.  Both ends are expected to
+// have the same byte order.
+//
+namespace Umap {
+  namespace TraceFormat {
+    const uint64_t MAGIC = 0x3143525450414d55;  // "UMAPTRC1" in little endian
+    const uint32_t VERSION = 1;
+
+    enum Event : uint32_t {
+        FAULT = 1           // Fault processed by its handler
+      , SPURIOUS_FAULT      // Fault on a page that was present already
+      , FILL                // Run of pages filled by a fill worker
+      , WRITEBACK           // Run of dirty pages written to the store
+      , EVICT               // Run of pages taken out of the Buffer
+      , DESCRIPTOR_WAIT     // Handler waiting for a free page descriptor
+      , PREFETCH            // Run of pages asked for with umap_prefetch*()
+    };
+
+    const uint32_t FLAG_WRITE = 1;      // The fault was a write
+
+    struct Header {
+      uint64_t magic;
+      uint32_t version;
+      uint32_t record_size;
+      uint64_t num_records;
+    };
+
+    //
+    // time_ns is the CLOCK_MONOTONIC time the event ended at, latency_ns
+    // how long it took, 0 for events that do not last
+    //
+    struct Record {
+      uint64_t time_ns;
+      uint64_t addr;          // First page
+      uint64_t region;        // Start of the region
+      uint64_t latency_ns;
+      uint32_t pages;
+      uint32_t tid;
+      uint32_t event;
+      uint32_t flags;
+    };
+
+    inline const char* event_name( uint32_t event ) {
+      switch (event) {
+        case FAULT:           return "fault";
+        case SPURIOUS_FAULT:  return "spurious_fault";
+        case FILL:            return "fill";
+        case WRITEBACK:       return "writeback";
+        case EVICT:           return "evict";
+        case DESCRIPTOR_WAIT: return "descriptor_wait";
+        case PREFETCH:        return "prefetch";
+        default:              return "unknown";
+      }
+    }
+  }
+}
+
+#endif // _UMAP_TRACE_FORMAT_HPP
@@ -0,0 +1,120 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// Round trip of a CompressedStore through umap regions:
+//
+//   1. A new store is mapped and three pages out of four are written, some
+//      of them with zeros, through a buffer much smaller than the region.
+//   2. The store is opened again and mapped: unwritten and zero pages read
+//      as zeros and the others as written.  A quarter of the pages is
+//      written again, leaving garbage in the log.
+//   3. compact() must shrink the log and keep the contents, which are
+//      checked once more through a read-only region of the reopened store.
+//
+// Usage: compressed-store <directory, removed first>
+//
+#include <iostream>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+
+#include "umap/umap.h"
+#include "umap/store/CompressedStore.h"
+#include "../utility/store_test.hpp"
+
+//
+// What word i of page p holds after generation gen, 0 for none
+//
+static uint64_t expected(uint64_t p, int gen)
+{
+  if (gen == 0 || p % 4 == 3 || p % 8 == 1)
+    return 0;
+  if (gen == 2 && p % 4 == 0)
+    return (p << 8) | 2;
+  return (p << 8) | 1;
+}
+
+static bool written(uint64_t p, int gen)
+{
+  return p % 4 != 3 && (gen != 2 || p % 4 == 0);
+}
+
+static off_t log_size(const std::string& dir)
+{
+  struct stat st;
+
+  return stat((dir + "/log").c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 2) {
+    std::cerr << "Usage: " << argv[0] << " <directory, removed first>" << std::endl;
+    return 1;
+  }
+
+  std::string dir = argv[1];
+  utility::StoreTest t;
+  uint64_t psize = t.page_size;
+  uint64_t size = t.size;
+  auto gen1 = [](uint64_t p, uint64_t) { return expected(p, 1); };
+  auto gen2 = [](uint64_t p, uint64_t) { return expected(p, 2); };
+
+  if (!t.fresh_directory(dir, false))
+    return 1;
+
+  {
+    Umap::CompressedStore* store = new Umap::CompressedStore(size, psize, dir);
+    uint64_t* region = t.map(store);
+
+    t.write_pages(region, [](uint64_t p) { return written(p, 1); }, gen1);
+    t.check_pages(region, gen1, "written");
+    t.unmap(region);
+
+    t.check(store->get_stored_bytes() > 0, "pages were stored");
+    t.check(store->get_compressed_bytes() < store->get_stored_bytes(), "pages were compressed");
+    t.check(store->close_files() == 0, "close_files()");
+    delete store;
+  }
+
+  off_t before;
+
+  {
+    Umap::CompressedStore* store = new Umap::CompressedStore(dir, false);
+    uint64_t* region = t.map(store);
+
+    t.check(store->is_zero_range(3 * psize, psize), "unwritten page is a zero range");
+    t.check_pages(region, gen1, "reopened");
+    t.write_pages(region, [](uint64_t p) { return written(p, 2); }, gen2);
+    t.unmap(region);
+
+    before = log_size(dir);
+    store->compact();
+    t.check(log_size(dir) < before, "compact() shrank the log");
+
+    region = t.map(store, PROT_READ);
+    t.check_pages(region, gen2, "compacted");
+    t.unmap(region);
+
+    t.check(store->close_files() == 0, "close_files()");
+    delete store;
+  }
+
+  {
+    Umap::CompressedStore* store = new Umap::CompressedStore(dir, true);
+    uint64_t* region = t.map(store, PROT_READ);
+
+    t.check_pages(region, gen2, "reopened after compact()");
+    t.unmap(region);
+    delete store;
+  }
+
+  std::cout << "log: " << before << " bytes before compact(), " << log_size(dir) << " after" << std::endl;
+
+  return t.finish(dir);
+}
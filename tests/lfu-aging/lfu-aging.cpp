@@ -0,0 +1,101 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// Aging of the frequencies of an LfuPolicy, outside of any Buffer:
+//
+//   1. Two hot pages are referenced often enough to be in the last bucket,
+//      a warm one a few times, and cold ones only once.
+//   2. The cold pages are chosen as victims, as many as the capacity, which
+//      ages the policy.  Every frequency of the pages left must have been
+//      halved exactly once and the hot pages must keep their order.
+//
+// Usage: lfu-aging
+//
+#include <iostream>
+#include <stdint.h>
+#include <vector>
+
+#include "umap/PageDescriptor.hpp"
+#include "umap/ReplacementPolicy.hpp"
+
+static const int NUM_COLD = 4;
+static const int NUM_PAGES = NUM_COLD + 3;
+static const uint32_t HOT = (1 << 17) + 6;
+static const uint32_t WARM = 6;
+
+static Umap::PageDescriptor pds[NUM_PAGES];
+static int failures;
+
+static void check(bool ok, const char* what)
+{
+  if (!ok) {
+    std::cerr << "FAILED: " << what << std::endl;
+    ++failures;
+  }
+}
+
+//
+// The order of the pages on the policy, each as its index in pds
+//
+static std::vector<int> order(Umap::ReplacementPolicy& policy)
+{
+  std::vector<Umap::PageDescriptor*> pages;
+  std::vector<int> indices;
+
+  policy.get_pages(pages);
+  for ( auto pd : pages )
+    indices.push_back(pd - pds);
+  return indices;
+}
+
+int main(int, char**)
+{
+  Umap::LfuPolicy policy(NUM_COLD);
+  int hot[2] = { NUM_COLD, NUM_COLD + 1 };
+  int warm = NUM_COLD + 2;
+
+  for ( int i = 0; i < NUM_PAGES; ++i ) {
+    pds[i].page = (char*)(uintptr_t)((i + 1) << 12);
+    pds[i].state = Umap::PageDescriptor::State::PRESENT;
+    policy.insert(&pds[i]);
+  }
+
+  for ( uint32_t f = 1; f < HOT; ++f ) {
+    policy.touch(&pds[hot[0]]);
+    policy.touch(&pds[hot[1]]);
+  }
+  for ( uint32_t f = 1; f < WARM; ++f )
+    policy.touch(&pds[warm]);
+
+  std::vector<int> before = order(policy);
+  std::vector<Umap::PageDescriptor*> victims;
+
+  policy.select_victims(victims, NUM_COLD, nullptr);
+  check(victims.size() == NUM_COLD, "the cold pages were chosen");
+  for ( auto pd : victims )
+    check(pd->frequency == 1, "only cold pages were chosen");
+
+  check(pds[hot[0]].frequency == HOT / 2 && pds[hot[1]].frequency == HOT / 2, "hot frequencies were halved once");
+  check(pds[warm].frequency == WARM / 2, "the warm frequency was halved");
+
+  std::vector<int> after = order(policy);
+  std::vector<int> hot_before, hot_after;
+
+  for ( int i : before )
+    if ( i == hot[0] || i == hot[1] )
+      hot_before.push_back(i);
+  for ( int i : after )
+    if ( i == hot[0] || i == hot[1] )
+      hot_after.push_back(i);
+  check(after.size() == NUM_PAGES - NUM_COLD, "the pages left are still on the policy");
+  check(hot_before == hot_after, "the hot pages kept their order");
+
+  std::cout << "hot frequencies: " << pds[hot[0]].frequency << ", " << pds[hot[1]].frequency << std::endl;
+  std::cout << (failures == 0 ? "PASSED" : "FAILED") << std::endl;
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,411 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// Microbenchmarks of the components of the engine, each run by 1, 2, 4...
+// threads a number of times, of which the median, mean, standard deviation,
+// minimum and maximum throughput are printed:
+//
+//   queue-list, queue-ring  A WorkItem enqueued and dequeued by each thread
+//                           on a ListWorkQueue or a RingWorkQueue
+//   region-lookup           RegionManager::containing_region() of a random
+//                           address of one of -R regions
+//   buffer-hit              Buffer::process_page_event() of a random
+//                           resident page, the path of a fault on a page
+//                           already present
+//   store-read, store-write A read_from_store() or write_to_store() of -s
+//                           bytes at a random offset of the file
+//
+// The file is the backing store of the regions and of the stores, and is
+// created, sparse, if it does not exist.
+//
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <errno.h>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "umap/Buffer.hpp"
+#include "umap/RegionManager.hpp"
+#include "umap/RingWorkQueue.hpp"
+#include "umap/WorkQueue.hpp"
+#include "umap/WorkerPool.hpp"
+#include "umap/store/Store.hpp"
+#include "umap/umap.h"
+#include "umap/util/Clock.hpp"
+
+using namespace std;
+
+struct options {
+  vector<string> benchmarks;
+  vector<uint64_t> threads;
+  uint64_t repetitions;
+  uint64_t ops;             // Per thread and repetition
+  uint64_t regions;
+  uint64_t pages;           // Of the buffer-hit region
+  uint64_t io_size;
+  string filename;
+  uint64_t file_size;
+};
+
+static const char* BENCHMARKS[] = {
+  "queue-list", "queue-ring", "region-lookup", "buffer-hit", "store-read", "store-write"
+};
+
+static void usage( char* pname, const options& o )
+{
+  cerr
+  << "Usage: " << pname << " [Options...]\n\n"
+  << " -b benchmark[,benchmark...] - default: all of";
+  for ( auto b : BENCHMARKS )
+    cerr << " " << b;
+  cerr << "\n"
+  << " -t threads[,threads...]     - default: 1,2,4\n"
+  << " -r repetitions              - default: " << o.repetitions << "\n"
+  << " -n operations per thread    - default: " << o.ops << "\n"
+  << " -R regions to look up       - default: " << o.regions << "\n"
+  << " -p pages for buffer-hit     - default: " << o.pages << "\n"
+  << " -s bytes per store I/O      - default: " << o.io_size << "\n"
+  << " -f [backing file name]      - default: " << o.filename << "\n"
+  << " -S bytes of the file        - default: " << o.file_size << "\n";
+  exit(1);
+}
+
+static vector<string> split( const string& s )
+{
+  vector<string> parts;
+  stringstream ss(s);
+  string part;
+
+  while ( getline(ss, part, ',') )
+    if ( ! part.empty() )
+      parts.push_back(part);
+  return parts;
+}
+
+static void getoptions( options& o, int argc, char** argv )
+{
+  int c;
+
+  o.benchmarks.assign(begin(BENCHMARKS), end(BENCHMARKS));
+  o.threads = {1, 2, 4};
+  o.repetitions = 5;
+  o.ops = 200000;
+  o.regions = 64;
+  o.pages = 1024;
+  o.io_size = 4096;
+  o.filename = "/tmp/umap_microbench.dat";
+  o.file_size = 64 << 20;
+
+  while ( (c = getopt(argc, argv, "b:t:r:n:R:p:s:f:S:h")) != -1 ) {
+    switch (c) {
+      case 'b': o.benchmarks = split(optarg); break;
+      case 't':
+        o.threads.clear();
+        for ( auto& t : split(optarg) )
+          o.threads.push_back(strtoull(t.c_str(), nullptr, 0));
+        break;
+      case 'r': o.repetitions = strtoull(optarg, nullptr, 0); break;
+      case 'n': o.ops = strtoull(optarg, nullptr, 0); break;
+      case 'R': o.regions = strtoull(optarg, nullptr, 0); break;
+      case 'p': o.pages = strtoull(optarg, nullptr, 0); break;
+      case 's': o.io_size = strtoull(optarg, nullptr, 0); break;
+      case 'f': o.filename = optarg; break;
+      case 'S': o.file_size = strtoull(optarg, nullptr, 0); break;
+      default: usage(argv[0], o);
+    }
+  }
+
+  for ( auto& b : o.benchmarks )
+    if ( find(begin(BENCHMARKS), end(BENCHMARKS), b) == end(BENCHMARKS) )
+      usage(argv[0], o);
+
+  for ( auto t : o.threads )
+    if ( t == 0 )
+      usage(argv[0], o);
+
+  if ( o.repetitions == 0 || o.ops == 0 || o.regions == 0 || o.pages == 0
+      || o.io_size == 0 || o.io_size > o.file_size )
+    usage(argv[0], o);
+}
+
+static inline uint64_t xorshift( uint64_t& x )
+{
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return x;
+}
+
+//
+// Runs body(thread, ops) on each of num_threads threads, released together,
+// and returns the nanoseconds until the last one is done
+//
+template <typename Body>
+static uint64_t run_threads( uint64_t num_threads, uint64_t ops, Body body )
+{
+  atomic<uint64_t> ready(0);
+  atomic<bool> go(false);
+  vector<thread> threads;
+
+  for ( uint64_t t = 0; t < num_threads; ++t ) {
+    threads.push_back(thread([&, t]() {
+      ++ready;
+      while ( ! go.load(memory_order_acquire) )
+        this_thread::yield();
+      body(t, ops);
+    }));
+  }
+
+  while ( ready != num_threads )
+    this_thread::yield();
+
+  uint64_t start = Umap::now_ns();
+  go.store(true, memory_order_release);
+
+  for ( auto& th : threads )
+    th.join();
+
+  return Umap::now_ns() - start;
+}
+
+//
+// Repeats a benchmark, after a run to warm it up, and prints the summary of
+// its throughput with the time per operation of the median run
+//
+template <typename Body>
+static void measure( const string& name, uint64_t num_threads, const options& o, Body body )
+{
+  vector<double> mops;
+
+  run_threads(num_threads, std::max<uint64_t>(o.ops / 10, 1), body);
+
+  for ( uint64_t r = 0; r < o.repetitions; ++r ) {
+    uint64_t ns = run_threads(num_threads, o.ops, body);
+    mops.push_back((double)(num_threads * o.ops) * 1000.0 / std::max<uint64_t>(ns, 1));
+  }
+
+  sort(mops.begin(), mops.end());
+
+  double median = ( mops.size() % 2 ) ? mops[mops.size() / 2]
+                : (mops[mops.size() / 2 - 1] + mops[mops.size() / 2]) / 2;
+  double mean = 0, var = 0;
+
+  for ( auto m : mops )
+    mean += m;
+  mean /= mops.size();
+
+  for ( auto m : mops )
+    var += (m - mean) * (m - mean);
+  double stddev = ( mops.size() > 1 ) ? sqrt(var / (mops.size() - 1)) : 0;
+
+  cout << setw(14) << left << name << right
+       << setw(8) << num_threads
+       << fixed << setprecision(3)
+       << setw(12) << median
+       << setw(12) << mean
+       << setw(10) << stddev
+       << setw(12) << mops.front()
+       << setw(12) << mops.back()
+       << setprecision(1)
+       << setw(12) << num_threads * 1000.0 / median
+       << endl;
+}
+
+static void bench_queue( const string& name, uint64_t num_threads, const options& o )
+{
+  Umap::WorkQueue<Umap::WorkItem>* wq;
+
+  if ( name == "queue-ring" )
+    wq = new Umap::RingWorkQueue<Umap::WorkItem>(num_threads, 1024);
+  else
+    wq = new Umap::ListWorkQueue<Umap::WorkItem>(num_threads);
+
+  //
+  // Each thread dequeues after each of its enqueues, so the queue always
+  // has an item for a dequeue that waits
+  //
+  measure(name, num_threads, o, [wq](uint64_t, uint64_t ops) {
+    Umap::WorkItem w = { nullptr, Umap::WorkItem::WorkType::NONE, 0 };
+
+    for ( uint64_t i = 0; i < ops; ++i ) {
+      wq->enqueue(w);
+      w = wq->dequeue();
+    }
+  });
+
+  delete wq;
+}
+
+static int open_file( const options& o )
+{
+  int fd = open(o.filename.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+
+  if ( fd == -1 ) {
+    cerr << o.filename << ": " << strerror(errno) << endl;
+    exit(1);
+  }
+
+  struct stat st;
+  if ( fstat(fd, &st) == 0 && (uint64_t)st.st_size < o.file_size && ftruncate(fd, o.file_size) == -1 ) {
+    cerr << o.filename << ": ftruncate failed: " << strerror(errno) << endl;
+    exit(1);
+  }
+  return fd;
+}
+
+static void* map_region( int fd, uint64_t size )
+{
+  void* region = umap(NULL, size, PROT_READ | PROT_WRITE, UMAP_PRIVATE, fd, 0);
+
+  if ( region == UMAP_FAILED ) {
+    cerr << "umap of " << size << " bytes failed: " << strerror(errno) << endl;
+    exit(1);
+  }
+  return region;
+}
+
+static void bench_region_lookup( uint64_t num_threads, const options& o, int fd )
+{
+  const uint64_t psize = umapcfg_get_umap_page_size();
+  const uint64_t region_size = 16 * psize;
+  vector<char*> regions;
+
+  for ( uint64_t i = 0; i < o.regions; ++i )
+    regions.push_back((char*)map_region(fd, region_size));
+
+  Umap::RegionManager& rm = Umap::RegionManager::getInstance();
+
+  measure("region-lookup", num_threads, o, [&](uint64_t t, uint64_t ops) {
+    uint64_t x = 0x9E3779B97F4A7C15ULL * (t + 1);
+    uint64_t found = 0;
+
+    for ( uint64_t i = 0; i < ops; ++i ) {
+      uint64_t r = xorshift(x);
+      char* addr = regions[r % regions.size()] + (r >> 32) % region_size;
+
+      found += ( rm.containing_region(addr) != nullptr );
+    }
+
+    if ( found != ops ) {
+      cerr << "region-lookup: " << ops - found << " addresses not found" << endl;
+      exit(1);
+    }
+  });
+
+  for ( auto r : regions )
+    uunmap(r, region_size);
+}
+
+static void bench_buffer_hit( uint64_t num_threads, const options& o, int fd )
+{
+  const uint64_t psize = umapcfg_get_umap_page_size();
+  const uint64_t size = o.pages * psize;
+
+  if ( o.pages > umapcfg_get_max_pages_in_buffer() / 2 ) {
+    cerr << "buffer-hit: " << o.pages << " pages would not stay in a buffer of "
+      << umapcfg_get_max_pages_in_buffer() << " pages" << endl;
+    exit(1);
+  }
+
+  char* region = (char*)map_region(fd, size);
+  uint64_t sum = 0;
+
+  for ( uint64_t p = 0; p < o.pages; ++p )
+    sum += *(volatile char*)(region + p * psize);
+
+  Umap::RegionManager& rm = Umap::RegionManager::getInstance();
+  Umap::Buffer* buffer = rm.get_buffer_h();
+  Umap::RegionDescriptor* rd = rm.containing_region(region);
+
+  measure("buffer-hit", num_threads, o, [&](uint64_t t, uint64_t ops) {
+    uint64_t x = 0x9E3779B97F4A7C15ULL * (t + 1);
+
+    for ( uint64_t i = 0; i < ops; ++i )
+      buffer->process_page_event(region + (xorshift(x) % o.pages) * psize, false, rd);
+  });
+
+  uunmap(region, size);
+  (void)sum;
+}
+
+static void bench_store( const string& name, uint64_t num_threads, const options& o, int fd )
+{
+  Umap::Store* store = Umap::Store::make_store(nullptr, o.file_size, o.io_size, fd);
+  const uint64_t slots = o.file_size / o.io_size;
+  const bool write = ( name == "store-write" );
+  vector<char*> bufs;
+
+  for ( uint64_t t = 0; t < num_threads; ++t ) {
+    char* buf = (char*)aligned_alloc(4096, (o.io_size + 4095) & ~4095ULL);
+    memset(buf, (int)t, o.io_size);
+    bufs.push_back(buf);
+  }
+
+  measure(name, num_threads, o, [&](uint64_t t, uint64_t ops) {
+    uint64_t x = 0x9E3779B97F4A7C15ULL * (t + 1);
+
+    for ( uint64_t i = 0; i < ops; ++i ) {
+      off_t off = (off_t)((xorshift(x) % slots) * o.io_size);
+      ssize_t n = write ? store->write_to_store(bufs[t], o.io_size, off)
+                        : store->read_from_store(bufs[t], o.io_size, off);
+
+      if ( n == -1 ) {
+        cerr << name << " failed: " << strerror(errno) << endl;
+        exit(1);
+      }
+    }
+  });
+
+  for ( auto buf : bufs )
+    free(buf);
+  delete store;
+}
+
+int main( int argc, char** argv )
+{
+  options o;
+
+  getoptions(o, argc, argv);
+
+  int fd = open_file(o);
+
+  cout << setw(14) << left << "benchmark" << right
+       << setw(8) << "threads"
+       << setw(12) << "Mops/s p50"
+       << setw(12) << "mean"
+       << setw(10) << "stddev"
+       << setw(12) << "min"
+       << setw(12) << "max"
+       << setw(12) << "ns/op p50" << endl;
+
+  for ( auto& b : o.benchmarks ) {
+    for ( auto t : o.threads ) {
+      if ( b == "queue-list" || b == "queue-ring" )
+        bench_queue(b, t, o);
+      else if ( b == "region-lookup" )
+        bench_region_lookup(t, o, fd);
+      else if ( b == "buffer-hit" )
+        bench_buffer_hit(t, o, fd);
+      else
+        bench_store(b, t, o, fd);
+    }
+  }
+
+  close(fd);
+  return 0;
+}
@@ -13,13 +13,37 @@
  * the average cost of WRITE PAGE FAULTs.
  *
  * A number of threads may be specified on the command line to enable concurrent I/O
- * access within the file.  Further, the file may be accessed sequentially (default)
- * or randomly (if "--shuffle" command line option is specified).
+ * access within the file.  The pages accessed, and in which order, are those of a
+ * pattern:
+ *
+ *   seq      Each page of the working set in turn (default)
+ *   shuffle  Each page of the working set once, in random order (or "--shuffle")
+ *   stride   Every --stride-th page, then those after them, and so on
+ *   streams  --streams sequential streams over slices of the working set, interleaved
+ *   zipf     Pages drawn with a Zipfian distribution of parameter --zipf-theta, the
+ *            hottest pages being spread over the working set
+ *   hotset   Pages drawn from a --hot-fraction of the working set with probability
+ *            --hot-probability, from the rest otherwise
+ *
+ * The working set is the first pages of the file, --ws-ratio times the pages of the
+ * umap buffer, or all of them by default.  --write-ratio makes that share of the
+ * accesses of pfbenchmark-read writes.  A --warmup phase of as many accesses as
+ * asked for runs before the one measured, and the statistics of umap are reset in
+ * between.
+ *
+ * The result is printed as one CSV line unless --output asks for csv, with a header,
+ * or json, with the configuration, the statistics of umap and the fault latencies of
+ * UMAP_LATENCY_HISTOGRAMS.  With --output-file, CSV lines are appended to the file,
+ * the header only being written to an empty file.
  */
 
 #include <iostream>
 #include <chrono>
+#include <cmath>
+#include <fstream>
+#include <getopt.h>
 #include <omp.h>
+#include <sstream>
 #include <string.h>
 #include <vector>
 #include <random>
@@ -32,175 +56,522 @@
 
 using namespace std;
 using namespace chrono;
+
+struct workload_t {
+  string pattern;
+  uint64_t stride;
+  uint64_t streams;
+  double zipf_theta;
+  double hot_fraction;
+  double hot_probability;
+  double write_ratio;
+  double ws_ratio;        // 0 for the whole file
+  uint64_t warmup;
+  string output;          // "", "csv" or "json"
+  string output_file;
+  uint64_t seed;
+};
+
 static bool usemmap = false;
 static uint64_t pagesize;
 static uint64_t page_step;
 static uint64_t* glb_array;
 static utility::umt_optstruct_t options;
+static workload_t workload;
 static uint64_t pages_to_access;
-vector<uint64_t> shuffled_indexes;
+static uint64_t working_set;
+static string mode;
 
-void do_write_pages(uint64_t page_step, uint64_t pages)
+static void usage(char* pname)
 {
-#pragma omp parallel for
-  for (uint64_t i = 0; i < pages; ++i) {
-    uint64_t myidx = shuffled_indexes[i];
-    glb_array[myidx * page_step] = (myidx * page_step);
-  }
+  cerr
+  << "Usage: " << pname << " [--initonly] [--noinit] [--usemmap] [-p #] [-t #] [-a #] [-f name]\n"
+  <<                       " [workload options]\n\n"
+  << " --help                 - This message\n"
+  << " --initonly             - Initialize file, then stop\n"
+  << " --noinit               - Use previously initialized file\n"
+  << " --usemmap              - Use mmap instead of umap\n"
+  << " -p # of pages          - default: " << utility::NUMPAGES << " test pages\n"
+  << " -t # of threads        - default: " << utility::NUMTHREADS << " application threads\n"
+  << " -a # pages to access   - default: 0 - as many as the working set has\n"
+  << " -f [file name]         - backing file name\n"
+  << " \n"
+  << " Workload options:\n"
+  << " --pattern name         - seq, shuffle, stride, streams, zipf or hotset, default: seq\n"
+  << " --shuffle              - Same as --pattern shuffle\n"
+  << " --stride #             - Pages between accesses of stride, default: 16\n"
+  << " --streams #            - Sequential streams of streams, default: 4\n"
+  << " --zipf-theta #         - Skew of zipf, below 1, default: 0.99\n"
+  << " --hot-fraction #       - Share of the working set that is hot, default: 0.1\n"
+  << " --hot-probability #    - Share of the accesses to the hot pages, default: 0.9\n"
+  << " --write-ratio #        - Share of the accesses that write, default: 0 for\n"
+  << "                          pfbenchmark-read, 1 for pfbenchmark-write\n"
+  << " --ws-ratio #           - Working set over buffer pages, default: 0 - all pages\n"
+  << " --warmup #             - Accesses before those measured, default: 0\n"
+  << " --seed #               - Of the random patterns, default: 1\n"
+  << " --output csv|json      - default: one CSV line without header\n"
+  << " --output-file name     - default: standard output\n"
+  << " \n"
+  << " Environment Variable Configuration:\n"
+  << " UMAP_PAGE_FILLERS(env) - currently: " << umapcfg_get_num_fillers() << " fillers\n"
+  << " UMAP_PAGE_EVICTORS(env)- currently: " << umapcfg_get_num_evictors() << " evictors\n"
+  << " UMAP_BUFSIZE(env)      - currently: " << umapcfg_get_max_pages_in_buffer() << " pages\n"
+  << " UMAP_PAGESIZE(env)     - currently: " << umapcfg_get_umap_page_size() << " bytes\n"
+  ;
+  exit(1);
 }
 
-uint64_t do_read_pages(uint64_t page_step, uint64_t pages)
+static void getoptions(int argc, char** argv)
 {
-  uint64_t x;
+  enum { PATTERN = 256, STRIDE, STREAMS, ZIPF_THETA, HOT_FRACTION, HOT_PROBABILITY
+       , WRITE_RATIO, WS_RATIO, WARMUP, SEED, OUTPUT, OUTPUT_FILE };
+  char* pname = argv[0];
+  int c;
 
-  // Weird logic to make sure that compiler doesn't optimize out our read of glb_array[i]
-#pragma omp parallel for
-  for (uint64_t i = 0; i < pages; ++i) {
-    uint64_t myidx = shuffled_indexes[i];
-    x = glb_array[myidx * page_step];
-
-    if (x != (myidx * page_step)) {
-      cout << __FUNCTION__ << "glb_array[" << myidx * page_step << "]: (" << glb_array[myidx*page_step] << ") != " << myidx * page_step << "\n";
-      exit(1);
+  options.initonly = 0;
+  options.noinit = 0;
+  options.usemmap = 0;
+  options.shuffle = 0;
+  options.pages_to_access = 0;
+  options.numpages = utility::NUMPAGES;
+  options.numthreads = utility::NUMTHREADS;
+  options.bufsize = umapcfg_get_max_pages_in_buffer();
+  options.uffdthreads = umapcfg_get_num_fillers();
+  options.filename = utility::FILENAME;
+  options.dirname = utility::DIRNAME;
+  options.pagesize = umapcfg_get_umap_page_size();
+
+  workload.pattern = "seq";
+  workload.stride = 16;
+  workload.streams = 4;
+  workload.zipf_theta = 0.99;
+  workload.hot_fraction = 0.1;
+  workload.hot_probability = 0.9;
+  workload.write_ratio = -1;
+  workload.ws_ratio = 0;
+  workload.warmup = 0;
+  workload.seed = 1;
+
+  while (1) {
+    int option_index = 0;
+    static struct option long_options[] = {
+      {"initonly",        no_argument,        &options.initonly, 1 },
+      {"noinit",          no_argument,        &options.noinit,   1 },
+      {"usemmap",         no_argument,        &options.usemmap,  1 },
+      {"shuffle",         no_argument,        &options.shuffle,  1 },
+      {"pattern",         required_argument,  NULL, PATTERN },
+      {"stride",          required_argument,  NULL, STRIDE },
+      {"streams",         required_argument,  NULL, STREAMS },
+      {"zipf-theta",      required_argument,  NULL, ZIPF_THETA },
+      {"hot-fraction",    required_argument,  NULL, HOT_FRACTION },
+      {"hot-probability", required_argument,  NULL, HOT_PROBABILITY },
+      {"write-ratio",     required_argument,  NULL, WRITE_RATIO },
+      {"ws-ratio",        required_argument,  NULL, WS_RATIO },
+      {"warmup",          required_argument,  NULL, WARMUP },
+      {"seed",            required_argument,  NULL, SEED },
+      {"output",          required_argument,  NULL, OUTPUT },
+      {"output-file",     required_argument,  NULL, OUTPUT_FILE },
+      {"help",            no_argument,        NULL, 0 },
+      {0,                 0,                  0,    0 }
+    };
+
+    c = getopt_long(argc, argv, "p:t:f:a:", long_options, &option_index);
+    if (c == -1)
+      break;
+
+    switch(c) {
+      case 0:
+        if (long_options[option_index].flag != 0)
+          break;
+        usage(pname);
+        break;
+      case 'p':
+        if ((options.numpages = strtoull(optarg, nullptr, 0)) > 0)
+          break;
+        usage(pname);
+        break;
+      case 't':
+        if ((options.numthreads = strtoull(optarg, nullptr, 0)) > 0)
+          break;
+        usage(pname);
+        break;
+      case 'a': options.pages_to_access = strtoull(optarg, nullptr, 0); break;
+      case 'f': options.filename = optarg; break;
+      case PATTERN: workload.pattern = optarg; break;
+      case STRIDE: workload.stride = strtoull(optarg, nullptr, 0); break;
+      case STREAMS: workload.streams = strtoull(optarg, nullptr, 0); break;
+      case ZIPF_THETA: workload.zipf_theta = strtod(optarg, nullptr); break;
+      case HOT_FRACTION: workload.hot_fraction = strtod(optarg, nullptr); break;
+      case HOT_PROBABILITY: workload.hot_probability = strtod(optarg, nullptr); break;
+      case WRITE_RATIO: workload.write_ratio = strtod(optarg, nullptr); break;
+      case WS_RATIO: workload.ws_ratio = strtod(optarg, nullptr); break;
+      case WARMUP: workload.warmup = strtoull(optarg, nullptr, 0); break;
+      case SEED: workload.seed = strtoull(optarg, nullptr, 0); break;
+      case OUTPUT: workload.output = optarg; break;
+      case OUTPUT_FILE: workload.output_file = optarg; break;
+      default:
+        usage(pname);
     }
   }
 
-  return x;
+  if (options.shuffle)
+    workload.pattern = "shuffle";
+
+  const char* patterns[] = { "seq", "shuffle", "stride", "streams", "zipf", "hotset" };
+  if (find(begin(patterns), end(patterns), workload.pattern) == end(patterns)) {
+    cerr << "Unknown pattern " << workload.pattern << "\n";
+    usage(pname);
+  }
+
+  if (workload.stride == 0 || workload.streams == 0
+      || workload.zipf_theta <= 0 || workload.zipf_theta >= 1
+      || workload.hot_fraction <= 0 || workload.hot_fraction > 1
+      || workload.hot_probability < 0 || workload.hot_probability > 1
+      || workload.write_ratio > 1 || workload.ws_ratio < 0
+      || (workload.output != "" && workload.output != "csv" && workload.output != "json")) {
+    cerr << "Invalid workload option\n";
+    usage(pname);
+  }
+
+  if (optind < argc) {
+    cerr << "Unknown Arguments: ";
+    while (optind < argc)
+      cerr << "\"" << argv[optind++] << "\" ";
+    cerr << endl;
+    usage(pname);
+  }
 }
 
-uint64_t do_read_modify_write_pages(uint64_t page_step, uint64_t pages)
+//
+// Zipfian ranks from 0 (the most frequent) to n - 1, after Gray et al.,
+// "Quickly generating billion-record synthetic databases"
+//
+class zipf_generator {
+  public:
+    zipf_generator(uint64_t n, double theta) : m_n(n), m_theta(theta) {
+      m_zetan = zeta(n, theta);
+      m_alpha = 1.0 / (1.0 - theta);
+      m_eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta(2, theta) / m_zetan);
+    }
+
+    uint64_t operator()(mt19937_64& g) {
+      double u = uniform_real_distribution<double>(0.0, 1.0)(g);
+      double uz = u * m_zetan;
+
+      if (uz < 1.0)
+        return 0;
+      if (uz < 1.0 + pow(0.5, m_theta))
+        return 1;
+      return min(m_n - 1, (uint64_t)(m_n * pow(m_eta * u - m_eta + 1.0, m_alpha)));
+    }
+
+  private:
+    uint64_t m_n;
+    double m_theta, m_zetan, m_alpha, m_eta;
+
+    static double zeta(uint64_t n, double theta) {
+      double sum = 0;
+      for (uint64_t i = 1; i <= n; ++i)
+        sum += 1.0 / pow((double)i, theta);
+      return sum;
+    }
+};
+
+//
+// The pages, within the working set, of count accesses of the pattern
+//
+static vector<uint64_t> make_accesses(uint64_t count, mt19937_64& g)
 {
-  uint64_t x;
+  vector<uint64_t> pages;
+  const uint64_t ws = working_set;
+  const string& p = workload.pattern;
 
-  // Weird logic to make sure that compiler doesn't optimize out our read of glb_array[i]
-#pragma omp parallel for
-  for (uint64_t i = 0; i < pages; ++i) {
-    uint64_t myidx = shuffled_indexes[i];
-    x = glb_array[myidx * page_step];
+  pages.reserve(count);
 
-    if (x != (myidx * page_step)) {
-      cout << __FUNCTION__ << "glb_array[" << myidx * page_step << "]: (" << x << ") != " << myidx * page_step << "\n";
-      exit(1);
+  if (p == "seq") {
+    for (uint64_t i = 0; i < count; ++i)
+      pages.push_back(i % ws);
+  }
+  else if (p == "shuffle") {
+    vector<uint64_t> perm(ws);
+    for (uint64_t i = 0; i < ws; ++i)
+      perm[i] = i;
+
+    while (pages.size() < count) {
+      shuffle(perm.begin(), perm.end(), g);
+      for (uint64_t i = 0; i < ws && pages.size() < count; ++i)
+        pages.push_back(perm[i]);
+    }
+  }
+  else if (p == "stride") {
+    const uint64_t stride = min(workload.stride, ws);
+
+    while (pages.size() < count)
+      for (uint64_t first = 0; first < stride && pages.size() < count; ++first)
+        for (uint64_t page = first; page < ws && pages.size() < count; page += stride)
+          pages.push_back(page);
+  }
+  else if (p == "streams") {
+    const uint64_t streams = min(workload.streams, ws);
+    const uint64_t slice = ws / streams;
+
+    for (uint64_t i = 0; i < count; ++i)
+      pages.push_back((i % streams) * slice + (i / streams) % slice);
+  }
+  else {
+    //
+    // The hot pages are spread over the working set rather than being its
+    // first pages, which read-ahead would favor
+    //
+    vector<uint64_t> perm(ws);
+    for (uint64_t i = 0; i < ws; ++i)
+      perm[i] = i;
+    shuffle(perm.begin(), perm.end(), g);
+
+    if (p == "zipf") {
+      zipf_generator zipf(ws, workload.zipf_theta);
+
+      for (uint64_t i = 0; i < count; ++i)
+        pages.push_back(perm[zipf(g)]);
     }
     else {
-      glb_array[myidx * page_step] = (myidx * page_step);
-      x++;
+      const uint64_t hot = max<uint64_t>(1, (uint64_t)(ws * workload.hot_fraction));
+      bernoulli_distribution is_hot(workload.hot_probability);
+      uniform_int_distribution<uint64_t> hot_page(0, hot - 1);
+      uniform_int_distribution<uint64_t> cold_page(min(hot, ws - 1), ws - 1);
+
+      for (uint64_t i = 0; i < count; ++i)
+        pages.push_back(perm[is_hot(g) ? hot_page(g) : cold_page(g)]);
     }
   }
-  return x;
+
+  return pages;
 }
 
-void print_stats( void )
+static vector<char> make_writes(uint64_t count, double ratio, mt19937_64& g)
 {
-  if (!usemmap) {
-#if 0
-    struct umap_cfg_stats s;
-    umap_cfg_get_stats(glb_array, &s);
+  vector<char> writes(count);
+  bernoulli_distribution is_write(ratio);
 
-    cout << s.dirty_evicts << " Dirty Evictions\n";
-    cout << s.evict_victims << " Victims\n";
-    cout << s.wp_messages << " WP Faults\n";
-    cout << s.read_faults << " Read Faults\n";
-    cout << s.write_faults << " Write Faults\n";
-#endif
-  }
+  for (uint64_t i = 0; i < count; ++i)
+    writes[i] = (ratio >= 1.0) ? 1 : (ratio <= 0.0) ? 0 : is_write(g);
+  return writes;
 }
 
-int read_test(int argc, char **argv)
+//
+// With writes in the mix, a page may be read before it was ever written, so
+// its word is zero in a file that was not initialized by pfbenchmark-write
+//
+static uint64_t do_accesses(const vector<uint64_t>& pages, const vector<char>& writes, bool rmw, bool strict)
 {
-  auto start_time = chrono::high_resolution_clock::now();
-  do_read_pages(page_step, pages_to_access);
-  auto end_time = chrono::high_resolution_clock::now();
+  uint64_t x = 0;
+  const uint64_t count = pages.size();
+
+#pragma omp parallel for
+  for (uint64_t i = 0; i < count; ++i) {
+    uint64_t myidx = pages[i];
+    uint64_t expected = myidx * page_step;
 
-  cout << ((options.usemmap == 1) ? "mmap" : "umap") << ","
-      << (( options.shuffle == 1) ? "shuffle" : "seq") << ","
-      << "read,"
-      << options.numthreads << ","
-      << options.uffdthreads << ","
-      << chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count() / pages_to_access << "\n";
+    if (writes[i] && !rmw) {
+      glb_array[expected] = expected;
+      continue;
+    }
 
-  return 0;
-}
+    uint64_t v = glb_array[expected];
 
-int write_test(int argc, char **argv)
-{
-  auto start_time = chrono::high_resolution_clock::now();
-  do_write_pages(page_step, pages_to_access);
-  auto end_time = chrono::high_resolution_clock::now();
+    if (v != expected && (strict || v != 0)) {
+      cout << __FUNCTION__ << "glb_array[" << expected << "]: (" << v << ") != " << expected << "\n";
+      exit(1);
+    }
 
-  cout << ((options.usemmap == 1) ? "mmap" : "umap") << ","
-      << (( options.shuffle == 1) ? "shuffle" : "seq") << ","
-      << "write,"
-      << options.numthreads << ","
-      << options.uffdthreads << ","
-      << chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count() / pages_to_access << "\n";
+    if (rmw)
+      glb_array[expected] = expected;
+    x = v;
+  }
 
-  return 0;
+  return x;
 }
 
-int read_modify_write_test(int argc, char **argv)
+static void report(uint64_t elapsed_ns, uint64_t accesses, double write_ratio)
 {
-  auto start_time = chrono::high_resolution_clock::now();
-  auto end_time = chrono::high_resolution_clock::now();
+  struct umap_stats s;
+  struct umap_latency_histogram h;
 
-  start_time = chrono::high_resolution_clock::now();
-  do_read_modify_write_pages(page_step, pages_to_access);
-  end_time = chrono::high_resolution_clock::now();
+  memset(&s, 0, sizeof(s));
+  memset(&h, 0, sizeof(h));
 
-  cout << ((options.usemmap == 1) ? "mmap" : "umap") << ","
-      << (( options.shuffle == 1) ? "shuffle" : "seq") << ","
-      << "rmw,"
-      << options.numthreads << ","
-      << options.uffdthreads << ","
-      << chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count() / pages_to_access << "\n";
+  if (!usemmap) {
+    umap_get_stats(&s);
+    umap_get_latency_histogram(UMAP_LATENCY_FAULT, &h);
+  }
 
-  return 0;
+  uint64_t ns_per_access = elapsed_ns / max<uint64_t>(accesses, 1);
+
+  if (workload.output == "") {
+    cout << (usemmap ? "mmap" : "umap") << ","
+         << workload.pattern << ","
+         << mode << ","
+         << options.numthreads << ","
+         << options.uffdthreads << ","
+         << ns_per_access << "\n";
+    return;
+  }
+
+  vector<pair<string, string>> fields;
+  auto add = [&fields](const string& name, const string& value) { fields.push_back(make_pair(name, value)); };
+  auto num = [](uint64_t v) { return to_string(v); };
+  auto real = [](double v) { ostringstream ss; ss << v; return ss.str(); };
+
+  add("mapping", usemmap ? "mmap" : "umap");
+  add("mode", mode);
+  add("pattern", workload.pattern);
+  add("threads", num(options.numthreads));
+  add("fillers", num(umapcfg_get_num_fillers()));
+  add("evictors", num(umapcfg_get_num_evictors()));
+  add("page_size", num(pagesize));
+  add("file_pages", num(options.numpages));
+  add("buffer_pages", num(umapcfg_get_max_pages_in_buffer()));
+  add("working_set_pages", num(working_set));
+  add("ws_ratio", real((double)working_set / umapcfg_get_max_pages_in_buffer()));
+  add("write_ratio", real(write_ratio));
+  add("stride", num(workload.stride));
+  add("streams", num(workload.streams));
+  add("zipf_theta", real(workload.zipf_theta));
+  add("hot_fraction", real(workload.hot_fraction));
+  add("hot_probability", real(workload.hot_probability));
+  add("warmup", num(workload.warmup));
+  add("seed", num(workload.seed));
+  add("accesses", num(accesses));
+  add("elapsed_ns", num(elapsed_ns));
+  add("ns_per_access", num(ns_per_access));
+  add("accesses_per_sec", real(accesses * 1e9 / max<uint64_t>(elapsed_ns, 1)));
+  add("faults", num(s.faults));
+  add("fills", num(s.fills));
+  add("prefetches", num(s.prefetches));
+  add("evictions", num(s.evictions));
+  add("writebacks", num(s.writebacks));
+  add("bytes_read", num(s.bytes_read));
+  add("bytes_written", num(s.bytes_written));
+  add("fault_p50_ns", num(umap_latency_percentile(&h, 50.0)));
+  add("fault_p99_ns", num(umap_latency_percentile(&h, 99.0)));
+  add("fault_max_ns", num(h.max_ns));
+
+  ofstream file;
+  bool empty = true;
+
+  if (workload.output_file != "") {
+    ifstream existing(workload.output_file);
+    empty = !existing.good() || existing.peek() == ifstream::traits_type::eof();
+    file.open(workload.output_file, ios::app);
+    if (!file) {
+      cerr << "Failed to open " << workload.output_file << "\n";
+      exit(1);
+    }
+  }
+  ostream& out = (workload.output_file != "") ? file : cout;
+
+  if (workload.output == "csv") {
+    if (empty) {
+      for (size_t i = 0; i < fields.size(); ++i)
+        out << (i ? "," : "") << fields[i].first;
+      out << "\n";
+    }
+    for (size_t i = 0; i < fields.size(); ++i)
+      out << (i ? "," : "") << fields[i].second;
+    out << "\n";
+  }
+  else {
+    out << "{";
+    for (size_t i = 0; i < fields.size(); ++i) {
+      const string& v = fields[i].second;
+      bool quoted = (fields[i].first == "mapping" || fields[i].first == "mode" || fields[i].first == "pattern");
+
+      out << (i ? ", " : "") << "\"" << fields[i].first << "\": "
+          << (quoted ? "\"" : "") << v << (quoted ? "\"" : "");
+    }
+    out << "}\n";
+  }
 }
 
 int main(int argc, char **argv)
 {
-  int rval = -1;
-  std::random_device rd;
-  std::mt19937 g(rd());
+  getoptions(argc, argv);
 
-  umt_getoptions(&options, argc, argv);
+  /*
+   * Get the program name
+   */
+  char* pname = strrchr(argv[0], '/');
+  if ( pname != NULL )
+    pname += 1;
+  else
+    pname = argv[0];
 
-  for (uint64_t i = 0; i < options.numpages; ++i)
-    shuffled_indexes.push_back(i);
+  bool rmw = false;
+  double write_ratio;
 
-  pages_to_access = options.pages_to_access ? options.pages_to_access : options.numpages;
+  if (strcmp(pname, "pfbenchmark-read") == 0) {
+    mode = "read";
+    write_ratio = 0;
+  }
+  else if (strcmp(pname, "pfbenchmark-write") == 0) {
+    mode = "write";
+    write_ratio = 1;
+  }
+  else if (strcmp(pname, "pfbenchmark-readmodifywrite") == 0) {
+    mode = "rmw";
+    write_ratio = 0;
+    rmw = true;
+  }
+  else {
+    cerr << "Unknown test mode " << pname << "\n";
+    return -1;
+  }
 
-  if ( options.shuffle )
-    std::shuffle(shuffled_indexes.begin(), shuffled_indexes.end(), g);
+  if (workload.write_ratio >= 0 && !rmw) {
+    write_ratio = workload.write_ratio;
+    if (write_ratio != 0 && write_ratio != 1)
+      mode = "mixed";
+  }
 
-  options.initonly = 0;
   usemmap = (options.usemmap == 1);
   omp_set_num_threads(options.numthreads);
   pagesize = (uint64_t)utility::umt_getpagesize();
   page_step = pagesize/sizeof(uint64_t);
 
-  glb_array = (uint64_t*) utility::map_in_file(options.filename, options.initonly,
+  working_set = options.numpages;
+  if (workload.ws_ratio > 0)
+    working_set = min(options.numpages,
+        max<uint64_t>(1, (uint64_t)(workload.ws_ratio * umapcfg_get_max_pages_in_buffer())));
+
+  pages_to_access = options.pages_to_access ? options.pages_to_access : working_set;
+
+  mt19937_64 g(workload.seed);
+  vector<uint64_t> warmup_pages = make_accesses(workload.warmup, g);
+  vector<char> warmup_writes = make_writes(workload.warmup, write_ratio, g);
+  vector<uint64_t> pages = make_accesses(pages_to_access, g);
+  vector<char> writes = make_writes(pages_to_access, write_ratio, g);
+
+  glb_array = (uint64_t*) utility::map_in_file(options.filename, 0,
       options.noinit, options.usemmap, pagesize * options.numpages);
 
-  /*
-   * Get the program name
-   */
-  char* pname = strrchr(argv[0], '/');
-  if ( pname != NULL )
-    pname += 1;
-  else
-    pname = argv[0];
+  if (glb_array == NULL)
+    return -1;
 
-  if (strcmp(pname, "pfbenchmark-read") == 0)
-    rval = read_test(argc, argv);
-  else if (strcmp(pname, "pfbenchmark-write") == 0)
-    rval = write_test(argc, argv);
-  else if (strcmp(pname, "pfbenchmark-readmodifywrite") == 0)
-    rval = read_modify_write_test(argc, argv);
-  else
-    cerr << "Unknown test mode " << pname << "\n";
+  bool strict = (write_ratio == 0 && !rmw);
+
+  if (workload.warmup != 0) {
+    do_accesses(warmup_pages, warmup_writes, rmw, strict);
+    if (!usemmap)
+      umap_reset_stats();
+  }
+
+  auto start_time = chrono::high_resolution_clock::now();
+  do_accesses(pages, writes, rmw, strict);
+  auto end_time = chrono::high_resolution_clock::now();
+
+  report(chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count(),
+      pages_to_access, write_ratio);
 
-  print_stats();
   utility::unmap_file(options.usemmap, pagesize * options.numpages, glb_array);
-  return rval;
+  return 0;
 }
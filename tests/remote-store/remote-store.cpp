@@ -0,0 +1,140 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// A RemoteStore striped over two umap-memserver processes started by the
+// test on the loopback address:
+//
+//   1. Three pages out of four of a region over the store are written,
+//      through a buffer much smaller than the region, and read back.
+//   2. The region is unmapped and a region over a new RemoteStore on the
+//      same servers must read the pages as written and the others as
+//      zeros.
+//
+// Usage: remote-store <umap-memserver> [<port of the first server, 17654 by default>]
+//
+#include <errno.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "umap/umap.h"
+#include "umap/store/RemoteStore.h"
+#include "../utility/store_test.hpp"
+
+static const int NUM_SERVERS = 2;
+
+//
+// What word i of page p holds, 0 for none
+//
+static uint64_t expected(uint64_t p, uint64_t)
+{
+  return p % 4 == 3 ? 0 : (p << 8) | 1;
+}
+
+//
+// Starts a server and waits until it accepts connections, -1 if it does
+// not within five seconds
+//
+static pid_t start_server(const char* path, int port)
+{
+  std::string p = std::to_string(port);
+  pid_t pid = fork();
+
+  if (pid == -1)
+    return -1;
+  if (pid == 0) {
+    execl(path, path, "-c", "64M", "-p", p.c_str(), (char*)nullptr);
+    std::cerr << "Cannot run " << path << std::endl;
+    _exit(1);
+  }
+
+  struct sockaddr_in sa = {};
+
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  for (int tries = 0; tries < 100; ++tries) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int rval = connect(fd, (struct sockaddr*)&sa, sizeof(sa));
+
+    close(fd);
+    if (rval == 0)
+      return pid;
+    if (waitpid(pid, nullptr, WNOHANG) == pid)
+      return -1;
+    usleep(50000);
+  }
+
+  kill(pid, SIGTERM);
+  waitpid(pid, nullptr, 0);
+  return -1;
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 2 && argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " <umap-memserver> [<port of the first server, 17654 by default>]" << std::endl;
+    return 1;
+  }
+
+  int port = argc == 3 ? atoi(argv[2]) : 17654;
+  pid_t servers[NUM_SERVERS];
+  std::string list;
+
+  for (int s = 0; s < NUM_SERVERS; ++s) {
+    servers[s] = start_server(argv[1], port + s);
+    if (servers[s] == -1) {
+      std::cerr << "Cannot start " << argv[1] << " on port " << port + s << std::endl;
+      while (s-- > 0) {
+        kill(servers[s], SIGTERM);
+        waitpid(servers[s], nullptr, 0);
+      }
+      return 1;
+    }
+    list += (s == 0 ? "" : ",") + std::string("127.0.0.1:") + std::to_string(port + s);
+  }
+
+  utility::StoreTest t;
+  uint64_t psize = t.page_size;
+  uint64_t size = t.size;
+
+  {
+    // Stripes of a few pages, so that requests span both servers
+    Umap::RemoteStore* store = new Umap::RemoteStore(list, size, 4 * psize);
+    uint64_t* region = t.map(store);
+
+    t.write_pages(region, [](uint64_t p) { return p % 4 != 3; }, expected);
+    t.check_pages(region, expected, "written");
+    t.unmap(region);
+    delete store;
+  }
+
+  {
+    Umap::RemoteStore* store = new Umap::RemoteStore(list, size, 4 * psize);
+    uint64_t* region = t.map(store, PROT_READ);
+
+    t.check_pages(region, expected, "new store");
+    t.unmap(region);
+    delete store;
+  }
+
+  for (int s = 0; s < NUM_SERVERS; ++s) {
+    kill(servers[s], SIGTERM);
+    waitpid(servers[s], nullptr, 0);
+  }
+
+  return t.finish();
+}
@@ -0,0 +1,149 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// Generations of SparseStores written by umap_snapshot():
+//
+//   1. Three pages out of four of a region over a working store are
+//      written, through a buffer much smaller than the region, and
+//      umap_snapshot() copies them to a first generation gen0.
+//   2. A quarter of the pages is written again and umap_snapshot() copies
+//      only those to a second generation gen1.
+//   3. Another quarter is written again without a snapshot.
+//   4. gen0 and gen1 composed must read as the region was at the second
+//      snapshot, the pages never written as zeros, gen1 alone must only
+//      hold the pages of the second snapshot, and the working store must
+//      hold the last writes.
+//
+// Usage: sparsestore-snapshot <directory, removed first>
+//
+#include <iostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "umap/umap.h"
+#include "umap/store/SparseStore.h"
+#include "../utility/store_test.hpp"
+
+static const uint64_t NUM_PAGES = 2048;
+static const uint64_t FILE_PAGES = NUM_PAGES / 8;
+
+//
+// What word i of page p holds after step step, 0 for none
+//
+static uint64_t expected(uint64_t p, int step)
+{
+  if (p % 4 == 3)
+    return 0;
+  if (step >= 2 && p % 4 == 0)
+    return (p << 8) | 2;
+  if (step >= 3 && p % 4 == 1)
+    return (p << 8) | 3;
+  return (p << 8) | 1;
+}
+
+//
+// Whether page p is written at step step
+//
+static bool written(uint64_t p, int step)
+{
+  if (step == 1)
+    return p % 4 != 3;
+  return p % 4 == (uint64_t)step - 2;
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 2) {
+    std::cerr << "Usage: " << argv[0] << " <directory, removed first>" << std::endl;
+    return 1;
+  }
+
+  std::string dir = argv[1];
+  utility::StoreTest t(NUM_PAGES);
+  uint64_t psize = t.page_size;
+  uint64_t size = t.size;
+
+  if (!t.fresh_directory(dir, true)) {
+    std::cerr << "Cannot create " << dir << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> generations;
+
+  generations.push_back(dir + "/gen0");
+  generations.push_back(dir + "/gen1");
+
+  auto at_step = [](int step) {
+    return [step](uint64_t p, uint64_t) { return expected(p, step); };
+  };
+
+  {
+    Umap::SparseStore* store = new Umap::SparseStore(size, psize, dir + "/work", FILE_PAGES * psize);
+    uint64_t* region = t.map(store);
+
+    for (int step = 1; step <= 3; ++step) {
+      t.write_pages(region, [step](uint64_t p) { return written(p, step); }, at_step(step));
+
+      if (step == 3)
+        break;
+
+      Umap::SparseStore* gen = new Umap::SparseStore(size, psize, generations[step - 1], FILE_PAGES * psize);
+
+      t.check(Umap::umap_snapshot(region, gen) == 0, "umap_snapshot()");
+      t.check(gen->close_files() == 0, "close_files()");
+      delete gen;
+    }
+
+    t.check_pages(region, at_step(3), "written");
+    t.unmap(region);
+
+    t.check(store->close_files() == 0, "close_files()");
+    delete store;
+  }
+
+  {
+    Umap::SparseStore* store = new Umap::SparseStore(generations, true);
+    uint64_t* region = t.map(store, PROT_READ);
+
+    t.check(store->is_zero_range(3 * psize, psize), "page never written is a zero range");
+    t.check_pages(region, at_step(2), "gen0 and gen1");
+    t.unmap(region);
+
+    t.check(store->close_files() == 0, "close_files()");
+    delete store;
+  }
+
+  {
+    Umap::SparseStore* store = new Umap::SparseStore(generations[1], true);
+    uint64_t bad = 0;
+
+    for (uint64_t p = 0; p < NUM_PAGES; ++p)
+      if (store->is_zero_range(p * psize, psize) == written(p, 2)) {
+        if (bad++ == 0)
+          std::cerr << "gen1: page " << p << (written(p, 2) ? " is not" : " is") << " held" << std::endl;
+      }
+    t.check(bad == 0, "gen1 holds the pages written since gen0 only");
+
+    t.check(store->close_files() == 0, "close_files()");
+    delete store;
+  }
+
+  {
+    Umap::SparseStore* store = new Umap::SparseStore(dir + "/work", true);
+    uint64_t* region = t.map(store, PROT_READ);
+
+    t.check_pages(region, at_step(3), "working store");
+    t.unmap(region);
+
+    t.check(store->close_files() == 0, "close_files()");
+    delete store;
+  }
+
+  return t.finish(dir);
+}
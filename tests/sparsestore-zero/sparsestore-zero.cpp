@@ -0,0 +1,97 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// Pages of a SparseStore that were never written:
+//
+//   1. A new store of eight partition files is mapped and one page out of
+//      four of its first half is written, some of them with zeros, through
+//      a buffer much smaller than the region.
+//   2. The store is opened again.  is_zero_range() must hold for the
+//      unwritten pages, the whole second half included, and not for the
+//      written ones, even those written with zeros.
+//   3. A read-only region of the reopened store must read the unwritten
+//      pages as zeros and the others as written.
+//
+// Usage: sparsestore-zero <directory, removed first>
+//
+#include <iostream>
+#include <stdint.h>
+#include <string>
+
+#include "umap/umap.h"
+#include "umap/store/SparseStore.h"
+#include "../utility/store_test.hpp"
+
+static const uint64_t NUM_PAGES = 2048;
+static const uint64_t FILE_PAGES = NUM_PAGES / 8;
+
+static bool written(uint64_t p)
+{
+  return p < NUM_PAGES / 2 && p % 4 == 0;
+}
+
+//
+// What word i of page p holds, 0 for none
+//
+static uint64_t expected(uint64_t p, uint64_t)
+{
+  if (!written(p) || p % 32 == 0)
+    return 0;
+  return (p << 8) | 1;
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 2) {
+    std::cerr << "Usage: " << argv[0] << " <directory, removed first>" << std::endl;
+    return 1;
+  }
+
+  std::string dir = argv[1];
+  utility::StoreTest t(NUM_PAGES);
+  uint64_t psize = t.page_size;
+  uint64_t size = t.size;
+
+  if (!t.fresh_directory(dir, false))
+    return 1;
+
+  {
+    Umap::SparseStore* store = new Umap::SparseStore(size, psize, dir, FILE_PAGES * psize);
+    uint64_t* region = t.map(store);
+
+    t.write_pages(region, written, expected);
+    t.unmap(region);
+
+    t.check(store->close_files() == 0, "close_files()");
+    delete store;
+  }
+
+  {
+    Umap::SparseStore* store = new Umap::SparseStore(dir, true);
+    uint64_t zero = 0;
+
+    for (uint64_t p = 0; p < NUM_PAGES; ++p)
+      if (store->is_zero_range(p * psize, psize) != !written(p)) {
+        if (zero++ == 0)
+          std::cerr << "page " << p << (written(p) ? " is" : " is not") << " a zero range" << std::endl;
+      }
+    t.check(zero == 0, "is_zero_range() tells the unwritten pages");
+    t.check(store->is_zero_range(size / 2, size / 2), "the unwritten half is a zero range");
+    t.check(!store->is_zero_range(0, size / 2), "the written half is not a zero range");
+
+    uint64_t* region = t.map(store, PROT_READ);
+
+    t.check_pages(region, expected, "reopened");
+    t.unmap(region);
+
+    t.check(store->close_files() == 0, "close_files()");
+    delete store;
+  }
+
+  return t.finish(dir);
+}
@@ -0,0 +1,117 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+
+//
+// A WRITE_BACK TieredStore, with a compressed memory tier and a file tier,
+// in front of a backend kept in memory by the test:
+//
+//   1. Every page of a region much larger than the buffer is written and
+//      read back, so that pages go through both tiers and the backend.
+//   2. Half of the pages are written again and the region is unmapped
+//      without reading them, as clean pages would push the dirty ones out.
+//      The tiers must have served hits and must still hold dirty pages
+//      the backend does not have yet.
+//   3. After flush() the backend must hold every page as last written,
+//      which is also what a region mapped over the store again reads.
+//
+// Usage: tiered-store <directory for the file tier, removed first>
+//
+#include <iostream>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "umap/umap.h"
+#include "umap/store/TieredStore.h"
+#include "../utility/store_test.hpp"
+
+//
+// The slow store the tiers are in front of
+//
+class MemoryStore : public Umap::Store {
+  public:
+    MemoryStore(size_t size) : data(size, 0), bytes_written(0) {}
+
+    ssize_t read_from_store(char* buf, size_t nb, off_t off) {
+      memcpy(buf, &data[off], nb);
+      return nb;
+    }
+
+    ssize_t write_to_store(char* buf, size_t nb, off_t off) {
+      memcpy(&data[off], buf, nb);
+      bytes_written += nb;
+      return nb;
+    }
+
+    std::vector<char> data;
+    uint64_t bytes_written;
+};
+
+//
+// What word i of page p holds after generation gen, mixed with i so that
+// the pages do not compress to almost nothing and do overflow the tiers
+//
+static uint64_t expected(uint64_t p, uint64_t i, int gen)
+{
+  uint64_t tag = (gen == 2 && p % 2 == 0) ? (p << 8) | 2 : (p << 8) | 1;
+
+  return tag ^ (i * 0x9e3779b97f4a7c15ULL);
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 2) {
+    std::cerr << "Usage: " << argv[0] << " <directory for the file tier, removed first>" << std::endl;
+    return 1;
+  }
+
+  std::string dir = argv[1];
+  utility::StoreTest t;
+  uint64_t psize = t.page_size;
+  uint64_t size = t.size;
+  auto gen1 = [](uint64_t p, uint64_t i) { return expected(p, i, 1); };
+  auto gen2 = [](uint64_t p, uint64_t i) { return expected(p, i, 2); };
+
+  if (!t.fresh_directory(dir, true)) {
+    std::cerr << "Cannot create " << dir << std::endl;
+    return 1;
+  }
+
+  MemoryStore* backend = new MemoryStore(size);
+  Umap::TieredStore* store = new Umap::TieredStore(backend, psize, 256 * psize
+      , dir + "/tier", 512 * psize, Umap::TieredStore::WRITE_BACK, true);
+
+  uint64_t* region = t.map(store);
+
+  t.write_pages(region, [](uint64_t) { return true; }, gen1);
+  t.check(t.differing_pages(region, gen1) == 0, "pages read back as written");
+  t.write_pages(region, [](uint64_t p) { return p % 2 == 0; }, gen2);
+  t.unmap(region);
+
+  uint64_t stale = t.differing_pages((const uint64_t*)backend->data.data(), gen2);
+
+  std::cout << "tiers: " << store->get_hits() << " hits, " << store->get_misses() << " misses, "
+            << stale << " pages not written back before flush()" << std::endl;
+  t.check(store->get_hits() > 0, "pages were read from the tiers");
+  t.check(stale > 0 && stale < t.num_pages, "the tiers held some of the dirty pages back");
+
+  t.check(store->flush() == 0, "flush()");
+  t.check(t.differing_pages((const uint64_t*)backend->data.data(), gen2) == 0, "flush() wrote every dirty page back");
+
+  uint64_t written = backend->bytes_written;
+
+  region = t.map(store);
+  t.check(t.differing_pages(region, gen2) == 0, "pages read back after flush()");
+  t.unmap(region);
+
+  delete store;
+  t.check(backend->bytes_written == written, "clean pages were not written back again");
+  delete backend;
+
+  return t.finish(dir);
+}
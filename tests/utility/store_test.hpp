@@ -0,0 +1,132 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright 2017-2021 Lawrence Livermore National Security, LLC and other
+// UMAP Project Developers. See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+//////////////////////////////////////////////////////////////////////////////
+#ifndef LIB_UTILITY_STORE_TEST_HPP
+#define LIB_UTILITY_STORE_TEST_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <functional>
+#include <iostream>
+#include <string>
+
+#include "umap/umap.h"
+
+namespace utility {
+//
+// What the tests of the stores have in common: regions of num_pages umap
+// pages mapped over a store, through a buffer much smaller than a region
+// so that pages are evicted to the store while they are written, and whose
+// words are written and compared to what the test expects of them.
+//
+// value(p, i) is what word i of page p is to hold, written(p) whether a
+// test writes page p at a step.
+//
+class StoreTest {
+public:
+  typedef std::function<uint64_t(uint64_t p, uint64_t i)> Value;
+  typedef std::function<bool(uint64_t p)> Written;
+
+  const uint64_t num_pages;
+  uint64_t page_size;
+  uint64_t page_words;
+  uint64_t size;
+
+  StoreTest(uint64_t _num_pages = 2048) : num_pages(_num_pages), failures(0) {
+    setenv("UMAP_BUFSIZE", "64", 0);
+
+    page_size = umapcfg_get_umap_page_size();
+    page_words = page_size / sizeof(uint64_t);
+    size = num_pages * page_size;
+  }
+
+  uint64_t* map(Umap::Store* store, int prot = PROT_READ | PROT_WRITE) {
+    void* region = Umap::umap_ex(nullptr, size, prot, UMAP_PRIVATE, -1, 0, store);
+
+    if (region == UMAP_FAILED) {
+      std::cerr << "umap_ex failed" << std::endl;
+      exit(1);
+    }
+    return (uint64_t*)region;
+  }
+
+  void unmap(uint64_t* region) {
+    uunmap(region, size);
+  }
+
+  void write_pages(uint64_t* region, const Written& written, const Value& value) {
+    for (uint64_t p = 0; p < num_pages; ++p) {
+      if (!written(p))
+        continue;
+      for (uint64_t i = 0; i < page_words; ++i)
+        region[p * page_words + i] = value(p, i);
+    }
+  }
+
+  //
+  // Number of pages of which some word differs, the first of which is told
+  // about unless what is nullptr.  Pages are looked at from the last one
+  // down, so that those written last are read while they may still be
+  // cached on their way to the store.
+  //
+  uint64_t differing_pages(const uint64_t* words, const Value& value, const char* what = nullptr) {
+    uint64_t bad = 0;
+
+    for (uint64_t p = num_pages; p-- > 0; ) {
+      for (uint64_t i = 0; i < page_words; ++i) {
+        if (words[p * page_words + i] == value(p, i))
+          continue;
+        if (bad++ == 0 && what != nullptr)
+          std::cerr << what << ": page " << p << " word " << i << " is "
+                    << words[p * page_words + i] << ", expected " << value(p, i) << std::endl;
+        break;
+      }
+    }
+    return bad;
+  }
+
+  void check_pages(const uint64_t* words, const Value& value, const char* what) {
+    uint64_t bad = differing_pages(words, value, what);
+
+    if (bad != 0) {
+      std::cerr << what << ": " << bad << " pages differ" << std::endl;
+      ++failures;
+    }
+  }
+
+  void check(bool ok, const char* what) {
+    if (!ok) {
+      std::cerr << "FAILED: " << what << std::endl;
+      ++failures;
+    }
+  }
+
+  //
+  // Removes dir, all of it, and creates it again if asked to
+  //
+  bool fresh_directory(const std::string& dir, bool create) {
+    return system(("rm -rf " + dir).c_str()) == 0
+        && (!create || system(("mkdir -p " + dir).c_str()) == 0);
+  }
+
+  //
+  // What main() returns, once dir is removed unless it is empty
+  //
+  int finish(const std::string& dir = "") {
+    if (!dir.empty() && !fresh_directory(dir, false))
+      ++failures;
+
+    std::cout << (failures == 0 ? "PASSED" : "FAILED") << std::endl;
+    return failures == 0 ? 0 : 1;
+  }
+
+private:
+  int failures;
+};
+} // namespace utility
+#endif // LIB_UTILITY_STORE_TEST_HPP